@@ -0,0 +1,66 @@
+''' time decoding genotypes stored at each bit depth
+
+Only 8 bit genotypes used to have vectorised decoders, so this times the other
+depths against them. The bgens are uncompressed, so the times are of the decode
+alone, for:
+  - probs: the probabilities of every sample
+  - dosage: the alt allele dosage of every sample
+  - phased_dosage: the same, for phased haplotypes
+
+Run from the repository root, e.g. python benchmarks/bench_bit_depths.py
+'''
+
+import argparse
+import logging
+import time
+
+from bgen import BgenReader
+
+from synthetic import synthetic_bgen
+
+def best_of(func, repeats):
+    ''' run a function a few times, and report the fastest, to cut timing noise
+    '''
+    times = []
+    for _ in range(repeats):
+        start = time.perf_counter()
+        func()
+        times.append(time.perf_counter() - start)
+    return min(times)
+
+def probs(path):
+    with BgenReader(path, use_mmap=True) as bfile:
+        for var in bfile:
+            var.probabilities
+
+def dosage(path):
+    with BgenReader(path, use_mmap=True) as bfile:
+        for var in bfile:
+            var.alt_dosage
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=100)
+    parser.add_argument('--samples', type=int, default=100000)
+    parser.add_argument('--repeats', type=int, default=3)
+    args = parser.parse_args()
+    # the writer warns that the low bit depths cannot hold the synthetic values
+    logging.disable(logging.WARNING)
+
+    print('bit_depth\tprobs_s\tdosage_s\tphased_dosage_s')
+    for bit_depth in [1, 2, 4, 8, 10, 12, 16, 20, 24, 32]:
+        path = synthetic_bgen(args.variants, args.samples, compression=None,
+                              bit_depth=bit_depth)
+        # read once first, so the file is in the page cache for every timing
+        probs(path)
+        probs_time = best_of(lambda: probs(path), args.repeats)
+        dosage_time = best_of(lambda: dosage(path), args.repeats)
+        phased = synthetic_bgen(args.variants, args.samples, compression=None,
+                                bit_depth=bit_depth, phased=True)
+        dosage(phased)
+        phased_time = best_of(lambda: dosage(phased), args.repeats)
+        print(f'{bit_depth}\t{probs_time:.4f}\t{dosage_time:.4f}\t{phased_time:.4f}')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,52 @@
+''' count genotype buffer allocations while iterating through a bgen
+
+Every variant needs buffers for its stored and decompressed genotypes, and for the
+per-sample ploidy. These are borrowed from a pool per thread, and given back once
+the variant is done with, so once the pool holds buffers for the largest variant,
+iterating further allocates nothing. This reports the buffers allocated per variant
+on a first pass (while the pool fills) and a second pass (in the steady state),
+alongside the throughput of each. Run from the benchmarks folder, e.g.
+python bench_buffers.py
+'''
+
+import argparse
+import time
+
+from bgen import BgenReader
+from bgen.reader import genotype_buffer_stats
+
+from synthetic import synthetic_bgen
+
+def one_pass(path, use_mmap, prefetch):
+    ''' decode every variant, and return the seconds taken and buffers allocated
+    '''
+    before = genotype_buffer_stats()
+    start = time.perf_counter()
+    with BgenReader(path, delay_parsing=True, use_mmap=use_mmap, prefetch=prefetch) as bfile:
+        for var in bfile:
+            var.alt_dosage
+            var.ploidy
+    elapsed = time.perf_counter() - start
+    after = genotype_buffer_stats()
+    return (elapsed, after['allocations'] - before['allocations'],
+            after['reuses'] - before['reuses'])
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.parse_args()
+
+    shapes = [(20000, 1000), (1000, 100000)]
+    print('variants\tsamples\tmmap\tprefetch\tpass\tseconds\tallocs/variant\treuses/variant')
+    for n_variants, n_samples in shapes:
+        path = synthetic_bgen(n_variants, n_samples)
+        for use_mmap in [False, True]:
+            for prefetch in [0, 4]:
+                for label in ['first', 'second']:
+                    elapsed, allocs, reuses = one_pass(path, use_mmap, prefetch)
+                    print(f'{n_variants}\t{n_samples}\t{use_mmap}\t{prefetch}\t{label}\t'
+                          f'{elapsed:.4f}\t{allocs / n_variants:.4f}\t'
+                          f'{reuses / n_variants:.2f}')
+
+if __name__ == '__main__':
+    main()
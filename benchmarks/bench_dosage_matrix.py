@@ -0,0 +1,54 @@
+''' time decoding a variants x samples dosage matrix, against a python loop
+
+Compares building the matrix by looping over variants for their alt_dosage, with
+BgenReader.dosage_matrix at a range of thread counts, to show how the threaded
+decode scales with cores. Run from the benchmarks folder, e.g.
+python bench_dosage_matrix.py --threads 1 2 4 8
+'''
+
+import argparse
+import time
+
+import numpy as np
+
+from bgen import BgenReader
+
+from synthetic import synthetic_bgen
+
+def best_of(func, repeats):
+    ''' run a function a few times, and report the fastest, to cut timing noise
+    '''
+    times = []
+    for _ in range(repeats):
+        start = time.perf_counter()
+        func()
+        times.append(time.perf_counter() - start)
+    return min(times)
+
+def python_loop(bfile, indices):
+    return np.array([bfile[i].alt_dosage for i in indices])
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--repeats', type=int, default=3)
+    parser.add_argument('--threads', type=int, nargs='+', default=[1, 2, 4, 8])
+    args = parser.parse_args()
+    
+    shapes = [(2000, 10000), (200, 100000)]
+    print('variants\tsamples\tmethod\tthreads\tseconds\tspeedup')
+    for n_variants, n_samples in shapes:
+        path = synthetic_bgen(n_variants, n_samples)
+        with BgenReader(path, delay_parsing=False) as bfile:
+            indices = list(range(len(bfile)))
+            out = np.empty((len(indices), n_samples), dtype=np.float32)
+            base = best_of(lambda: python_loop(bfile, indices), args.repeats)
+            print(f'{n_variants}\t{n_samples}\tloop\t1\t{base:.4f}\t1.00x')
+            for threads in args.threads:
+                elapsed = best_of(lambda: bfile.dosage_matrix(indices, out=out,
+                    threads=threads), args.repeats)
+                print(f'{n_variants}\t{n_samples}\tmatrix\t{threads}\t{elapsed:.4f}\t'
+                      f'{base / elapsed:.2f}x')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,63 @@
+''' time X^T Y of a dosage matrix and phenotypes, against building X in numpy
+
+dosage_products multiplies the dosages of each few variants by the phenotypes as
+they decode, so the variants x samples dosage matrix is never built. This times it
+against the numpy route it replaces, for k phenotypes:
+  - numpy: dosage_matrix a chunk of variants at a time, mean impute, then X @ Y
+  - products: dosage_products, at each thread count
+
+The bgen is uncompressed, so the times are of the decode and multiply alone.
+
+Run from the benchmarks folder, e.g. python bench_dosage_products.py
+'''
+
+import argparse
+
+import numpy as np
+
+from bgen import BgenReader
+
+from bench_bit_depths import best_of
+from synthetic import synthetic_bgen
+
+def numpy_products(bfile, y, chunk, threads):
+    n_variants = len(bfile)
+    out = np.empty((n_variants, y.shape[1]))
+    for start in range(0, n_variants, chunk):
+        rows = range(start, min(start + chunk, n_variants))
+        dose = bfile.dosage_matrix(rows, threads=threads)
+        means = np.nanmean(dose, axis=1)
+        dose = np.where(np.isnan(dose), means[:, None], dose)
+        out[start:start + len(rows)] = dose @ y
+    return out
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=200)
+    parser.add_argument('--samples', type=int, default=100000)
+    parser.add_argument('--phenotypes', type=int, nargs='+', default=[1, 10])
+    parser.add_argument('--chunk', type=int, default=100)
+    parser.add_argument('--repeats', type=int, default=3)
+    parser.add_argument('--threads', type=int, nargs='+', default=[1, 2, 4])
+    args = parser.parse_args()
+
+    path = synthetic_bgen(args.variants, args.samples, compression=None, bit_depth=8)
+    rng = np.random.default_rng(1)
+    print('method\tk\tthreads\tseconds')
+    with BgenReader(path, use_mmap=True) as bfile:
+        indices = list(range(len(bfile)))
+        # read once first, so the file is in the page cache for every timing
+        bfile.dosage_matrix(indices)
+        for k in args.phenotypes:
+            y = rng.normal(size=(args.samples, k)).astype(np.float32)
+            for threads in args.threads:
+                elapsed = best_of(lambda: numpy_products(bfile, y, args.chunk, threads),
+                                  args.repeats)
+                print(f'numpy\t{k}\t{threads}\t{elapsed:.4f}')
+                elapsed = best_of(lambda: bfile.dosage_products(y, indices,
+                    threads=threads), args.repeats)
+                print(f'products\t{k}\t{threads}\t{elapsed:.4f}')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,64 @@
+''' time building a GRM from a bgen, against building it in numpy
+
+grm standardizes each variant's dosages as they decode, and adds blocks of their
+outer products to tiles of the GRM across threads, without building the dosage
+matrix. This times it against the numpy route, at several sample counts:
+  - numpy: dosage_matrix a chunk of variants at a time, standardize, then Z^T Z
+  - grm: BgenReader.grm with everything in one tile
+  - tiled: BgenReader.grm with a memory budget a quarter of the GRM's size
+
+Numpy's Z^T Z goes through a multithreaded BLAS, so compare it against grm at the
+same thread count as BLAS uses.
+
+Run from the benchmarks folder, e.g. python bench_grm.py
+'''
+
+import argparse
+
+import numpy as np
+
+from bgen import BgenReader
+
+from bench_bit_depths import best_of
+from synthetic import synthetic_bgen
+
+def numpy_grm(bfile, chunk, threads):
+    n_variants = len(bfile)
+    n_samples = len(bfile.samples)
+    grm = np.zeros((n_samples, n_samples))
+    for start in range(0, n_variants, chunk):
+        rows = range(start, min(start + chunk, n_variants))
+        dose = bfile.dosage_matrix(rows, threads=threads).astype(np.float64)
+        freq = np.nanmean(dose, axis=1) / 2
+        z = (dose - 2 * freq[:, None]) / np.sqrt(2 * freq * (1 - freq))[:, None]
+        z = np.nan_to_num(z)
+        grm += z.T @ z
+    return grm / n_variants
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=1000)
+    parser.add_argument('--samples', type=int, nargs='+', default=[1000, 2000, 4000])
+    parser.add_argument('--chunk', type=int, default=256)
+    parser.add_argument('--repeats', type=int, default=3)
+    parser.add_argument('--threads', type=int, default=1)
+    args = parser.parse_args()
+
+    print('samples\tnumpy_s\tgrm_s\ttiled_s')
+    for n_samples in args.samples:
+        path = synthetic_bgen(args.variants, n_samples, compression=None, bit_depth=8)
+        with BgenReader(path, use_mmap=True) as bfile:
+            # read once first, so the file is in the page cache for every timing
+            bfile.dosage_matrix(range(len(bfile)))
+            numpy_time = best_of(lambda: numpy_grm(bfile, args.chunk, args.threads),
+                                 args.repeats)
+            grm_time = best_of(lambda: bfile.grm(threads=args.threads, max_memory=2**34),
+                               args.repeats)
+            budget = n_samples ** 2 * 8 // 4
+            tiled_time = best_of(lambda: bfile.grm(threads=args.threads,
+                max_memory=budget), args.repeats)
+        print(f'{n_samples}\t{numpy_time:.4f}\t{grm_time:.4f}\t{tiled_time:.4f}')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,59 @@
+''' time hard calling genotypes, against thresholding the probabilities in numpy
+
+Hard calls used to need the float32 probabilities of every sample, thresholded in
+numpy afterwards. This times that against BgenVar.hard_calls, which calls them as
+they decode, for unphased and phased bgens. The bgens are uncompressed, so the times
+are of the decode alone.
+
+Run from the benchmarks folder, e.g. python bench_hard_calls.py
+'''
+
+import argparse
+
+import numpy as np
+
+from bgen import BgenReader
+
+from bench_bit_depths import best_of
+from synthetic import synthetic_bgen
+
+def numpy_calls(path, threshold):
+    ''' the calls as they were made before, from the unphased probabilities
+    '''
+    with BgenReader(path, use_mmap=True) as bfile:
+        for var in bfile:
+            probs = var.probabilities
+            calls = probs.argmax(axis=1).astype(np.int8)
+            calls[~(probs.max(axis=1) >= threshold)] = -1
+
+def hard_calls(path, threshold):
+    with BgenReader(path, use_mmap=True) as bfile:
+        for var in bfile:
+            var.hard_calls(threshold)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=100)
+    parser.add_argument('--samples', type=int, default=100000)
+    parser.add_argument('--repeats', type=int, default=3)
+    parser.add_argument('--threshold', type=float, default=0.9)
+    args = parser.parse_args()
+
+    print('phased\tbit_depth\tnumpy_s\thard_calls_s\tspeedup')
+    for phased, bit_depth in [(False, 8), (False, 16), (True, 8)]:
+        path = synthetic_bgen(args.variants, args.samples, compression=None,
+                              bit_depth=bit_depth, phased=phased)
+        # read once first, so the file is in the page cache for every timing
+        hard_calls(path, args.threshold)
+        calls_time = best_of(lambda: hard_calls(path, args.threshold), args.repeats)
+        if phased:
+            # numpy has no quick equivalent for haplotypes, so only time the calls
+            print(f'{phased}\t{bit_depth}\t-\t{calls_time:.4f}\t-')
+            continue
+        numpy_time = best_of(lambda: numpy_calls(path, args.threshold), args.repeats)
+        print(f'{phased}\t{bit_depth}\t{numpy_time:.4f}\t{calls_time:.4f}\t'
+              f'{numpy_time / calls_time:.2f}x')
+
+if __name__ == '__main__':
+    main()
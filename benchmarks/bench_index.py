@@ -0,0 +1,54 @@
+''' time building a bgenix index for an existing bgen
+
+Compares loading the index a row at a time through the Indexer which BgenWriter
+uses, fed from iterating over the variants, with bgen.build_index, which scans the
+variant headers in C++ in a background thread and bulk loads them, building the
+table indexes after the rows are in. Run from the benchmarks folder, e.g.
+python bench_index.py
+'''
+
+import argparse
+import time
+
+from bgen import BgenReader, build_index
+from bgen.writer import Indexer
+
+from synthetic import synthetic_bgen
+
+def best_of(func, repeats):
+    ''' run a function a few times, and report the fastest, to cut timing noise
+    '''
+    times = []
+    for _ in range(repeats):
+        start = time.perf_counter()
+        func()
+        times.append(time.perf_counter() - start)
+    return min(times)
+
+def row_by_row(path):
+    with BgenReader(path, delay_parsing=True) as bfile:
+        indexer = Indexer(path)
+        for var in bfile:
+            indexer.add_variant(var.chrom, var.pos, var.rsid, var.alleles,
+                                var.fileoffset, var.next_variant_offset - var.fileoffset)
+        indexer.close()
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--repeats', type=int, default=3)
+    args = parser.parse_args()
+
+    shapes = [(200000, 10), (20000, 1000)]
+    print('variants\tsamples\tmethod\tseconds\tvariants/s\tspeedup')
+    for n_variants, n_samples in shapes:
+        path = synthetic_bgen(n_variants, n_samples)
+        base = best_of(lambda: row_by_row(path), args.repeats)
+        print(f'{n_variants}\t{n_samples}\trow_by_row\t{base:.4f}\t'
+              f'{n_variants / base:.0f}\t1.00x')
+        elapsed = best_of(lambda: build_index(path), args.repeats)
+        print(f'{n_variants}\t{n_samples}\tbuild_index\t{elapsed:.4f}\t'
+              f'{n_variants / elapsed:.0f}\t{base / elapsed:.2f}x')
+
+if __name__ == '__main__':
+    main()
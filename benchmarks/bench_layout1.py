@@ -0,0 +1,40 @@
+''' time decoding layout 1 (bgen v1.1) genotypes beside layout 2 ones
+
+Layout 1 stores three 16 bit probabilities per sample, and used to be decoded one
+sample at a time. This times it against the same genotypes in layout 2, at 8 and
+16 bits, for:
+  - probs: the probabilities of every sample
+  - dosage: the alt allele dosage of every sample
+
+The bgens are uncompressed by default, so the times are of the decode alone. Pass
+--compression zlib for a rescan as it would run on an archive.
+
+Run from the repository root, e.g. python benchmarks/bench_layout1.py
+'''
+
+import argparse
+
+from bench_bit_depths import best_of, probs, dosage
+from synthetic import synthetic_bgen
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=100)
+    parser.add_argument('--samples', type=int, default=100000)
+    parser.add_argument('--repeats', type=int, default=3)
+    parser.add_argument('--compression', default=None, choices=[None, 'zlib'])
+    args = parser.parse_args()
+
+    print('layout\tbit_depth\tprobs_s\tdosage_s')
+    for layout, bit_depth in [(1, 16), (2, 8), (2, 16)]:
+        path = synthetic_bgen(args.variants, args.samples, compression=args.compression,
+                              bit_depth=bit_depth, layout=layout)
+        # read once first, so the file is in the page cache for every timing
+        probs(path)
+        probs_time = best_of(lambda: probs(path), args.repeats)
+        dosage_time = best_of(lambda: dosage(path), args.repeats)
+        print(f'{layout}\t{bit_depth}\t{probs_time:.4f}\t{dosage_time:.4f}')
+
+if __name__ == '__main__':
+    main()
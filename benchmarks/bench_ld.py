@@ -0,0 +1,57 @@
+''' time LD matrices of a region, against correlating the dosage matrix in numpy
+
+ld_matrix decodes and standardizes each variant once, then sums the products
+between blocks of variants across threads, without building the dosage matrix.
+This times it against the numpy route it replaces:
+  - numpy: dosage_matrix of every variant, mean impute, then np.corrcoef
+  - full: ld_matrix of every pair, at each thread count
+  - banded: ld_matrix of pairs within a window, at each thread count
+
+The bgen is uncompressed, so the times are of the decode and products alone.
+
+Run from the benchmarks folder, e.g. python bench_ld.py
+'''
+
+import argparse
+
+import numpy as np
+
+from bgen import BgenReader
+
+from bench_bit_depths import best_of
+from synthetic import synthetic_bgen
+
+def numpy_ld(bfile, indices, threads):
+    dose = bfile.dosage_matrix(indices, threads=threads)
+    means = np.nanmean(dose, axis=1)
+    dose = np.where(np.isnan(dose), means[:, None], dose)
+    return np.corrcoef(dose)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=2000)
+    parser.add_argument('--samples', type=int, default=5000)
+    parser.add_argument('--window', type=int, default=250)
+    parser.add_argument('--repeats', type=int, default=3)
+    parser.add_argument('--threads', type=int, nargs='+', default=[1, 2, 4])
+    args = parser.parse_args()
+
+    path = synthetic_bgen(args.variants, args.samples, compression=None, bit_depth=8)
+    print('method\tthreads\tseconds')
+    with BgenReader(path, use_mmap=True) as bfile:
+        indices = list(range(len(bfile)))
+        # read once first, so the file is in the page cache for every timing
+        bfile.dosage_matrix(indices)
+        for threads in args.threads:
+            elapsed = best_of(lambda: numpy_ld(bfile, indices, threads), args.repeats)
+            print(f'numpy\t{threads}\t{elapsed:.4f}')
+            elapsed = best_of(lambda: bfile.ld_matrix(indices=indices, threads=threads),
+                              args.repeats)
+            print(f'full\t{threads}\t{elapsed:.4f}')
+            elapsed = best_of(lambda: bfile.ld_matrix(indices=indices,
+                window=args.window, threads=threads), args.repeats)
+            print(f'banded\t{threads}\t{elapsed:.4f}')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,41 @@
+''' time decoding variants whose samples mix haploid and diploid, as on chrX
+
+Variants where the ploidy varies between samples used to fall back to decoding
+one sample at a time. This times them beside the same data with every sample
+diploid. The bgens are uncompressed, so the times are of the decode alone, for:
+  - probs: the probabilities of every sample
+  - dosage: the alt allele dosage of every sample
+
+Run from the repository root, e.g. python benchmarks/bench_mixed_ploidy.py
+'''
+
+import argparse
+import logging
+
+from bench_bit_depths import best_of, probs, dosage
+from synthetic import synthetic_bgen
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=100)
+    parser.add_argument('--samples', type=int, default=100000)
+    parser.add_argument('--repeats', type=int, default=3)
+    args = parser.parse_args()
+    # the writer warns that the low bit depths cannot hold the synthetic values
+    logging.disable(logging.WARNING)
+
+    print('bit_depth\tploidy\tprobs_s\tdosage_s')
+    for bit_depth in [4, 8, 12, 16]:
+        for mixed in [False, True]:
+            path = synthetic_bgen(args.variants, args.samples, compression=None,
+                                  bit_depth=bit_depth, mixed_ploidy=mixed)
+            # read once first, so the file is in the page cache for every timing
+            probs(path)
+            probs_time = best_of(lambda: probs(path), args.repeats)
+            dosage_time = best_of(lambda: dosage(path), args.repeats)
+            ploidy = 'mixed' if mixed else 'diploid'
+            print(f'{bit_depth}\t{ploidy}\t{probs_time:.4f}\t{dosage_time:.4f}')
+
+if __name__ == '__main__':
+    main()
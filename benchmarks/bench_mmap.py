@@ -0,0 +1,55 @@
+''' compare reading a bgen through the buffered stream against a memory mapping
+
+Times two things for each mode, on synthetic bgens of a few shapes:
+  - parse: opening with delay_parsing=False, which parses every variant header
+  - dosage: iterating the variants in order and decoding their alt dosages
+
+The many-small-variants shape is where the mapping should matter most, since each
+variant then costs a seek and a refill of the stream buffer, against very little
+decoding. Run from the repository root, e.g. python benchmarks/bench_mmap.py
+'''
+
+import argparse
+import time
+
+from bgen import BgenReader
+
+from synthetic import synthetic_bgen
+
+def best_of(func, repeats):
+    ''' run a function a few times, and report the fastest, to cut timing noise
+    '''
+    times = []
+    for _ in range(repeats):
+        start = time.perf_counter()
+        func()
+        times.append(time.perf_counter() - start)
+    return min(times)
+
+def parse(path, use_mmap):
+    with BgenReader(path, delay_parsing=False, use_mmap=use_mmap) as bfile:
+        bfile.positions()
+
+def dosage(path, use_mmap):
+    with BgenReader(path, use_mmap=use_mmap) as bfile:
+        for var in bfile:
+            var.alt_dosage
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--repeats', type=int, default=3)
+    args = parser.parse_args()
+    
+    shapes = [(50000, 10), (10000, 1000), (200, 100000)]
+    print('variants\tsamples\ttask\tstream_s\tmmap_s\tspeedup')
+    for n_variants, n_samples in shapes:
+        path = synthetic_bgen(n_variants, n_samples)
+        for name, task in [('parse', parse), ('dosage', dosage)]:
+            stream = best_of(lambda: task(path, False), args.repeats)
+            mapped = best_of(lambda: task(path, True), args.repeats)
+            print(f'{n_variants}\t{n_samples}\t{name}\t{stream:.4f}\t{mapped:.4f}\t'
+                  f'{stream / mapped:.2f}x')
+
+if __name__ == '__main__':
+    main()
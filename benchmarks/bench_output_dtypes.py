@@ -0,0 +1,48 @@
+''' time decoding genotypes into each output number format
+
+Probabilities and dosages used to only come out as float32. This times the narrower
+formats against float32, for:
+  - probs: the probabilities of every sample, a variant at a time
+  - matrix: a variants x samples dosage matrix, decoded across threads
+
+The bgens are uncompressed, so the times are of the decode and conversion alone.
+
+Run from the benchmarks folder, e.g. python bench_output_dtypes.py
+'''
+
+import argparse
+
+from bgen import BgenReader
+
+from bench_bit_depths import best_of
+from synthetic import synthetic_bgen
+
+def probs(path, dtype):
+    with BgenReader(path, use_mmap=True) as bfile:
+        for var in bfile:
+            var.probabilities_as(dtype)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=100)
+    parser.add_argument('--samples', type=int, default=100000)
+    parser.add_argument('--repeats', type=int, default=3)
+    parser.add_argument('--threads', type=int, default=1)
+    args = parser.parse_args()
+
+    path = synthetic_bgen(args.variants, args.samples, compression=None, bit_depth=8)
+    # read once first, so the file is in the page cache for every timing
+    probs(path, 'float32')
+    print('dtype\tprobs_s\tmatrix_s\tmatrix_MB')
+    with BgenReader(path, use_mmap=True) as bfile:
+        indices = list(range(len(bfile)))
+        for dtype in ['float32', 'float16', 'bfloat16', 'uint8']:
+            probs_time = best_of(lambda: probs(path, dtype), args.repeats)
+            matrix_time = best_of(lambda: bfile.dosage_matrix(indices, dtype=dtype,
+                threads=args.threads), args.repeats)
+            size = bfile.dosage_matrix(indices[:1], dtype=dtype).nbytes * len(indices)
+            print(f'{dtype}\t{probs_time:.4f}\t{matrix_time:.4f}\t{size / 1e6:.1f}')
+
+if __name__ == '__main__':
+    main()
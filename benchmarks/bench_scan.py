@@ -0,0 +1,55 @@
+''' time finding variant offsets and positions, against parsing every variant
+
+Compares opening a bgen with its variants parsed up front (as BgenReader does by
+default) then listing positions, with BgenReader.scan_positions, which steps over
+everything but the offsets and positions. The shapes cover many small variants,
+where one read covers many variants, and fewer large ones, where each variant needs
+its own seek. Run from the benchmarks folder, e.g. python bench_scan.py
+'''
+
+import argparse
+import time
+
+from bgen import BgenReader
+
+from synthetic import synthetic_bgen
+
+def best_of(func, repeats):
+    ''' run a function a few times, and report the fastest, to cut timing noise
+    '''
+    times = []
+    for _ in range(repeats):
+        start = time.perf_counter()
+        func()
+        times.append(time.perf_counter() - start)
+    return min(times)
+
+def parse_all(path, use_mmap):
+    with BgenReader(path, delay_parsing=False, use_mmap=use_mmap) as bfile:
+        return bfile.positions()
+
+def scan(path, use_mmap):
+    with BgenReader(path, delay_parsing=True, use_mmap=use_mmap) as bfile:
+        return bfile.scan_positions()
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--repeats', type=int, default=3)
+    args = parser.parse_args()
+
+    shapes = [(200000, 10), (20000, 1000), (1000, 100000)]
+    print('variants\tsamples\tmmap\tmethod\tseconds\tMB/s\tspeedup')
+    for n_variants, n_samples in shapes:
+        path = synthetic_bgen(n_variants, n_samples)
+        megabytes = path.stat().st_size / 1e6
+        for use_mmap in [False, True]:
+            base = best_of(lambda: parse_all(path, use_mmap), args.repeats)
+            print(f'{n_variants}\t{n_samples}\t{use_mmap}\tparse_all\t{base:.4f}\t'
+                  f'{megabytes / base:.0f}\t1.00x')
+            elapsed = best_of(lambda: scan(path, use_mmap), args.repeats)
+            print(f'{n_variants}\t{n_samples}\t{use_mmap}\tscan\t{elapsed:.4f}\t'
+                  f'{megabytes / elapsed:.0f}\t{base / elapsed:.2f}x')
+
+if __name__ == '__main__':
+    main()
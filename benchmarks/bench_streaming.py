@@ -0,0 +1,46 @@
+''' time decoding wide variants from whole blocks against streamed blocks
+
+Large compressed genotype blocks can be decoded a window at a time as they
+decompress, rather than decompressing the whole block first. This times both ways
+over a few sample counts, to pick the block size streaming starts from, for:
+  - probs: the probabilities of every sample
+  - dosage: the alt allele dosage of every sample
+
+Run from the repository root, e.g. python benchmarks/bench_streaming.py
+'''
+
+import argparse
+
+import bgen.reader
+
+from bench_bit_depths import best_of, probs, dosage
+from synthetic import synthetic_bgen
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=20)
+    parser.add_argument('--samples', type=int, nargs='+', default=[100000, 500000, 2000000])
+    parser.add_argument('--bit-depth', type=int, default=16)
+    parser.add_argument('--repeats', type=int, default=3)
+    parser.add_argument('--compression', default='zstd', choices=['zlib', 'zstd'])
+    args = parser.parse_args()
+
+    default = bgen.reader.stream_size()
+    print('samples\tblock_MB\tmode\tprobs_s\tdosage_s')
+    for n_samples in args.samples:
+        path = synthetic_bgen(args.variants, n_samples, compression=args.compression,
+                              bit_depth=args.bit_depth)
+        # read once first, so the file is in the page cache for every timing
+        probs(path)
+        block_mb = (10 + n_samples * (1 + 2 * args.bit_depth / 8)) / 1e6
+        # a threshold of zero never streams, and one streams every block
+        for mode, threshold in [('whole', 0), ('stream', 1)]:
+            bgen.reader.set_stream_size(threshold)
+            probs_time = best_of(lambda: probs(path), args.repeats)
+            dosage_time = best_of(lambda: dosage(path), args.repeats)
+            print(f'{n_samples}\t{block_mb:.1f}\t{mode}\t{probs_time:.4f}\t{dosage_time:.4f}')
+    bgen.reader.set_stream_size(default)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,61 @@
+''' time per-variant QC statistics, against working them out in numpy
+
+variant_stats finds the allele frequency, missingness, info score, HWE p-value and
+genotype counts of each variant in one pass as it decodes, across threads. This
+times it against the loop it replaces, which decodes each variant's probabilities
+into python and reduces them with numpy, for:
+  - numpy: probabilities of each variant, then the statistics in numpy
+  - stats: variant_stats, at each thread count
+
+The bgen is uncompressed, so the times are of the decode and statistics alone.
+
+Run from the benchmarks folder, e.g. python bench_variant_stats.py
+'''
+
+import argparse
+
+import numpy as np
+
+from bgen import BgenReader
+
+from bench_bit_depths import best_of
+from synthetic import synthetic_bgen
+
+def numpy_stats(path, threshold=0.9):
+    ''' the statistics without HWE, which would only add to the numpy time
+    '''
+    with BgenReader(path, use_mmap=True) as bfile:
+        for var in bfile:
+            geno = var.probabilities
+            missing = np.isnan(geno[:, 0])
+            geno = geno[~missing]
+            dose = geno[:, 1] + 2 * geno[:, 2]
+            theta = dose.mean() / 2
+            variance = (geno[:, 1] + 4 * geno[:, 2] - dose ** 2).sum()
+            info = 1 - variance / (2 * len(dose) * theta * (1 - theta))
+            top = geno.max(axis=1)
+            calls = np.where(top >= threshold, geno.argmax(axis=1), -1)
+            counts = np.bincount(calls[calls >= 0], minlength=3)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=100)
+    parser.add_argument('--samples', type=int, default=100000)
+    parser.add_argument('--repeats', type=int, default=3)
+    parser.add_argument('--threads', type=int, nargs='+', default=[1, 2, 4])
+    args = parser.parse_args()
+
+    path = synthetic_bgen(args.variants, args.samples, compression=None, bit_depth=8)
+    # read once first, so the file is in the page cache for every timing
+    numpy_stats(path)
+    print('method\tthreads\tseconds\tvariants_per_s')
+    elapsed = best_of(lambda: numpy_stats(path), args.repeats)
+    print(f'numpy\t1\t{elapsed:.4f}\t{args.variants / elapsed:.0f}')
+    with BgenReader(path, use_mmap=True) as bfile:
+        for threads in args.threads:
+            elapsed = best_of(lambda: bfile.variant_stats(threads=threads), args.repeats)
+            print(f'stats\t{threads}\t{elapsed:.4f}\t{args.variants / elapsed:.0f}')
+
+if __name__ == '__main__':
+    main()
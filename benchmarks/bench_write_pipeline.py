@@ -0,0 +1,58 @@
+''' time writing a bgen, compressing on the calling thread or in the background
+
+BgenWriter normally encodes, compresses and writes each variant before add_variant
+returns. With threads other than 1, add_variant only encodes, and hands the variant
+to a pool of threads to compress, while a writer thread appends them in order. This
+times writing the same variants both ways, for each compression scheme and thread
+count, and checks the files match.
+
+Run from the benchmarks folder, e.g. python bench_write_pipeline.py
+'''
+
+import argparse
+from pathlib import Path
+import tempfile
+
+import numpy as np
+
+from bgen import BgenWriter
+
+from bench_bit_depths import best_of
+from synthetic import make_genotypes
+
+def write(path, genotypes, n_variants, compression, threads):
+    n_samples = len(genotypes[0])
+    with BgenWriter(path, n_samples, compression=compression, threads=threads) as bfile:
+        for i in range(n_variants):
+            bfile.add_variant(f'var{i}', f'rs{i}', '1', i + 1, ['A', 'C'],
+                              genotypes[i % len(genotypes)])
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=200)
+    parser.add_argument('--samples', type=int, default=100000)
+    parser.add_argument('--repeats', type=int, default=3)
+    parser.add_argument('--threads', type=int, nargs='+', default=[1, 2, 4])
+    args = parser.parse_args()
+
+    rng = np.random.default_rng(1)
+    # a handful of genotype arrays, cycled through, so making them isn't timed
+    genotypes = [make_genotypes(args.samples, rng) for _ in range(8)]
+    print('compression\tthreads\tseconds\tvariants/s\tspeedup')
+    with tempfile.TemporaryDirectory() as tmp:
+        for compression in ['zstd', 'zlib']:
+            base, expected = None, None
+            for threads in args.threads:
+                path = Path(tmp) / f'{compression}.{threads}.bgen'
+                elapsed = best_of(lambda: write(path, genotypes, args.variants,
+                                                compression, threads), args.repeats)
+                if base is None:
+                    base, expected = elapsed, path.read_bytes()
+                elif path.read_bytes() != expected:
+                    raise ValueError(f'{path} does not match the serial bgen')
+                print(f'{compression}\t{threads}\t{elapsed:.4f}\t'
+                      f'{args.variants / elapsed:.0f}\t{base / elapsed:.2f}x')
+
+if __name__ == '__main__':
+    main()
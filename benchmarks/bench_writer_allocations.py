@@ -0,0 +1,125 @@
+''' count the large allocations made per variant while writing a bgen
+
+Encoding and compressing a variant needs buffers sized by the sample count, and
+compression contexts with tables of tens of kB or more. BgenWriter keeps these
+from one variant to the next, so once the first few variants have grown them,
+writing shouldn't allocate anything large at all. This counts the allocations of
+at least --min-bytes made while writing variants after a warm up, and times the
+writes, for each compression scheme and thread count. Each compression thread
+makes its context the first time it compresses, so the warm up needs to run past
+the writer's queue depth for every thread to have had a turn.
+
+Allocations are counted by a small malloc wrapper, which is compiled with the
+system C compiler and preloaded by rerunning this script, so it needs Linux and cc.
+The genotypes are float64 and written at the default bit depth, so add_variant
+makes no large numpy arrays of its own, and every large allocation counted is
+the writer's.
+
+Run from the benchmarks folder, e.g. python bench_writer_allocations.py
+'''
+
+import argparse
+import ctypes
+import os
+from pathlib import Path
+import subprocess
+import sys
+import tempfile
+import time
+
+import numpy as np
+
+from bgen import BgenWriter
+
+from synthetic import CACHE, make_genotypes
+
+SHIM = r"""
+#include <stddef.h>
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t n, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+extern void * __libc_memalign(size_t align, size_t size);
+
+size_t bench_alloc_min = (size_t) -1;
+unsigned long bench_alloc_count = 0;
+
+static void count(size_t size) {
+  if (size >= bench_alloc_min) {
+    __atomic_add_fetch(&bench_alloc_count, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void * malloc(size_t size) { count(size); return __libc_malloc(size); }
+void * calloc(size_t n, size_t size) { count(n * size); return __libc_calloc(n, size); }
+void * realloc(void * ptr, size_t size) { count(size); return __libc_realloc(ptr, size); }
+void * aligned_alloc(size_t align, size_t size) {
+  count(size);
+  return __libc_memalign(align, size);
+}
+int posix_memalign(void ** ptr, size_t align, size_t size) {
+  count(size);
+  *ptr = __libc_memalign(align, size);
+  return *ptr ? 0 : 12;
+}
+"""
+
+def build_shim():
+    ''' compile the malloc wrapper, if not already built
+    '''
+    CACHE.mkdir(parents=True, exist_ok=True)
+    source = CACHE / 'alloc_count.c'
+    library = CACHE / 'alloc_count.so'
+    if not library.exists() or source.read_text() != SHIM:
+        source.write_text(SHIM)
+        subprocess.run(['cc', '-O2', '-shared', '-fPIC', '-o', str(library),
+                        str(source)], check=True)
+    return library
+
+def write(path, genotypes, args, compression, threads, counter):
+    ''' write variants, giving the seconds and large allocations after the warm up
+    '''
+    with BgenWriter(path, args.samples, compression=compression,
+                    threads=threads) as bfile:
+        for i in range(args.warmup + args.variants):
+            if i == args.warmup:
+                start, before = time.perf_counter(), counter.value
+            bfile.add_variant(f'var{i}', f'rs{i}', '1', i + 1, ['A', 'C'],
+                              genotypes[i % len(genotypes)])
+        # the variants still queued belong to the timing too
+        bfile.close()
+        return time.perf_counter() - start, counter.value - before
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--variants', type=int, default=200)
+    parser.add_argument('--warmup', type=int, default=50)
+    parser.add_argument('--samples', type=int, default=100000)
+    parser.add_argument('--threads', type=int, nargs='+', default=[1, 2])
+    parser.add_argument('--min-bytes', type=int, default=16384)
+    args = parser.parse_args()
+
+    library = build_shim()
+    if str(library) not in os.environ.get('LD_PRELOAD', ''):
+        env = dict(os.environ, LD_PRELOAD=str(library))
+        os.execve(sys.executable, [sys.executable] + sys.argv, env)
+
+    shim = ctypes.CDLL(str(library))
+    ctypes.c_size_t.in_dll(shim, 'bench_alloc_min').value = args.min_bytes
+    counter = ctypes.c_ulong.in_dll(shim, 'bench_alloc_count')
+
+    rng = np.random.default_rng(1)
+    genotypes = [make_genotypes(args.samples, rng) for _ in range(8)]
+    print('compression\tthreads\tseconds\tvariants/s\tallocations/variant')
+    with tempfile.TemporaryDirectory() as tmp:
+        for compression in [None, 'zlib', 'zstd']:
+            for threads in args.threads:
+                path = Path(tmp) / f'{compression}.{threads}.bgen'
+                elapsed, allocs = write(path, genotypes, args, compression, threads,
+                                        counter)
+                print(f'{compression}\t{threads}\t{elapsed:.4f}\t'
+                      f'{args.variants / elapsed:.0f}\t{allocs / args.variants:.2f}')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,74 @@
+''' time decoding zlib compressed bgens, with whichever deflate decoder was built in
+
+The deflate decoder is picked when the extension is built, so to compare backends,
+run this once per build and compare the tables, e.g.
+
+    python setup.py build_ext --inplace
+    python benchmarks/bench_zlib.py
+    BGEN_LIBDEFLATE=/opt/libdeflate python setup.py build_ext --inplace --force
+    python benchmarks/bench_zlib.py
+
+Times iterating through every variant and decoding its probabilities, for:
+  - the zlib compressed files under tests/data, which are many small variants, so
+    mostly time per block rather than per byte
+  - a synthetic many-variants, few-samples bgen, for the same reason
+  - a synthetic bgen of 500,000 samples, about the size of UK Biobank, where the
+    time is spent inflating large blocks
+'''
+
+import argparse
+from pathlib import Path
+import time
+
+from bgen import BgenReader
+import bgen.reader
+
+from synthetic import synthetic_bgen
+
+DATA = Path(__file__).resolve().parent.parent / 'tests' / 'data'
+
+def best_of(func, repeats):
+    ''' run a function a few times, and report the fastest, to cut timing noise
+    '''
+    times = []
+    for _ in range(repeats):
+        start = time.perf_counter()
+        func()
+        times.append(time.perf_counter() - start)
+    return min(times)
+
+def decode(paths):
+    for path in paths:
+        with BgenReader(path, delay_parsing=True) as bfile:
+            for var in bfile:
+                var.probabilities
+
+def zlib_test_files():
+    ''' find the zlib compressed bgens in tests/data
+    '''
+    paths = []
+    for path in sorted(DATA.glob('*.bgen')):
+        with BgenReader(path, delay_parsing=True) as bfile:
+            if bfile.header.compression == 'zlib':
+                paths.append(path)
+    return paths
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--repeats', type=int, default=3)
+    args = parser.parse_args()
+
+    datasets = [('tests/data', zlib_test_files()),
+                ('20000x500', [synthetic_bgen(20000, 500, compression='zlib')]),
+                ('100x500000', [synthetic_bgen(100, 500000, compression='zlib')])]
+    backend = bgen.reader.INFLATE_BACKEND
+    print('backend\tdataset\tfiles\tMB\tseconds\tMB/s')
+    for name, paths in datasets:
+        size = sum(x.stat().st_size for x in paths) / 1e6
+        elapsed = best_of(lambda: decode(paths), args.repeats)
+        print(f'{backend}\t{name}\t{len(paths)}\t{size:.1f}\t{elapsed:.4f}\t'
+              f'{size / elapsed:.1f}')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,82 @@
+''' build synthetic bgen files for the benchmarks
+
+The example files under tests/data are far too small to time anything on, so the
+benchmarks write their own. The files are cached by their parameters in a temporary
+folder, since writing a large bgen takes longer than most of the timings.
+'''
+
+from pathlib import Path
+import tempfile
+
+import numpy as np
+
+from bgen import BgenWriter
+
+CACHE = Path(tempfile.gettempdir()) / 'bgen_benchmarks'
+
+def make_genotypes(n_samples, rng):
+    ''' random unphased biallelic diploid probabilities, with a few missing samples
+    '''
+    geno = rng.random((n_samples, 3))
+    geno /= geno.sum(axis=1)[:, None]
+    geno[rng.random(n_samples) < 0.01] = np.nan
+    return geno
+
+def make_haplotypes(n_samples, rng):
+    ''' random phased biallelic diploid probabilities, one pair per haplotype
+    '''
+    first = rng.random((n_samples, 2))
+    geno = np.column_stack([first[:, 0], 1 - first[:, 0], first[:, 1], 1 - first[:, 1]])
+    geno[rng.random(n_samples) < 0.01] = np.nan
+    return geno
+
+def make_mixed_ploidy(n_samples, rng, ploidy):
+    ''' random unphased biallelic probabilities, for haploid and diploid samples
+    '''
+    geno = make_genotypes(n_samples, rng)
+    haploid = ploidy == 1
+    geno[haploid, 2] = 0
+    geno[haploid] /= geno[haploid].sum(axis=1)[:, None]
+    geno[haploid, 2] = np.nan
+    return geno
+
+def synthetic_bgen(n_variants, n_samples, compression='zstd', bit_depth=8, seed=1,
+                   phased=False, mixed_ploidy=False, layout=2):
+    ''' get the path to a synthetic bgen, writing it if not already cached
+    
+    Only a handful of distinct genotype arrays are generated and reused across the
+    variants, since generating random data for every variant would dominate the
+    time spent writing large files, and the genotype values don't affect the reads.
+    '''
+    CACHE.mkdir(exist_ok=True)
+    name = f'synthetic.{n_variants}x{n_samples}.{compression}.{bit_depth}bits.bgen'
+    if phased:
+        name = name.replace('.bgen', '.phased.bgen')
+    if mixed_ploidy:
+        # half the samples haploid, as for males on chrX
+        name = name.replace('.bgen', '.mixed.bgen')
+    if layout == 1:
+        # layout 1 always holds 16 bit values, whatever bit_depth says
+        name = name.replace('.bgen', '.v11.bgen')
+    path = CACHE / name
+    if path.exists():
+        return path
+    
+    rng = np.random.default_rng(seed)
+    ploidy = 2
+    if mixed_ploidy:
+        ploidy = rng.choice([1, 2], n_samples).astype(np.uint8)
+        pool = [make_mixed_ploidy(n_samples, rng, ploidy) for _ in range(8)]
+    else:
+        make = make_haplotypes if phased else make_genotypes
+        pool = [make(n_samples, rng) for _ in range(8)]
+    tmp = path.with_suffix('.tmp')
+    with BgenWriter(tmp, n_samples, compression=compression, layout=layout) as bfile:
+        for i in range(n_variants):
+            bfile.add_variant(f'var{i}', f'rs{i}', '1', i + 1, ['A', 'G'],
+                              pool[i % len(pool)], ploidy=ploidy, phased=phased,
+                              bit_depth=bit_depth)
+    # the writer also makes an index, which the benchmarks don't want picked up
+    Path(str(tmp) + '.bgi').unlink(missing_ok=True)
+    tmp.rename(path)
+    return path
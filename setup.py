@@ -13,13 +13,41 @@ ROOT = Path(__file__).resolve().parent
 ZLIB_DIR = str(ROOT / 'zlib_build')
 
 EXTRA_COMPILE_ARGS = []
+EXTRA_LINK_ARGS = []
 if sys.platform == 'linux':
-    EXTRA_COMPILE_ARGS += ['-std=c++11', '-O2']
+    # std::thread needs libpthread linked on older glibc, e.g. manylinux2014
+    EXTRA_COMPILE_ARGS += ['-std=c++11', '-O2', '-pthread']
+    EXTRA_LINK_ARGS += ['-pthread']
 elif sys.platform == "darwin":
     EXTRA_COMPILE_ARGS += ["-stdlib=libc++", "-std=c++11", "-O2"]
 elif sys.platform == "win32":
     EXTRA_COMPILE_ARGS += ['/std:c++14', '/O2']
 
+SANITIZE = os.environ.get('BGEN_SANITIZE')
+if SANITIZE and sys.platform != 'win32':
+    # e.g. BGEN_SANITIZE=undefined for a test build, which stops at the first error
+    # found, rather than logging it and carrying on, so a test run fails on it
+    EXTRA_COMPILE_ARGS += [f'-fsanitize={SANITIZE}', f'-fno-sanitize-recover={SANITIZE}',
+                           '-g']
+    EXTRA_LINK_ARGS += [f'-fsanitize={SANITIZE}']
+
+def inflate_options():
+    ''' pick the deflate decoder for zlib compressed genotypes
+    
+    The vendored zlib-ng is used unless BGEN_LIBDEFLATE gives the install prefix
+    of a libdeflate build, whose single-shot decoder is then used instead.
+    '''
+    prefix = os.environ.get('BGEN_LIBDEFLATE')
+    if not prefix:
+        return {}
+    prefix = Path(prefix)
+    return {'define_macros': [('BGEN_LIBDEFLATE', None)],
+            'include_dirs': [str(prefix / 'include')],
+            'library_dirs': [str(prefix / 'lib')],
+            'libraries': ['deflate']}
+
+INFLATE_OPTIONS = inflate_options()
+
 def flatten(*lists):
     return [str(x) for sublist in lists for x in sublist]
 
@@ -137,23 +165,52 @@ class build_ext_subclass(build_ext):
 extensions = [
     Extension('bgen.reader',
         extra_compile_args=EXTRA_COMPILE_ARGS,
+        extra_link_args=EXTRA_LINK_ARGS,
         sources=['src/bgen/reader.pyx',
             'src/reader.cpp',
+            'src/blockcache.cpp',
+            'src/blockstream.cpp',
+            'src/buffers.cpp',
+            'src/catalog.cpp',
+            'src/convert.cpp',
             'src/genotypes.cpp',
+            'src/grm.cpp',
             'src/header.cpp',
+            'src/inflate.cpp',
+            'src/ld.cpp',
+            'src/mapped.cpp',
+            'src/prefetch.cpp',
+            'src/products.cpp',
             'src/samples.cpp',
+            'src/scan.cpp',
+            'src/stats.cpp',
             'src/utils.cpp',
-            'src/variant.cpp'],
-        include_dirs=['src', 'src/zstd/lib', ZLIB_DIR],
+            'src/variant.cpp',
+            'src/varindex.cpp'],
+        include_dirs=['src', 'src/zstd/lib', ZLIB_DIR] + INFLATE_OPTIONS.get('include_dirs', []),
+        define_macros=INFLATE_OPTIONS.get('define_macros', []),
+        library_dirs=INFLATE_OPTIONS.get('library_dirs', []),
+        libraries=INFLATE_OPTIONS.get('libraries', []),
         language='c++'),
     Extension('bgen.writer',
         extra_compile_args=EXTRA_COMPILE_ARGS,
+        extra_link_args=EXTRA_LINK_ARGS,
         sources=['src/bgen/writer.pyx',
             'src/writer.cpp',
+            'src/blockcache.cpp',
+            'src/blockstream.cpp',
+            'src/buffers.cpp',
+            'src/convert.cpp',
             'src/genotypes.cpp',
+            'src/inflate.cpp',
+            'src/mapped.cpp',
+            'src/stats.cpp',
             'src/utils.cpp',
             ],
-        include_dirs=['src', 'src/zstd/lib', ZLIB_DIR],
+        include_dirs=['src', 'src/zstd/lib', ZLIB_DIR] + INFLATE_OPTIONS.get('include_dirs', []),
+        define_macros=INFLATE_OPTIONS.get('define_macros', []),
+        library_dirs=INFLATE_OPTIONS.get('library_dirs', []),
+        libraries=INFLATE_OPTIONS.get('libraries', []),
         language='c++'),
     ]
 
@@ -3,8 +3,9 @@ from importlib.metadata import version
 __name__ = 'bgen'
 __version__ = version(__name__)
 
-from bgen.reader import BgenReader, BgenVar
+from bgen.reader import BgenReader, BgenVar, NativeIndex, build_index, build_native_index
 from bgen.writer import BgenWriter
 
 # listed explicitly so type checkers treat these as re-exported from bgen
-__all__ = ['BgenReader', 'BgenVar', 'BgenWriter']
+__all__ = ['BgenReader', 'BgenVar', 'BgenWriter', 'NativeIndex', 'build_index',
+           'build_native_index']
@@ -1,8 +1,8 @@
 import os
-from typing import Any, IO, Iterator, Optional, Union
+from typing import Any, IO, Iterator, Optional, Sequence, Union
 
 import numpy as np
-from numpy.typing import NDArray
+from numpy.typing import DTypeLike, NDArray
 
 class IStream:
     ''' basic cython implementation of std::istream, for easy pickling
@@ -20,6 +20,38 @@ class OpenStatus:
     def off(self) -> None: ...
     def __reduce__(self) -> tuple[Any, ...]: ...
 
+class SampleSelection:
+    ''' a subset of samples, which genotype outputs are restricted to
+    '''
+    def __new__(cls, indices: Sequence[int], n_samples: int) -> SampleSelection: ...
+    def __len__(self) -> int: ...
+    @property
+    def indices(self) -> list[int]: ...
+    def __reduce__(self) -> tuple[Any, ...]: ...
+
+def genotype_buffer_stats() -> dict[str, int]:
+    ''' count the genotype buffers allocated or reused since the module loaded
+    '''
+    ...
+
+def set_stream_size(n_bytes: int) -> None:
+    ''' set how large a genotype block must be to be decoded as it decompresses
+    '''
+    ...
+
+def stream_size() -> int:
+    ''' get the decompressed size from which genotype blocks are streamed
+    '''
+    ...
+
+class GenotypeCache:
+    ''' decompressed genotype blocks, shared by a BgenReader and its BgenVars
+    '''
+    def __new__(cls, capacity: int = 0) -> GenotypeCache: ...
+    def info(self) -> dict[str, int]: ...
+    def clear(self) -> None: ...
+    def __reduce__(self) -> tuple[Any, ...]: ...
+
 class BgenHeader:
     ''' holds information about the Bgen file, obtained from the intial header.
     '''
@@ -62,7 +94,20 @@ class BgenVar:
                 expected_n: int,
                 is_stdin: bool,
                 is_open: OpenStatus,
+                selection: Optional[SampleSelection] = None,
+                cache: Optional[GenotypeCache] = None,
                 ) -> BgenVar: ...
+    def __init__(self,
+                 handle: IStream,
+                 offset: int,
+                 layout: int,
+                 compression: int,
+                 expected_n: int,
+                 is_stdin: bool,
+                 is_open: OpenStatus,
+                 selection: Optional[SampleSelection] = None,
+                 cache: Optional[GenotypeCache] = None,
+                 ) -> None: ...
     def __repr__(self) -> str: ...
     def __str__(self) -> str: ...
     def __reduce__(self) -> tuple[Any, ...]: ...
@@ -105,6 +150,11 @@ class BgenVar:
         '''
         ...
     @property
+    def missing(self) -> NDArray[np.bool_]:
+        ''' get whether each sample is missing, as a boolean array
+        '''
+        ...
+    @property
     def minor_allele(self) -> str:
         ''' get the minor allele of a biallelic variant
         '''
@@ -119,16 +169,78 @@ class BgenVar:
         ''' dosage for the alt allele for a biallelic variant
         '''
         ...
+    def alt_dosage_as(self, dtype: DTypeLike) -> NDArray[Any]:
+        ''' dosage for the alt allele for a biallelic variant, in a given number format
+        '''
+        ...
+    def minor_allele_dosage_as(self, dtype: DTypeLike) -> NDArray[Any]:
+        ''' dosage for the minor allele for a biallelic variant, in a given number format
+        '''
+        ...
+    def hard_calls(self, threshold: float = 0.9) -> NDArray[np.int8]:
+        ''' hard call each sample's genotype, as its count of alt alleles
+        '''
+        ...
     @property
     def probabilities(self) -> NDArray[np.float32]:
         ''' get the allelic probabilities for a variant
         '''
         ...
+    def probabilities_as(self, dtype: DTypeLike) -> NDArray[Any]:
+        ''' get the allelic probabilities for a variant, in a given number format
+        '''
+        ...
     def copy_data(self) -> list[int]:
         ''' get a copy of the data on disk for the variant
         '''
         ...
 
+NATIVE_INDEX_SUFFIX: str
+OUTPUT_DTYPES: dict[str, int]
+INFLATE_BACKEND: str
+
+class NativeIndex:
+    ''' a binary variant index (.bgix), looked up in place through a memory mapping
+    '''
+    path: str
+    def __new__(cls, path: Union[str, os.PathLike[str]]) -> NativeIndex: ...
+    @property
+    def bgen_size(self) -> int:
+        ''' size in bytes of the bgen when it was indexed
+        '''
+        ...
+    def fetch(self, chrom: str, start: Optional[int] = None,
+              stop: Optional[int] = None) -> Iterator[int]:
+        ''' get file offsets for variants within a genome region, in position order
+        '''
+        ...
+    def __len__(self) -> int: ...
+    def offset_by_index(self, index: int) -> int: ...
+    def size_by_index(self, index: int) -> int: ...
+    def offset_by_rsid(self, rsid: str) -> list[int]: ...
+    def offset_by_pos(self, pos: int) -> list[int]: ...
+    @property
+    def rsids(self) -> list[str]: ...
+    @property
+    def chroms(self) -> list[str]: ...
+    @property
+    def positions(self) -> list[int]: ...
+    @property
+    def sizes(self) -> list[int]: ...
+    def close(self) -> None: ...
+
+def build_index(path: Union[str, os.PathLike[str]]) -> str:
+    ''' write a bgenix compatible index (.bgi) for an existing bgen
+    '''
+    ...
+
+def build_native_index(path: Union[str, os.PathLike[str]],
+                       source: Optional[Union[str, os.PathLike[str]]] = None,
+                       ) -> str:
+    ''' write a binary variant index (.bgix) beside a bgen
+    '''
+    ...
+
 class BgenReader:
     ''' class to open bgen files from disk, and access variant data within
     '''
@@ -136,6 +248,10 @@ class BgenReader:
                 path: Union[str, os.PathLike[str], IO[Any]],
                 sample_path: Union[str, os.PathLike[str]] = '',
                 delay_parsing: bool = True,
+                use_mmap: bool = False,
+                prefetch: int = 0,
+                prefetch_threads: int = 2,
+                cache_size: int = 0,
                 ) -> BgenReader: ...
     def __repr__(self) -> str: ...
     def __iter__(self) -> Iterator[BgenVar]: ...
@@ -145,6 +261,83 @@ class BgenReader:
         ''' pull out a Variant by index position
         '''
         ...
+    def select_samples(self,
+                       samples: Optional[Union[Sequence[str], Sequence[int], NDArray[Any]]] = None,
+                       ) -> None:
+        ''' restrict the genotypes of variants to a subset of samples
+        '''
+        ...
+    @property
+    def selected_samples(self) -> list[str]:
+        ''' IDs of the samples that genotype outputs are restricted to, in output order
+        '''
+        ...
+    def dosage_matrix(self,
+                      indices: Optional[Sequence[int]] = None,
+                      offsets: Optional[Sequence[int]] = None,
+                      out: Optional[NDArray[Any]] = None,
+                      threads: int = 0,
+                      minor_allele: bool = False,
+                      dtype: DTypeLike = np.float32,
+                      ) -> NDArray[Any]:
+        ''' decode the dosages of many variants into one variants x samples array
+        '''
+        ...
+    def hard_call_matrix(self,
+                         indices: Optional[Sequence[int]] = None,
+                         offsets: Optional[Sequence[int]] = None,
+                         out: Optional[NDArray[np.int8]] = None,
+                         threads: int = 0,
+                         threshold: float = 0.9,
+                         ) -> NDArray[np.int8]:
+        ''' hard call the genotypes of many variants into one variants x samples array
+        '''
+        ...
+    def dosage_products(self,
+                        y: NDArray[Any],
+                        indices: Optional[Sequence[int]] = None,
+                        offsets: Optional[Sequence[int]] = None,
+                        threads: int = 0,
+                        minor_allele: bool = False,
+                        ) -> tuple[NDArray[np.float64], NDArray[np.float64], NDArray[np.float64]]:
+        ''' multiply the dosage matrix of many variants by phenotypes, without building it
+        '''
+        ...
+    def grm(self,
+            indices: Optional[Sequence[int]] = None,
+            offsets: Optional[Sequence[int]] = None,
+            threads: int = 0,
+            max_memory: int = 2**30,
+            path: Optional[Union[str, os.PathLike[str]]] = None,
+            ) -> tuple[NDArray[np.float32], int]:
+        ''' genetic relationship matrix between the selected samples, as GCTA finds it
+        '''
+        ...
+    def variant_stats(self,
+                      indices: Optional[Sequence[int]] = None,
+                      offsets: Optional[Sequence[int]] = None,
+                      chrom: Optional[str] = None,
+                      start: Optional[int] = None,
+                      stop: Optional[int] = None,
+                      threads: int = 0,
+                      threshold: float = 0.9,
+                      ) -> dict[str, NDArray[Any]]:
+        ''' quality control statistics for many variants, as columns of a table
+        '''
+        ...
+    def ld_matrix(self,
+                  chrom: Optional[str] = None,
+                  start: Optional[int] = None,
+                  stop: Optional[int] = None,
+                  indices: Optional[Sequence[int]] = None,
+                  offsets: Optional[Sequence[int]] = None,
+                  window: Optional[int] = None,
+                  threads: int = 0,
+                  path: Optional[Union[str, os.PathLike[str]]] = None,
+                  ) -> NDArray[np.float32]:
+        ''' correlations (r) between the alt dosages of the variants in a region
+        '''
+        ...
     def __enter__(self) -> BgenReader: ...
     def __exit__(self, exc_type: Any, exc_value: Any, traceback: Any) -> bool: ...
     @property
@@ -199,6 +392,14 @@ class BgenReader:
         ''' get the positions of all variants in the bgen file
         '''
         ...
+    def scan_positions(self) -> tuple[NDArray[np.uint64], NDArray[np.uint32]]:
+        ''' find the file offset and position of every variant, reading nothing else
+        '''
+        ...
+    def cache_info(self) -> dict[str, int]:
+        ''' get the counters for the cache of decompressed genotype blocks
+        '''
+        ...
     def close(self) -> None: ...
 
 BgenFile = BgenReader
@@ -2,6 +2,7 @@
 
 import logging
 from pathlib import Path
+import sqlite3
 import sys
 import warnings
 
@@ -9,7 +10,7 @@ from libcpp cimport bool
 from libcpp.memory cimport shared_ptr, make_shared
 from libcpp.string cimport string
 from libcpp.vector cimport vector
-from libc.stdint cimport uint8_t, uint32_t, uint64_t, uintptr_t
+from libc.stdint cimport int8_t, uint8_t, uint16_t, uint32_t, uint64_t, uintptr_t
 from libc.string cimport memcpy
 
 from cython.operator cimport dereference as deref
@@ -17,6 +18,10 @@ from cython.operator cimport dereference as deref
 import numpy as np
 
 from bgen.index import Index
+from bgen.writer import Indexer
+
+# suffix of the binary variant index, which sits beside the bgen as a .bgi would
+NATIVE_INDEX_SUFFIX = '.bgix'
 
 # Random access needs to seek to a variant's offset, which a stream cannot do, so the
 # only way through a pipe is to iterate. Kept in one place because several methods hit
@@ -47,6 +52,48 @@ cdef extern from "<memory>" namespace "std":
 cdef extern from 'utils.h' namespace 'bgen':
     shared_ptr_istream borrowed_stream(istream * handle) except +
 
+cdef extern from 'samples.h' namespace 'bgen':
+    cdef cppclass SampleSubset:
+        SampleSubset(vector[uint32_t] indices, uint32_t n_samples) except +
+        uint32_t size()
+        vector[uint32_t] indices
+        uint32_t n_samples
+
+cdef extern from 'buffers.h' namespace 'bgen':
+    cdef struct BufferStats:
+        uint64_t allocations
+        uint64_t reuses
+    BufferStats buffer_stats()
+
+cdef extern from 'inflate.h' namespace 'bgen':
+    const char * inflate_backend()
+
+cdef extern from 'genotypes.h' namespace 'bgen':
+    void set_stream_threshold(uint64_t bytes)
+    uint64_t stream_threshold()
+
+cdef extern from 'blockcache.h' namespace 'bgen':
+    cdef cppclass BlockCache:
+        BlockCache(uint64_t capacity) except +
+        void clear()
+        uint64_t capacity()
+        uint64_t hits()
+        uint64_t misses()
+        uint64_t evictions()
+        uint64_t bytes()
+        uint64_t size()
+
+cdef extern from 'grm.h' namespace 'bgen':
+    const uint32_t GRM_BLOCK
+
+cdef extern from 'stats.h' namespace 'bgen':
+    cdef cppclass StatsTable:
+        vector[string] varid, rsid, chrom
+        vector[uint32_t] pos
+        vector[uint16_t] n_alleles
+        vector[double] alt_freq, missing_rate, info, hwe_p
+        vector[uint32_t] hom_ref, het, hom_alt
+
 cdef extern from 'variant.h' namespace 'bgen':
     cdef cppclass Variant:
         # declare class constructor and methods
@@ -54,12 +101,21 @@ cdef extern from 'variant.h' namespace 'bgen':
         Variant() except +
         void minor_allele_dosage(float * dosage) except +
         void alt_dosage(float * dosage) except +
+        void hard_calls(int8_t * calls, float threshold) except +
+        void missing_samples(uint8_t * out) except +
+        void alt_dosage_as(void * dosage, int type) except +
+        void minor_allele_dosage_as(void * dosage, int type) except +
+        void probs_1d_as(void * probs, int type) except +
         string get_minor_allele() except +
         void probs_1d(float * dosage) except +
         int probs_per_sample() except +
         bool phased() except +
         bool probs_above_max() except +
         uint8_t * ploidy() except +
+        void selected_ploidy(uint8_t * out) except +
+        void select_samples(shared_ptr[SampleSubset] subset) except +
+        void use_cache(shared_ptr[BlockCache] cache)
+        uint32_t n_selected()
         vector[uint8_t] copy_data() except +
         
         # declare public attributes
@@ -92,14 +148,71 @@ cdef extern from 'header.h' namespace 'bgen':
         string extra
         bool has_sample_ids
 
+cdef extern from 'catalog.h' namespace 'bgen':
+    cdef cppclass VariantCatalog:
+        uint64_t size()
+        uint64_t offset(uint64_t idx)
+
+cdef extern from 'varindex.h' namespace 'bgen':
+    cdef cppclass IndexRows:
+        IndexRows() except +
+        uint64_t size()
+        vector[string] chroms
+        vector[uint32_t] positions
+        vector[string] rsids
+        vector[uint16_t] n_alleles
+        vector[string] allele1
+        vector[string] allele2
+        vector[uint64_t] offsets
+        vector[uint32_t] sizes
+    void write_variant_index(string path, const IndexRows & rows, uint64_t bgen_size) except + nogil
+    cdef cppclass VariantIndex:
+        VariantIndex(string path) except +
+        uint64_t size()
+        uint64_t bgen_size()
+        vector[uint64_t] fetch(string chrom, uint32_t start, uint32_t stop) except +
+        vector[uint64_t] with_rsid(string rsid) except +
+        vector[uint64_t] at_position(uint32_t pos) except +
+        uint64_t offset(uint64_t row) except +
+        uint32_t size(uint64_t row) except +
+        uint32_t position(uint64_t row) except +
+        string chrom(uint64_t row) except +
+        string rsid(uint64_t row) except +
+
+cdef extern from 'scan.h' namespace 'bgen':
+    cdef cppclass IndexScanner:
+        bool next(IndexRows & rows) except + nogil
+
 cdef extern from 'reader.h' namespace 'bgen':
     cdef cppclass CppBgenReader:
         # declare class constructor and methods
-        CppBgenReader(string path, string sample_path, bool delay_parsing) except +
+        CppBgenReader(string path, string sample_path, bool delay_parsing, bool use_mmap) except +
         void close_stream() except +
         void parse_all_variants() except +
-        Variant & operator[](int idx) except +
-        Variant & get(int idx) except +
+        void scan_positions(vector[uint64_t] & offsets, vector[uint32_t] & positions) except + nogil
+        void index_rows(IndexRows & rows) except + nogil
+        IndexScanner * index_scanner(uint64_t batch_size, int depth) except +
+        void start_prefetch(uint64_t offset, int depth, int threads) except +
+        Variant * next_prefetched() except + nogil
+        void stop_prefetch() except +
+        void select_samples(shared_ptr[SampleSubset] subset) except +
+        uint32_t n_selected()
+        vector[uint64_t] dosage_matrix(const vector[uint64_t] & offsets, void * dose,
+                                       bool use_minor, int threads, int type) except + nogil
+        vector[uint64_t] hard_call_matrix(const vector[uint64_t] & offsets, int8_t * calls,
+                                          float threshold, int threads) except + nogil
+        vector[uint64_t] grm_tile(const vector[uint64_t] & offsets, uint32_t row_start,
+                                  uint32_t n_rows, uint32_t col_start, uint32_t n_cols,
+                                  double * tile, uint64_t & n_used,
+                                  int threads) except + nogil
+        vector[uint64_t] dosage_products(const vector[uint64_t] & offsets, const float * yt,
+                                         uint32_t k, double * out, double * sums,
+                                         double * sumsq, bool use_minor,
+                                         int threads) except + nogil
+        vector[uint64_t] variant_stats(const vector[uint64_t] & offsets, StatsTable & table,
+                                       float threshold, int threads) except + nogil
+        vector[uint64_t] ld_matrix(const vector[uint64_t] & offsets, uint64_t window,
+                                   bool banded, float * out, int threads) except + nogil
         void drop_variants(vector[int] indices) except +
         vector[string] varids() except +
         vector[string] rsids() except +
@@ -108,9 +221,10 @@ cdef extern from 'reader.h' namespace 'bgen':
         
         # declare public attributes
         shared_ptr_istream handle
-        vector[Variant] variants
+        VariantCatalog catalog
         Samples samples
         Header header
+        shared_ptr[BlockCache] cache
         uint64_t offset
 
 cdef extern from 'utils.h' namespace 'bgen':
@@ -174,6 +288,95 @@ cdef class OpenStatus:
     def __reduce__(self):
         return (self.__class__, ())
 
+cdef class SampleSelection:
+    ''' a subset of samples, which genotype outputs are restricted to
+    
+    The C++ side of this is shared by the BgenReader and every BgenVar opened while
+    the selection is in place, so it is only built once however many variants are
+    decoded with it. The indices are into the bgen's samples, and the output columns
+    follow their order.
+    '''
+    cdef shared_ptr[SampleSubset] ptr
+    def __cinit__(self, indices, uint32_t n_samples):
+        cdef vector[uint32_t] picked = indices
+        self.ptr.reset(new SampleSubset(picked, n_samples))
+    def __len__(self):
+        return self.ptr.get().size()
+    @property
+    def indices(self):
+        return list(self.ptr.get().indices)
+    def __reduce__(self):
+        return (self.__class__, (self.indices, self.ptr.get().n_samples))
+
+def genotype_buffer_stats():
+    ''' count the genotype buffers allocated or reused since the module loaded
+
+    Decoding a variant borrows buffers for its stored and decompressed genotypes and
+    its ploidy from a small pool per thread, and gives them back once the variant
+    is done with. Once the pool has buffers large enough for the largest variant,
+    reading more variants only reuses them.
+
+    Returns:
+        dict with the number of fresh allocations and of reuses from a pool
+    '''
+    cdef BufferStats stats = buffer_stats()
+    return {'allocations': stats.allocations, 'reuses': stats.reuses}
+
+def set_stream_size(uint64_t n_bytes):
+    ''' set how large a genotype block must be to be decoded as it decompresses
+
+    A variant's genotypes are normally decompressed whole, then decoded. Blocks which
+    decompress to at least this many bytes are instead decompressed a window at a
+    time, with each window decoded while it is still in cache, so memory per variant
+    stays near the size of the output. Such a block is not kept, so asking the same
+    BgenVar for its genotypes twice decompresses it twice. Blocks are never streamed
+    for a BgenReader with a cache_size, or when prefetching.
+
+    Args:
+        n_bytes: decompressed size from which blocks are streamed, 4 MiB by
+            default. 0 never streams.
+    '''
+    set_stream_threshold(n_bytes)
+
+def stream_size():
+    ''' get the decompressed size from which genotype blocks are streamed
+    '''
+    return stream_threshold()
+
+# deflate decoder used for zlib compressed genotypes, picked when the module is
+# built: 'zlib', or 'libdeflate' if built with BGEN_LIBDEFLATE set
+INFLATE_BACKEND = inflate_backend().decode('utf8')
+
+cdef class GenotypeCache:
+    ''' decompressed genotype blocks, shared by a BgenReader and its BgenVars
+    
+    A BgenVar for a variant which was decoded before takes its genotypes from here,
+    rather than reading and decompressing them again. A capacity of zero keeps
+    nothing. This is not pickled with a BgenVar, so an unpickled BgenVar reads its
+    genotypes afresh.
+    '''
+    cdef shared_ptr[BlockCache] ptr
+    def __cinit__(self, uint64_t capacity=0):
+        if capacity > 0:
+            self.ptr.reset(new BlockCache(capacity))
+    def info(self):
+        ''' counts of lookups which found a block (hits) or not (misses), blocks
+        dropped to stay in budget (evictions), and the blocks (entries) and bytes
+        currently held, out of the capacity in bytes
+        '''
+        cdef BlockCache * cache = self.ptr.get()
+        if cache == NULL:
+            return {'hits': 0, 'misses': 0, 'evictions': 0, 'entries': 0,
+                    'bytes': 0, 'capacity': 0}
+        return {'hits': cache.hits(), 'misses': cache.misses(),
+                'evictions': cache.evictions(), 'entries': cache.size(),
+                'bytes': cache.bytes(), 'capacity': cache.capacity()}
+    def clear(self):
+        if self.ptr.get() != NULL:
+            self.ptr.get().clear()
+    def __reduce__(self):
+        return (self.__class__, ())
+
 # compression flags as stored in the bgen header, mapped to the names the
 # BgenWriter accepts, so a variant copied between files can be checked. this is
 # cdef so it stays private to the module, and shared by BgenHeader and BgenVar
@@ -239,6 +442,8 @@ cdef class BgenVar:
     cdef int _layout, _compression, expected_n
     cdef bool is_stdin
     cdef OpenStatus is_open
+    cdef SampleSelection selection
+    cdef GenotypeCache cache
     def __cinit__(self,
                   IStream handle,
                   uint64_t offset,
@@ -247,6 +452,8 @@ cdef class BgenVar:
                   int expected_n,
                   bool is_stdin,
                   OpenStatus is_open,
+                  SampleSelection selection=None,
+                  GenotypeCache cache=None,
                   ):
         self.handle = handle
         self.offset = offset
@@ -255,9 +462,31 @@ cdef class BgenVar:
         self.expected_n = expected_n
         self.is_stdin = is_stdin
         self.is_open = is_open
-        
-        # construct new Variant from the handle, offset and other file info
+        self.selection = selection
+        self.cache = cache
+        self.thisptr = NULL
+    
+    def __init__(self,
+                 IStream handle,
+                 uint64_t offset,
+                 int layout,
+                 int compression,
+                 int expected_n,
+                 bool is_stdin,
+                 OpenStatus is_open,
+                 SampleSelection selection=None,
+                 GenotypeCache cache=None,
+                 ):
+        # construct new Variant from the handle, offset and other file info. This is
+        # kept out of __cinit__, so that a BgenReader which already has the parsed
+        # Variant (from prefetching) can wrap it via adopt_variant() without parsing
+        # it a second time.
+        del self.thisptr
         self.thisptr = new Variant(self.handle.ptr, offset, layout, compression, expected_n, is_stdin)
+        if selection is not None:
+            self.thisptr.select_samples(selection.ptr)
+        if cache is not None:
+            self.thisptr.use_cache(cache.ptr)
     
     def __repr__(self):
        return f'BgenVar("{self.varid}", "{self.rsid}", "{self.chrom}", {self.pos}, {self.alleles})'
@@ -287,7 +516,7 @@ cdef class BgenVar:
         ''' the arguments needed to rebuild an equivalent BgenVar
         '''
         return (self.handle, self.thisptr.offset, self._layout, self._compression,
-                self.expected_n, self.is_stdin, self.is_open)
+                self.expected_n, self.is_stdin, self.is_open, self.selection, self.cache)
     
     def __reduce__(self):
         ''' enable pickling of a BgenVar object
@@ -367,11 +596,23 @@ cdef class BgenVar:
         ''' get the ploidy for each sample
         '''
         self.__check_closed()
-        cdef uint8_t * ploid = self.thisptr.ploidy()
-        cdef uint64_t size = self.expected_n
+        cdef uint64_t size = self.thisptr.n_selected()
         cdef uint8_t[::1] arr = np.empty(size, dtype=np.uint8, order='C')
-        memcpy(&arr[0], ploid, size)
+        self.thisptr.selected_ploidy(&arr[0])
         return np.asarray(arr)
+    @property
+    def missing(self):
+        ''' get whether each sample is missing, as a boolean array
+
+        This is for outputs with no value to mark missing samples by, such as the
+        uint8 dtype. Layout 1 bgens only mark missing samples in their probabilities,
+        so those are decoded to find them.
+        '''
+        self.__check_closed()
+        cdef uint64_t size = self.thisptr.n_selected()
+        cdef uint8_t[::1] arr = np.empty(size, dtype=np.uint8, order='C')
+        self.thisptr.missing_samples(&arr[0])
+        return np.asarray(arr).view(np.bool_)
     def __warn_if_malformed(self):
         ''' warn if the decode just done found probabilities summing above the maximum
 
@@ -398,7 +639,7 @@ cdef class BgenVar:
         ''' dosage for the minor allele for a biallelic variant
         '''
         self.__check_closed()
-        cdef float[:] dose = np.empty(self.expected_n, dtype=np.float32, order='C')
+        cdef float[:] dose = np.empty(self.thisptr.n_selected(), dtype=np.float32, order='C')
         self.thisptr.minor_allele_dosage(&dose[0])
         self.__warn_if_malformed()
         return np.asarray(dose)
@@ -407,25 +648,88 @@ cdef class BgenVar:
         ''' dosage for the alt allele for a biallelic variant
         '''
         self.__check_closed()
-        cdef float[:] dose = np.empty(self.expected_n, dtype=np.float32, order='C')
+        cdef float[:] dose = np.empty(self.thisptr.n_selected(), dtype=np.float32, order='C')
         self.thisptr.alt_dosage(&dose[0])
         self.__warn_if_malformed()
         return np.asarray(dose)
+    def alt_dosage_as(self, dtype):
+        ''' dosage for the alt allele for a biallelic variant, in a given number format
+        
+        Args:
+            dtype: float32, float16, bfloat16, uint8 or uint8_254 (see OUTPUT_DTYPES)
+        '''
+        return self.__dosage_as(dtype, False)
+    def minor_allele_dosage_as(self, dtype):
+        ''' dosage for the minor allele for a biallelic variant, in a given number format
+        
+        Args:
+            dtype: float32, float16, bfloat16, uint8 or uint8_254 (see OUTPUT_DTYPES)
+        '''
+        return self.__dosage_as(dtype, True)
+    def __dosage_as(self, dtype, bool minor):
+        self.__check_closed()
+        cdef int out_type
+        out_type, np_dtype = _output_type(dtype)
+        dose = np.empty(self.thisptr.n_selected(), dtype=np_dtype, order='C')
+        cdef uint8_t[::1] raw = dose.view(np.uint8)
+        if minor:
+            self.thisptr.minor_allele_dosage_as(&raw[0], out_type)
+        else:
+            self.thisptr.alt_dosage_as(&raw[0], out_type)
+        self.__warn_if_malformed()
+        return dose
+    def hard_calls(self, float threshold=0.9):
+        ''' hard call each sample's genotype, as its count of alt alleles
+        
+        The calls are made as the genotypes decode, without building the float32
+        probabilities, so the output is a twelfth the size. The exceptions are
+        when samples have been selected, or ploidy varies between samples (e.g.
+        on chrX), where the full float32 probabilities are decoded first, then
+        called. Only works for biallelic variants with ploidy of 2 or less.
+        
+        Args:
+            threshold: lowest probability a sample's most likely genotype needs to
+                be called. Phased samples are called from the genotype probabilities
+                of their haplotypes. Ties go to the genotype with fewer alt alleles.
+        
+        Returns:
+            1D int8 numpy array with 0, 1 or 2 per sample (0 or 1 if haploid), and
+            -1 for missing samples and those below the threshold
+        '''
+        self.__check_closed()
+        _check_call_threshold(threshold)
+        cdef int8_t[:] calls = np.empty(self.thisptr.n_selected(), dtype=np.int8, order='C')
+        self.thisptr.hard_calls(&calls[0], threshold)
+        self.__warn_if_malformed()
+        return np.asarray(calls)
     @property
     def probabilities(self):
         ''' get the allelic probabilities for a variant
         '''
+        return self.probabilities_as(np.float32)
+    def probabilities_as(self, dtype):
+        ''' get the allelic probabilities for a variant, in a given number format
+        
+        Args:
+            dtype: float32, float16, bfloat16, uint8 or uint8_254 (see OUTPUT_DTYPES)
+        
+        Returns:
+            probabilities shaped as for the probabilities attribute
+        '''
         self.__check_closed()
+        cdef int out_type
+        out_type, np_dtype = _output_type(dtype)
         cdef int cols = self.thisptr.probs_per_sample()
-        cdef uint32_t n_samples = self.expected_n
+        cdef uint32_t n_samples = self.thisptr.n_selected()
         cdef uint64_t size = n_samples * cols
         cdef uint8_t[::1] ploidy
         if self.is_phased:
             ploidy = self.ploidy
             size = fast_ploidy_sum(&ploidy[0], n_samples) * cols
         
-        cdef float[:] arr = np.empty(size, dtype=np.float32, order='C')
-        self.thisptr.probs_1d(&arr[0])
+        arr = np.empty(size, dtype=np_dtype, order='C')
+        cdef uint8_t[::1] raw = arr.view(np.uint8)
+        self.thisptr.probs_1d_as(&raw[0], out_type)
         self.__warn_if_malformed()
         
         cdef int current = 0
@@ -447,8 +751,8 @@ cdef class BgenVar:
                 phase_width = data.shape[1]
                 
                 # create an empty array filled with nans
-                ragged = np.empty((len(ploidy), max_ploidy * cols), dtype=np.float32)
-                ragged.fill(np.nan)
+                ragged = np.empty((len(ploidy), max_ploidy * cols), dtype=np_dtype)
+                ragged.fill(_MISSING_VALUES[out_type])
                 
                 # fill in the empty array
                 for i, x in enumerate(ploidy):
@@ -478,12 +782,306 @@ cdef class BgenVar:
         cdef vector[uint8_t] data = self.thisptr.copy_data()
         return data
 
+cdef BgenVar adopt_variant(Variant * ptr, IStream handle, int layout, int compression,
+                           int expected_n, bool is_stdin, OpenStatus is_open,
+                           SampleSelection selection, GenotypeCache cache):
+    ''' wrap an already parsed Variant in a BgenVar, taking ownership of it
+    
+    __new__ only runs __cinit__, which leaves the Variant to __init__, so this skips
+    the parse that calling BgenVar(...) would do.
+    '''
+    cdef BgenVar var
+    try:
+        var = BgenVar.__new__(BgenVar, handle, ptr.offset, layout, compression,
+                              expected_n, is_stdin, is_open, selection, cache)
+    except:
+        del ptr
+        raise
+    var.thisptr = ptr
+    if cache is not None:
+        ptr.use_cache(cache.ptr)
+    return var
+
+# number formats genotypes can be decoded into, by the name to ask for them with.
+# bfloat16 has no numpy type, so its raw bits come back as uint16, which
+# e.g. ml_dtypes.bfloat16 can view. uint8 scales the largest value (1 for
+# probabilities, 2 for dosages) to 255, as 8 bit bgens store probabilities, so
+# those come back exactly as stored. Missing values are zero, and BgenVar.missing
+# says which samples are missing. uint8_254 scales to 254 instead, to mark missing
+# values with 255, but loses the exact 8 bit values, as 256 fall on 255 steps.
+OUTPUT_DTYPES = {'float32': 0, 'float16': 1, 'bfloat16': 2, 'uint8': 3, 'uint8_254': 4}
+_NUMPY_DTYPES = {0: np.float32, 1: np.float16, 2: np.uint16, 3: np.uint8, 4: np.uint8}
+_MISSING_VALUES = {0: np.nan, 1: np.nan, 2: 0x7fc0, 3: 0, 4: 255}
+
+def _output_type(dtype):
+    ''' find the output type code and numpy dtype for a requested number format
+    '''
+    if isinstance(dtype, str):
+        name = dtype
+    else:
+        name = np.dtype(dtype).name
+    if name not in OUTPUT_DTYPES:
+        raise ValueError(f'cannot decode genotypes to {dtype}, only to one of '
+                         f'{", ".join(OUTPUT_DTYPES)}')
+    code = OUTPUT_DTYPES[name]
+    return code, _NUMPY_DTYPES[code]
+
+def _grm_tile_size(max_memory, n_samples):
+    ''' largest GRM tile side whose working memory fits in max_memory bytes
+    
+    A tile needs 8 bytes per sample pair for its float64 sums, and 4 bytes per
+    sample per variant of a decode block for the standardized dosages of its row
+    and column samples.
+    '''
+    block = 2 * 4 * GRM_BLOCK
+    size = int((-block + (block ** 2 + 32 * max_memory) ** 0.5) / 16)
+    return max(16, min(size, n_samples))
+
+def _check_call_threshold(threshold):
+    ''' make sure a hard call threshold is a probability
+    '''
+    if not 0 <= threshold <= 1:
+        raise ValueError(f'hard call threshold must be from 0 to 1, not {threshold}')
+
+cdef uint32_t _clamp_position(pos, uint32_t default):
+    ''' fit a region bound into the range of a bgen position
+    '''
+    if pos is None:
+        return default
+    return min(max(int(pos), 0), 0xFFFFFFFF)
+
+cdef class NativeIndex:
+    ''' a binary variant index (.bgix), looked up in place through a memory mapping
+
+    This answers the same queries as bgen.index.Index does from a bgenix .bgi, but
+    each is a binary search or hash lookup in C++, rather than a sqlite query, and
+    opening it reads nothing past the header, whatever the size of the bgen.
+    '''
+    cdef VariantIndex * thisptr
+    cdef readonly str path
+    def __cinit__(self, path):
+        self.path = str(path)
+        logging.debug(f'opening binary bgen index: {self.path}')
+        self.thisptr = new VariantIndex(self.path.encode('utf8'))
+
+    def __dealloc__(self):
+        del self.thisptr
+
+    cdef VariantIndex * _index(self) except NULL:
+        if self.thisptr == NULL:
+            raise ValueError('bgen index is closed')
+        return self.thisptr
+
+    @property
+    def bgen_size(self):
+        ''' size in bytes of the bgen when it was indexed
+        '''
+        return self._index().bgen_size()
+
+    def fetch(self, chrom, start=None, stop=None):
+        ''' get file offsets for variants within a genome region, in position order
+
+        Args:
+            chrom: chromosome that variants must be on
+            start: start nucleotide of region. If None, gets offsets for
+                variants with positions up to stop, or for all variants on the
+                chromosome if stop is also None
+            stop: end nucleotide of region. If None, gets offsets for variants
+                with positions after start
+
+        Returns:
+            iterator over the file offsets for variants within the genome region
+        '''
+        if stop is not None and stop < 0:
+            return iter([])
+        cdef vector[uint64_t] offsets = self._index().fetch(chrom.encode('utf8'),
+            _clamp_position(start, 0), _clamp_position(stop, 0xFFFFFFFF))
+        return iter(offsets)
+
+    def __len__(self) -> int:
+        ''' number of variants listed in the index
+        '''
+        return self._index().size()
+
+    def offset_by_index(self, index) -> int:
+        ''' get file offset of bgen variant given a variant index
+        '''
+        cdef VariantIndex * ptr = self._index()
+        if index < 0:
+            index += ptr.size()
+        if index < 0:
+            raise IndexError(f'variant index out of range: {index - ptr.size()}')
+        return ptr.offset(index)
+
+    def size_by_index(self, index) -> int:
+        ''' get the size in bytes of a bgen variant given a variant index
+
+        Along with the offsets the lookups below give, this is enough to read a
+        variant's whole block in one go, as the size_in_bytes column of a .bgi is.
+        '''
+        cdef VariantIndex * ptr = self._index()
+        if index < 0:
+            index += ptr.size()
+        if index < 0:
+            raise IndexError(f'variant index out of range: {index - ptr.size()}')
+        return ptr.size(index)
+
+    def offset_by_rsid(self, rsid) -> list[int]:
+        ''' get file offsets of bgen variants with an rsID
+        '''
+        return self._index().with_rsid(rsid.encode('utf8'))
+
+    def offset_by_pos(self, pos) -> list[int]:
+        ''' get file offsets of bgen variants at a position
+        '''
+        if pos < 0 or pos > 0xFFFFFFFF:
+            return []
+        return self._index().at_position(pos)
+
+    @property
+    def rsids(self):
+        ''' get rsID list for all variants in the bgen file
+        '''
+        cdef VariantIndex * index = self._index()
+        return [index.rsid(i).decode('utf8') for i in range(index.size())]
+
+    @property
+    def chroms(self):
+        ''' get chromosome list for all variants in the bgen file
+        '''
+        cdef VariantIndex * index = self._index()
+        return [index.chrom(i).decode('utf8') for i in range(index.size())]
+
+    @property
+    def positions(self):
+        ''' get position list for all variants in the bgen file
+        '''
+        cdef VariantIndex * index = self._index()
+        return [index.position(i) for i in range(index.size())]
+
+    @property
+    def sizes(self):
+        ''' get the size in bytes of every variant in the bgen file
+        '''
+        cdef VariantIndex * index = self._index()
+        return [index.size(i) for i in range(index.size())]
+
+    def close(self):
+        del self.thisptr
+        self.thisptr = NULL
+
+def build_native_index(path, source=None):
+    ''' write a binary variant index (.bgix) beside a bgen
+
+    BgenReader opens a .bgix in preference to a bgenix .bgi, since its lookups run
+    in place from a memory mapping rather than through sqlite.
+
+    Args:
+        path: path to the bgen
+        source: path to a bgenix .bgi to convert. If None, the .bgi beside the bgen
+            is converted if there is one, otherwise the bgen itself is scanned.
+
+    Returns:
+        path to the written index
+    '''
+    path = Path(path)
+    bgi_path = Path(str(path) + '.bgi') if source is None else Path(source)
+    out_path = str(path) + NATIVE_INDEX_SUFFIX
+
+    cdef IndexRows rows
+    cdef CppBgenReader * reader
+    if bgi_path.exists():
+        conn = sqlite3.connect(str(bgi_path))
+        try:
+            query = 'SELECT chromosome, position, rsid, file_start_position, size_in_bytes ' \
+                    'FROM Variant ORDER BY file_start_position'
+            for chrom, pos, rsid, offset, size in conn.execute(query):
+                rows.chroms.push_back(chrom.encode('utf8'))
+                rows.positions.push_back(pos)
+                rows.rsids.push_back(rsid.encode('utf8'))
+                rows.offsets.push_back(offset)
+                rows.sizes.push_back(size)
+        finally:
+            conn.close()
+    elif source is not None:
+        raise ValueError(f'bgen index is missing: {bgi_path}')
+    else:
+        reader = new CppBgenReader(str(path).encode('utf8'), b'', True, False)
+        try:
+            with nogil:
+                reader.index_rows(rows)
+        finally:
+            del reader
+
+    cdef string encoded = out_path.encode('utf8')
+    cdef uint64_t bgen_size = path.stat().st_size
+    with nogil:
+        write_variant_index(encoded, rows, bgen_size)
+    return out_path
+
+# variants per batch handed from the index scan to sqlite, and batches held at once
+INDEX_BATCH_SIZE = 50000
+INDEX_BATCH_DEPTH = 4
+
+def build_index(path):
+    ''' write a bgenix compatible index (.bgi) for an existing bgen
+
+    Variant headers are scanned in C++ in a background thread, which reads the next
+    batch of variants while sqlite loads the last, and the table indexes are built
+    once every row is in, rather than updated row by row.
+
+    Args:
+        path: path to the bgen. The index is written to path + '.bgi', replacing
+            any index already there.
+
+    Returns:
+        path to the written index
+    '''
+    path = Path(path)
+    cdef CppBgenReader * reader = new CppBgenReader(str(path).encode('utf8'), b'',
+                                                    True, False)
+    cdef IndexScanner * scanner = NULL
+    try:
+        scanner = reader.index_scanner(INDEX_BATCH_SIZE, INDEX_BATCH_DEPTH)
+    finally:
+        # the scanner reads through a handle of its own
+        del reader
+
+    cdef IndexRows rows
+    cdef bool more
+    indexer = None
+    try:
+        indexer = Indexer(path, bulk=True)
+        while True:
+            with nogil:
+                more = scanner.next(rows)
+            if not more:
+                break
+            indexer.add_variants(zip(
+                [x.decode('utf8') for x in rows.chroms],
+                rows.positions,
+                [x.decode('utf8') for x in rows.rsids],
+                rows.n_alleles,
+                [x.decode('utf8') for x in rows.allele1],
+                [x.decode('utf8') if n > 1 else None
+                    for x, n in zip(rows.allele2, rows.n_alleles)],
+                rows.offsets,
+                rows.sizes))
+    except BaseException:
+        if indexer is not None:
+            indexer.discard()
+        raise
+    finally:
+        del scanner
+    indexer.close()
+    return str(indexer.index_path)
+
 cdef class BgenReader:
     ''' class to open bgen files from disk, and access variant data within
     '''
     cdef CppBgenReader * thisptr
     cdef string path, sample_path
-    cdef bool delay_parsing, is_stdin
+    cdef bool delay_parsing, is_stdin, use_mmap
     cdef IStream handle
     cdef object index
     cdef OpenStatus is_open
@@ -491,7 +1089,15 @@ cdef class BgenReader:
     # variants returned by __next__ so far, to spot a truncated bgen which stops
     # short of the variant count in the header
     cdef uint64_t n_iterated
-    def __cinit__(self, path, sample_path='', bool delay_parsing=True):
+    # how many variants to read ahead while iterating, and with how many threads
+    cdef int prefetch, prefetch_threads
+    cdef bool prefetching
+    # samples that genotype outputs are restricted to, or None for all of them
+    cdef SampleSelection selection
+    # decompressed genotype blocks, shared with every BgenVar from this reader
+    cdef GenotypeCache cache
+    def __cinit__(self, path, sample_path='', bool delay_parsing=True, bool use_mmap=False,
+                  int prefetch=0, int prefetch_threads=2, cache_size=0):
         if isinstance(path, Path):
             path = str(path)
         if isinstance(sample_path, Path):
@@ -504,19 +1110,36 @@ cdef class BgenReader:
         if Path(path).exists() and Path(path).is_dir():
             raise ValueError(f'bgen path is for a folder: {path}')
         
+        if prefetch < 0:
+            raise ValueError(f'prefetch depth cannot be negative: {prefetch}')
+        if prefetch > 0 and prefetch_threads < 1:
+            raise ValueError(f'prefetching needs at least one thread, not {prefetch_threads}')
+        if cache_size < 0:
+            raise ValueError(f'cache size cannot be negative: {cache_size}')
+        
         delay_parsing |= self._check_for_index(path)
         
         self.path = path.encode('utf8')
         self.sample_path = sample_path.encode('utf8')
         self.delay_parsing = delay_parsing
+        # a pipe cannot be mapped, so stdin always goes through the stream
+        self.use_mmap = use_mmap and not self.is_stdin
         
         samp = '' if sample_path == '' else f', (samples={self.sample_path.decode("utf")})'
         logging.debug(f'opening BgenFile from {self.path.decode("utf")}{samp}')
-        self.thisptr = new CppBgenReader(self.path, self.sample_path, self.delay_parsing)
+        self.thisptr = new CppBgenReader(self.path, self.sample_path, self.delay_parsing,
+                                         self.use_mmap)
         self.handle = wrap_stream(self.thisptr.handle)
         self.is_open = OpenStatus()
         self.offset = self.thisptr.offset
         self.n_iterated = 0
+        self.prefetch = prefetch
+        self.prefetch_threads = prefetch_threads
+        self.prefetching = False
+        self.selection = None
+        # a stream is only read once, so there is nothing to revisit from a cache
+        self.cache = GenotypeCache(0 if self.is_stdin else cache_size)
+        self.thisptr.cache = self.cache.ptr
     
     def __is_from_stdin(self, bgen_path):
         if bgen_path is sys.stdin:
@@ -549,10 +1172,23 @@ cdef class BgenReader:
             raise ValueError('bgen file is closed')
         
         cdef BgenVar var
+        cdef Variant * ptr
         try:
-            var = BgenVar(self.handle, self.offset, self.thisptr.header.layout,
-                self.thisptr.header.compression, self.thisptr.header.nsamples, self.is_stdin,
-                self.is_open)
+            if self.prefetch > 0:
+                if not self.prefetching:
+                    # start lazily, so the threads only read ahead once iteration
+                    # begins, and from wherever earlier iteration left off
+                    self.thisptr.start_prefetch(self.offset, self.prefetch, self.prefetch_threads)
+                    self.prefetching = True
+                with nogil:
+                    ptr = self.thisptr.next_prefetched()
+                var = adopt_variant(ptr, self.handle, self.thisptr.header.layout,
+                    self.thisptr.header.compression, self.thisptr.header.nsamples,
+                    self.is_stdin, self.is_open, self.selection, self.cache)
+            else:
+                var = BgenVar(self.handle, self.offset, self.thisptr.header.layout,
+                    self.thisptr.header.compression, self.thisptr.header.nsamples,
+                    self.is_stdin, self.is_open, self.selection, self.cache)
             # read the next offset off the C++ variant, rather than through the python
             # property, which would box it into a python int just to unbox it
             self.offset = var.thisptr.next_variant_offset
@@ -579,7 +1215,7 @@ cdef class BgenReader:
       if not self.is_open == True:
           raise ValueError("bgen file is closed")
       
-      length = self.thisptr.variants.size()
+      length = self.thisptr.catalog.size()
       if length > 0:
           return length
       
@@ -614,15 +1250,15 @@ cdef class BgenReader:
             raise ValueError(NO_RANDOM_ACCESS)
         
         # account for lazy loading variants from bgen
-        if self.index is None and self.thisptr.variants.size() == 0:
+        if self.index is None and self.thisptr.catalog.size() == 0:
             self.thisptr.parse_all_variants()
         
         cdef long offset
-        offset = self.index.offset_by_index(idx) if self.index else self.thisptr.variants[idx].offset
+        offset = self.index.offset_by_index(idx) if self.index else self.thisptr.catalog.offset(idx)
         try:
             return BgenVar(self.handle, offset, self.thisptr.header.layout,
               self.thisptr.header.compression, self.thisptr.header.nsamples,
-              self.is_stdin, self.is_open)
+              self.is_stdin, self.is_open, self.selection, self.cache)
         except IndexError:
             # The index was in range, so running out of file means the bgen does
             # not hold the variant its index (or header) says it should. Reporting
@@ -630,9 +1266,555 @@ cdef class BgenReader:
             raise ValueError(f'bgen is truncated - could not read the variant at '
                              f'index {orig_idx}')
     
+    cdef vector[uint64_t] _offsets_or_all(self, indices=None, offsets=None) except *:
+        ''' as _variant_offsets, but for every variant if none are picked
+        '''
+        if indices is None and offsets is None:
+            # parse first, so the count is of the variants really in the file, rather
+            # than the one the header gives
+            if self.index is None and self.thisptr.catalog.size() == 0 and not self.is_stdin:
+                self.thisptr.parse_all_variants()
+            indices = range(len(self))
+        return self._variant_offsets(indices, offsets)
+    
+    cdef vector[uint64_t] _picked_variants(self, indices=None, offsets=None, chrom=None,
+                                           start=None, stop=None) except *:
+        ''' as _offsets_or_all, but variants can also be picked by a genome region
+        
+        A region is fetched from the index if there is one. Otherwise the variants
+        are parsed, and those in the region taken from them in position order.
+        '''
+        cdef vector[uint64_t] picked
+        if chrom is None:
+            return self._offsets_or_all(indices, offsets)
+        if indices is not None or offsets is not None:
+            raise ValueError('pick variants by one of indices, offsets or region')
+        if self.is_stdin:
+            raise ValueError(NO_RANDOM_ACCESS)
+        if self.index:
+            for offset in self.index.fetch(chrom, start, stop):
+                picked.push_back(offset)
+            return picked
+        
+        if self.thisptr.catalog.size() == 0:
+            self.thisptr.parse_all_variants()
+        chroms = np.array([x.decode('utf8') for x in self.thisptr.chroms()], dtype=str)
+        positions = np.array(self.thisptr.positions(), dtype=np.int64)
+        keep = chroms == chrom
+        if start is not None:
+            keep &= positions >= start
+        if stop is not None:
+            keep &= positions <= stop
+        rows = np.flatnonzero(keep)
+        rows = rows[np.argsort(positions[rows], kind='stable')]
+        picked.reserve(len(rows))
+        for idx in rows:
+            picked.push_back(self.thisptr.catalog.offset(idx))
+        return picked
+    
+    cdef vector[uint64_t] _variant_offsets(self, indices=None, offsets=None) except *:
+        ''' get the file offsets for variants picked by index position, or by offset
+        
+        Indices can be negative, as for bfile[i]. Offsets are taken as given, since
+        they can only be checked by reading the variants there.
+        '''
+        cdef vector[uint64_t] picked
+        cdef Py_ssize_t idx, size
+        if (indices is None) == (offsets is None):
+            raise ValueError('pick variants by either indices or offsets, not both')
+        
+        if self.is_stdin:
+            raise ValueError(NO_RANDOM_ACCESS)
+        
+        if offsets is not None:
+            for offset in offsets:
+                if offset < 0:
+                    raise ValueError(f'variant offsets cannot be negative: {offset}')
+                picked.push_back(offset)
+            return picked
+        
+        if self.index is None and self.thisptr.catalog.size() == 0:
+            self.thisptr.parse_all_variants()
+        
+        size = len(self)
+        picked.reserve(len(indices))
+        for orig_idx in indices:
+            idx = orig_idx
+            if idx < 0:
+                idx += size
+            if idx >= size or idx < 0:
+                raise IndexError(f'cannot get Variant at index: {orig_idx}')
+            if self.index is not None:
+                picked.push_back(self.index.offset_by_index(idx))
+            else:
+                picked.push_back(self.thisptr.catalog.offset(idx))
+        return picked
+    
+    def select_samples(self, samples=None):
+        ''' restrict the genotypes of variants to a subset of samples
+        
+        Probabilities, dosages and ploidy from variants opened after this only cover
+        the selected samples, in the order they were given, and are decoded for
+        those samples alone, rather than for the whole cohort then indexed. The
+        minor allele is also found from the selected samples.
+        
+        Variants opened before this keep whichever selection they were opened with.
+        
+        Args:
+            samples: sample IDs (as in BgenReader.samples), or index positions of
+                samples, including a numpy array of indices or a boolean mask of
+                length nsamples. None goes back to using every sample.
+        '''
+        if not self.is_open == True:
+            raise ValueError('bgen file is closed')
+        
+        # a python int, since negating an unsigned count would wrap around
+        n_samples = int(self.thisptr.header.nsamples)
+        if samples is None:
+            self.selection = None
+        else:
+            if isinstance(samples, np.ndarray) and samples.dtype == np.bool_:
+                if len(samples) != n_samples:
+                    raise ValueError(f'sample mask has {len(samples)} entries, but the '
+                                     f'bgen has {n_samples} samples')
+                indices = np.flatnonzero(samples).tolist()
+            elif isinstance(samples, str):
+                raise ValueError('select samples with a list of IDs, not a single ID')
+            else:
+                samples = list(samples)
+                if len(samples) > 0 and all(isinstance(x, str) for x in samples):
+                    lookup = {x: i for i, x in enumerate(self.samples)}
+                    absent = [x for x in samples if x not in lookup]
+                    if len(absent) > 0:
+                        raise ValueError(f'{len(absent)} sample IDs are not in the bgen, '
+                                         f'e.g. {absent[0]}')
+                    indices = [lookup[x] for x in samples]
+                else:
+                    indices = []
+                    for idx in samples:
+                        idx = int(idx)
+                        if idx < -n_samples or idx >= n_samples:
+                            raise IndexError(f'cannot select sample at index: {idx}')
+                        indices.append(idx + n_samples if idx < 0 else idx)
+            if len(indices) == 0:
+                raise ValueError('cannot select an empty set of samples')
+            self.selection = SampleSelection(indices, n_samples)
+        
+        cdef shared_ptr[SampleSubset] empty
+        self.thisptr.select_samples(empty if self.selection is None else self.selection.ptr)
+    
+    @property
+    def selected_samples(self):
+        ''' IDs of the samples that genotype outputs are restricted to, in output order
+        '''
+        if not self.is_open == True:
+            raise ValueError('bgen file is closed')
+        samples = self.samples
+        if self.selection is None:
+            return samples
+        return [samples[i] for i in self.selection.indices]
+    
+    def dosage_matrix(self, indices=None, offsets=None, out=None, int threads=0,
+                      bool minor_allele=False, dtype=np.float32):
+        ''' decode the dosages of many variants into one variants x samples array
+        
+        The variants are decoded in parallel, each thread reading through its own
+        handle on the bgen, and without holding the GIL, so this scales with the
+        number of threads, unlike looping over variants in python.
+        
+        Args:
+            indices: index positions of the variants to decode, one per row
+            offsets: file offsets of the variants, instead of indices
+            out: optional float32 array of shape (n_variants, n_samples) to fill,
+                which must be C contiguous. A new array is made if not given
+            threads: number of threads to decode with. Zero uses one per core
+            minor_allele: give minor allele dosages, rather than alt allele dosages
+            dtype: number format of the dosages: float32, float16, bfloat16, uint8
+                or uint8_254 (see OUTPUT_DTYPES). Narrower types are converted from
+                float32 as each variant decodes, so only the output is held at full
+                size. uint8 has no missing value, so use uint8_254 to tell missing
+                samples apart
+        
+        Returns:
+            the filled array of dosages, as a numpy array
+        '''
+        if not self.is_open == True:
+            raise ValueError('bgen file is closed')
+        cdef int out_type
+        out_type, np_dtype = _output_type(dtype)
+        
+        cdef vector[uint64_t] picked = self._variant_offsets(indices, offsets)
+        cdef uint64_t n_rows = picked.size()
+        cdef uint64_t n_samples = self.thisptr.n_selected()
+        if out is None:
+            out = np.empty((n_rows, n_samples), dtype=np_dtype, order='C')
+        elif not isinstance(out, np.ndarray) or out.dtype != np_dtype:
+            raise ValueError(f'out must be a {np.dtype(np_dtype).name} numpy array')
+        elif out.shape != (n_rows, n_samples):
+            raise ValueError(f'out has shape {out.shape}, but needs to be '
+                             f'{(n_rows, n_samples)}')
+        elif not out.flags.c_contiguous:
+            raise ValueError('out must be C contiguous')
+        
+        if n_rows == 0 or n_samples == 0:
+            return out
+        
+        cdef uint8_t[:, ::1] dose = out.view(np.uint8)
+        cdef void * ptr = &dose[0, 0]
+        cdef vector[uint64_t] malformed
+        with nogil:
+            malformed = self.thisptr.dosage_matrix(picked, ptr, minor_allele, threads,
+                                                   out_type)
+        if malformed.size() > 0:
+            logging.warning(f'{malformed.size()} of the variants store genotype '
+                            f'probabilities which sum to more than the bit depth '
+                            f'allows, so this bgen is malformed (first at row '
+                            f'{malformed[0]}). The dosages of the affected samples are '
+                            f'not reliable')
+        return out
+    
+    def hard_call_matrix(self, indices=None, offsets=None, out=None, int threads=0,
+                         float threshold=0.9):
+        ''' hard call the genotypes of many variants into one variants x samples array
+        
+        As dosage_matrix, but with the int8 calls of BgenVar.hard_calls, so the
+        output is a quarter the size of the dosages.
+        
+        Args:
+            indices: index positions of the variants to decode, one per row
+            offsets: file offsets of the variants, instead of indices
+            out: optional int8 array of shape (n_variants, n_samples) to fill,
+                which must be C contiguous. A new array is made if not given
+            threads: number of threads to decode with. Zero uses one per core
+            threshold: lowest probability a sample's most likely genotype needs to
+                be called
+        
+        Returns:
+            the filled array of calls, as a numpy array
+        '''
+        if not self.is_open == True:
+            raise ValueError('bgen file is closed')
+        _check_call_threshold(threshold)
+        
+        cdef vector[uint64_t] picked = self._variant_offsets(indices, offsets)
+        cdef uint64_t n_rows = picked.size()
+        cdef uint64_t n_samples = self.thisptr.n_selected()
+        if out is None:
+            out = np.empty((n_rows, n_samples), dtype=np.int8, order='C')
+        elif not isinstance(out, np.ndarray) or out.dtype != np.int8:
+            raise ValueError('out must be an int8 numpy array')
+        elif out.shape != (n_rows, n_samples):
+            raise ValueError(f'out has shape {out.shape}, but needs to be '
+                             f'{(n_rows, n_samples)}')
+        elif not out.flags.c_contiguous:
+            raise ValueError('out must be C contiguous')
+        
+        if n_rows == 0 or n_samples == 0:
+            return out
+        
+        cdef int8_t[:, ::1] calls = out
+        cdef int8_t * ptr = &calls[0, 0]
+        cdef vector[uint64_t] malformed
+        with nogil:
+            malformed = self.thisptr.hard_call_matrix(picked, ptr, threshold, threads)
+        if malformed.size() > 0:
+            logging.warning(f'{malformed.size()} of the variants store genotype '
+                            f'probabilities which sum to more than the bit depth '
+                            f'allows, so this bgen is malformed (first at row '
+                            f'{malformed[0]}). The calls of the affected samples are '
+                            f'not reliable')
+        return out
+    
+    def dosage_products(self, y, indices=None, offsets=None, int threads=0,
+                        bool minor_allele=False):
+        ''' multiply the dosage matrix of many variants by phenotypes, without building it
+        
+        Gives X^T Y, where X is the samples x variants dosage matrix, as a GWAS
+        score test needs. Each thread decodes a few variants at a time into a
+        small buffer, and multiplies them by every phenotype a cache sized tile of
+        samples at a time, so only the output is held at full size. Missing
+        samples take the mean dosage of the variant's other samples.
+        
+        Args:
+            y: phenotypes (or covariate residuals), with a row per selected sample,
+                either 1D or 2D with a column per phenotype. Used as float32
+            indices: index positions of the variants, one per output row
+            offsets: file offsets of the variants, instead of indices
+            threads: number of threads to decode with. Zero uses one per core
+            minor_allele: use minor allele dosages, rather than alt allele dosages
+        
+        Returns:
+            tuple of float64 numpy arrays:
+              - products: (n_variants, n_phenotypes) array of X^T Y, or 1D for 1D y
+              - sums: sum of each variant's (mean imputed) dosages
+              - sumsq: sum of each variant's squared (mean imputed) dosages
+        '''
+        if not self.is_open == True:
+            raise ValueError('bgen file is closed')
+        
+        cdef uint64_t n_samples = self.thisptr.n_selected()
+        y = np.asarray(y)
+        one_dim = y.ndim == 1
+        if one_dim:
+            y = y[:, None]
+        if y.ndim != 2 or y.shape[0] != n_samples:
+            raise ValueError(f'y has shape {y.shape}, but needs a row for each of the '
+                             f'{n_samples} selected samples')
+        cdef uint32_t k = y.shape[1]
+        cdef float[:, ::1] yt = np.ascontiguousarray(y.T, dtype=np.float32)
+        
+        cdef vector[uint64_t] picked = self._variant_offsets(indices, offsets)
+        cdef uint64_t n_rows = picked.size()
+        out = np.zeros((n_rows, k), dtype=np.float64)
+        sums = np.zeros(n_rows, dtype=np.float64)
+        sumsq = np.zeros(n_rows, dtype=np.float64)
+        if n_rows == 0 or n_samples == 0 or k == 0:
+            return (out[:, 0] if one_dim else out), sums, sumsq
+        
+        cdef double[:, ::1] products = out
+        cdef double[::1] sums_view = sums
+        cdef double[::1] sumsq_view = sumsq
+        cdef vector[uint64_t] malformed
+        with nogil:
+            malformed = self.thisptr.dosage_products(picked, &yt[0, 0], k,
+                &products[0, 0], &sums_view[0], &sumsq_view[0], minor_allele, threads)
+        if malformed.size() > 0:
+            logging.warning(f'{malformed.size()} of the variants store genotype '
+                            f'probabilities which sum to more than the bit depth '
+                            f'allows, so this bgen is malformed (first at row '
+                            f'{malformed[0]}). The products of the affected variants '
+                            f'are not reliable')
+        return (out[:, 0] if one_dim else out), sums, sumsq
+    
+    def grm(self, indices=None, offsets=None, int threads=0, max_memory=2**30,
+            path=None):
+        ''' genetic relationship matrix between the selected samples, as GCTA finds it
+        
+        Each variant's dosages are standardized by its alt allele frequency as they
+        decode, with missing samples at zero, and the GRM is the mean over variants
+        of the outer products. Variants without two alleles, or with no spread
+        in their dosages, are left out.
+        
+        The GRM is built a tile of sample pairs at a time, with tiles as large as
+        max_memory allows, and written straight to the output, so a path lets the
+        GRM be far larger than memory. Every tile reads through all the variants,
+        so larger tiles mean fewer passes over the bgen. Only the tiles on or above
+        the diagonal are worked out, and mirrored below it.
+        
+        Args:
+            indices: index positions of the variants to use
+            offsets: file offsets of the variants, instead of indices. Every
+                variant is used if neither are given
+            threads: number of threads to decode with. Zero uses one per core
+            max_memory: bytes of working memory to size the tiles by, not counting
+                the GRM itself
+            path: path to write the GRM to as a float32 .npy file, which is then
+                returned as a numpy memmap. The GRM is kept in memory if not given
+        
+        Returns:
+            tuple of the (n_samples, n_samples) float32 GRM, and the number of
+            variants it was built from
+        '''
+        if not self.is_open == True:
+            raise ValueError('bgen file is closed')
+        
+        cdef vector[uint64_t] picked = self._offsets_or_all(indices, offsets)
+        cdef uint32_t n = self.thisptr.n_selected()
+        cdef uint32_t size = _grm_tile_size(max_memory, n)
+        if path is None:
+            out = np.empty((n, n), dtype=np.float32)
+        else:
+            out = np.lib.format.open_memmap(str(path), mode='w+', dtype=np.float32,
+                                            shape=(n, n))
+        
+        buffer = np.empty(size * size, dtype=np.float64)
+        cdef double[::1] view = buffer
+        cdef vector[uint64_t] malformed
+        cdef uint64_t n_used = 0
+        cdef uint32_t row, col, n_rows, n_cols
+        for row in range(0, n, size):
+            for col in range(row, n, size):
+                n_rows, n_cols = min(size, n - row), min(size, n - col)
+                with nogil:
+                    malformed = self.thisptr.grm_tile(picked, row, n_rows, col, n_cols,
+                                                      &view[0], n_used, threads)
+                tile = buffer[:n_rows * n_cols].reshape(n_rows, n_cols)
+                if n_used > 0:
+                    tile /= n_used
+                else:
+                    tile[:] = np.nan
+                out[row:row + n_rows, col:col + n_cols] = tile
+                if col != row:
+                    out[col:col + n_cols, row:row + n_rows] = tile.T
+        if malformed.size() > 0:
+            logging.warning(f'{malformed.size()} of the variants store genotype '
+                            f'probabilities which sum to more than the bit depth '
+                            f'allows, so this bgen is malformed (first at row '
+                            f'{malformed[0]}). The GRM is not reliable')
+        if path is not None:
+            out.flush()
+        return out, n_used
+    
+    def variant_stats(self, indices=None, offsets=None, chrom=None, start=None,
+                      stop=None, int threads=0, float threshold=0.9):
+        ''' quality control statistics for many variants, as columns of a table
+        
+        Each variant's statistics come from one pass over its genotypes as they
+        decode, without building any float32 arrays, and the variants are shared
+        out across threads as in dosage_matrix. Statistics cover the selected
+        samples, if any were selected. As for BgenVar.hard_calls, variants are
+        decoded to float32 probabilities in full first when samples were selected,
+        or when ploidy varies between samples.
+        
+        Variants with more than two alleles, or ploidy above 2, get nan for the
+        frequencies and scores, and zero counts.
+        
+        Args:
+            indices: index positions of the variants, one per row
+            offsets: file offsets of the variants, instead of indices
+            chrom: chromosome of a genome region to cover instead, fetched from
+                the index if there is one, or found by parsing the variants if
+                not. Every variant is covered if none of indices, offsets or
+                chrom are given
+            start: start nucleotide of the region, as for fetch
+            stop: end nucleotide of the region, as for fetch
+            threads: number of threads to decode with. Zero uses one per core
+            threshold: lowest probability a sample's most likely genotype needs to
+                be hard called, for the genotype counts and the HWE test
+        
+        Returns:
+            dict of numpy arrays, one per column, with a row per variant:
+              - varid, rsid, chrom, pos, n_alleles: details of each variant
+              - alt_freq: alt allele frequency, from the dosages of samples that
+                are not missing
+              - missing_rate: fraction of samples that are missing
+              - info: IMPUTE info score, from the variance of the dosages
+              - hwe_p: exact Hardy-Weinberg p-value of the diploid hard calls
+              - hom_ref, het, hom_alt: hard call counts of the diploid samples
+        '''
+        if not self.is_open == True:
+            raise ValueError('bgen file is closed')
+        _check_call_threshold(threshold)
+        
+        cdef vector[uint64_t] picked = self._picked_variants(indices, offsets, chrom,
+                                                             start, stop)
+        cdef StatsTable table
+        cdef vector[uint64_t] malformed
+        with nogil:
+            malformed = self.thisptr.variant_stats(picked, table, threshold, threads)
+        if malformed.size() > 0:
+            logging.warning(f'{malformed.size()} of the variants store genotype '
+                            f'probabilities which sum to more than the bit depth '
+                            f'allows, so this bgen is malformed (first at row '
+                            f'{malformed[0]}). The statistics of the affected variants '
+                            f'are not reliable')
+        
+        def strings(values):
+            return np.array([x.decode('utf8') for x in values], dtype=str)
+        
+        return {
+            'varid': strings(table.varid),
+            'rsid': strings(table.rsid),
+            'chrom': strings(table.chrom),
+            'pos': np.array(table.pos, dtype=np.uint32),
+            'n_alleles': np.array(table.n_alleles, dtype=np.uint16),
+            'alt_freq': np.array(table.alt_freq, dtype=np.float64),
+            'missing_rate': np.array(table.missing_rate, dtype=np.float64),
+            'info': np.array(table.info, dtype=np.float64),
+            'hwe_p': np.array(table.hwe_p, dtype=np.float64),
+            'hom_ref': np.array(table.hom_ref, dtype=np.uint32),
+            'het': np.array(table.het, dtype=np.uint32),
+            'hom_alt': np.array(table.hom_alt, dtype=np.uint32),
+            }
+    
+    def ld_matrix(self, chrom=None, start=None, stop=None, indices=None, offsets=None,
+                  window=None, int threads=0, path=None):
+        ''' correlations (r) between the alt dosages of the variants in a region
+        
+        Dosages are mean imputed for missing samples, so the correlations match
+        np.corrcoef of the imputed dosage matrix. They decode and standardize once
+        per variant, and the products between variants are summed a block of
+        variants at a time across threads, so the dosage matrix is never built in
+        full. Variants without two alleles, or with no spread in their dosages, get
+        nan correlations.
+        
+        With a window, only pairs of variants up to that many rows apart are
+        worked out, and the output is a band rather than a full matrix. The memory
+        used then scales with the window, not the region, so long regions fit.
+        Rows are in the order variants are picked, which variant_stats with the
+        same arguments gives details of.
+        
+        Args:
+            chrom: chromosome of a genome region to cover, fetched from the index
+                if there is one, or found by parsing the variants if not
+            start: start nucleotide of the region, as for fetch
+            stop: end nucleotide of the region, as for fetch
+            indices: index positions of the variants, instead of a region
+            offsets: file offsets of the variants, instead of a region. Every
+                variant is used if none of chrom, indices or offsets are given
+            window: largest number of rows apart to correlate variants. None
+                gives the full matrix
+            threads: number of threads to decode with. Zero uses one per core
+            path: path to write the output to as a float32 .npy file, which is
+                then returned as a numpy memmap. Kept in memory if not given
+        
+        Returns:
+            float32 numpy array. Without a window, the (n_variants, n_variants)
+            correlation matrix. With one, a (n_variants, window + 1) band, where
+            row a, column d holds the correlation between variants a and a + d,
+            and nan past the last variant
+        '''
+        if not self.is_open == True:
+            raise ValueError('bgen file is closed')
+        if window is not None and window < 0:
+            raise ValueError(f'window cannot be negative: {window}')
+        
+        cdef vector[uint64_t] picked = self._picked_variants(indices, offsets, chrom,
+                                                             start, stop)
+        cdef uint64_t n_vars = picked.size()
+        cdef bool banded = window is not None
+        cdef uint64_t width = window + 1 if banded else n_vars
+        cdef uint64_t reach = window if banded else max(n_vars, 1) - 1
+        shape = (n_vars, width)
+        if path is None:
+            out = np.empty(shape, dtype=np.float32)
+        else:
+            out = np.lib.format.open_memmap(str(path), mode='w+', dtype=np.float32,
+                                            shape=shape)
+        if out.size == 0:
+            return out
+        
+        cdef float[:, ::1] view = out
+        cdef vector[uint64_t] malformed
+        with nogil:
+            malformed = self.thisptr.ld_matrix(picked, reach, banded, &view[0, 0],
+                                               threads)
+        if malformed.size() > 0:
+            logging.warning(f'{malformed.size()} of the variants store genotype '
+                            f'probabilities which sum to more than the bit depth '
+                            f'allows, so this bgen is malformed (first at row '
+                            f'{malformed[0]}). The correlations of the affected '
+                            f'variants are not reliable')
+        if path is not None:
+            out.flush()
+        return out
+    
     def _check_for_index(self, bgen_path):
-        ''' creates self.index if a bgenix index file is available
+        ''' creates self.index if a binary or bgenix index file is available
+
+        A binary index (.bgix) is used ahead of a .bgi, unless the bgen has changed
+        size since it was indexed, which means the offsets in it are stale.
         '''
+        native_path = Path(bgen_path + NATIVE_INDEX_SUFFIX)
+        if native_path.exists():
+            index = NativeIndex(native_path)
+            if index.bgen_size == Path(bgen_path).stat().st_size:
+                self.index = index
+                return True
+            index.close()
+            logging.warning(f'ignoring stale bgen index, as the bgen has changed since '
+                            f'it was indexed: {native_path}')
+
         index_path = Path(bgen_path + '.bgi')
         idx_exists = index_path.exists()
         self.index = Index(index_path) if idx_exists else None
@@ -717,7 +1899,7 @@ cdef class BgenReader:
         for offset in self.index.fetch(chrom, start, stop):
             yield BgenVar(self.handle, offset, self.thisptr.header.layout,
                 self.thisptr.header.compression, self.thisptr.header.nsamples,
-                self.is_stdin, self.is_open)
+                self.is_stdin, self.is_open, self.selection, self.cache)
     
     def with_rsid(self, rsid):
       ''' get BgenVar from file given an rsID
@@ -729,7 +1911,7 @@ cdef class BgenReader:
           offsets = self.index.offset_by_rsid(rsid)
           return [BgenVar(self.handle, int(offset), self.thisptr.header.layout,
                           self.thisptr.header.compression, self.thisptr.header.nsamples,
-                          self.is_stdin, self.is_open)
+                          self.is_stdin, self.is_open, self.selection, self.cache)
                   for offset in offsets]
       
       if not self.delay_parsing:
@@ -751,7 +1933,7 @@ cdef class BgenReader:
           offsets = self.index.offset_by_pos(pos)
           return [BgenVar(self.handle, int(offset), self.thisptr.header.layout,
                           self.thisptr.header.compression, self.thisptr.header.nsamples,
-                          self.is_stdin, self.is_open) 
+                          self.is_stdin, self.is_open, self.selection, self.cache) 
                   for offset in offsets]
       
       if not self.delay_parsing:
@@ -810,6 +1992,38 @@ cdef class BgenReader:
         
         return self.thisptr.positions()
     
+    def scan_positions(self):
+        ''' find the file offset and position of every variant, reading nothing else
+        
+        This steps over the IDs, alleles and genotypes of each variant, rather than
+        parsing them, so it runs close to the speed the file can be read at. It
+        suits working out how to split up a bgen before decoding anything. The
+        offsets can go straight to dosage_matrix(offsets=...).
+        
+        Unlike positions(), this always reads the bgen itself, even if there is an
+        index file, and it doesn't load the variants for indexing.
+        
+        Returns:
+            tuple of numpy arrays, for offsets (uint64) and positions (uint32)
+        '''
+        if not self.is_open == True:
+            raise ValueError("bgen file is closed")
+        
+        if self.is_stdin:
+            raise ValueError(NO_RANDOM_ACCESS)
+        
+        cdef vector[uint64_t] offsets
+        cdef vector[uint32_t] positions
+        with nogil:
+            self.thisptr.scan_positions(offsets, positions)
+        
+        cdef uint64_t[::1] offsets_arr = np.empty(offsets.size(), dtype=np.uint64)
+        cdef uint32_t[::1] positions_arr = np.empty(positions.size(), dtype=np.uint32)
+        if offsets.size() > 0:
+            memcpy(&offsets_arr[0], offsets.data(), offsets.size() * sizeof(uint64_t))
+            memcpy(&positions_arr[0], positions.data(), positions.size() * sizeof(uint32_t))
+        return np.asarray(offsets_arr), np.asarray(positions_arr)
+    
     def __enter__(self):
         return self
     
@@ -817,6 +2031,17 @@ cdef class BgenReader:
         self.close()
         return False
     
+    def cache_info(self):
+        ''' get the counters for the cache of decompressed genotype blocks
+        
+        Returns:
+            dict of hits and misses (lookups which did or did not find a block),
+            evictions (blocks dropped to stay within the budget), and the entries
+            and bytes held now, out of the capacity in bytes. All zero without a
+            cache.
+        '''
+        return self.cache.info()
+    
     def close(self):
         if not self.is_open == True:
             # this can also be a partially constructed reader, where __cinit__
@@ -839,6 +2064,10 @@ cdef class BgenReader:
             del self.thisptr
             self.thisptr = NULL
             self.handle = None
+            # nothing can read from the cache any more, so free its blocks now,
+            # rather than once the last BgenVar from this reader goes
+            if self.cache is not None:
+                self.cache.clear()
         finally:
             self._close_index()
     
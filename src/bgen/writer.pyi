@@ -11,8 +11,9 @@ class Indexer:
     '''
     conn: Any
     cur: Any
-    def __init__(self, bgen_path: Union[str, os.PathLike[str]]) -> None: ...
+    def __init__(self, bgen_path: Union[str, os.PathLike[str]], bulk: bool = False) -> None: ...
     def create_tables(self) -> None: ...
+    def create_indexes(self) -> None: ...
     def add_variant(self,
                     chrom: str,
                     pos: int,
@@ -21,7 +22,11 @@ class Indexer:
                     offset: int,
                     size: int,
                     ) -> None: ...
+    def add_variants(self,
+                     rows: Iterable[tuple[str, int, str, int, str, Optional[str], int, int]],
+                     ) -> None: ...
     def close(self) -> None: ...
+    def discard(self) -> None: ...
 
 class BgenWriter:
     ''' class to write bgen files to disk
@@ -33,6 +38,8 @@ class BgenWriter:
                 compression: Optional[str] = 'zstd',
                 layout: int = 2,
                 metadata: Optional[str] = None,
+                threads: int = 1,
+                depth: int = 16,
                 ) -> BgenWriter: ...
     def __repr__(self) -> str: ...
     def __enter__(self) -> BgenWriter: ...
@@ -1,5 +1,6 @@
 # cython: language_level=3, boundscheck=False, emit_linenums=True
 
+from collections import deque
 import logging
 from pathlib import Path
 import sqlite3
@@ -53,19 +54,39 @@ cdef extern from 'writer.h' namespace 'bgen':
                          uint8_t min_ploidy, uint8_t max_ploidy,
                          bool phased, uint8_t bit_depth) except +
         uint64_t write_genotype_data() except +
+        void start_pipeline(int threads, int depth) except +
+        void queue_variant(string &varid, string &rsid, string &chrom, uint32_t &pos,
+                           vector[string] &alleles, uint32_t _n_samples) except + nogil
+        void queue_variant_direct(vector[uint8_t] & data) except + nogil
+        void flush() except + nogil
+        void written_offsets(vector[uint64_t] & starts, vector[uint64_t] & ends) except +
         void close() except +
 
 class Indexer:
     ''' class to automatically index bgen files as they are being constructed
+    
+    Args:
+        bgen_path: path to the bgen being indexed
+        bulk: whether the variants will arrive in large batches, all at once. The
+            table indexes are then only built on close, rather than updated with
+            every row, and the database skips its rollback journal and syncs while
+            loading. A failed bulk load leaves nothing worth keeping, so call
+            discard() rather than close() on an error.
     '''
-    def __init__(self, bgen_path):
+    def __init__(self, bgen_path, bulk=False):
         self.index_path = Path(str(bgen_path) + '.bgi')
         if self.index_path.exists():
             self.index_path.unlink()
+        self.bulk = bulk
         self.create_time = time.strftime('%Y-%m-%d %H:%M:%S', time.localtime())
         self.conn = sqlite3.connect(self.index_path)
         self.cur = self.conn.cursor()
+        if self.bulk:
+            self.cur.execute('PRAGMA journal_mode=OFF')
+            self.cur.execute('PRAGMA synchronous=OFF')
         self.create_tables()
+        if not self.bulk:
+            self.create_indexes()
     
     def create_tables(self):
         query = '''CREATE TABLE Metadata (
@@ -87,8 +108,10 @@ class Indexer:
                 PRIMARY KEY (chromosome, position, rsid, allele1, allele2, file_start_position))
                 WITHOUT ROWID'''
         self.cur.execute(query)
-        
-        # index the Variant table
+    
+    def create_indexes(self):
+        ''' index the Variant table
+        '''
         self.cur.execute('CREATE INDEX chrom_index on Variant(chromosome)')
         self.cur.execute('CREATE INDEX pos_index on Variant(position)')
         self.cur.execute('CREATE INDEX rsid_index on Variant(rsid)')
@@ -100,6 +123,16 @@ class Indexer:
         params = (chrom, pos, rsid, len(alleles), allele_1, allele_2, offset, size)
         self.cur.execute(query, params)
     
+    def add_variants(self, rows):
+        ''' add many variants at once
+        
+        Args:
+            rows: iterable of (chrom, pos, rsid, n_alleles, allele1, allele2,
+                offset, size) tuples, with allele2 as None for a single allele
+        '''
+        query = '''INSERT INTO Variant VALUES (?, ?, ?, ?, ?, ?, ?, ?)'''
+        self.cur.executemany(query, rows)
+    
     def add_metadata(self):
         bgen_path = self.index_path.with_suffix('')
         bgen_size = bgen_path.stat().st_size
@@ -113,15 +146,41 @@ class Indexer:
     def close(self):
         try:
             self.add_metadata()
+            if self.bulk:
+                self.create_indexes()
         finally:
             self.conn.commit()
             if _IS_WIN32 and time is not None:
                 time.sleep(0.01)
             self.cur.close()
             self.conn.close()
+    
+    def discard(self):
+        ''' close the index without finishing it, and delete it
+        '''
+        self.cur.close()
+        self.conn.close()
+        self.index_path.unlink()
 
 cdef class BgenWriter:
     ''' class to write bgen files to disk
+    
+    Args:
+        path: path to write the bgen to
+        n_samples: number of samples in the bgen
+        samples: sample IDs, to store in the bgen
+        compression: one of None, 'zlib' or 'zstd'
+        layout: bgen layout version, 1 or 2
+        metadata: free text to store in the header
+        threads: number of threads to compress with. With 1, each variant is
+            compressed and written before add_variant returns. Otherwise (zero
+            uses one per core) genotypes are encoded as they're added, so bad
+            genotypes still raise errors there, but compress on a pool of
+            threads, and a writer thread appends them in the order added. Errors
+            from compressing or writing are then raised by a later call.
+        depth: most variants to hold compressing or waiting to be written, when
+            threads isn't 1. This bounds memory, as add_variant waits while the
+            queue is full
     '''
     cdef CppBgenWriter * thisptr
     cdef string path
@@ -130,8 +189,11 @@ cdef class BgenWriter:
     cdef int layout
     cdef object compression
     cdef uint32_t n_samples
+    cdef bool pipelined
+    # details for the index of variants queued, but not yet written
+    cdef object queued
     def __cinit__(self, path, uint32_t n_samples, samples=None, compression='zstd',
-                  int layout=2, metadata=None):
+                  int layout=2, metadata=None, int threads=1, int depth=16):
         if isinstance(path, Path):
             path = str(path)
         
@@ -150,6 +212,11 @@ cdef class BgenWriter:
         if layout == 1 and compression == 'zstd':
             raise ValueError('layout 1 is not supported with zstd compression')
         
+        if threads < 0:
+            raise ValueError(f'threads cannot be negative: {threads}')
+        if threads != 1 and depth < 1:
+            raise ValueError(f'queue depth must be at least one, not {depth}')
+        
         self.n_samples = n_samples
         self.layout = layout
         self.compression = compression
@@ -163,6 +230,10 @@ cdef class BgenWriter:
         logging.debug(f'opening CppBgenWriter from {self.path.decode("utf")}')
         self.thisptr = new CppBgenWriter(self.path, n_samples, _metadata, compress_flag, layout, _samples)
         self.is_open = True
+        self.pipelined = threads != 1
+        self.queued = deque()
+        if self.pipelined:
+            self.thisptr.start_pipeline(threads, depth)
         self.indexer = Indexer(path)
     
     def __dealloc__(self):
@@ -339,6 +410,13 @@ cdef class BgenWriter:
                                            geno_len, &ploidy_arr[0], min_ploidy, 
                                            max_ploidy, phased, bit_depth)
         
+        if self.pipelined:
+            with nogil:
+                self.thisptr.queue_variant(_varid, _rsid, _chrom, pos, _alleles, n_samples)
+            self.queued.append((chrom, int(pos), rsid, alleles))
+            self._index_written()
+            return
+        
         var_offset = self.thisptr.write_variant_header(_varid, _rsid, _chrom, pos, _alleles, n_samples)
         end_offset = self.thisptr.write_genotype_data()
         
@@ -368,11 +446,29 @@ cdef class BgenWriter:
         rsid = variant.rsid
         alleles = variant.alleles
         cdef vector[uint8_t] data = variant.copy_data()
+        if self.pipelined:
+            # already compressed, but queued behind the variants still compressing
+            with nogil:
+                self.thisptr.queue_variant_direct(data)
+            self.queued.append((chrom, pos, rsid, alleles))
+            self._index_written()
+            return
+        
         var_offset = self.thisptr.write_variant_direct(data)
         end_offset = var_offset + len(data)
 
         self.indexer.add_variant(chrom, pos, rsid, alleles, var_offset, end_offset - var_offset)
 
+    def _index_written(self):
+        ''' index the queued variants which have been written since the last call
+        '''
+        cdef vector[uint64_t] starts, ends
+        self.thisptr.written_offsets(starts, ends)
+        for i in range(starts.size()):
+            chrom, pos, rsid, alleles = self.queued.popleft()
+            self.indexer.add_variant(chrom, pos, rsid, alleles, starts[i],
+                                     ends[i] - starts[i])
+    
     def _check_compatible(self, variant):
         ''' check a variant's data can be copied into this file unchanged
 
@@ -410,6 +506,11 @@ cdef class BgenWriter:
             if self.is_open:
                 self.is_open = False
                 try:
+                    if self.pipelined:
+                        # wait for the queued variants, so the index gets them all
+                        with nogil:
+                            self.thisptr.flush()
+                        self._index_written()
                     # close explicitly, so that errors while finishing the file
                     # off (e.g. a full disk) are raised rather than being
                     # swallowed by the C++ destructor
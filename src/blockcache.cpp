@@ -0,0 +1,88 @@
+
+#include "blockcache.h"
+#include "genotypes.h"
+
+namespace bgen {
+
+/// bytes a block counts against the budget, including the decoder padding
+static std::uint64_t block_bytes(const CachedBlock & block) {
+  return (std::uint64_t) block.size + PROBS_READ_PAD;
+}
+
+/// look up the block for a variant, marking it as the most recently used
+///
+/// @param offset file offset of the variant's genotype data
+/// @return the block, or an empty pointer if it is not cached
+std::shared_ptr<const CachedBlock> BlockCache::find(std::uint64_t offset) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto found = lookup.find(offset);
+  if (found == lookup.end()) {
+    n_misses++;
+    return nullptr;
+  }
+  n_hits++;
+  order.splice(order.begin(), order, found->second);
+  return found->second->second;
+}
+
+/// add a block, dropping the least recently used ones to stay within budget
+///
+/// A block larger than the whole budget is not kept, rather than emptying the cache
+/// for a block which would be dropped by the next insert anyway.
+///
+/// @param offset file offset of the variant's genotype data
+/// @param block the decompressed block
+void BlockCache::insert(std::uint64_t offset, std::shared_ptr<const CachedBlock> block) {
+  std::uint64_t needed = block_bytes(*block);
+  std::lock_guard<std::mutex> lock(mutex);
+  if ((needed > max_bytes) || (lookup.count(offset) > 0)) {
+    // another variant at the same offset may have been decoded alongside this one
+    return;
+  }
+  while (used + needed > max_bytes) {
+    used -= block_bytes(*order.back().second);
+    lookup.erase(order.back().first);
+    order.pop_back();
+    n_evictions++;
+  }
+  order.emplace_front(offset, std::move(block));
+  lookup[offset] = order.begin();
+  used += needed;
+}
+
+/// drop every block, but keep the counters
+void BlockCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  order.clear();
+  lookup.clear();
+  used = 0;
+}
+
+std::uint64_t BlockCache::hits() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return n_hits;
+}
+
+std::uint64_t BlockCache::misses() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return n_misses;
+}
+
+std::uint64_t BlockCache::evictions() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return n_evictions;
+}
+
+/// bytes held by the cached blocks
+std::uint64_t BlockCache::bytes() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return used;
+}
+
+/// number of cached blocks
+std::uint64_t BlockCache::size() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return order.size();
+}
+
+} // namespace bgen
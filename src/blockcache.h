@@ -0,0 +1,60 @@
+#ifndef BGEN_BLOCKCACHE_H_
+#define BGEN_BLOCKCACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "buffers.h"
+
+namespace bgen {
+
+/// a decompressed genotype block, padded as the decoders expect
+struct CachedBlock {
+  PooledArray<char> data;
+  // bytes of genotype data, not counting the padding
+  std::uint32_t size = 0;
+};
+
+/// decompressed genotype blocks, kept up to a byte budget and shared by every
+/// variant opened from one reader
+///
+/// Picking the same variants again (by index, offset or region) builds a fresh
+/// Variant each time, which would otherwise read and decompress its block again.
+/// Blocks are keyed by the file offset of the genotype data, so they only make sense
+/// within one bgen. The least recently used blocks are dropped once the budget is
+/// exceeded. A Variant holds on to its block through a shared_ptr, so dropping one
+/// from the cache never pulls it out from under a variant which is decoding it.
+///
+/// Every method takes a lock, since variants decoded in parallel share the cache.
+class BlockCache {
+public:
+  BlockCache(std::uint64_t capacity) : max_bytes(capacity) {}
+  std::shared_ptr<const CachedBlock> find(std::uint64_t offset);
+  void insert(std::uint64_t offset, std::shared_ptr<const CachedBlock> block);
+  void clear();
+  std::uint64_t capacity() const { return max_bytes; }
+  std::uint64_t hits();
+  std::uint64_t misses();
+  std::uint64_t evictions();
+  std::uint64_t bytes();
+  std::uint64_t size();
+private:
+  typedef std::pair<std::uint64_t, std::shared_ptr<const CachedBlock>> Entry;
+  std::uint64_t max_bytes;
+  std::uint64_t used = 0;
+  std::uint64_t n_hits = 0;
+  std::uint64_t n_misses = 0;
+  std::uint64_t n_evictions = 0;
+  // most recently used first
+  std::list<Entry> order;
+  std::unordered_map<std::uint64_t, std::list<Entry>::iterator> lookup;
+  std::mutex mutex;
+};
+
+} // namespace bgen
+
+#endif  // BGEN_BLOCKCACHE_H_
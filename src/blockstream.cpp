@@ -0,0 +1,133 @@
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "zlib.h"
+#include "zstd/lib/zstd.h"
+
+#include "blockstream.h"
+
+namespace bgen {
+
+/// the decompressor behind a BlockStream, for whichever compression the block uses
+///
+/// zlib blocks always go through zlib's inflate here, even in a build which decodes
+/// whole blocks with libdeflate, since libdeflate cannot stop partway through.
+struct BlockStream::State {
+  int compression;
+  z_stream strm;
+  ZSTD_DCtx * dctx = nullptr;
+  ZSTD_inBuffer input = {nullptr, 0, 0};
+  // whether the decompressor has reported the end of the compressed data
+  bool ended = false;
+
+  State(const char * data, std::uint32_t compressed_len, int _compression)
+      : compression(_compression) {
+    std::memset(&strm, 0, sizeof(strm));
+    if (compression == 1) {
+      if (inflateInit(&strm) != Z_OK) {
+        throw std::runtime_error("cannot allocate a zlib inflate stream");
+      }
+      strm.next_in = (Bytef *) data;
+      strm.avail_in = compressed_len;
+    } else if (compression == 2) {
+      dctx = ZSTD_createDCtx();
+      if (dctx == nullptr) {
+        throw std::runtime_error("cannot allocate a zstd decompression context");
+      }
+      input = {data, compressed_len, 0};
+    } else {
+      throw std::invalid_argument("only compressed genotype blocks can be streamed");
+    }
+  }
+  ~State() {
+    if (compression == 1) {
+      inflateEnd(&strm);
+    }
+    ZSTD_freeDCtx(dctx);
+  }
+
+  /// decompress up to n bytes into out
+  ///
+  /// @return number of bytes written, which is short of n only at the end of the data
+  std::uint32_t fill(char * out, std::uint32_t n) {
+    if (compression == 1) {
+      strm.next_out = (Bytef *) out;
+      strm.avail_out = n;
+      while ((strm.avail_out > 0) && !ended) {
+        int status = inflate(&strm, Z_NO_FLUSH);
+        if (status == Z_STREAM_END) {
+          ended = true;
+        } else if (status == Z_DATA_ERROR || status == Z_NEED_DICT || status == Z_MEM_ERROR) {
+          throw std::invalid_argument(std::string("zlib decompression failed: ") +
+                                      (strm.msg ? strm.msg : "invalid or corrupt data"));
+        } else if (status == Z_BUF_ERROR) {
+          // no progress can be made, so the compressed data ran out early
+          break;
+        }
+      }
+      return n - strm.avail_out;
+    }
+    ZSTD_outBuffer output = {out, n, 0};
+    while ((output.pos < output.size) && !ended) {
+      std::size_t before = output.pos + input.pos;
+      std::size_t status = ZSTD_decompressStream(dctx, &output, &input);
+      if (ZSTD_isError(status)) {
+        throw std::invalid_argument(std::string("zstd decompression failed: ") +
+                                    ZSTD_getErrorName(status));
+      }
+      if (status == 0) {
+        ended = true;
+      } else if (output.pos + input.pos == before) {
+        break;
+      }
+    }
+    return (std::uint32_t) output.pos;
+  }
+};
+
+/// @param data the genotype bytes as stored in the bgen, after the decompressed
+///     length field if the layout has one
+/// @param compressed_len number of stored bytes
+/// @param decompressed_len number of bytes the data decompresses to
+/// @param compression 1 for zlib, 2 for zstd
+BlockStream::BlockStream(const char * data, std::uint32_t compressed_len,
+                         std::uint32_t decompressed_len, int compression)
+    : state(new State(data, compressed_len, compression)), total(decompressed_len) {}
+
+BlockStream::~BlockStream() {}
+
+/// decompress the next n bytes of the block into out
+///
+/// Fails as decompressing the whole block would, if the data is corrupt or ends
+/// before the block length says it should.
+void BlockStream::read(char * out, std::uint32_t n) {
+  if ((pos + n > total) || (state->fill(out, n) != n)) {
+    throw std::invalid_argument("decompression gave data of wrong length");
+  }
+  pos += n;
+}
+
+/// decompress and discard the next n bytes, through a scratch buffer
+void BlockStream::skip(std::uint64_t n, char * scratch, std::uint32_t scratch_len) {
+  while (n > 0) {
+    std::uint32_t step = (n < scratch_len) ? (std::uint32_t) n : scratch_len;
+    read(scratch, step);
+    n -= step;
+  }
+}
+
+/// run through anything left of the block, and check the data ends where it should
+///
+/// The decoders stop after the last probability, which can be short of the block's
+/// end, so this covers the same checks that decompressing the whole block makes.
+void BlockStream::finish(char * scratch, std::uint32_t scratch_len) {
+  skip(total - pos, scratch, scratch_len);
+  // asking for one more byte finds the end of the data, or shows there is more
+  if (!state->ended && (state->fill(scratch, 1) != 0 || !state->ended)) {
+    throw std::invalid_argument("decompression gave data of wrong length");
+  }
+}
+
+} // namespace bgen
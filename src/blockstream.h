@@ -0,0 +1,41 @@
+#ifndef BGEN_BLOCKSTREAM_H_
+#define BGEN_BLOCKSTREAM_H_
+
+#include <cstdint>
+#include <memory>
+
+namespace bgen {
+
+/// decompresses a genotype block a piece at a time, in order
+///
+/// Decompressing a whole block means holding all of it at once, which for a wide
+/// variant at a high bit depth or with many alleles runs to tens of MB. This instead
+/// hands the block over in pieces of whatever size the caller asks for, so a decoder
+/// can work through a small window which stays in cache.
+///
+/// Each stream owns its zlib or zstd state, rather than borrowing the per thread
+/// state the one-shot decompressors use, since a variant can read its header on one
+/// call and its probabilities on a later one, with other variants decoded between.
+/// Streams are only made for large blocks, so the setup cost is small beside them.
+class BlockStream {
+public:
+  BlockStream(const char * data, std::uint32_t compressed_len,
+              std::uint32_t decompressed_len, int compression);
+  ~BlockStream();
+  BlockStream(const BlockStream &) = delete;
+  BlockStream & operator=(const BlockStream &) = delete;
+  void read(char * out, std::uint32_t n);
+  void skip(std::uint64_t n, char * scratch, std::uint32_t scratch_len);
+  void finish(char * scratch, std::uint32_t scratch_len);
+  // bytes of the decompressed block handed out so far
+  std::uint64_t position() const { return pos; }
+private:
+  struct State;
+  std::unique_ptr<State> state;
+  std::uint64_t pos = 0;
+  std::uint64_t total = 0;
+};
+
+} // namespace bgen
+
+#endif  // BGEN_BLOCKSTREAM_H_
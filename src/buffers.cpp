@@ -0,0 +1,94 @@
+
+#include <algorithm>
+#include <atomic>
+
+#include "buffers.h"
+
+namespace bgen {
+
+/// most idle buffers a pool keeps
+///
+/// A variant holds at most three buffers, and iteration has the next variant open
+/// while the last is still alive, so this covers a couple of variants at a time
+/// without holding on to much memory once they are done.
+const std::size_t POOL_MAX_BUFFERS = 8;
+
+static std::atomic<std::uint64_t> n_allocations(0);
+static std::atomic<std::uint64_t> n_reuses(0);
+
+BufferPool::~BufferPool() {
+  for (auto & buffer : idle) {
+    delete[] buffer.first;
+  }
+}
+
+/// take a buffer of at least n bytes
+///
+/// The smallest idle buffer which fits is reused, so large buffers stay free for
+/// large variants. If none fits, a new buffer of exactly n bytes is allocated.
+///
+/// @param n bytes needed
+/// @param capacity set to the bytes the buffer really holds
+/// @return the buffer, which must go back through give_back
+char * BufferPool::borrow(std::uint64_t n, std::uint64_t & capacity) {
+  // an empty request still gets a distinct buffer, so the array reads as set
+  n = std::max(n, (std::uint64_t) 1);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto best = idle.end();
+    for (auto it = idle.begin(); it != idle.end(); ++it) {
+      if ((it->second >= n) && ((best == idle.end()) || (it->second < best->second))) {
+        best = it;
+      }
+    }
+    if (best != idle.end()) {
+      char * data = best->first;
+      capacity = best->second;
+      *best = idle.back();
+      idle.pop_back();
+      n_reuses.fetch_add(1, std::memory_order_relaxed);
+      return data;
+    }
+  }
+  char * data = new char[n];
+  capacity = n;
+  n_allocations.fetch_add(1, std::memory_order_relaxed);
+  return data;
+}
+
+/// put a buffer back, to hand out again
+///
+/// A full pool keeps its largest buffers, so over time it holds buffers big enough
+/// for the largest variants, and smaller ones are freed.
+///
+/// @param data buffer from borrow
+/// @param capacity bytes the buffer holds
+void BufferPool::give_back(char * data, std::uint64_t capacity) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (idle.size() < POOL_MAX_BUFFERS) {
+    idle.emplace_back(data, capacity);
+    return;
+  }
+  auto smallest = std::min_element(idle.begin(), idle.end(),
+    [] (const std::pair<char *, std::uint64_t> & a,
+        const std::pair<char *, std::uint64_t> & b) { return a.second < b.second; });
+  if (smallest->second < capacity) {
+    delete[] smallest->first;
+    *smallest = std::make_pair(data, capacity);
+  } else {
+    delete[] data;
+  }
+}
+
+/// get the buffer pool of the current thread, creating it on first use
+std::shared_ptr<BufferPool> thread_buffer_pool() {
+  static thread_local std::shared_ptr<BufferPool> pool = std::make_shared<BufferPool>();
+  return pool;
+}
+
+BufferStats buffer_stats() {
+  return {n_allocations.load(std::memory_order_relaxed),
+          n_reuses.load(std::memory_order_relaxed)};
+}
+
+} // namespace bgen
@@ -0,0 +1,105 @@
+#ifndef BGEN_BUFFERS_H_
+#define BGEN_BUFFERS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace bgen {
+
+/// counts of pooled buffers handed out since the module loaded, across threads
+struct BufferStats {
+  // buffers which had to be freshly allocated
+  std::uint64_t allocations;
+  // buffers which were reused from a pool
+  std::uint64_t reuses;
+};
+
+BufferStats buffer_stats();
+
+/// idle buffers kept by one thread, for the genotype arrays it allocates
+///
+/// A buffer goes back to the pool it came from, whichever thread frees it, since
+/// the prefetch threads decompress variants which the caller's thread then frees.
+/// Returning buffers to the freeing thread's pool would leave the prefetch threads
+/// allocating for every variant. So the pool takes a lock, though there is rarely
+/// anyone to contend with, and is held by a shared_ptr, which keeps it alive until
+/// the buffers borrowed from it are back, even once its thread has exited.
+class BufferPool {
+public:
+  BufferPool() {}
+  ~BufferPool();
+  BufferPool(const BufferPool &) = delete;
+  BufferPool & operator=(const BufferPool &) = delete;
+  char * borrow(std::uint64_t n, std::uint64_t & capacity);
+  void give_back(char * data, std::uint64_t capacity);
+private:
+  std::mutex mutex;
+  std::vector<std::pair<char *, std::uint64_t>> idle;
+};
+
+std::shared_ptr<BufferPool> thread_buffer_pool();
+
+/// an array borrowed from the buffer pool of the current thread
+///
+/// Each Variant needs a buffer for its stored genotypes, another for them once
+/// decompressed, and one for the per-sample ploidy, all sized by the sample count,
+/// so iterating through a bgen would otherwise allocate and free several buffers
+/// of ~MBs per variant. Those come back as fresh pages from the OS each time, and
+/// page faulting them in costs as much as the decompression. Pooled arrays go back
+/// to a small pool instead, which hands them out again, so once the pool holds
+/// buffers as large as the largest variant, reading more allocates nothing.
+///
+/// This holds T only for trivially constructible T, since the bytes are reused
+/// without being constructed or destroyed. The contents start out undefined.
+template <typename T>
+class PooledArray {
+public:
+  PooledArray() {}
+  explicit PooledArray(std::uint64_t n) : pool(thread_buffer_pool()) {
+    data = reinterpret_cast<T *>(pool->borrow(n * sizeof(T), capacity));
+  }
+  ~PooledArray() { reset(); }
+  PooledArray(const PooledArray &) = delete;
+  PooledArray & operator=(const PooledArray &) = delete;
+  PooledArray(PooledArray && other) noexcept :
+      pool(std::move(other.pool)), data(other.data), capacity(other.capacity) {
+    other.data = nullptr;
+    other.capacity = 0;
+  }
+  PooledArray & operator=(PooledArray && other) noexcept {
+    if (this != &other) {
+      reset();
+      pool = std::move(other.pool);
+      data = other.data;
+      capacity = other.capacity;
+      other.data = nullptr;
+      other.capacity = 0;
+    }
+    return *this;
+  }
+  /// give the buffer back to the pool it came from
+  void reset() {
+    if (data != nullptr) {
+      pool->give_back(reinterpret_cast<char *>(data), capacity);
+      data = nullptr;
+      capacity = 0;
+    }
+    pool.reset();
+  }
+  T * get() const { return data; }
+  T & operator[](std::size_t i) const { return data[i]; }
+  explicit operator bool() const { return data != nullptr; }
+private:
+  std::shared_ptr<BufferPool> pool;
+  T * data = nullptr;
+  // bytes in the borrowed buffer, which can be more than were asked for
+  std::uint64_t capacity = 0;
+};
+
+} // namespace bgen
+
+#endif  // BGEN_BUFFERS_H_
@@ -0,0 +1,102 @@
+
+#include <algorithm>
+
+#include "catalog.h"
+
+namespace bgen {
+
+/// make room for n variants
+///
+/// Only the fixed width arrays are reserved, since the ID lengths are not known up
+/// front, and the arenas grow by doubling like any string.
+void VariantCatalog::reserve(std::uint64_t n) {
+  offsets.reserve(n);
+  positions.reserve(n);
+  allele_counts.reserve(n);
+  chrom_idx.reserve(n);
+  varid_starts.reserve(n + 1);
+  rsid_starts.reserve(n + 1);
+}
+
+/// drop every variant, and release the memory they held
+void VariantCatalog::clear() {
+  *this = VariantCatalog();
+}
+
+/// add a variant to the end of the catalog
+///
+/// @param offset file offset where the variant starts
+/// @param varid variant ID
+/// @param rsid reference SNP ID
+/// @param chrom chromosome name
+/// @param position nucleotide position
+/// @param n_alleles number of alleles
+void VariantCatalog::append(std::uint64_t offset, const std::string & varid,
+                            const std::string & rsid, const std::string & chrom,
+                            std::uint32_t position, std::uint16_t n_alleles) {
+  auto found = chrom_lookup.find(chrom);
+  std::uint32_t chrom_id;
+  if (found == chrom_lookup.end()) {
+    chrom_id = (std::uint32_t) chrom_names.size();
+    chrom_names.push_back(chrom);
+    chrom_lookup[chrom] = chrom_id;
+  } else {
+    chrom_id = found->second;
+  }
+  offsets.push_back(offset);
+  positions.push_back(position);
+  allele_counts.push_back(n_alleles);
+  chrom_idx.push_back(chrom_id);
+  varid_arena += varid;
+  rsid_arena += rsid;
+  varid_starts.push_back(varid_arena.size());
+  rsid_starts.push_back(rsid_arena.size());
+}
+
+std::string VariantCatalog::varid(std::uint64_t idx) const {
+  return varid_arena.substr(varid_starts[idx], varid_starts[idx + 1] - varid_starts[idx]);
+}
+
+std::string VariantCatalog::rsid(std::uint64_t idx) const {
+  return rsid_arena.substr(rsid_starts[idx], rsid_starts[idx + 1] - rsid_starts[idx]);
+}
+
+/// rebuild the catalog from a subset of its variants, in a new order
+///
+/// @param order indices of the variants to keep, in the order to keep them
+void VariantCatalog::keep(const std::vector<std::uint64_t> & order) {
+  VariantCatalog kept;
+  kept.reserve(order.size());
+  for (auto idx : order) {
+    kept.append(offsets[idx], varid(idx), rsid(idx), chrom(idx),
+                positions[idx], allele_counts[idx]);
+  }
+  *this = std::move(kept);
+}
+
+/// drop a subset of variants, then order the rest by position
+///
+/// This matches what dropping from a vector of Variants did, including the sort by
+/// position afterwards. The sort is stable, so variants at the same position stay
+/// in file order.
+///
+/// @param indices positions of the variants to drop, already checked to be in range
+///     and unique
+void VariantCatalog::drop(std::vector<int> indices) {
+  std::vector<char> dropped(size(), 0);
+  for (auto idx : indices) {
+    dropped[idx] = 1;
+  }
+  std::vector<std::uint64_t> order;
+  order.reserve(size() - indices.size());
+  for (std::uint64_t idx = 0; idx < size(); idx++) {
+    if (!dropped[idx]) {
+      order.push_back(idx);
+    }
+  }
+  std::stable_sort(order.begin(), order.end(),
+    [this] (std::uint64_t a, std::uint64_t b) { return positions[a] < positions[b]; });
+  keep(order);
+}
+
+} // namespace bgen
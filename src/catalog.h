@@ -0,0 +1,54 @@
+#ifndef BGEN_CATALOG_H_
+#define BGEN_CATALOG_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bgen {
+
+/// the identifying fields of every variant in a bgen, stored as flat arrays
+///
+/// A parsed Variant costs several hundred bytes, between its strings, allele vector,
+/// stream handle and Genotypes, which is tens of GB across a bgen of ~100M variants.
+/// Listing the IDs or positions needs none of that, so the catalog keeps one entry
+/// per variant in a set of parallel arrays instead: the offsets and positions as
+/// integers, the chromosome as an index into a table of the distinct names (a bgen
+/// has a few dozen at most), and the IDs packed end to end in one string each, with
+/// a table of where each ID starts. That comes to ~34 bytes per variant plus the ID
+/// text, and a handful of allocations rather than several per variant.
+///
+/// A Variant is only built from an entry when its genotypes are needed.
+class VariantCatalog {
+public:
+  void reserve(std::uint64_t n);
+  void clear();
+  void append(std::uint64_t offset, const std::string & varid, const std::string & rsid,
+              const std::string & chrom, std::uint32_t position, std::uint16_t n_alleles);
+  void drop(std::vector<int> indices);
+  std::uint64_t size() const { return offsets.size(); }
+  std::uint64_t offset(std::uint64_t idx) const { return offsets[idx]; }
+  std::uint32_t position(std::uint64_t idx) const { return positions[idx]; }
+  std::uint16_t n_alleles(std::uint64_t idx) const { return allele_counts[idx]; }
+  std::string varid(std::uint64_t idx) const;
+  std::string rsid(std::uint64_t idx) const;
+  const std::string & chrom(std::uint64_t idx) const { return chrom_names[chrom_idx[idx]]; }
+private:
+  void keep(const std::vector<std::uint64_t> & order);
+  std::vector<std::uint64_t> offsets;
+  std::vector<std::uint32_t> positions;
+  std::vector<std::uint16_t> allele_counts;
+  std::vector<std::uint32_t> chrom_idx;
+  std::vector<std::string> chrom_names;
+  std::unordered_map<std::string, std::uint32_t> chrom_lookup;
+  // the IDs of variant i are arena[starts[i]:starts[i + 1]]
+  std::string varid_arena;
+  std::string rsid_arena;
+  std::vector<std::uint64_t> varid_starts = {0};
+  std::vector<std::uint64_t> rsid_starts = {0};
+};
+
+} // namespace bgen
+
+#endif  // BGEN_CATALOG_H_
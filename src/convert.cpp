@@ -0,0 +1,191 @@
+
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "convert.h"
+#include "utils.h"
+
+#if defined(__x86_64__)
+  #include <immintrin.h>
+#endif
+
+namespace bgen {
+
+std::uint32_t output_size(int type) {
+  switch (type) {
+    case FLOAT32: return 4;
+    case FLOAT16: return 2;
+    case BFLOAT16: return 2;
+    case UINT8: return 1;
+    case UINT8_254: return 1;
+  }
+  throw std::invalid_argument("unknown output type: " + std::to_string(type));
+}
+
+/// @brief round a float to half precision, to nearest even, as F16C does
+///
+/// Values too large for a half become infinite, and nans stay nans, keeping the top
+/// of their payload.
+static inline std::uint16_t to_float16(float value) {
+  std::uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  std::uint32_t sign = (bits >> 16) & 0x8000;
+  std::uint32_t magnitude = bits & 0x7fffffff;
+  if (magnitude > 0x7f800000) {
+    return (std::uint16_t) (sign | 0x7e00 | ((magnitude >> 13) & 0x3ff));
+  }
+  if (magnitude >= 0x477ff000) {
+    // rounds to above the largest half, 65504
+    return (std::uint16_t) (sign | 0x7c00);
+  }
+  if (magnitude < 0x38800000) {
+    // subnormal as a half. Adding 0.5 lines the half's bits up with the bottom of
+    // the float's mantissa, and the float addition rounds them to nearest even
+    float shifted;
+    std::memcpy(&shifted, &magnitude, sizeof(shifted));
+    shifted += 0.5f;
+    std::uint32_t rounded;
+    std::memcpy(&rounded, &shifted, sizeof(rounded));
+    return (std::uint16_t) (sign | (rounded - 0x3f000000));
+  }
+  // rebias the exponent, and round the dropped bits to nearest even
+  std::uint32_t odd = (magnitude >> 13) & 1;
+  magnitude += ((std::uint32_t) (15 - 127) << 23) + 0xfff + odd;
+  return (std::uint16_t) (sign | (magnitude >> 13));
+}
+
+/// round a float to bfloat16, to nearest even, keeping nans as quiet nans
+static inline std::uint16_t to_bfloat16(float value) {
+  std::uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  if ((bits & 0x7fffffff) > 0x7f800000) {
+    return (std::uint16_t) ((bits >> 16) | 0x40);
+  }
+  return (std::uint16_t) ((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+/// scale a float to a byte, to nearest even, no higher than high, and nans as missing
+static inline std::uint8_t to_uint8(float value, float scale, std::uint8_t high,
+                                    std::uint8_t missing) {
+  if (std::isnan(value)) {
+    return missing;
+  }
+  float scaled = std::nearbyint(value * scale);
+  scaled = std::fmin(std::fmax(scaled, 0.0f), (float) high);
+  return (std::uint8_t) scaled;
+}
+
+#if defined(__x86_64__)
+// the F16C half of the float16 conversion. F16C came in alongside AVX, and every
+// AVX2 CPU has it, but it is checked for separately all the same.
+BGEN_TARGET_F16C
+static void float16_f16c(const float * in, std::uint16_t * out, std::uint64_t n,
+                         std::uint64_t & i) {
+  for (; i + 8 <= n; i += 8) {
+    __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(&in[i]), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128((__m128i *) &out[i], half);
+  }
+}
+
+// the AVX2 half of the bfloat16 conversion, with the same integer rounding as
+// to_bfloat16 above
+BGEN_TARGET_AVX2
+static void bfloat16_avx2(const float * in, std::uint16_t * out, std::uint64_t n,
+                          std::uint64_t & i) {
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i bias = _mm256_set1_epi32(0x7fff);
+  const __m256i abs_mask = _mm256_set1_epi32(0x7fffffff);
+  const __m256i infinity = _mm256_set1_epi32(0x7f800000);
+  const __m256i quiet = _mm256_set1_epi32(0x40);
+  for (; i + 8 <= n; i += 8) {
+    __m256i bits = _mm256_loadu_si256((const __m256i *) &in[i]);
+    __m256i odd = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+    __m256i rounded = _mm256_srli_epi32(
+        _mm256_add_epi32(bits, _mm256_add_epi32(bias, odd)), 16);
+    __m256i is_nan = _mm256_cmpgt_epi32(_mm256_and_si256(bits, abs_mask), infinity);
+    __m256i nan = _mm256_or_si256(_mm256_srli_epi32(bits, 16), quiet);
+    rounded = _mm256_blendv_epi8(rounded, nan, is_nan);
+    // every value fits in 16 bits, so the unsigned saturating pack keeps them as is
+    __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(rounded),
+                                      _mm256_extracti128_si256(rounded, 1));
+    _mm_storeu_si128((__m128i *) &out[i], packed);
+  }
+}
+
+// the AVX2 half of the uint8 conversion. cvtps rounds to nearest even, as
+// nearbyint does in the default rounding mode.
+BGEN_TARGET_AVX2
+static void uint8_avx2(const float * in, std::uint8_t * out, std::uint64_t n,
+                       float scale, std::uint8_t top, std::uint8_t absent,
+                       std::uint64_t & i) {
+  const __m256 factor = _mm256_set1_ps(scale);
+  const __m256i low = _mm256_setzero_si256();
+  const __m256i high = _mm256_set1_epi32(top);
+  const __m256i missing = _mm256_set1_epi32(absent);
+  for (; i + 8 <= n; i += 8) {
+    __m256 values = _mm256_loadu_ps(&in[i]);
+    __m256i scaled = _mm256_cvtps_epi32(_mm256_mul_ps(values, factor));
+    scaled = _mm256_min_epi32(_mm256_max_epi32(scaled, low), high);
+    __m256 is_nan = _mm256_cmp_ps(values, values, _CMP_UNORD_Q);
+    scaled = _mm256_blendv_epi8(scaled, missing, _mm256_castps_si256(is_nan));
+    __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(scaled),
+                                     _mm256_extracti128_si256(scaled, 1));
+    _mm_storel_epi64((__m128i *) &out[i], _mm_packus_epi16(words, words));
+  }
+}
+#endif
+
+/// @brief convert decoded float32 values to another output type
+///
+/// @param in float32 values, as the decoders give them
+/// @param out output, with room for n values of the output type
+/// @param n number of values
+/// @param type one of OutputType
+/// @param max_value largest value the input can hold, which UINT8 scales to
+///     UINT8_SCALE, and UINT8_254 to UINT8_254_SCALE. Unused for the other types.
+void convert_floats(const float * in, void * out, std::uint64_t n, int type,
+                    float max_value) {
+  std::uint64_t i = 0;
+  if (type == FLOAT32) {
+    std::memcpy(out, in, n * sizeof(float));
+  } else if (type == FLOAT16) {
+    std::uint16_t * half = reinterpret_cast<std::uint16_t *>(out);
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx")) {
+      float16_f16c(in, half, n, i);
+    }
+#endif
+    for (; i < n; i++) {
+      half[i] = to_float16(in[i]);
+    }
+  } else if (type == BFLOAT16) {
+    std::uint16_t * half = reinterpret_cast<std::uint16_t *>(out);
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+      bfloat16_avx2(in, half, n, i);
+    }
+#endif
+    for (; i < n; i++) {
+      half[i] = to_bfloat16(in[i]);
+    }
+  } else if ((type == UINT8) || (type == UINT8_254)) {
+    std::uint8_t * bytes = reinterpret_cast<std::uint8_t *>(out);
+    std::uint8_t high = (type == UINT8) ? UINT8_SCALE : UINT8_254_SCALE;
+    std::uint8_t missing = (type == UINT8) ? 0 : UINT8_254_MISSING;
+    float scale = (float) high / max_value;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+      uint8_avx2(in, bytes, n, scale, high, missing, i);
+    }
+#endif
+    for (; i < n; i++) {
+      bytes[i] = to_uint8(in[i], scale, high, missing);
+    }
+  } else {
+    throw std::invalid_argument("unknown output type: " + std::to_string(type));
+  }
+}
+
+} // namespace bgen
@@ -0,0 +1,40 @@
+#ifndef BGEN_CONVERT_H_
+#define BGEN_CONVERT_H_
+
+#include <cstdint>
+
+namespace bgen {
+
+/// number formats the decoders can write their probabilities and dosages in
+///
+/// The decoders all work in float32, and narrower outputs are converted from that a
+/// chunk at a time, so the values are those of the float32 output, rounded once.
+enum OutputType : int {
+  FLOAT32 = 0,
+  // IEEE half precision, rounded to nearest even
+  FLOAT16 = 1,
+  // the top half of a float32, rounded to nearest even. numpy has no type for this,
+  // so the raw bits are handed out as uint16
+  BFLOAT16 = 2,
+  // scaled so the largest value (1 for probabilities, 2 for dosages) is 255, the
+  // scale 8 bit bgens store probabilities at, so those come out exactly as stored.
+  // Missing values are zero, so missingness has to be found separately
+  UINT8 = 3,
+  // as UINT8, but scaled to 254 so missing values can be UINT8_254_MISSING. 8 bit
+  // probabilities don't survive this, since their 256 values fall on 255 steps
+  UINT8_254 = 4,
+};
+
+const std::uint8_t UINT8_SCALE = 255;
+const std::uint8_t UINT8_254_SCALE = 254;
+const std::uint8_t UINT8_254_MISSING = 255;
+
+/// bytes per value of an output type
+std::uint32_t output_size(int type);
+
+void convert_floats(const float * in, void * out, std::uint64_t n, int type,
+                    float max_value);
+
+} // namespace bgen
+
+#endif  // BGEN_CONVERT_H_
@@ -1,5 +1,6 @@
 
 #include <algorithm>
+#include <atomic>
 #include <iterator>
 #include <stdexcept>
 #include <bitset>
@@ -18,13 +19,25 @@
 #endif
 
 #include "zstd/lib/zstd.h"
-#include "zlib.h"
 
 #include "genotypes.h"
+#include "inflate.h"
 #include "utils.h"
 
 namespace bgen {
 
+/// @brief read a value starting at any byte of a buffer
+///
+/// Packed values start wherever the previous one ended, and dereferencing a cast
+/// pointer that isn't aligned for its type is undefined, even on cpus which allow
+/// it. memcpy compiles to the same single load.
+template <typename T>
+static inline T load_unaligned(const void * data) {
+  T value;
+  std::memcpy(&value, data, sizeof(T));
+  return value;
+}
+
 // create lookup table of all probs for 8 bit integers. This has 511 entries, in
 // order to allow for looking up values for the minor allele dosage, which can
 // be up to 2.0 if a sample contains both copies are of the minor allele
@@ -104,27 +117,6 @@ const float lut8[511] = {0.0000000, 0.0039216, 0.0078431, 0.0117647, 0.0156863,
   1.9725490, 1.9764706, 1.9803922, 1.9843137, 1.9882353, 1.9921569, 1.9960784,
   2.0000000};
 
-// uncompress a char array with zlib
-static void zlib_uncompress(char * input, int compressed_len, char * decompressed, int decompressed_len) {
-  z_stream infstream;
-  infstream.zalloc = Z_NULL;
-  infstream.zfree = Z_NULL;
-  infstream.opaque = Z_NULL;
-  
-  infstream.avail_in = compressed_len; // size of input
-  infstream.next_in = (Bytef *) input; // input char array
-  infstream.avail_out = decompressed_len; // size of output
-  infstream.next_out = (Bytef *) decompressed; // output char array
-  
-  inflateInit(&infstream);
-  inflate(&infstream, Z_NO_FLUSH);
-  inflateEnd(&infstream);
-  
-  if (decompressed_len != (int) infstream.total_out) {
-    throw std::invalid_argument("zlib decompression gave data of wrong length");
-  }
-}
-
 // uncompress a char array with zstd
 //
 // ZSTD_decompress allocates a decompression context, initialises it, then frees it on every
@@ -152,7 +144,7 @@ static ZSTD_DCtx * borrow_zstd_dctx() {
   return ctx.get();
 }
 
-static void zstd_uncompress(char * input, int compressed_len, char * decompressed,  int decompressed_len) {
+static void zstd_uncompress(const char * input, int compressed_len, char * decompressed,  int decompressed_len) {
   std::size_t total_out = ZSTD_decompressDCtx(borrow_zstd_dctx(), decompressed,
                                               decompressed_len, input, compressed_len);
   if (ZSTD_isError(total_out)) {
@@ -164,14 +156,31 @@ static void zstd_uncompress(char * input, int compressed_len, char * decompresse
   }
 }
 
-/// Read genotype data for a variant from disk and decompress.
+// blocks which decompress to at least this many bytes are streamed, see stream_wanted
+static std::atomic<std::uint64_t> stream_min_bytes(4 * 1024 * 1024);
+
+/// @brief set the size from which genotype blocks are decoded as they decompress
 ///
-/// The decompressed data is stored in the 'uncompressed' member. Decompression
-/// is handled internally by either zlib_decompress, or zstd_decompress,
-/// depending on compression scheme.
-void Genotypes::decompress() {
-  if (is_decompressed) {
-    // don't decompress if already available
+/// @param bytes decompressed size from which blocks are streamed. 0 never streams.
+void set_stream_threshold(std::uint64_t bytes) {
+  stream_min_bytes.store(bytes);
+}
+
+std::uint64_t stream_threshold() {
+  return stream_min_bytes.load();
+}
+
+/// Read the stored bytes of a variant's genotype block, without decompressing them
+///
+/// This is the only part of decoding which touches the bgen stream, so it is split
+/// out from decompress(), which lets a caller holding a lock around the shared
+/// stream do just the I/O under it, and leave the decompression to run in parallel.
+///
+/// A mapped bgen doesn't copy anything here, the stored bytes are used where they
+/// sit in the mapping. A stream has to read them somewhere, and uncompressed data is
+/// read into a buffer padded for the decoders, so decompress() can adopt it as is.
+void Genotypes::read_block() {
+  if (is_read || is_decompressed) {
     return;
   }
   
@@ -180,7 +189,10 @@ void Genotypes::decompress() {
     throw std::invalid_argument("cannot read from closed bgen file");
   }
   
-  if (!is_stdin) {
+  ByteCursor cursor = {nullptr, 0, 0};
+  if (mapped != nullptr) {
+    cursor = {mapped->data(), mapped->size(), file_offset};
+  } else if (!is_stdin) {
     // any other error state (e.g. the failbit and eofbit left behind by a read
     // which ran to the end of the file) is recoverable, since we are about to
     // seek to a known good offset. Only safe when we can seek, so stdin keeps
@@ -202,13 +214,20 @@ void Genotypes::decompress() {
         throw std::invalid_argument("bgen genotype data is too short to hold a "
                                     "decompressed length");
       }
-      if (! handle->read(reinterpret_cast<char*>(&decompressed_len), sizeof(std::uint32_t))) {
+      bool read_ok = (mapped != nullptr) ? read_value(cursor, decompressed_len)
+                                         : read_value(*handle, decompressed_len);
+      if (!read_ok) {
         throw std::invalid_argument("couldn't read the compressed length");
       }
     }
   }
   
   std::uint32_t compressed_len = length - decompressed_field * 4;
+  if ((mapped != nullptr) && !cursor.has(compressed_len)) {
+    // the mapping knows its size, so a block running off the end of the file is
+    // caught before anything is allocated for it
+    throw std::invalid_argument("couldn't read the compressed data");
+  }
   // the decompressed length is read from the bgen, so guard the buffer size
   // against wrapping. Without this a length near the 32-bit limit allocates a
   // few bytes and the padding memset below writes way past the end.
@@ -217,30 +236,239 @@ void Genotypes::decompress() {
                                 "decompressed length: " +
                                 std::to_string(decompressed_len));
   }
-  // hold the buffers in unique_ptrs, so the reads and decompression below can
-  // throw on a malformed bgen without leaking them
-  std::unique_ptr<char[]> compressed(new char[compressed_len]);
+  
+  if (mapped != nullptr) {
+    // Uncompressed bytes can be decoded in place, so long as the padding the
+    // kernels read past the end still lies inside the mapping. That padding is
+    // then the start of the next variant rather than zeros, but every read past
+    // the data is masked off, so what those bytes hold never reaches a result.
+    // The final variant in the file lacks the room, so it gets copied instead.
+    // The mapping is pinned, so the bytes stay readable if the reader closes.
+    in_place = (compression == 0) &&
+               cursor.has((std::uint64_t) compressed_len + PROBS_READ_PAD);
+    pinned = mapped->pin();
+    stored = cursor.data + cursor.pos;
+  } else {
+    // hold the buffer in a PooledArray, so a failed read cannot leak it
+    std::uint32_t pad = (compression == 0) ? PROBS_READ_PAD : 0;
+    PooledArray<char> buffer((std::uint64_t) compressed_len + pad);
+    std::memset(buffer.get() + compressed_len, 0, pad);
+    if (! handle->read(&buffer[0], compressed_len)) {
+      throw std::invalid_argument("couldn't read the compressed data");
+    }
+    stored_buffer = std::move(buffer);
+    stored = stored_buffer.get();
+  }
+  stored_len = compressed_len;
+  expanded_len = decompressed_len;
+  is_read = true;
+}
+
+/// Read genotype data for a variant from disk and decompress.
+///
+/// The decompressed data is pointed to by the 'block' member. Decompression
+/// is handled internally by either zlib_decompress, or zstd_decompress,
+/// depending on compression scheme.
+///
+/// Uncompressed data never gets copied: it is either decoded in place in the
+/// mapping, or the buffer it was read into becomes the decoded block.
+///
+/// With a cache, a block another variant already decompressed is used as is, and a
+/// newly decompressed block is handed over to the cache to share. Blocks decoded in
+/// place from the mapping are left out, since there is nothing to save on those.
+///
+/// A large block is instead streamed (see stream_wanted), which only decompresses the
+/// header here, unless whole is set.
+///
+/// @param whole decompress the whole block, even one which would be streamed
+void Genotypes::decompress(bool whole) {
+  if (is_decompressed) {
+    // don't decompress if already available
+    if (whole && streaming) {
+      unstream();
+    }
+    return;
+  }
+  if (cache) {
+    std::shared_ptr<const CachedBlock> found = cache->find(file_offset);
+    if (found) {
+      shared_block = found;
+      block = found->data.get();
+      uncompressed_len = found->size;
+      stored_buffer.reset();
+      stored = nullptr;
+      pinned.reset();
+      is_decompressed = true;
+      return;
+    }
+  }
+  read_block();
+  
+  if (!whole && stream_wanted()) {
+    start_stream();
+    return;
+  }
+  if ((compression == 0) && in_place) {
+    block = stored;
+  } else if ((compression == 0) && stored_buffer) {
+    uncompressed = std::move(stored_buffer);
+    block = uncompressed.get();
+  } else {
+    unpack(stored, stored_len, expanded_len);
+    // nothing points into the mapping any more, so let it go
+    pinned.reset();
+  }
+  stored_buffer.reset();
+  stored = nullptr;
+  uncompressed_len = expanded_len;
+  is_decompressed = true;
+  if (cache && uncompressed) {
+    // the buffer changes owner, but not address, so block stays valid
+    std::shared_ptr<CachedBlock> entry = std::make_shared<CachedBlock>();
+    entry->data = std::move(uncompressed);
+    entry->size = uncompressed_len;
+    shared_block = entry;
+    cache->insert(file_offset, entry);
+  }
+}
+
+/// @brief whether to decompress the block a window at a time, as it is decoded
+///
+/// A whole decompressed block sits in memory beside the compressed one until the
+/// variant is done with, which for a wide variant at a high bit depth or with many
+/// alleles runs to tens of MB, and the decoders then read it back from main memory.
+/// Past the threshold, the block is instead decompressed STREAM_WINDOW bytes at a time
+/// and each window decoded while it is still in cache.
+///
+/// The cost is that the block is not kept, so a second decode of the same variant
+/// decompresses it again. A reader with a cache wants whole blocks to share, so gets
+/// them. Uncompressed blocks have nothing to gain.
+bool Genotypes::stream_wanted() {
+  std::uint64_t threshold = stream_threshold();
+  return (compression != 0) && !cache && (threshold > 0) && (expanded_len >= threshold);
+}
+
+/// @brief decompress just the header of a block which is to be streamed
+///
+/// Layout 2 starts with a 10 byte preamble and a ploidy byte per sample, which the
+/// header parse reads from block as usual. Layout 1 has no header. The stream is left
+/// after the header for the first decode to carry on from.
+void Genotypes::start_stream() {
+  std::uint32_t head = 0;
+  if (layout == 2) {
+    // as much of the header as the block holds, the header parse checks the length
+    head = (std::uint32_t) std::min((std::uint64_t) n_samples + 10,
+                                    (std::uint64_t) expanded_len);
+  }
+  std::unique_ptr<BlockStream> opened(new BlockStream(stored, stored_len,
+                                                      expanded_len, compression));
+  PooledArray<char> buffer((std::uint64_t) head + PROBS_READ_PAD);
+  std::memset(buffer.get() + head, 0, PROBS_READ_PAD);
+  opened->read(buffer.get(), head);
+  // as in unpack, only take these on once the header has decompressed cleanly
+  uncompressed = std::move(buffer);
+  block = uncompressed.get();
+  stream = std::move(opened);
+  streaming = true;
+  uncompressed_len = expanded_len;
+  is_decompressed = true;
+}
+
+/// @brief swap a streamed block for the whole of it, for the decoders which need that
+///
+/// The header was parsed from the same bytes, so everything taken from it still holds.
+void Genotypes::unstream() {
+  stream.reset();
+  unpack(stored, stored_len, expanded_len);
+  streaming = false;
+  pinned.reset();
+  stored_buffer.reset();
+  stored = nullptr;
+}
+
+/// bits each sample takes in the block, when every sample has the same ploidy
+///
+/// This is also the bytes per group of eight samples, which is the unit the decoders
+/// can start from partway through a block.
+std::uint64_t Genotypes::sample_bits() {
+  if (layout == 1) {
+    return 48;
+  } else if (phased) {
+    return (std::uint64_t) max_ploidy * (n_alleles - 1) * bit_depth;
+  }
+  return (std::uint64_t) (max_probs - 1) * bit_depth;
+}
+
+/// @brief decode a streamed block a window at a time
+///
+/// Eight samples fill a whole number of bytes at any bit depth, so the windows cover
+/// whole groups of eight, and each starts on a byte, as the decoders expect. The
+/// stream is reopened if an earlier decode has moved it past the header.
+///
+/// @param decode called with each window, the first sample in it, and the count of
+///     samples it holds
+template <typename Decode>
+void Genotypes::stream_samples(Decode decode) {
+  std::uint64_t group_bytes = sample_bits();
+  std::uint64_t groups = std::max(STREAM_WINDOW / std::max(group_bytes, (std::uint64_t) 1),
+                                  (std::uint64_t) 1);
+  std::uint32_t chunk = (std::uint32_t) std::min(groups * 8, (std::uint64_t) n_samples);
+  // the window also skips the header when reopening, so is never left empty, even
+  // for a variant which stores nothing per sample
+  std::uint32_t window_len = (std::uint32_t) std::max(groups * group_bytes,
+                                                      (std::uint64_t) STREAM_WINDOW);
+  PooledArray<char> window((std::uint64_t) window_len + PROBS_READ_PAD);
+  
+  if (!stream || (stream->position() != idx)) {
+    stream.reset(new BlockStream(stored, stored_len, expanded_len, compression));
+    stream->skip(idx, window.get(), window_len);
+  }
+  for (std::uint32_t start = 0; start < n_samples; start += chunk) {
+    std::uint32_t n = std::min(chunk, n_samples - start);
+    std::uint32_t bytes = (std::uint32_t) (((std::uint64_t) n * group_bytes + 7) / 8);
+    stream->read(window.get(), bytes);
+    // zero the padding, as unpack does, so the trailing bits are deterministic
+    std::memset(window.get() + bytes, 0, PROBS_READ_PAD);
+    decode(window.get(), start, n);
+  }
+  stream->finish(window.get(), window_len);
+  stream.reset();
+}
+
+/// decompress a genotype block which is already in memory into a padded buffer
+///
+/// @param data the genotype bytes as stored in the bgen, after the decompressed
+///     length field if the layout has one
+/// @param compressed_len number of stored bytes
+/// @param decompressed_len number of bytes the data decompresses to
+void Genotypes::unpack(const char * data, std::uint32_t compressed_len,
+                       std::uint32_t decompressed_len) {
   // pad the buffer, since probabilities_layout2 reads 8 bytes at a time and the
   // read for the final probability would otherwise run off the end of the
   // genotype data. Zero the padding so those trailing bits are deterministic.
-  std::unique_ptr<char[]> buffer(new char[decompressed_len + PROBS_READ_PAD]);
+  PooledArray<char> buffer((std::uint64_t) decompressed_len + PROBS_READ_PAD);
   std::memset(buffer.get() + decompressed_len, 0, PROBS_READ_PAD);
-  if (! handle->read(&compressed[0], compressed_len)) {
-    throw std::invalid_argument("couldn't read the compressed data");
-  }
-
   if (compression == 0) { //no compression
-    std::memcpy(&buffer[0], &compressed[0], compressed_len);
+    std::memcpy(&buffer[0], data, compressed_len);
   } else if (compression == 1) { // zlib
-    zlib_uncompress(compressed.get(), (int) compressed_len, buffer.get(), (int) decompressed_len);  // about 2 milliseconds
+    zlib_uncompress(data, (int) compressed_len, buffer.get(), (int) decompressed_len);  // about 2 milliseconds
   } else if (compression == 2) { // zstd
-    zstd_uncompress(compressed.get(), (int) compressed_len, buffer.get(), (int) decompressed_len);
+    zstd_uncompress(data, (int) compressed_len, buffer.get(), (int) decompressed_len);
   }
   // only take ownership once the data has decompressed cleanly, so a failed
   // parse leaves no half filled buffer behind for a later call to read from
   uncompressed = std::move(buffer);
-  uncompressed_len = decompressed_len;
-  is_decompressed = true;
+  block = uncompressed.get();
+}
+
+/// switch the genotypes over to a different handle on the same bgen
+///
+/// Prefetched variants are read through the prefetcher's own handle, so that its
+/// threads never share a stream with the caller. Once handed over they are moved to
+/// the reader's handle, so that closing the reader closes them too.
+void Genotypes::rebind(std::shared_ptr<std::istream> _handle) {
+  handle = _handle;
+  mapped = is_stdin ? nullptr : as_mapped(handle.get());
 }
 
 /// figure out the maximum number of probabilities across the individuals
@@ -351,8 +579,11 @@ void Genotypes::check_block_size() {
 ///
 /// Layout 1 doesn't store any information before the genotype probabilities,
 /// so layout 1 just receives default values.
-void Genotypes::load_data_and_parse_header() {
-  decompress();
+///
+/// @param whole decompress the whole block, rather than only the header of a block
+///     which is streamed as it is decoded
+void Genotypes::load_data_and_parse_header(bool whole) {
+  decompress(whole);
   if (has_ploidy) {
     if (!block_checked) {
       // the header was parsed on an earlier call which then failed the size
@@ -386,9 +617,9 @@ void Genotypes::load_data_and_parse_header() {
       // about four billion times before returning a meaningless count
       throw std::invalid_argument("bgen variant has no alleles");
     }
-    std::uint32_t nn_samples = *reinterpret_cast<const std::uint32_t*>(&uncompressed[idx]);
+    std::uint32_t nn_samples = load_unaligned<std::uint32_t>(&block[idx]);
     idx += sizeof(std::uint32_t);
-    std::uint16_t allele_check = *reinterpret_cast<const std::uint16_t*>(&uncompressed[idx]);
+    std::uint16_t allele_check = load_unaligned<std::uint16_t>(&block[idx]);
     idx += sizeof(std::uint16_t);
     if (nn_samples != (std::uint32_t) n_samples) {
       throw std::invalid_argument("number of samples doesn't match!");
@@ -397,9 +628,9 @@ void Genotypes::load_data_and_parse_header() {
       throw std::invalid_argument("number of alleles doesn't match!");
     }
     
-    min_ploidy = (int) *reinterpret_cast<const std::uint8_t*>(&uncompressed[idx]);
+    min_ploidy = (int) *reinterpret_cast<const std::uint8_t*>(&block[idx]);
     idx += sizeof(std::uint8_t);
-    max_ploidy = (int) *reinterpret_cast<const std::uint8_t*>(&uncompressed[idx]);
+    max_ploidy = (int) *reinterpret_cast<const std::uint8_t*>(&block[idx]);
     idx += sizeof(std::uint8_t);
 
     if (max_ploidy < min_ploidy) {
@@ -413,9 +644,9 @@ void Genotypes::load_data_and_parse_header() {
   parse_ploidy();
   
   if (layout == 2) {
-    phased = (bool) *reinterpret_cast<const std::uint8_t*>(&uncompressed[idx]);
+    phased = (bool) *reinterpret_cast<const std::uint8_t*>(&block[idx]);
     idx += sizeof(std::uint8_t);
-    bit_depth = (int) *reinterpret_cast<const std::uint8_t*>(&uncompressed[idx]);
+    bit_depth = (int) *reinterpret_cast<const std::uint8_t*>(&block[idx]);
     if ((bit_depth < 1) | (bit_depth > 32)) {
       throw std::invalid_argument("probabilities bit depth out of bounds");
     }
@@ -452,15 +683,17 @@ void Genotypes::parse_ploidy() {
   std::uint8_t mask = 63;
   if (constant_ploidy) {
     // only the missingness matters, since the ploidy is known, and the scan is vectorised
-    fast_missing_scan(&uncompressed[idx], n_samples, missing);
+    fast_missing_scan(&block[idx], n_samples, missing);
   } else {
-    ploidy.reset(new std::uint8_t[n_samples]);
+    ploidy = PooledArray<std::uint8_t>(n_samples);
+    // split into a plain masking copy, which vectorises, and the vectorised scan,
+    // rather than one loop whose push_back keeps both scalar
+    std::uint8_t * dst = ploidy.get();
+    const char * src = &block[idx];
     for (std::uint32_t x=0; x < n_samples; x++) {
-      ploidy[x] = mask & uncompressed[idx + x];
-      if (uncompressed[idx + x] & 0x80) {
-        missing.push_back(x);
-      }
+      dst[x] = mask & src[x];
     }
+    fast_missing_scan(src, n_samples, missing);
     // The per-sample ploidy sizes the probability reads and writes, but the
     // arrays those go into are sized from max_ploidy, so a sample outside the
     // declared bounds would write past the end of its row - and past the end of
@@ -499,23 +732,87 @@ void Genotypes::materialise_ploidy() {
   if (ploidy) {
     return;
   }
-  ploidy.reset(new std::uint8_t[n_samples]);
+  ploidy = PooledArray<std::uint8_t>(n_samples);
   std::memset(ploidy.get(), max_ploidy, n_samples);
 }
 
+#if defined(__x86_64__)
+/// @brief AVX2 probabilities of layout 1 samples
+///
+/// Layout 1 stores every probability of a sample, so the output is the stored 16-bit
+/// values in the same order, each scaled, and eight samples convert as three runs of
+/// eight values. The samples to mark missing, with all three values zero, are found
+/// from which bytes are zero: a sample is missing when all six of its are.
+///
+/// Leaves n as the count of samples handled, for the scalar loop to finish.
+BGEN_TARGET_AVX2
+static void layout1_probs_avx2(const char * packed, float * probs, std::uint32_t nrows,
+                               std::uint32_t & n) {
+  const __m256 scale = _mm256_set1_ps(1.0f / 32768);
+  const __m256 nan = _mm256_set1_ps((float) std::nan("1"));
+  const __m256i zero = _mm256_setzero_si256();
+  // the lowest bit of each sample's six in the zero byte mask
+  const std::uint64_t firsts = 0x041041041041ULL;
+  const char * in = packed + (std::uint64_t) n * 6;
+  float * out = probs + (std::uint64_t) n * 3;
+  for (; n + 8 <= nrows; n += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i *) in);
+    __m128i b = _mm_loadu_si128((const __m128i *) (in + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *) (in + 32));
+    __m256 fa = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(a)), scale);
+    __m256 fb = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(b)), scale);
+    __m256 fc = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(c)), scale);
+
+    __m256i ab = _mm256_inserti128_si256(_mm256_castsi128_si256(a), b, 1);
+    std::uint64_t zeros = (std::uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(ab, zero));
+    zeros |= (std::uint64_t) (std::uint16_t) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(c, _mm256_castsi256_si128(zero))) << 32;
+    std::uint64_t empty = zeros & (zeros >> 1) & (zeros >> 2) & (zeros >> 3) &
+                          (zeros >> 4) & (zeros >> 5) & firsts;
+    if (empty != 0) {
+      // value k of the 24 belongs to sample k / 3, so build lane masks per run
+      std::uint32_t samples = 0;
+      for (; empty != 0; empty &= empty - 1) {
+        samples |= 1u << (__builtin_ctzll(empty) / 6);
+      }
+      alignas(32) std::int32_t lanes[24];
+      for (int k = 0; k < 24; k++) {
+        lanes[k] = ((samples >> (k / 3)) & 1) ? -1 : 0;
+      }
+      fa = _mm256_blendv_ps(fa, nan, _mm256_load_ps((const float *) lanes));
+      fb = _mm256_blendv_ps(fb, nan, _mm256_load_ps((const float *) (lanes + 8)));
+      fc = _mm256_blendv_ps(fc, nan, _mm256_load_ps((const float *) (lanes + 16)));
+    }
+    _mm256_storeu_ps(out, fa);
+    _mm256_storeu_ps(out + 8, fb);
+    _mm256_storeu_ps(out + 16, fc);
+    in += 48;
+    out += 24;
+  }
+}
+#endif
+
 /// parse probabilities for layout1.
 ///
 /// Layout 1 genotype probabilities are simple to parse, they are just 16-bit ints
 /// one for each of the three possible genotypes. Missingness is encoded for a
-/// sample when all probabilties are zero.
+/// sample when all probabilties are zero. Most samples go through
+/// layout1_probs_avx2 first, and this loop finishes the rest.
 ///
 /// @return 1D float array of genotype probabilties (each from 0.0-1.0).
-void Genotypes::probabilities_layout1(char * uncompressed, std::uint32_t idx, float * probs, std::uint32_t & nrows) {
+void Genotypes::probabilities_layout1(const char * uncompressed, std::uint32_t idx, float * probs, std::uint32_t & nrows) {
   float factor = 1.0 / 32768;
-  for (std::uint32_t offset=0; offset<nrows * max_probs; offset+=max_probs) {
-    probs[offset] = *reinterpret_cast<const std::uint16_t*>(&uncompressed[idx]) * factor;
-    probs[offset + 1] = *reinterpret_cast<const std::uint16_t*>(&uncompressed[idx + 2]) * factor;
-    probs[offset + 2] = *reinterpret_cast<const std::uint16_t*>(&uncompressed[idx + 4]) * factor;
+  std::uint32_t n = 0;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    layout1_probs_avx2(&uncompressed[idx], probs, nrows, n);
+    idx += n * 6;
+  }
+#endif
+  for (std::uint32_t offset=n * max_probs; offset<nrows * max_probs; offset+=max_probs) {
+    probs[offset] = load_unaligned<std::uint16_t>(&uncompressed[idx]) * factor;
+    probs[offset + 1] = load_unaligned<std::uint16_t>(&uncompressed[idx + 2]) * factor;
+    probs[offset + 2] = load_unaligned<std::uint16_t>(&uncompressed[idx + 4]) * factor;
     idx += 6;
     
     if ((probs[offset] == 0.0) & (probs[offset + 1] == 0.0) & (probs[offset + 2] == 0.0)) {
@@ -530,13 +827,11 @@ void Genotypes::probabilities_layout1(char * uncompressed, std::uint32_t idx, fl
 // the AVX2 half of fast_haplotype_probs below. Compiled for AVX2 in isolation,
 // so it is only ever entered after a runtime check for AVX2 support.
 BGEN_TARGET_AVX2
-static void haplotype_probs_avx2(char * uncompressed, std::uint32_t & idx,
+static void haplotype_probs_avx2(const char * uncompressed, std::uint32_t & idx,
                                  float * probs, std::uint32_t & nrows,
                                  std::uint32_t & n) {
   const std::uint32_t c = 255;
-  const float f = 1.0 / 255.0f;
   __m256i k = _mm256_set_epi32(c, c, c, c, c, c, c, c);
-  __m256 j = _mm256_set_ps(f, f, f, f, f, f, f, f);
 
   __m128i initial;
   __m256i widened, partner;
@@ -554,9 +849,10 @@ static void haplotype_probs_avx2(char * uncompressed, std::uint32_t & idx,
     partner = _mm256_sub_epi32(k, widened);
 
     // interleave the registers to get paired values beside each other, then
-    // convert to float and multiply by inverted constant to get probability
-    store_lo = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_unpacklo_epi32(widened, partner)), j);
-    store_hi = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_unpackhi_epi32(widened, partner)), j);
+    // look each probability up in lut8, so the values match the scalar tail
+    // exactly wherever the tail falls
+    store_lo = _mm256_i32gather_ps(lut8, _mm256_unpacklo_epi32(widened, partner), 4);
+    store_hi = _mm256_i32gather_ps(lut8, _mm256_unpackhi_epi32(widened, partner), 4);
 
     // _mm256_unpacklo_epi32 interleaves values from two registers, but it
     // does it within the top part of each m128 portion of the register
@@ -581,8 +877,8 @@ static void haplotype_probs_avx2(char * uncompressed, std::uint32_t & idx,
     widened = _mm256_cvtepu8_epi32(_mm_bsrli_si128(initial, 8));
     partner = _mm256_sub_epi32(k, widened);
 
-    store_lo = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_unpacklo_epi32(widened, partner)), j);
-    store_hi = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_unpackhi_epi32(widened, partner)), j);
+    store_lo = _mm256_i32gather_ps(lut8, _mm256_unpacklo_epi32(widened, partner), 4);
+    store_hi = _mm256_i32gather_ps(lut8, _mm256_unpackhi_epi32(widened, partner), 4);
 
     _mm_storeu_ps(&probs[n + 16], _mm256_castps256_ps128(store_lo));
     _mm_storeu_ps(&probs[n + 20], _mm256_castps256_ps128(store_hi));
@@ -608,7 +904,7 @@ static void haplotype_probs_avx2(char * uncompressed, std::uint32_t & idx,
 /// remainders are accumulated before clamping, so a negative one leaves its sign bit in the
 /// accumulator, and one test after the loop reports whether any was seen.
 BGEN_TARGET_AVX2
-static void unphased_probs_avx2(char * uncompressed, std::uint32_t & idx,
+static void unphased_probs_avx2(const char * uncompressed, std::uint32_t & idx,
                                 float * probs, std::uint32_t & nrows,
                                 std::uint32_t & n, bool & above_max) {
   const __m256i k255 = _mm256_set1_epi32(255);
@@ -696,8 +992,383 @@ static inline int dosage_count8(std::uint8_t first, std::uint8_t second,
   return (count < 511) ? count : 510;
 }
 
+/// @brief whether the packed decoders below handle a bit depth
+///
+/// A value is unpacked with a four byte load from the byte it starts in, so it has to
+/// fit in the 32 bits loaded after shifting off up to seven bits before it, which holds
+/// up to 25 bits. 32 bit values sit on whole bytes, so are loaded directly instead.
+static inline bool packed_depth_supported(std::uint32_t bit_depth) {
+  return ((bit_depth >= 1) && (bit_depth <= 25)) || (bit_depth == 32);
+}
+
+#if defined(__x86_64__)
+/// @brief where each of eight consecutive values starts, for a given bit depth
+///
+/// Eight values at any bit depth fill a whole number of bytes (bit_depth bytes), so
+/// every group of eight starts on a byte, and the values within each group start at
+/// the same byte offsets and bit shifts. These are worked out once per variant.
+BGEN_TARGET_AVX2
+static inline void packed_lanes(std::uint32_t bit_depth, __m256i & offsets,
+                                __m256i & shifts, __m256i & mask) {
+  alignas(32) std::int32_t off[8];
+  alignas(32) std::int32_t shift[8];
+  for (std::uint32_t i = 0; i < 8; i++) {
+    off[i] = (std::int32_t) ((i * bit_depth) >> 3);
+    shift[i] = (std::int32_t) ((i * bit_depth) & 7);
+  }
+  offsets = _mm256_load_si256((const __m256i *) off);
+  shifts = _mm256_load_si256((const __m256i *) shift);
+  // shifting a 32 bit one by 32 is undefined, and 32 bit values are never masked
+  std::uint32_t bits = (bit_depth <= 25) ? (1u << bit_depth) - 1 : 0xFFFFFFFFu;
+  mask = _mm256_set1_epi32((std::int32_t) bits);
+}
+
+/// @brief unpack a group of eight values at bit depths up to 25
+///
+/// Gathers four bytes from where each value starts, then shifts off the bits of the
+/// value before it and masks off those of the value after. The last gather reads up
+/// to three bytes past the group, which PROBS_READ_PAD covers at the end of a block.
+BGEN_TARGET_AVX2
+static inline __m256i unpack8_avx2(const std::uint8_t * group, __m256i offsets,
+                                   __m256i shifts, __m256i mask) {
+  __m256i raw = _mm256_i32gather_epi32((const int *) group, offsets, 1);
+  return _mm256_and_si256(_mm256_srlv_epi32(raw, shifts), mask);
+}
+
+/// @brief unpack and scale a group of eight values, at any depth packed_depth_supported allows
+///
+/// The result matches the scalar decode exactly: values up to 25 bits convert to float
+/// with the same rounding as the scalar conversion from 64 bits. A 32 bit value can be
+/// too large for a signed conversion, so it is converted in 16 bit halves, which are
+/// exact, and summed, which rounds once, as the scalar conversion does.
+BGEN_TARGET_AVX2
+static inline __m256 scaled8_avx2(const std::uint8_t * group, std::uint32_t bit_depth,
+                                  __m256i offsets, __m256i shifts, __m256i mask,
+                                  __m256 scale) {
+  if (bit_depth == 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) group);
+    __m256 hi = _mm256_cvtepi32_ps(_mm256_srli_epi32(v, 16));
+    __m256 lo = _mm256_cvtepi32_ps(_mm256_and_si256(v, _mm256_set1_epi32(0xFFFF)));
+    __m256 value = _mm256_add_ps(_mm256_mul_ps(hi, _mm256_set1_ps(65536.0f)), lo);
+    return _mm256_mul_ps(value, scale);
+  }
+  __m256i v = unpack8_avx2(group, offsets, shifts, mask);
+  return _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale);
+}
+
+/// @brief AVX2 decode of packed probabilities at bit depths other than 8
+///
+/// Writes value * factor for each of n_values packed values, which must be a multiple
+/// of eight, so the packed data starts and ends on a byte.
+///
+/// @param packed first byte of the packed values
+/// @param n_values number of values to decode
+/// @param bit_depth bits per value, which packed_depth_supported allows
+/// @param factor scale from the stored integers to probabilities
+/// @param out array with room for n_values floats
+BGEN_TARGET_AVX2
+static void packed_probs_avx2(const char * packed, std::uint64_t n_values,
+                              std::uint32_t bit_depth, float factor, float * out) {
+  const std::uint8_t * in = reinterpret_cast<const std::uint8_t *>(packed);
+  __m256i offsets, shifts, mask;
+  packed_lanes(bit_depth, offsets, shifts, mask);
+  const __m256 scale = _mm256_set1_ps(factor);
+  for (std::uint64_t n = 0; n < n_values; n += 8) {
+    _mm256_storeu_ps(out + n, scaled8_avx2(in, bit_depth, offsets, shifts, mask, scale));
+    in += bit_depth;
+  }
+}
+
+/// @brief AVX2 decode of rows storing one or two values, the biallelic cases
+///
+/// These are most rows, and are narrow enough to build the remainders in registers,
+/// rather than going through the scratch array packed_probs_rows uses for wider rows.
+/// The remainder is (1 - first) - second, as the scalar decode subtracts them, so the
+/// values match it exactly, and negative remainders are clamped and flagged as there.
+///
+/// @return number of rows decoded, a multiple of eight
+BGEN_TARGET_AVX2
+static std::uint32_t narrow_rows_avx2(const char * packed, float * probs,
+                                      std::uint32_t nrows, std::uint32_t stored,
+                                      std::uint32_t bit_depth, float factor,
+                                      bool & above_max) {
+  const std::uint8_t * in = reinterpret_cast<const std::uint8_t *>(packed);
+  __m256i offsets, shifts, mask;
+  packed_lanes(bit_depth, offsets, shifts, mask);
+  const __m256 scale = _mm256_set1_ps(factor);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 limit = _mm256_set1_ps(-1e-6f);
+  __m256 negative = _mm256_setzero_ps();
+  std::uint32_t n = 0;
+  float * out = probs;
+  if (stored == 1) {
+    for (; n + 8 <= nrows; n += 8) {
+      __m256 p = scaled8_avx2(in, bit_depth, offsets, shifts, mask, scale);
+      __m256 rem = _mm256_sub_ps(one, p);
+      __m256 neg = _mm256_cmp_ps(rem, limit, _CMP_LT_OQ);
+      negative = _mm256_or_ps(negative, neg);
+      rem = _mm256_andnot_ps(neg, rem);
+      // pair each value with its remainder, then put the 128 bit halves back in order
+      __m256 lo = _mm256_unpacklo_ps(p, rem);
+      __m256 hi = _mm256_unpackhi_ps(p, rem);
+      _mm256_storeu_ps(out, _mm256_permute2f128_ps(lo, hi, 0x20));
+      _mm256_storeu_ps(out + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+      in += bit_depth;
+      out += 16;
+    }
+  } else {
+    // moves the first values of four rows to the low half, the second to the high
+    const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    for (; n + 8 <= nrows; n += 8) {
+      __m256 a = _mm256_permutevar8x32_ps(
+          scaled8_avx2(in, bit_depth, offsets, shifts, mask, scale), split);
+      __m256 b = _mm256_permutevar8x32_ps(
+          scaled8_avx2(in + bit_depth, bit_depth, offsets, shifts, mask, scale), split);
+      __m256 first = _mm256_permute2f128_ps(a, b, 0x20);
+      __m256 second = _mm256_permute2f128_ps(a, b, 0x31);
+      __m256 rem = _mm256_sub_ps(_mm256_sub_ps(one, first), second);
+      __m256 neg = _mm256_cmp_ps(rem, limit, _CMP_LT_OQ);
+      negative = _mm256_or_ps(negative, neg);
+      rem = _mm256_andnot_ps(neg, rem);
+      // three floats per row does not divide the register width, so spill the lanes
+      // and interleave them, as unphased_probs_avx2 does
+      float b0[8], b1[8], b2[8];
+      _mm256_storeu_ps(b0, first);
+      _mm256_storeu_ps(b1, second);
+      _mm256_storeu_ps(b2, rem);
+      for (int j = 0; j < 8; j++) {
+        out[j * 3] = b0[j];
+        out[j * 3 + 1] = b1[j];
+        out[j * 3 + 2] = b2[j];
+      }
+      in += 2 * bit_depth;
+      out += 24;
+    }
+  }
+  if (_mm256_movemask_ps(negative) != 0) {
+    above_max = true;
+  }
+  return n;
+}
+#endif
+
+/// @brief decode probabilities with a constant ploidy, at bit depths other than 8
+///
+/// With a constant ploidy every row stores the same number of values, so the packed
+/// values run on without gaps, and can be unpacked in bulk ahead of working out the
+/// remainder of each row. The values go through a small scratch array, in chunks of a
+/// multiple of eight rows, so each chunk starts on a byte. The remainder is subtracted
+/// one value at a time, in the same order as probabilities_layout2 does, so the
+/// remainders match it exactly.
+///
+/// Rows with one or two stored values skip the scratch array, see narrow_rows_avx2.
+/// Rows with more than 32 stored values, and machines without AVX2, are left to the
+/// scalar decode.
+///
+/// @return number of rows decoded, which is a multiple of eight. The caller finishes
+///     the rest, starting from the bit after the last of these rows.
+static std::uint32_t packed_probs_rows(const char * packed, float * probs,
+                                       std::uint32_t nrows, std::uint32_t max_probs,
+                                       std::uint32_t bit_depth, float factor,
+                                       bool & above_max) {
+  std::uint32_t row = 0;
+#if defined(__x86_64__)
+  std::uint32_t stored = max_probs - 1;
+  if (!packed_depth_supported(bit_depth) || (stored == 0) || (stored > 32) ||
+      !__builtin_cpu_supports("avx2")) {
+    return 0;
+  }
+  if (stored <= 2) {
+    return narrow_rows_avx2(packed, probs, nrows, stored, bit_depth, factor, above_max);
+  }
+  // at most 256 values per chunk, whatever the row width
+  std::uint32_t chunk_rows = 8 * std::max((std::uint32_t) 1, 32 / stored);
+  float scratch[256];
+  float * out = probs;
+  while (row + 8 <= nrows) {
+    std::uint32_t rows = std::min(chunk_rows, (nrows - row) & ~(std::uint32_t) 7);
+    std::uint64_t n_values = (std::uint64_t) rows * stored;
+    packed_probs_avx2(packed, n_values, bit_depth, factor, scratch);
+    packed += n_values * bit_depth / 8;
+    const float * p = scratch;
+    for (std::uint32_t r = 0; r < rows; r++) {
+      float remainder = 1.0f;
+      for (std::uint32_t x = 0; x < stored; x++) {
+        remainder -= p[x];
+        out[x] = p[x];
+      }
+      if (remainder < -1e-6f) {
+        remainder = 0.0f;
+        above_max = true;
+      }
+      out[stored] = remainder;
+      p += stored;
+      out += max_probs;
+    }
+    row += rows;
+  }
+#endif
+  return row;
+}
+
+#if defined(__x86_64__)
+/// @brief unpack the values of eight biallelic samples whose ploidy varies
+///
+/// A biallelic sample stores as many values as its ploidy, at most two here, so a
+/// sample's values start after the total ploidy of the samples before it. That running
+/// total comes from one multiply: each byte of the product sums the ploidy bytes at or
+/// below it, and cannot carry, since the total is at most 16. Each sample's values are
+/// then gathered from where they start. The gathers skip the values a sample does not
+/// have, so nothing past the last stored value is read, and those lanes come out zero.
+///
+/// @param in byte holding the first bit of the first sample
+/// @param lead bits of that byte before the first sample starts
+/// @param ploidy ploidy of the eight samples
+/// @param n_values set to the number of values the eight samples store
+BGEN_TARGET_AVX2
+static inline void ploidy_group_avx2(const std::uint8_t * in, std::uint32_t lead,
+                                     const std::uint8_t * ploidy,
+                                     std::uint32_t bit_depth, __m256i mask,
+                                     __m256i & ploid, __m256i & first,
+                                     __m256i & second, std::uint32_t & n_values) {
+  std::uint64_t counts;
+  std::memcpy(&counts, ploidy, 8);
+  std::uint64_t inclusive = counts * 0x0101010101010101ULL;
+  n_values = (std::uint32_t) (inclusive >> 56);
+  ploid = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128((long long) counts));
+  __m256i start = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128((long long) (inclusive << 8)));
+
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i seven = _mm256_set1_epi32(7);
+  __m256i bits = _mm256_set1_epi32((int) bit_depth);
+  __m256i pos = _mm256_add_epi32(_mm256_mullo_epi32(start, bits),
+                                 _mm256_set1_epi32((int) lead));
+  __m256i has_first = _mm256_cmpgt_epi32(ploid, zero);
+  __m256i has_second = _mm256_cmpgt_epi32(ploid, _mm256_set1_epi32(1));
+
+  __m256i raw = _mm256_mask_i32gather_epi32(zero, (const int *) in,
+      _mm256_srli_epi32(pos, 3), has_first, 1);
+  first = _mm256_and_si256(_mm256_srlv_epi32(raw, _mm256_and_si256(pos, seven)), mask);
+  pos = _mm256_add_epi32(pos, bits);
+  raw = _mm256_mask_i32gather_epi32(zero, (const int *) in,
+      _mm256_srli_epi32(pos, 3), has_second, 1);
+  second = _mm256_and_si256(_mm256_srlv_epi32(raw, _mm256_and_si256(pos, seven)), mask);
+}
+
+/// @brief AVX2 probabilities of unphased biallelic samples with one or two copies
+///
+/// Haploid and diploid samples mixed in one variant, as on chrX, have rows of two and
+/// three genotypes, padded out to three with nan. A sample with no copies has a single
+/// genotype, so a probability of 1. The values are worked out as the scalar decode does,
+/// subtracting each from 1 in turn for the remainder, so they match it exactly, and a
+/// negative remainder is clamped and flagged as there.
+///
+/// Leaves n as the count of samples handled, and bit_idx just past their values, for
+/// the scalar loop to finish.
+BGEN_TARGET_AVX2
+static void varied_ploidy_probs_avx2(const char * packed, const std::uint8_t * ploidy,
+                                     float * probs, std::uint32_t nrows,
+                                     std::uint32_t bit_depth, float factor,
+                                     std::uint32_t & n, std::uint64_t & bit_idx,
+                                     bool & above_max) {
+  const std::uint8_t * in = reinterpret_cast<const std::uint8_t *>(packed);
+  const __m256i mask = _mm256_set1_epi32((std::int32_t) ((1u << bit_depth) - 1));
+  const __m256 scale = _mm256_set1_ps(factor);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 limit = _mm256_set1_ps(-1e-6f);
+  // the same nan the scalar decode pads rows with
+  const __m256 pad = _mm256_set1_ps((float) std::nan("1"));
+  __m256 negative = _mm256_setzero_ps();
+  __m256i ploid, first, second;
+  std::uint32_t n_values;
+  float * out = probs + (std::uint64_t) n * 3;
+  for (; n + 8 <= nrows; n += 8) {
+    ploidy_group_avx2(in + bit_idx / 8, bit_idx % 8, ploidy + n, bit_depth, mask,
+                      ploid, first, second, n_values);
+    bit_idx += (std::uint64_t) n_values * bit_depth;
+
+    __m256 none = _mm256_castsi256_ps(_mm256_cmpeq_epi32(ploid, _mm256_setzero_si256()));
+    __m256 haploid = _mm256_castsi256_ps(_mm256_cmpeq_epi32(ploid, _mm256_set1_epi32(1)));
+    __m256 diploid = _mm256_castsi256_ps(_mm256_cmpeq_epi32(ploid, _mm256_set1_epi32(2)));
+
+    __m256 p0 = _mm256_mul_ps(_mm256_cvtepi32_ps(first), scale);
+    __m256 p1 = _mm256_mul_ps(_mm256_cvtepi32_ps(second), scale);
+    __m256 rem = _mm256_sub_ps(one, p0);
+    rem = _mm256_blendv_ps(rem, _mm256_sub_ps(rem, p1), diploid);
+    // a sample with no copies has nothing stored, so its remainder is always 1
+    __m256 neg = _mm256_andnot_ps(none, _mm256_cmp_ps(rem, limit, _CMP_LT_OQ));
+    negative = _mm256_or_ps(negative, neg);
+    rem = _mm256_andnot_ps(neg, rem);
+
+    __m256 col0 = _mm256_blendv_ps(p0, one, none);
+    __m256 col1 = _mm256_blendv_ps(_mm256_blendv_ps(pad, rem, haploid), p1, diploid);
+    __m256 col2 = _mm256_blendv_ps(pad, rem, diploid);
+
+    // spill the lanes and interleave them, as unphased_probs_avx2 does
+    float b0[8], b1[8], b2[8];
+    _mm256_storeu_ps(b0, col0);
+    _mm256_storeu_ps(b1, col1);
+    _mm256_storeu_ps(b2, col2);
+    for (int j = 0; j < 8; j++) {
+      out[j * 3] = b0[j];
+      out[j * 3 + 1] = b1[j];
+      out[j * 3 + 2] = b2[j];
+    }
+    out += 24;
+  }
+  if (_mm256_movemask_ps(negative) != 0) {
+    above_max = true;
+  }
+}
+
+/// @brief AVX2 ref dosage of biallelic samples with zero, one or two copies
+///
+/// Unphased samples give hom * ploidy + het * (ploidy / 2), and a sample whose values
+/// sum above the maximum gets a dosage of its ploidy, as in ref_dosage_slow_unphased.
+/// Phased samples sum their haplotypes, each scaled first, as in
+/// ref_dosage_slow_phased. Either way the dosages match the scalar loops exactly.
+///
+/// Leaves n as the count of samples handled, and bit_idx just past their values, for
+/// the scalar loop to finish.
+BGEN_TARGET_AVX2
+static void varied_ploidy_dosage_avx2(const char * packed, const std::uint8_t * ploidy,
+                                      float * dose, std::uint32_t nrows,
+                                      std::uint32_t bit_depth, float factor, bool phased,
+                                      std::uint32_t & n, std::uint64_t & bit_idx,
+                                      bool & above_max) {
+  const std::uint8_t * in = reinterpret_cast<const std::uint8_t *>(packed);
+  const __m256i mask = _mm256_set1_epi32((std::int32_t) ((1u << bit_depth) - 1));
+  const __m256 scale = _mm256_set1_ps(factor);
+  __m256i over = _mm256_setzero_si256();
+  __m256i ploid, first, second;
+  std::uint32_t n_values;
+  for (; n + 8 <= nrows; n += 8) {
+    ploidy_group_avx2(in + bit_idx / 8, bit_idx % 8, ploidy + n, bit_depth, mask,
+                      ploid, first, second, n_values);
+    bit_idx += (std::uint64_t) n_values * bit_depth;
+    __m256 d;
+    if (phased) {
+      // lanes without a haplotype are zero, so add nothing
+      d = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(first), scale),
+                        _mm256_mul_ps(_mm256_cvtepi32_ps(second), scale));
+    } else {
+      // the het value is zero unless the sample is diploid, where it counts once
+      __m256i count = _mm256_add_epi32(_mm256_mullo_epi32(first, ploid), second);
+      __m256i bad = _mm256_cmpgt_epi32(_mm256_add_epi32(first, second), mask);
+      over = _mm256_or_si256(over, bad);
+      d = _mm256_mul_ps(_mm256_cvtepi32_ps(count), scale);
+      d = _mm256_blendv_ps(d, _mm256_cvtepi32_ps(ploid), _mm256_castsi256_ps(bad));
+    }
+    _mm256_storeu_ps(&dose[n], d);
+  }
+  if (!_mm256_testz_si256(over, over)) {
+    above_max = true;
+  }
+}
+#endif
+
 /// fast path for phased data with ploidy=2, and 8 bits per probability
-void Genotypes::fast_haplotype_probs(char * uncompressed, std::uint32_t idx, float * probs,  std::uint32_t & nrows) {
+void Genotypes::fast_haplotype_probs(const char * uncompressed, std::uint32_t idx, float * probs,  std::uint32_t & nrows) {
   std::uint32_t n = 0;
 #if defined(__x86_64__)
   if (__builtin_cpu_supports("avx2")) {
@@ -724,7 +1395,7 @@ void Genotypes::fast_haplotype_probs(char * uncompressed, std::uint32_t idx, flo
 /// is a common use case.
 ///
 /// @return 1D float array of genotype probabilties (each from 0.0-1.0).
-void Genotypes::probabilities_layout2(char * uncompressed, std::uint32_t idx, float * probs, std::uint32_t & nrows) {
+void Genotypes::probabilities_layout2(const char * uncompressed, std::uint32_t idx, float * probs, std::uint32_t & nrows) {
   // get genotype/allele probabilities
   std::uint32_t n_probs;
   std::uint32_t max_less_1 = max_probs - 1;
@@ -762,7 +1433,24 @@ void Genotypes::probabilities_layout2(char * uncompressed, std::uint32_t idx, fl
     // fast path for phased data with ploidy=2, and 8 bits per probability
     fast_haplotype_probs(uncompressed, idx, probs, nrows);
   } else {
-    for (std::uint32_t offset=0; offset < (nrows * max_probs); offset += max_probs) {
+    // other bit depths, or more alleles. Every row is the same width when the ploidy is
+    // constant, so most rows can be unpacked in bulk, leaving the rest to the loop below
+    std::uint32_t start = 0;
+    if (constant_ploidy || phased) {
+      // phased rows are one per haplotype, so are the same width whatever the ploidy
+      start = packed_probs_rows(&uncompressed[idx], probs, nrows, max_probs, bit_depth,
+                                factor, probs_above_max);
+      bit_idx = (std::uint64_t) start * max_less_1 * bit_depth;
+    } else if ((n_alleles == 2) && (max_ploidy <= 2)) {
+      // haploid and diploid samples mixed, as on chrX
+#if defined(__x86_64__)
+      if ((bit_depth >= 1) && (bit_depth <= 25) && __builtin_cpu_supports("avx2")) {
+        varied_ploidy_probs_avx2(&uncompressed[idx], ploidy.get(), probs, nrows,
+                                 bit_depth, factor, start, bit_idx, probs_above_max);
+      }
+#endif
+    }
+    for (std::uint32_t offset=start * max_probs; offset < (nrows * max_probs); offset += max_probs) {
       // calculate the number of probabilities per sample (depends on whether the
       // data is phased, the sample ploidy and the number of alleles)
       if (constant_ploidy) {
@@ -776,7 +1464,7 @@ void Genotypes::probabilities_layout2(char * uncompressed, std::uint32_t idx, fl
       }
       remainder = 1.0;
       for (std::uint32_t x=0; x<n_probs; x++) {
-        prob = ((*reinterpret_cast<const std::uint64_t* >(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask) * factor ;
+        prob = ((load_unaligned<std::uint64_t>(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask) * factor ;
         bit_idx += bit_depth;
         remainder -= prob;
         probs[offset + x] = prob;
@@ -793,7 +1481,13 @@ void Genotypes::probabilities_layout2(char * uncompressed, std::uint32_t idx, fl
       }
     }
   }
-  
+}
+
+/// set the probabilities of the samples in missing to nan
+///
+/// Kept apart from probabilities_layout2, since a streamed block is decoded a window
+/// of samples at a time, and this needs the offsets of the whole output.
+void Genotypes::mark_missing_probs(float * probs) {
   std::uint32_t offset;
   std::uint32_t k = (phased) ? max_ploidy : 1;  // phased data needs scaled offset
   // Phased samples with varying ploidy occupy a row per haplotype, so a sample's
@@ -838,6 +1532,16 @@ void Genotypes::probabilities(float * probs) {
   // an earlier variant's problem to a later read
   probs_above_max = false;
   
+  if (streaming && (subset || !constant_ploidy)) {
+    // the rows have no fixed size, or only some are wanted, so take the whole block
+    unstream();
+  }
+  
+  if (subset) {
+    probabilities_subset(block, idx, probs);
+    return;
+  }
+  
   std::uint32_t nrows;
   if (!phased) {
     nrows = n_samples;
@@ -850,10 +1554,174 @@ void Genotypes::probabilities(float * probs) {
     }
   }
   
+  if (streaming) {
+    // every sample has the same number of rows and values here
+    std::uint64_t rows = phased ? max_ploidy : 1;
+    stream_samples([&](const char * window, std::uint32_t start, std::uint32_t n) {
+      probabilities_rows(window, 0, probs + start * rows * max_probs,
+                         (std::uint32_t) (n * rows));
+    });
+  } else {
+    probabilities_rows(block, idx, probs, nrows); // about 3 milliseconds
+  }
+  if (layout == 2) {
+    mark_missing_probs(probs);
+  }
+}
+
+/// decode the probabilities of consecutive rows, by the layout's decoder
+///
+/// @param uncompressed genotype data, either the whole block or a streamed window
+/// @param idx position in uncompressed where the rows start
+/// @param probs output for the first row
+/// @param nrows number of rows, which is a row per haplotype for phased data
+void Genotypes::probabilities_rows(const char * uncompressed, std::uint32_t idx,
+                                   float * probs, std::uint32_t nrows) {
   if (layout == 1) {
-    probabilities_layout1(uncompressed.get(), idx, probs, nrows);
+    probabilities_layout1(uncompressed, idx, probs, nrows);
   } else if (layout == 2) {
-    probabilities_layout2(uncompressed.get(), idx, probs, nrows); // about 3 milliseconds
+    probabilities_layout2(uncompressed, idx, probs, nrows);
+  }
+}
+
+/// parse probabilities for only the selected samples
+///
+/// The stored probabilities have no fixed stride once the ploidy varies, so this walks
+/// the selected samples in ascending order, skipping the bits of everything between
+/// them, and writes each into its output row. Skipping costs a table lookup per
+/// unselected sample when the ploidy varies, and nothing when it is constant, so the
+/// decode itself (and the output) scales with the subset rather than the cohort.
+///
+/// The values match the full decode's: the 8 bit cases read the same lookup table as
+/// its fast paths, and the rest use the same arithmetic as probabilities_layout2.
+///
+/// @param uncompressed decompressed genotype block
+/// @param idx position in the block where the probabilities start
+/// @param probs output, with max_probs values per row, and a row per selected sample
+///     (or per haplotype of each selected sample, for phased data)
+void Genotypes::probabilities_subset(const char * uncompressed, std::uint32_t idx, float * probs) {
+  const std::vector<std::uint32_t> & sorted = subset->sorted;
+  const std::vector<std::uint32_t> & dest = subset->dest;
+  std::uint32_t n_sel = subset->size();
+  
+  if (layout == 1) {
+    float factor = 1.0 / 32768;
+    for (std::uint32_t k=0; k<n_sel; k++) {
+      const char * in = &uncompressed[idx + (std::uint64_t) sorted[k] * 6];
+      float * out = probs + (std::uint64_t) dest[k] * 3;
+      out[0] = load_unaligned<std::uint16_t>(in) * factor;
+      out[1] = load_unaligned<std::uint16_t>(in + 2) * factor;
+      out[2] = load_unaligned<std::uint16_t>(in + 4) * factor;
+      if ((out[0] == 0.0) & (out[1] == 0.0) & (out[2] == 0.0)) {
+        out[0] = std::nan("1");
+        out[1] = std::nan("1");
+        out[2] = std::nan("1");
+      }
+    }
+    return;
+  }
+  
+  // phased samples take a row per haplotype, so with a varying ploidy a sample's
+  // first row depends on the ploidy of every selected sample before it in output order
+  std::vector<std::uint64_t> first_row;
+  if (phased && !constant_ploidy) {
+    first_row.resize(n_sel);
+    std::uint64_t rows = 0;
+    for (std::uint32_t j=0; j<n_sel; j++) {
+      first_row[j] = rows;
+      rows += ploidy[subset->indices[j]];
+    }
+  }
+  
+  // number of values stored per sample, for each ploidy
+  std::uint64_t stored[64];
+  for (int ploid=0; ploid <= max_ploidy; ploid++) {
+    if (constant_ploidy && (ploid == max_ploidy)) {
+      stored[ploid] = (max_probs - 1) * (phased ? (std::uint64_t) max_ploidy : 1);
+    } else if (phased) {
+      stored[ploid] = (std::uint64_t) ploid * (n_alleles - 1);
+    } else if ((ploid == 2) && (n_alleles == 2)) {
+      stored[ploid] = 2;
+    } else {
+      int p = ploid;
+      stored[ploid] = get_max_probs(p, n_alleles, phased) - 1;
+    }
+  }
+  
+  float factor = 1.0 / ((float) (std::pow(2, (int) bit_depth)) - 1);
+  std::uint64_t probs_mask = std::uint64_t(0xFFFFFFFFFFFFFFFF) >> (64 - bit_depth);
+  bool lut_triples = constant_ploidy & (max_probs == 3) & (bit_depth == 8);
+  bool lut_pairs = constant_ploidy & (max_probs == 2) & (bit_depth == 8);
+  
+  auto missing_at = missing.begin();
+  std::uint64_t bit_idx = 0;
+  std::uint32_t next = 0;  // cohort index of the sample starting at bit_idx
+  for (std::uint32_t k=0; k<n_sel; k++) {
+    std::uint32_t s = sorted[k];
+    if (constant_ploidy) {
+      bit_idx += (std::uint64_t) (s - next) * stored[max_ploidy] * bit_depth;
+    } else {
+      for (; next < s; next++) {
+        bit_idx += stored[ploidy[next]] * bit_depth;
+      }
+    }
+    next = s + 1;
+    
+    std::uint32_t ploid = constant_ploidy ? max_ploidy : ploidy[s];
+    std::uint32_t groups = phased ? ploid : 1;
+    std::uint64_t per_group = phased ? (std::uint64_t) n_alleles - 1 : stored[ploid];
+    std::uint64_t row = dest[k];
+    if (phased) {
+      row = constant_ploidy ? row * max_ploidy : first_row[row];
+    }
+    float * out = probs + row * max_probs;
+    
+    // missing holds cohort indices in ascending order, as sorted does
+    while ((missing_at != missing.end()) && (*missing_at < s)) {
+      ++missing_at;
+    }
+    if ((missing_at != missing.end()) && (*missing_at == s)) {
+      for (std::uint64_t x=0; x<(std::uint64_t) max_probs * groups; x++) {
+        out[x] = std::nan("1");
+      }
+      bit_idx += stored[ploid] * bit_depth;
+      continue;
+    }
+    
+    for (std::uint32_t g=0; g<groups; g++) {
+      float * group = out + (std::uint64_t) g * max_probs;
+      if (lut_triples) {
+        std::uint8_t first = uncompressed[idx + bit_idx / 8];
+        std::uint8_t second = uncompressed[idx + bit_idx / 8 + 1];
+        group[0] = lut8[first];
+        group[1] = lut8[second];
+        group[2] = remainder_lut8(first, second, probs_above_max);
+        bit_idx += 16;
+        continue;
+      } else if (lut_pairs) {
+        std::uint8_t first = uncompressed[idx + bit_idx / 8];
+        group[0] = lut8[first];
+        group[1] = lut8[255 - first];
+        bit_idx += 8;
+        continue;
+      }
+      float remainder = 1.0;
+      for (std::uint64_t x=0; x<per_group; x++) {
+        float prob = ((load_unaligned<std::uint64_t>(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask) * factor;
+        bit_idx += bit_depth;
+        remainder -= prob;
+        group[x] = prob;
+      }
+      // clamp a negative remainder as probabilities_layout2 does
+      if (remainder < -1e-6f) {
+        remainder = 0.0f;
+        probs_above_max = true;
+      }
+      group[per_group] = remainder;
+      for (std::uint64_t x=(per_group + 1); x<max_probs; x++) {
+        group[x] = std::nan("1");
+      }
+    }
   }
 }
 
@@ -882,10 +1750,15 @@ void Genotypes::probabilities(float * probs) {
 /// A constant ploidy variant gathers each stride rather than walking it, which needs no
 /// per sample ploidy lookup and gives a bit identical sum.
 ///
+/// With a sample subset, dose only holds the selected samples, so the frequency (and
+/// so the minor allele) is that of the subset.
+///
 /// @param dose float array of dosages for the reference (first) allele, with
 ///     missing samples already set to nan
 /// @return index for minor allele (0 or 1)
 int Genotypes::find_minor_allele(float * dose) {
+  // only the samples written out count, so a subset gets the minor allele of the subset
+  std::uint32_t n_samples = n_out();
   std::uint32_t batchsize = 100;
   std::uint32_t increment = std::max(n_samples / batchsize, (std::uint32_t) 1);
   double total = 0;
@@ -919,7 +1792,7 @@ int Genotypes::find_minor_allele(float * dose) {
           continue;
         }
         total += dose[n];
-        n_alleles_seen += ploidy[n];
+        n_alleles_seen += ploidy[sample_at(n)];
         n_checked += 1;
       }
     } else {
@@ -961,7 +1834,7 @@ int Genotypes::find_minor_allele(float * dose) {
         continue;
       }
       total += dose[n];
-      n_alleles_seen += ploidy[n];
+      n_alleles_seen += ploidy[sample_at(n)];
     }
   }
   if (n_alleles_seen == 0) {
@@ -981,7 +1854,7 @@ int Genotypes::find_minor_allele(float * dose) {
 // the AVX2 half of ref_dosage_fast below. Compiled for AVX2 in isolation, so it
 // is only ever entered after a runtime check for AVX2 support.
 BGEN_TARGET_AVX2
-static void ref_dosage_avx2(char * uncompressed, std::uint32_t & idx,
+static void ref_dosage_avx2(const char * uncompressed, std::uint32_t & idx,
                             float * dose, std::uint32_t & nrows,
                             std::uint32_t & n, bool & above_max) {
   const float c = 1.0f / 255.0f;
@@ -1002,7 +1875,7 @@ static void ref_dosage_avx2(char * uncompressed, std::uint32_t & idx,
   __m256i lo;
   __m256i hi;
   for (; n + 16 <= nrows; n+=16) {
-    initial = _mm256_loadu_si256((__m256i *) &uncompressed[idx]);
+    initial = _mm256_loadu_si256((const __m256i *) &uncompressed[idx]);
 
     // multiply each byte by its weight and add the pairs, which both applies the
     // ploidy and sums the two counts of a sample. Counts start as 8-bit uints and
@@ -1050,7 +1923,7 @@ static void ref_dosage_avx2(char * uncompressed, std::uint32_t & idx,
 ///
 /// @param uncompressed char array containing genotype probabilities
 /// @param idx uint position where the genotype probabilties begin
-void Genotypes::ref_dosage_fast(char *uncompressed, std::uint32_t idx, float *dose, std::uint32_t nrows) {
+void Genotypes::ref_dosage_fast(const char * uncompressed, std::uint32_t idx, float *dose, std::uint32_t nrows) {
   std::uint32_t n=0;
 #if defined(__x86_64__)
   if (__builtin_cpu_supports("avx2")) {
@@ -1060,7 +1933,7 @@ void Genotypes::ref_dosage_fast(char *uncompressed, std::uint32_t idx, float *do
   // using this optimised method roughly doubles the speed of computing the ref
   // dosage, but it has a limited impact, since 80-90% of the time is spent
   // decompressing the genotypes array (with zlib compressed data).
-  std::uint8_t * buff = reinterpret_cast<std::uint8_t *>(uncompressed);
+  const std::uint8_t * buff = reinterpret_cast<const std::uint8_t *>(uncompressed);
   const float c = 1.0f / 255.0f;
   float32x4_t k = vdupq_n_f32(c);
   uint8x16x2_t initial;
@@ -1112,6 +1985,88 @@ void Genotypes::ref_dosage_fast(char *uncompressed, std::uint32_t idx, float *do
   }
 }
 
+#if defined(__x86_64__)
+/// @brief AVX2 ref dosage of unphased diploid biallelic samples, at bit depths up to 25
+///
+/// Each sample stores two values, the homozygous and heterozygous probabilities, so
+/// eight samples fill two groups of eight values. Those are unpacked and split into the
+/// two probabilities, and combined as hom * 2 + het, as ref_dosage_slow_unphased does.
+/// The count needs at most 27 bits, so converts to float exactly as its 64 bit count
+/// does. A sample whose two values sum above the maximum gets a dosage of 2, and sets
+/// above_max, again matching the scalar path.
+///
+/// Leaves n as the count of samples handled, for the scalar loop to finish.
+BGEN_TARGET_AVX2
+static void ref_dosage_packed_avx2(const char * packed, float * dose,
+                                   std::uint32_t nrows, std::uint32_t bit_depth,
+                                   float factor, std::uint32_t & n, bool & above_max) {
+  const std::uint8_t * in = reinterpret_cast<const std::uint8_t *>(packed);
+  __m256i offsets, shifts, mask;
+  packed_lanes(bit_depth, offsets, shifts, mask);
+  const __m256 scale = _mm256_set1_ps(factor);
+  const __m256 two = _mm256_set1_ps(2.0f);
+  // moves the homozygous values of four samples to the low half, the hets to the high
+  const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  __m256i over = _mm256_setzero_si256();
+  for (; n + 8 <= nrows; n += 8) {
+    __m256i a = _mm256_permutevar8x32_epi32(unpack8_avx2(in, offsets, shifts, mask), split);
+    __m256i b = _mm256_permutevar8x32_epi32(
+        unpack8_avx2(in + bit_depth, offsets, shifts, mask), split);
+    __m256i hom = _mm256_permute2x128_si256(a, b, 0x20);
+    __m256i het = _mm256_permute2x128_si256(a, b, 0x31);
+
+    __m256i count = _mm256_add_epi32(_mm256_slli_epi32(hom, 1), het);
+    // both are below 2^25, so the sum cannot reach the sign bit of the comparison
+    __m256i bad = _mm256_cmpgt_epi32(_mm256_add_epi32(hom, het), mask);
+    over = _mm256_or_si256(over, bad);
+
+    __m256 d = _mm256_mul_ps(_mm256_cvtepi32_ps(count), scale);
+    _mm256_storeu_ps(&dose[n], _mm256_blendv_ps(d, two, _mm256_castsi256_ps(bad)));
+    in += 2 * bit_depth;
+  }
+  if (!_mm256_testz_si256(over, over)) {
+    above_max = true;
+  }
+}
+#endif
+
+#if defined(__x86_64__)
+/// @brief AVX2 ref dosage of layout 1 samples
+///
+/// Each sample is three 16-bit values, so a 32-bit gather at its start picks up the
+/// hom and het values, and one two bytes on picks up the third in its high half, without
+/// reading past the sample. The dosage is hom * 2 + het, scaled, as in
+/// ref_dosage_slow_unphased, and samples with all three zero are added to missing, in
+/// order.
+///
+/// Leaves n as the count of samples handled, for the scalar loop to finish.
+BGEN_TARGET_AVX2
+static void layout1_dosage_avx2(const char * packed, float * dose, std::uint32_t nrows,
+                                std::uint32_t & n, std::vector<std::uint32_t> & missing) {
+  const __m256 scale = _mm256_set1_ps(1.0f / 32768);
+  const __m256i low = _mm256_set1_epi32(0xFFFF);
+  const __m256i starts = _mm256_setr_epi32(0, 6, 12, 18, 24, 30, 36, 42);
+  const __m256i zero = _mm256_setzero_si256();
+  const char * in = packed + (std::uint64_t) n * 6;
+  for (; n + 8 <= nrows; n += 8) {
+    __m256i first = _mm256_i32gather_epi32((const int *) in, starts, 1);
+    __m256i last = _mm256_srli_epi32(
+        _mm256_i32gather_epi32((const int *) (in + 2), starts, 1), 16);
+    __m256i hom = _mm256_and_si256(first, low);
+    __m256i het = _mm256_srli_epi32(first, 16);
+    __m256i count = _mm256_add_epi32(_mm256_add_epi32(hom, hom), het);
+    _mm256_storeu_ps(&dose[n], _mm256_mul_ps(_mm256_cvtepi32_ps(count), scale));
+
+    int empty = _mm256_movemask_ps(_mm256_castsi256_ps(
+        _mm256_cmpeq_epi32(_mm256_or_si256(first, last), zero)));
+    for (; empty != 0; empty &= empty - 1) {
+      missing.push_back(n + __builtin_ctz(empty));
+    }
+    in += 48;
+  }
+}
+#endif
+
 /// calculate dosage of the reference (first) allele for all samples for unphased genotpes
 ///
 /// The slow path, loops across samples. Figures out ploidy at each step,
@@ -1127,7 +2082,7 @@ void Genotypes::ref_dosage_fast(char *uncompressed, std::uint32_t idx, float *do
 ///
 /// @param uncompressed char array of genotype probabilities (encoding depends on layout)
 /// @param idx uint index position in uncompressed where genotype probabilities start
-void Genotypes::ref_dosage_slow_unphased(char * uncompressed, std::uint32_t idx, float * dose, std::uint32_t nrows) {
+void Genotypes::ref_dosage_slow_unphased(const char * uncompressed, std::uint32_t idx, float * dose, std::uint32_t nrows) {
   std::uint32_t curr_ploidy = max_ploidy;
   std::uint32_t half_ploidy = curr_ploidy / 2;
 
@@ -1142,7 +2097,26 @@ void Genotypes::ref_dosage_slow_unphased(char * uncompressed, std::uint32_t idx,
   std::uint32_t hom_alt;
   std::uint64_t probs_mask = std::uint64_t(0xFFFFFFFFFFFFFFFF) >> (64 - bit_depth);
   std::uint64_t bit_idx = 0;  // index position in bits
-  for (std::uint32_t n=0; n<nrows; n++) {
+  std::uint32_t n = 0;
+#if defined(__x86_64__)
+  // diploid samples at other bit depths than 8 can be unpacked eight at a time. 32 bit
+  // counts need more than the 32 bit lanes hold, so stay on the loop below
+  if (constant_ploidy && (max_ploidy == 2) && (layout == 2) && (bit_depth >= 1) &&
+      (bit_depth <= 25) && __builtin_cpu_supports("avx2")) {
+    ref_dosage_packed_avx2(&uncompressed[idx], dose, nrows, bit_depth, factor, n,
+                           probs_above_max);
+    bit_idx = (std::uint64_t) n * 2 * bit_depth;
+  } else if (!constant_ploidy && (max_ploidy <= 2) && (layout == 2) &&
+             (bit_depth >= 1) && (bit_depth <= 25) && __builtin_cpu_supports("avx2")) {
+    // haploid and diploid samples mixed, as on chrX
+    varied_ploidy_dosage_avx2(&uncompressed[idx], ploidy.get(), dose, nrows, bit_depth,
+                              factor, false, n, bit_idx, probs_above_max);
+  } else if ((layout == 1) && __builtin_cpu_supports("avx2")) {
+    layout1_dosage_avx2(&uncompressed[idx], dose, nrows, n, missing);
+    bit_idx = (std::uint64_t) n * 48;
+  }
+#endif
+  for (; n<nrows; n++) {
     if (!constant_ploidy) {
       curr_ploidy = this->ploidy[n];
       half_ploidy = curr_ploidy / 2;
@@ -1159,12 +2133,12 @@ void Genotypes::ref_dosage_slow_unphased(char * uncompressed, std::uint32_t idx,
       dose[n] = 0.0f;
       continue;
     }
-    hom = ((*reinterpret_cast<const std::uint64_t* >(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask);
+    hom = ((load_unaligned<std::uint64_t>(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask);
     bit_idx += bit_depth;
     
     het = 0;
     if (curr_ploidy == 2) {
-      het = ((*reinterpret_cast<const std::uint64_t* >(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask);
+      het = ((load_unaligned<std::uint64_t>(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask);
       bit_idx += bit_depth;
     }
     
@@ -1178,7 +2152,7 @@ void Genotypes::ref_dosage_slow_unphased(char * uncompressed, std::uint32_t idx,
     }
     if (layout == 1) {
       // layout1 stores hom alt probability, and all zeros indicates missingness
-      hom_alt = *reinterpret_cast<const std::uint16_t* >(&uncompressed[idx + bit_idx / 8]);
+      hom_alt = load_unaligned<std::uint16_t>(&uncompressed[idx + bit_idx / 8]);
       bit_idx += bit_depth;
       if ((hom == 0) & (het == 0) & (hom_alt == 0)) {
         missing.push_back(n);
@@ -1187,6 +2161,58 @@ void Genotypes::ref_dosage_slow_unphased(char * uncompressed, std::uint32_t idx,
   }
 }
 
+#if defined(__x86_64__)
+/// @brief AVX2 ref dosage of phased diploid biallelic samples
+///
+/// A biallelic haplotype stores one value, the probability of the first allele, so
+/// a sample's dosage is the sum of its two haplotypes' values, scaled. That is summed
+/// as first * factor + second * factor, as ref_dosage_slow_phased does, rather than
+/// summing the integers first, so a sample's dosage matches the scalar loop exactly.
+///
+/// 8 bit values are split straight from the packed bytes. Other depths are unpacked
+/// eight values at a time, as in ref_dosage_packed_avx2.
+///
+/// The remainder of a haplotype is the maximum less its one stored value, so cannot
+/// be negative, and there is no above-max check to make.
+///
+/// Leaves n as the count of samples handled, for the scalar loop to finish.
+BGEN_TARGET_AVX2
+static void phased_dosage_avx2(const char * packed, float * dose, std::uint32_t nrows,
+                               std::uint32_t bit_depth, float factor, std::uint32_t & n) {
+  const std::uint8_t * in = reinterpret_cast<const std::uint8_t *>(packed);
+  const __m256 scale = _mm256_set1_ps(factor);
+  if (bit_depth == 8) {
+    // the two haplotypes of 8 samples are interleaved in 16 bytes
+    const __m128i even = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+                                       -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i odd = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15,
+                                      -1, -1, -1, -1, -1, -1, -1, -1);
+    for (; n + 8 <= nrows; n += 8) {
+      __m128i raw = _mm_loadu_si128((const __m128i *) in);
+      __m256 first = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_shuffle_epi8(raw, even)));
+      __m256 second = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_shuffle_epi8(raw, odd)));
+      _mm256_storeu_ps(&dose[n], _mm256_add_ps(_mm256_mul_ps(first, scale),
+                                               _mm256_mul_ps(second, scale)));
+      in += 16;
+    }
+    return;
+  }
+  __m256i offsets, shifts, mask;
+  packed_lanes(bit_depth, offsets, shifts, mask);
+  // moves the first haplotypes of four samples to the low half, the second to the high
+  const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  for (; n + 8 <= nrows; n += 8) {
+    __m256 a = _mm256_permutevar8x32_ps(
+        scaled8_avx2(in, bit_depth, offsets, shifts, mask, scale), split);
+    __m256 b = _mm256_permutevar8x32_ps(
+        scaled8_avx2(in + bit_depth, bit_depth, offsets, shifts, mask, scale), split);
+    _mm256_storeu_ps(&dose[n], _mm256_add_ps(_mm256_permute2f128_ps(a, b, 0x20),
+                                             _mm256_permute2f128_ps(a, b, 0x31)));
+    in += 2 * bit_depth;
+  }
+}
+#endif
+
 /// calculate dosage of the reference (first) allele for all samples for phased genotpes
 ///
 /// The slow path, loops across samples. Figures out ploidy at each step,
@@ -1194,9 +2220,12 @@ void Genotypes::ref_dosage_slow_unphased(char * uncompressed, std::uint32_t idx,
 /// For the most part we just have to use the first allele for each haplotype for
 /// a sample. This assumes the first allele is for the ref genotype.
 ///
+/// Diploid biallelic samples are mostly handled by phased_dosage_avx2 first, or
+/// on aarch64 a NEON loop for 8 bit data, and this loop finishes the rest.
+///
 /// @param uncompressed char array of genotype probabilities (encoding depends on layout)
 /// @param idx uint index position in uncompressed where genotype probabilities start
-void Genotypes::ref_dosage_slow_phased(char * uncompressed, std::uint32_t idx, float * dose, std::uint32_t nrows) {
+void Genotypes::ref_dosage_slow_phased(const char * uncompressed, std::uint32_t idx, float * dose, std::uint32_t nrows) {
   std::uint32_t curr_ploidy = max_ploidy;
 
   std::uint32_t maxval = std::pow(2, (std::uint32_t) (bit_depth)) - 1;
@@ -1204,14 +2233,55 @@ void Genotypes::ref_dosage_slow_phased(char * uncompressed, std::uint32_t idx, f
   float prob;
   std::uint64_t probs_mask = std::uint64_t(0xFFFFFFFFFFFFFFFF) >> (64 - bit_depth);
   std::uint64_t bit_idx = 0;  // index position in bits
-  for (std::uint32_t n=0; n<nrows; n++) {
+  std::uint32_t n = 0;
+#if defined(__x86_64__) || defined(__aarch64__)
+  // diploid biallelic haplotypes store a value each, so samples are a fixed width and
+  // can be read several at a time
+  bool paired = constant_ploidy && (max_ploidy == 2) && (layout == 2) && (n_alleles == 2);
+#endif
+#if defined(__x86_64__)
+  if (paired && packed_depth_supported(bit_depth) && __builtin_cpu_supports("avx2")) {
+    phased_dosage_avx2(&uncompressed[idx], dose, nrows, bit_depth, factor, n);
+    bit_idx = (std::uint64_t) n * 2 * bit_depth;
+  } else if (!constant_ploidy && (max_ploidy <= 2) && (layout == 2) && (n_alleles == 2) &&
+             (bit_depth >= 1) && (bit_depth <= 25) && __builtin_cpu_supports("avx2")) {
+    // haploid and diploid samples mixed, as on chrX
+    varied_ploidy_dosage_avx2(&uncompressed[idx], ploidy.get(), dose, nrows, bit_depth,
+                              factor, true, n, bit_idx, probs_above_max);
+  }
+#elif defined(__aarch64__)
+  if (paired && (bit_depth == 8)) {
+    // as the AVX2 path: vld2q_u8 splits the two haplotypes of 16 samples, and each is
+    // scaled before they are summed, to match the loop below
+    const std::uint8_t * buff = reinterpret_cast<const std::uint8_t *>(&uncompressed[idx]);
+    float32x4_t k = vdupq_n_f32(factor);
+    for (; n + 16 <= nrows; n += 16) {
+      uint8x16x2_t haps = vld2q_u8(buff + n * 2);
+      uint16x8_t first_lo = vmovl_u8(vget_low_u8(haps.val[0]));
+      uint16x8_t first_hi = vmovl_u8(vget_high_u8(haps.val[0]));
+      uint16x8_t second_lo = vmovl_u8(vget_low_u8(haps.val[1]));
+      uint16x8_t second_hi = vmovl_u8(vget_high_u8(haps.val[1]));
+      uint16x4_t firsts[4] = {vget_low_u16(first_lo), vget_high_u16(first_lo),
+                              vget_low_u16(first_hi), vget_high_u16(first_hi)};
+      uint16x4_t seconds[4] = {vget_low_u16(second_lo), vget_high_u16(second_lo),
+                               vget_low_u16(second_hi), vget_high_u16(second_hi)};
+      for (int j = 0; j < 4; j++) {
+        float32x4_t a = vmulq_f32(vcvtq_f32_u32(vmovl_u16(firsts[j])), k);
+        float32x4_t b = vmulq_f32(vcvtq_f32_u32(vmovl_u16(seconds[j])), k);
+        vst1q_f32(dose + n + j * 4, vaddq_f32(a, b));
+      }
+    }
+    bit_idx = (std::uint64_t) n * 2 * bit_depth;
+  }
+#endif
+  for (; n<nrows; n++) {
     if (!constant_ploidy) {
       curr_ploidy = this->ploidy[n];
     }
     
     prob = 0;
     for (std::uint32_t i=0; i<curr_ploidy; i++) {
-      prob += ((*reinterpret_cast<const std::uint64_t* >(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask) * factor;
+      prob += ((load_unaligned<std::uint64_t>(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask) * factor;
       bit_idx += bit_depth;
     }
     dose[n] = prob;
@@ -1219,6 +2289,120 @@ void Genotypes::ref_dosage_slow_phased(char * uncompressed, std::uint32_t idx, f
   }
 }
 
+/// calculate dosage of the reference (first) allele for consecutive samples
+///
+/// @param uncompressed genotype data, either the whole block or a streamed window
+/// @param idx position in uncompressed where the samples start
+/// @param dose output for the first sample
+/// @param nrows number of samples
+void Genotypes::ref_dosage(const char * uncompressed, std::uint32_t idx, float * dose,
+                           std::uint32_t nrows) {
+  if (constant_ploidy & (max_probs == 3) & (bit_depth == 8) & (!phased)) {
+    // A fast path when we know the ploidy is constant and the bit depth is 8,
+    // this avoids the bit shifts/masks used in the variable bit_depth path.
+    ref_dosage_fast(uncompressed, idx, dose, nrows);
+  } else if (!phased) {
+    ref_dosage_slow_unphased(uncompressed, idx, dose, nrows);
+  } else {
+    ref_dosage_slow_phased(uncompressed, idx, dose, nrows);
+  }
+}
+
+/// calculate dosage of the reference (first) allele for only the selected samples
+///
+/// This covers every case the full cohort paths do (8 bit constant ploidy, any other
+/// bit depth or ploidy, phased or not, and layout 1) with one walk over the selected
+/// samples in ascending order. A biallelic sample stores one value per allele copy
+/// (or three 16 bit values in layout 1), so the bits between selected samples are
+/// skipped with a multiply when the ploidy is constant, or by summing the ploidy of
+/// the skipped samples otherwise. The arithmetic per sample is the same as in
+/// ref_dosage_fast and the two slow paths, so a sample gets the same dosage either way.
+///
+/// Only the selected samples are checked against the ploidy limit, so a subset which
+/// leaves out the polyploid samples of a variant can still have its dosage computed.
+///
+/// @param uncompressed char array of genotype probabilities
+/// @param idx position in uncompressed where genotype probabilities start
+/// @param dose output array, with one dosage per selected sample, in selection order
+void Genotypes::ref_dosage_subset(const char * uncompressed, std::uint32_t idx, float * dose) {
+  const std::vector<std::uint32_t> & sorted = subset->sorted;
+  const std::vector<std::uint32_t> & dest = subset->dest;
+  std::uint32_t n_sel = subset->size();
+  
+  if (constant_ploidy & (max_probs == 3) & (bit_depth == 8) & (!phased)) {
+    // every sample is two bytes, so each can be read directly
+    const std::uint8_t * in = reinterpret_cast<const std::uint8_t *>(&uncompressed[idx]);
+    for (std::uint32_t k=0; k<n_sel; k++) {
+      std::uint64_t pos = (std::uint64_t) sorted[k] * 2;
+      dose[dest[k]] = dosage_count8(in[pos], in[pos + 1], probs_above_max) * (1.0f / 255.0f);
+    }
+    return;
+  }
+  
+  std::uint32_t maxval = std::pow(2, (std::uint32_t) (bit_depth)) - 1;
+  float factor = (layout == 2) ? 1.0f / (float) maxval : 1.0f / 32768;
+  std::uint64_t probs_mask = std::uint64_t(0xFFFFFFFFFFFFFFFF) >> (64 - bit_depth);
+  // layout 1 stores all three probabilities of a diploid, layout 2 one per allele copy
+  auto sample_bits = [this] (std::uint32_t ploid) -> std::uint64_t {
+    return (layout == 1) ? 48 : (std::uint64_t) ploid * bit_depth;
+  };
+  
+  std::uint64_t bit_idx = 0;
+  std::uint32_t next = 0;  // cohort index of the sample starting at bit_idx
+  for (std::uint32_t k=0; k<n_sel; k++) {
+    std::uint32_t s = sorted[k];
+    if (constant_ploidy) {
+      bit_idx += (std::uint64_t) (s - next) * sample_bits(max_ploidy);
+    } else {
+      for (; next < s; next++) {
+        bit_idx += sample_bits(ploidy[next]);
+      }
+    }
+    next = s + 1;
+    std::uint32_t curr_ploidy = constant_ploidy ? max_ploidy : ploidy[s];
+    std::uint64_t end_idx = bit_idx + sample_bits(curr_ploidy);
+    float * out = &dose[dest[k]];
+    
+    if (phased) {
+      float prob = 0;
+      for (std::uint32_t i=0; i<curr_ploidy; i++) {
+        prob += ((load_unaligned<std::uint64_t>(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask) * factor;
+        bit_idx += bit_depth;
+      }
+      *out = prob;
+    } else {
+      // as for ref_dosage_slow_unphased
+      std::uint32_t half_ploidy = curr_ploidy / 2;
+      if (curr_ploidy > 2) {
+        throw std::invalid_argument("cannot compute dosage with ploidy > 2");
+      }
+      if (curr_ploidy == 0) {
+        *out = 0.0f;
+        continue;
+      }
+      std::int64_t hom = ((load_unaligned<std::uint64_t>(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask);
+      bit_idx += bit_depth;
+      std::int64_t het = 0;
+      if (curr_ploidy == 2) {
+        het = ((load_unaligned<std::uint64_t>(&uncompressed[idx + bit_idx / 8]) >> bit_idx % 8) & probs_mask);
+        bit_idx += bit_depth;
+      }
+      *out = ((hom * curr_ploidy) + het * half_ploidy) * factor;
+      if ((layout == 2) && ((std::uint64_t) (hom + het) > probs_mask)) {
+        *out = curr_ploidy;
+        probs_above_max = true;
+      }
+      if (layout == 1) {
+        std::uint32_t hom_alt = load_unaligned<std::uint16_t>(&uncompressed[idx + bit_idx / 8]);
+        if ((hom == 0) & (het == 0) & (hom_alt == 0)) {
+          missing.push_back(s);
+        }
+      }
+    }
+    bit_idx = end_idx;
+  }
+}
+
 #if defined(__x86_64__)
 // the AVX half of swap_allele_dosage_simple below. This only needs AVX, not
 // AVX2, and is compiled in isolation so it is only ever entered after a runtime
@@ -1242,6 +2426,7 @@ static void swap_dosage_avx(float * dose, std::uint32_t & n_samples,
 /// This uses AVX and NEON vectorization to speed up calculations on relevant
 /// x86_64 and aarch64 hardware
 void Genotypes::swap_allele_dosage_simple(float * dose) {
+  std::uint32_t n_samples = n_out();
   std::uint32_t n=0;
 #if defined(__x86_64__)
   if (__builtin_cpu_supports("avx")) {
@@ -1270,6 +2455,7 @@ void Genotypes::swap_allele_dosage_simple(float * dose) {
 ///
 /// This replaces the values in the dose array with ploidy - value.
 void Genotypes::swap_allele_dosage_complex(float * dose) {
+  std::uint32_t n_samples = n_out();
   // reached when the ploidy varies or is not 2, so read the array only in the former case
   if (constant_ploidy) {
     float ploid = (float) max_ploidy;
@@ -1278,8 +2464,46 @@ void Genotypes::swap_allele_dosage_complex(float * dose) {
     }
     return;
   }
+  if (!subset) {
+    // without the subset lookup this vectorises, which matters on chrX, where every
+    // variant has a varying ploidy
+    const std::uint8_t * ploid = this->ploidy.get();
+    for (std::uint32_t n=0; n<n_samples; n++) {
+      dose[n] = (float) ploid[n] - dose[n];
+    }
+    return;
+  }
   for (std::uint32_t n=0; n<n_samples; n++) {
-    dose[n] = (float) (this->ploidy[n]) - dose[n];
+    dose[n] = (float) (this->ploidy[sample_at(n)]) - dose[n];
+  }
+}
+
+/// restrict the decoded output to a subset of samples, or to every sample if empty
+///
+/// The minor allele depends on which samples are counted, so any earlier answer is
+/// dropped.
+void Genotypes::select_samples(std::shared_ptr<const SampleSubset> _subset) {
+  if (_subset && (_subset->n_samples != n_samples)) {
+    throw std::invalid_argument("sample subset is for " +
+                                std::to_string(_subset->n_samples) +
+                                " samples, but the variant has " +
+                                std::to_string(n_samples));
+  }
+  subset = _subset;
+  minor_known = false;
+}
+
+/// copy out the ploidy of each sample which is written out, in output order
+///
+/// @param out array with room for n_out() values
+void Genotypes::selected_ploidy(std::uint8_t * out) {
+  std::uint32_t n = n_out();
+  if (constant_ploidy) {
+    std::memset(out, max_ploidy, n);
+    return;
+  }
+  for (std::uint32_t i=0; i<n; i++) {
+    out[i] = ploidy[sample_at(i)];
   }
 }
 
@@ -1293,7 +2517,7 @@ void Genotypes::swap_allele_dosage_complex(float * dose) {
 /// @return index into alleles of the minor allele (0 or 1)
 int Genotypes::get_minor_idx() {
   if (!minor_known) {
-    std::unique_ptr<float[]> dose(new float[n_samples]);
+    PooledArray<float> dose(n_out());
     // this sets minor_idx, and the dosages themselves are not needed
     get_allele_dosage(dose.get(), true, false);
   }
@@ -1327,25 +2551,43 @@ void Genotypes::get_allele_dosage(float * dose, bool use_alt, bool use_minor) {
     missing.clear();
   }
   
+  if (streaming && (subset || !constant_ploidy)) {
+    // as in probabilities, these need the whole block
+    unstream();
+  }
+  
   // calculate the dosage for the first allele for all samples
-  if (constant_ploidy & (max_probs == 3) & (bit_depth == 8) & (!phased)) {
-    // A fast path when we know the ploidy is constant and the bit depth is 8,
-    // this avoids the bit shifts/masks used in the variable bit_depth path.
-    ref_dosage_fast(uncompressed.get(), idx, dose, n_samples);
+  if (subset) {
+    ref_dosage_subset(block, idx, dose);
+  } else if (streaming) {
+    stream_samples([&](const char * window, std::uint32_t start, std::uint32_t n) {
+      std::size_t found = missing.size();
+      ref_dosage(window, 0, dose + start, n);
+      // layout 1 spots missing samples as it goes, by their place in the window
+      for (; found < missing.size(); found++) {
+        missing[found] += start;
+      }
+    });
   } else {
-    if (!phased) {
-      ref_dosage_slow_unphased(uncompressed.get(), idx, dose, n_samples);
-    } else {
-      ref_dosage_slow_phased(uncompressed.get(), idx, dose, n_samples);
-    }
+    ref_dosage(block, idx, dose, n_samples);
   }
   
   // Mark the missing samples before finding the minor allele, so they are left out
   // of the frequency - their zeroed dosages would otherwise pull it towards zero
   // and can flip which allele looks minor. The swaps below carry nans through
   // unchanged, since both subtract the dosage from a number.
-  for (auto n: missing) {
-    dose[n] = std::nanf("1");
+  if (subset) {
+    // missing holds cohort indices, so find where each one went, if it was selected
+    for (auto n: missing) {
+      std::uint32_t column = subset->column[n];
+      if (column != NOT_SELECTED) {
+        dose[column] = std::nanf("1");
+      }
+    }
+  } else {
+    for (auto n: missing) {
+      dose[n] = std::nanf("1");
+    }
   }
   
   minor_idx = find_minor_allele(dose);
@@ -1359,4 +2601,360 @@ void Genotypes::get_allele_dosage(float * dose, bool use_alt, bool use_minor) {
   } 
 }
 
+/// @brief a sample's probabilities by count of alt alleles
+///
+/// Unphased rows already hold these. Phased diploid samples get them from the
+/// product of their two haplotypes.
+///
+/// @param probs the sample's probabilities, a row for unphased data, or a row per
+///     haplotype for phased data
+/// @param ploidy the sample's ploidy, 1 or 2
+/// @param phased whether the rows are haplotypes
+/// @param geno room for three probabilities, used if they need working out
+/// @return the probabilities, which is either probs or geno
+static inline const float * genotype_probs(const float * probs, int ploidy, bool phased,
+                                           float * geno) {
+  if (phased && (ploidy == 2)) {
+    geno[0] = probs[0] * probs[2];
+    geno[1] = probs[0] * probs[3] + probs[1] * probs[2];
+    geno[2] = probs[1] * probs[3];
+    return geno;
+  }
+  return probs;
+}
+
+/// @brief the most likely alt allele count of one sample, or -1
+///
+/// @param probs the sample's probabilities, a row for unphased data, or a row per
+///     haplotype for phased data
+/// @param ploidy the sample's ploidy, at most 2
+/// @param phased whether the rows are haplotypes
+/// @param threshold lowest probability a genotype is called at
+static inline std::int8_t hard_call(const float * probs, int ploidy, bool phased,
+                                    float threshold) {
+  if (ploidy == 0) {
+    return -1;
+  }
+  float geno[3];
+  const float * p = genotype_probs(probs, ploidy, phased, geno);
+  std::int8_t best = 0;
+  float top = p[0];
+  for (int i = 1; i <= ploidy; i++) {
+    if (p[i] > top) {
+      top = p[i];
+      best = (std::int8_t) i;
+    }
+  }
+  // a missing sample's nans fail this, so it is not called
+  return (top >= threshold) ? best : -1;
+}
+
+#if defined(__x86_64__)
+/// @brief AVX2 half of calling unphased diploid genotypes from their probabilities
+///
+/// Gathers the three probabilities of eight samples into a register each, then
+/// picks the largest as hard_call does, with the same comparisons, so nans and ties
+/// come out the same.
+///
+/// Leaves n as the count of samples handled, for the scalar tail to finish.
+BGEN_TARGET_AVX2
+static void diploid_calls_avx2(const float * probs, std::int8_t * calls,
+                               std::uint32_t nrows, float threshold,
+                               std::uint32_t & n) {
+  const __m256i stride = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+  const __m256 limit = _mm256_set1_ps(threshold);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i two = _mm256_set1_epi32(2);
+  const __m256i none = _mm256_set1_epi32(-1);
+  for (; n + 8 <= nrows; n += 8) {
+    const float * row = &probs[n * 3];
+    __m256 p0 = _mm256_i32gather_ps(row, stride, 4);
+    __m256 p1 = _mm256_i32gather_ps(row + 1, stride, 4);
+    __m256 p2 = _mm256_i32gather_ps(row + 2, stride, 4);
+    
+    __m256 second = _mm256_cmp_ps(p1, p0, _CMP_GT_OQ);
+    __m256 top = _mm256_blendv_ps(p0, p1, second);
+    __m256i best = _mm256_and_si256(_mm256_castps_si256(second), one);
+    __m256 third = _mm256_cmp_ps(p2, top, _CMP_GT_OQ);
+    top = _mm256_blendv_ps(top, p2, third);
+    best = _mm256_blendv_epi8(best, two, _mm256_castps_si256(third));
+    __m256 called = _mm256_cmp_ps(top, limit, _CMP_GE_OQ);
+    best = _mm256_blendv_epi8(none, best, _mm256_castps_si256(called));
+    
+    // narrow the eight 32 bit calls to bytes, which saturating packs keep in order
+    __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(best),
+                                    _mm256_extracti128_si256(best, 1));
+    _mm_storel_epi64((__m128i *) &calls[n], _mm_packs_epi16(words, words));
+  }
+}
+#endif
+
+/// call genotypes from decoded probabilities, laid out as probabilities() gives them
+///
+/// @param probs decoded probabilities of n samples
+/// @param ploid ploidy of each sample, or nullptr if all have the maximum ploidy
+/// @param n number of samples
+/// @param threshold lowest probability a genotype is called at
+/// @param calls output, one per sample
+void Genotypes::call_rows(const float * probs, const std::uint8_t * ploid,
+                          std::uint32_t n, float threshold, std::int8_t * calls) {
+  if (!phased && !ploid && (max_ploidy == 2)) {
+    // most variants are this, so it gets a vectorised path
+    std::uint32_t i = 0;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+      diploid_calls_avx2(probs, calls, n, threshold, i);
+    }
+#endif
+    for (; i<n; i++) {
+      calls[i] = hard_call(&probs[i * 3], 2, false, threshold);
+    }
+    return;
+  }
+  std::uint64_t offset = 0;
+  for (std::uint32_t i=0; i<n; i++) {
+    int p = ploid ? ploid[i] : max_ploidy;
+    calls[i] = hard_call(&probs[offset], p, phased, threshold);
+    offset += phased ? (std::uint64_t) p * max_probs : max_probs;
+  }
+}
+
+/// decode consecutive samples a chunk at a time, and hand each chunk on
+///
+/// Each chunk is decoded by the same kernels as probabilities(), into a scratch
+/// buffer small enough to stay in cache, for use to turn into some other output
+/// while it is there. This needs every sample to take the same number of bits, so
+/// the chunks start on whole bytes.
+///
+/// @param uncompressed genotype data, either the whole block or a streamed window
+/// @param idx position in uncompressed of the first sample
+/// @param first index of the first sample in the cohort
+/// @param n number of samples
+/// @param scratch room for the probabilities of DECODE_CHUNK samples
+/// @param use called with the decoded probabilities, and the cohort index and count
+///     of the samples they hold
+template <typename Use>
+void Genotypes::decode_chunks(const char * uncompressed, std::uint32_t idx,
+                              std::uint32_t first, std::uint32_t n, float * scratch,
+                              Use use) {
+  std::uint64_t bits = sample_bits();
+  std::uint32_t rows = phased ? max_ploidy : 1;
+  for (std::uint32_t start=0; start<n; start+=DECODE_CHUNK) {
+    std::uint32_t chunk = std::min(DECODE_CHUNK, n - start);
+    std::uint32_t at = idx + (std::uint32_t) (start / 8 * bits);
+    probabilities_rows(uncompressed, at, scratch, chunk * rows);
+    use(scratch, first + start, chunk);
+  }
+}
+
+/// decode every sample a chunk at a time, from the whole block or a stream
+///
+/// Only for variants where every sample has the same ploidy, and all are wanted.
+/// Missing samples are set to nan before use sees them, as probabilities() does.
+template <typename Use>
+void Genotypes::decode_all_chunks(Use use) {
+  // as in probabilities, cleared per decode rather than latched across calls
+  probs_above_max = false;
+  std::uint32_t rows = phased ? max_ploidy : 1;
+  std::uint64_t width = (std::uint64_t) rows * max_probs;
+  PooledArray<float> scratch((std::uint64_t) DECODE_CHUNK * width);
+  // missing holds samples in ascending order, so step through it chunk by chunk.
+  // Layout 1 finds its missing samples as it decodes, and nans them itself
+  std::size_t next = 0;
+  auto mark_then_use = [&](float * probs, std::uint32_t start, std::uint32_t n) {
+    if (layout == 2) {
+      for (; (next < missing.size()) && (missing[next] < start + n); next++) {
+        float * row = &probs[(missing[next] - start) * width];
+        std::fill(row, row + width, std::nanf("1"));
+      }
+    }
+    use(probs, start, n);
+  };
+  if (streaming) {
+    stream_samples([&](const char * window, std::uint32_t start, std::uint32_t n) {
+      decode_chunks(window, 0, start, n, scratch.get(), mark_then_use);
+    });
+  } else {
+    decode_chunks(block, idx, 0, n_samples, scratch.get(), mark_then_use);
+  }
+}
+
+/// @brief hard call the genotype of every sample, as a count of alt alleles
+///
+/// A sample is called with its most likely genotype, if that has a probability of at
+/// least the threshold. Phased samples are called from the genotype probabilities
+/// their haplotypes give. Ties go to the genotype with fewer alt alleles.
+///
+/// @param calls output, with 0, 1 or 2 per sample (0 or 1 for haploid samples), and
+///     -1 for samples which are missing, have a ploidy of zero, or fall short of the
+///     threshold
+/// @param threshold lowest probability a genotype is called at
+void Genotypes::hard_calls(std::int8_t * calls, float threshold) {
+  load_data_and_parse_header();
+  
+  if (n_alleles != 2) {
+    throw std::invalid_argument("can't get hard calls for non-biallelic var.");
+  }
+  if (max_ploidy > 2) {
+    throw std::invalid_argument("cannot compute hard calls with ploidy > 2");
+  }
+  
+  if (subset || !constant_ploidy) {
+    // the rows have no fixed size, or only some samples are wanted, so decode every
+    // probability first, as those paths already handle both
+    std::uint32_t n = n_out();
+    PooledArray<std::uint8_t> ploid(n);
+    selected_ploidy(ploid.get());
+    std::uint64_t rows = phased ? fast_ploidy_sum(ploid.get(), n) : n;
+    PooledArray<float> probs(rows * max_probs);
+    probabilities(probs.get());
+    call_rows(probs.get(), ploid.get(), n, threshold, calls);
+    return;
+  }
+  
+  decode_all_chunks([&](float * probs, std::uint32_t start, std::uint32_t n) {
+    call_rows(probs, nullptr, n, threshold, &calls[start]);
+  });
+}
+
+/// add decoded samples to running sums for their variant's statistics
+///
+/// @param probs probabilities of n samples, as probabilities() lays them out
+/// @param ploid ploidy of each sample, or nullptr if they all have max_ploidy
+/// @param n number of samples
+/// @param threshold lowest probability a genotype is hard called at
+/// @param sums sums to add to
+void Genotypes::stats_rows(const float * probs, const std::uint8_t * ploid,
+                           std::uint32_t n, float threshold, StatsSums & sums) {
+  float geno[3];
+  std::uint64_t offset = 0;
+  for (std::uint32_t i=0; i<n; i++) {
+    int p = ploid ? ploid[i] : max_ploidy;
+    const float * row = &probs[offset];
+    offset += phased ? (std::uint64_t) p * max_probs : max_probs;
+    if ((p == 0) || std::isnan(row[0])) {
+      sums.missing++;
+      continue;
+    }
+    sums.add(genotype_probs(row, p, phased, geno), p, threshold);
+  }
+}
+
+/// @brief quality control statistics of the variant, from one pass over its samples
+///
+/// The sums are taken a decode chunk at a time, so no array of every sample's
+/// probabilities is made, except for subsets and variable ploidy, as in hard_calls.
+///
+/// @param stats output. Left with its defaults for variants with more than two
+///     alleles, or ploidy above 2.
+/// @param threshold lowest probability a genotype is hard called at, for the
+///     genotype counts and the Hardy-Weinberg test
+void Genotypes::variant_stats(VariantStats & stats, float threshold) {
+  load_data_and_parse_header();
+  if ((n_alleles != 2) || (max_ploidy > 2)) {
+    return;
+  }
+  
+  StatsSums sums;
+  if (subset || !constant_ploidy) {
+    std::uint32_t n = n_out();
+    PooledArray<std::uint8_t> ploid(n);
+    selected_ploidy(ploid.get());
+    std::uint64_t rows = phased ? fast_ploidy_sum(ploid.get(), n) : n;
+    PooledArray<float> probs(rows * max_probs);
+    probabilities(probs.get());
+    stats_rows(probs.get(), ploid.get(), n, threshold, sums);
+  } else {
+    decode_all_chunks([&](float * probs, std::uint32_t /*start*/, std::uint32_t n) {
+      stats_rows(probs, nullptr, n, threshold, sums);
+    });
+  }
+  sums.finish(stats, n_out());
+}
+
+/// @brief decode the probabilities into a narrower output type than float32
+///
+/// Samples are decoded a chunk at a time and converted while in cache, so no
+/// float32 array of the whole variant is made, where that is possible. Subsets and
+/// variable ploidy decode to float32 first.
+///
+/// @param out output, laid out as probabilities() lays out its floats
+/// @param type one of OutputType
+void Genotypes::probabilities_as(void * out, int type) {
+  if (type == FLOAT32) {
+    probabilities(reinterpret_cast<float *>(out));
+    return;
+  }
+  load_data_and_parse_header();
+  std::uint32_t size = output_size(type);
+  
+  if (subset || !constant_ploidy) {
+    std::uint32_t n = n_out();
+    std::uint64_t rows = n;
+    if (phased) {
+      PooledArray<std::uint8_t> ploid(n);
+      selected_ploidy(ploid.get());
+      rows = fast_ploidy_sum(ploid.get(), n);
+    }
+    PooledArray<float> probs(rows * max_probs);
+    probabilities(probs.get());
+    convert_floats(probs.get(), out, rows * max_probs, type, 1.0f);
+    return;
+  }
+  
+  std::uint64_t width = (std::uint64_t) (phased ? max_ploidy : 1) * max_probs;
+  char * dest = reinterpret_cast<char *>(out);
+  decode_all_chunks([&](float * probs, std::uint32_t start, std::uint32_t n) {
+    convert_floats(probs, dest + start * width * size, n * width, type, 1.0f);
+  });
+}
+
+/// @brief flag which samples are missing, for outputs without a missing value
+///
+/// Layout 2 stores missingness beside each sample's ploidy, which the header parse
+/// has already scanned. Layout 1 only marks a missing sample by zeroing all its
+/// probabilities, so those have to be decoded to find them.
+///
+/// @param out output, with 1 for each missing sample and 0 otherwise
+void Genotypes::missing_samples(std::uint8_t * out) {
+  load_data_and_parse_header();
+  std::uint32_t n = n_out();
+  if (layout == 1) {
+    PooledArray<float> probs((std::uint64_t) n * max_probs);
+    probabilities(probs.get());
+    for (std::uint32_t i = 0; i < n; i++) {
+      out[i] = std::isnan(probs[(std::uint64_t) i * max_probs]);
+    }
+    return;
+  }
+  std::fill(out, out + n, 0);
+  // missing holds cohort indices, so find where each one went, if it was selected
+  for (auto s: missing) {
+    std::uint32_t column = subset ? subset->column[s] : s;
+    if (column != NOT_SELECTED) {
+      out[column] = 1;
+    }
+  }
+}
+
+/// @brief decode allele dosages into a narrower output type than float32
+///
+/// The minor allele is found from the dosages of every sample, so these are decoded
+/// to float32 in full first, then converted.
+///
+/// @param out output with room for a value per sample
+/// @param type one of OutputType
+/// @param use_alt whether to give the alt allele dosage
+/// @param use_minor whether to give the minor allele dosage
+void Genotypes::allele_dosage_as(void * out, int type, bool use_alt, bool use_minor) {
+  if (type == FLOAT32) {
+    get_allele_dosage(reinterpret_cast<float *>(out), use_alt, use_minor);
+    return;
+  }
+  std::uint32_t n = n_out();
+  PooledArray<float> dose(n);
+  get_allele_dosage(dose.get(), use_alt, use_minor);
+  convert_floats(dose.get(), out, n, type, 2.0f);
+}
+
 } //namespace bgen
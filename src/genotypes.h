@@ -9,6 +9,14 @@
 #include <string>
 #include <sstream>
 
+#include "blockcache.h"
+#include "blockstream.h"
+#include "buffers.h"
+#include "convert.h"
+#include "mapped.h"
+#include "samples.h"
+#include "stats.h"
+
 namespace bgen {
 
 /// bytes of padding to allocate past the end of the decompressed genotype data
@@ -19,13 +27,27 @@ namespace bgen {
 /// run past the end of the buffer.
 const std::uint32_t PROBS_READ_PAD = 8;
 
+/// bytes of a decompressed genotype block decoded at a time, when it is streamed
+///
+/// Sized to sit in L2 beside the stretch of output it decodes into.
+const std::uint32_t STREAM_WINDOW = 256 * 1024;
+
+/// samples decoded at a time when turning probabilities into some other output, a
+/// multiple of eight so each chunk starts on a byte. Three floats a sample keeps the
+/// scratch buffer at 48 kB.
+const std::uint32_t DECODE_CHUNK = 4096;
+
+void set_stream_threshold(std::uint64_t bytes);
+std::uint64_t stream_threshold();
+
 /// genotype data for one variant, which owns its decompressed buffers
 ///
-/// The buffers are held in unique_ptrs, so a Genotypes can be moved but not
+/// The buffers are held in PooledArrays, so a Genotypes can be moved but not
 /// copied. That matters because a Variant holds one of these by value, and
-/// parse_all_variants moves Variants into a vector. Owning the buffers through
-/// raw pointers instead would let a copy duplicate them, and both copies would
-/// then free the same memory.
+/// Variants are moved about, e.g. returned from CppBgenReader::get, and handed
+/// from the prefetch threads to the caller through their slots. Owning the
+/// buffers through raw pointers instead would let a copy duplicate them, and both
+/// copies would then free the same memory.
 class Genotypes {
 public:
   Genotypes() {}
@@ -45,14 +67,27 @@ public:
       file_offset = _offset;
       length = _length;
       is_stdin = _is_stdin;
+      mapped = is_stdin ? nullptr : as_mapped(handle.get());
       if (is_stdin) {
         load_data_and_parse_header();
       }
     }
-  void load_data_and_parse_header();
+  void read_block();
+  void load_data_and_parse_header(bool whole=false);
+  void rebind(std::shared_ptr<std::istream> _handle);
   void probabilities(float * probs);
   void get_allele_dosage(float * dose, bool use_alt=true, bool use_minor=false);
+  void hard_calls(std::int8_t * calls, float threshold);
+  void missing_samples(std::uint8_t * out);
+  void variant_stats(VariantStats & stats, float threshold);
+  void probabilities_as(void * out, int type);
+  void allele_dosage_as(void * out, int type, bool use_alt=true, bool use_minor=false);
   int get_minor_idx();
+  void select_samples(std::shared_ptr<const SampleSubset> _subset);
+  void use_cache(std::shared_ptr<BlockCache> _cache) { cache = _cache; }
+  void selected_ploidy(std::uint8_t * out);
+  // number of samples the decoders write out, which is the subset size if one is set
+  std::uint32_t n_out() const { return subset ? subset->size() : n_samples; }
   bool phased=false;
   std::uint32_t max_probs=0;
   int min_ploidy=0;
@@ -63,21 +98,39 @@ public:
   // not stored but inferred as the remainder, so an over-large sum makes it negative. The
   // negative values are clamped to zero.
   bool probs_above_max = false;
-  std::unique_ptr<std::uint8_t[]> ploidy;
+  PooledArray<std::uint8_t> ploidy;
   // fills the ploidy array when every sample shares a ploidy, in which case parse_ploidy
   // leaves it empty. Public because variant.cpp hands the array out to callers
   void materialise_ploidy();
 private:
-  void decompress();
+  void decompress(bool whole=false);
+  void unpack(const char * data, std::uint32_t compressed_len, std::uint32_t decompressed_len);
+  bool stream_wanted();
+  void start_stream();
+  void unstream();
+  template <typename Decode>
+  void stream_samples(Decode decode);
+  std::uint64_t sample_bits();
   void parse_ploidy();
   std::uint64_t probability_bytes();
   void check_block_size();
-  void probabilities_layout1(char * uncompressed, std::uint32_t idx, float * probs, std::uint32_t & nrows);
-  void probabilities_layout2(char * uncompressed, std::uint32_t idx, float * probs, std::uint32_t & nrows);
-  void fast_haplotype_probs(char * uncompressed, std::uint32_t idx, float * probs, std::uint32_t & nrows);
-  void ref_dosage_fast(char * uncompressed, std::uint32_t idx, float * dose, std::uint32_t nrows);
-  void ref_dosage_slow_unphased(char * uncompressed, std::uint32_t idx, float * dose, std::uint32_t nrows);
-  void ref_dosage_slow_phased(char * uncompressed, std::uint32_t idx, float * dose, std::uint32_t nrows);
+  void probabilities_layout1(const char * uncompressed, std::uint32_t idx, float * probs, std::uint32_t & nrows);
+  void probabilities_layout2(const char * uncompressed, std::uint32_t idx, float * probs, std::uint32_t & nrows);
+  void probabilities_rows(const char * uncompressed, std::uint32_t idx, float * probs, std::uint32_t nrows);
+  void mark_missing_probs(float * probs);
+  void ref_dosage(const char * uncompressed, std::uint32_t idx, float * dose, std::uint32_t nrows);
+  void fast_haplotype_probs(const char * uncompressed, std::uint32_t idx, float * probs, std::uint32_t & nrows);
+  void ref_dosage_fast(const char * uncompressed, std::uint32_t idx, float * dose, std::uint32_t nrows);
+  void ref_dosage_slow_unphased(const char * uncompressed, std::uint32_t idx, float * dose, std::uint32_t nrows);
+  void ref_dosage_slow_phased(const char * uncompressed, std::uint32_t idx, float * dose, std::uint32_t nrows);
+  void probabilities_subset(const char * uncompressed, std::uint32_t idx, float * probs);
+  void ref_dosage_subset(const char * uncompressed, std::uint32_t idx, float * dose);
+  void call_rows(const float * probs, const std::uint8_t * ploid, std::uint32_t n, float threshold, std::int8_t * calls);
+  void stats_rows(const float * probs, const std::uint8_t * ploid, std::uint32_t n, float threshold, StatsSums & sums);
+  template <typename Use>
+  void decode_chunks(const char * uncompressed, std::uint32_t idx, std::uint32_t first, std::uint32_t n, float * scratch, Use use);
+  template <typename Use>
+  void decode_all_chunks(Use use);
   void swap_allele_dosage_simple(float * dose);
   void swap_allele_dosage_complex(float * dose);
   int find_minor_allele(float * dose);
@@ -89,9 +142,39 @@ private:
   std::uint64_t file_offset = 0;
   std::uint32_t length = 0;
   bool is_stdin = false;
+  // the mapping under the bgen stream, if the reader opened one. The genotype block
+  // is then taken straight from memory rather than seeking and reading the stream.
+  const MappedFile * mapped = nullptr;
   std::uint32_t bit_depth=0;
   std::uint32_t idx=0;
-  std::unique_ptr<char[]> uncompressed;
+  PooledArray<char> uncompressed;
+  // the decompressed genotype block. This normally points into uncompressed, but
+  // for an uncompressed bgen read through a mapping it points straight into the
+  // mapping instead, and uncompressed is left empty.
+  const char * block = nullptr;
+  std::shared_ptr<const MappedRegion> pinned;
+  // blocks decompressed by the other variants from the same reader, if it keeps any
+  std::shared_ptr<BlockCache> cache;
+  // the decompressed block when it is shared with the cache. block then points into
+  // this rather than into uncompressed.
+  std::shared_ptr<const CachedBlock> shared_block;
+  // the genotype block as stored in the bgen, once read_block has fetched it but
+  // before it is decompressed. This points into stored_buffer for a stream, or into
+  // the mapping for a mapped bgen.
+  const char * stored = nullptr;
+  PooledArray<char> stored_buffer;
+  std::uint32_t stored_len = 0;
+  std::uint32_t expanded_len = 0;
+  bool is_read = false;
+  // whether the stored bytes are uncompressed and can be decoded where they sit
+  bool in_place = false;
+  // whether the block is decompressed a window at a time as it is decoded, rather
+  // than all at once. block then holds only the header, and the stored bytes are
+  // kept, since each decode streams them afresh. See stream_wanted
+  bool streaming = false;
+  // the block part way through, left just past the header by start_stream so the
+  // first decode carries on from there rather than decompressing the header again
+  std::unique_ptr<BlockStream> stream;
   // size of the decompressed genotype block, so that the reads below can be
   // bounded by the data which is actually present. The block length comes from
   // the bgen itself, so it cannot be assumed to match what the other header
@@ -111,6 +194,10 @@ private:
   // list as it goes.
   bool minor_known = false;
   std::vector<std::uint32_t> missing;
+  // samples to restrict the output to, or empty to output every sample
+  std::shared_ptr<const SampleSubset> subset;
+  // cohort index of the sample in output position n
+  std::uint32_t sample_at(std::uint32_t n) const { return subset ? subset->indices[n] : n; }
 };
 
 std::uint32_t get_max_probs(int &max_ploidy, int &n_alleles, bool &phased);
@@ -0,0 +1,238 @@
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "grm.h"
+#include "utils.h"
+
+#if defined(__x86_64__)
+  #include <immintrin.h>
+#endif
+
+namespace bgen {
+
+/// @brief how to standardize a variant's dosages, for the GRM
+///
+/// Dosages are centred on twice the alt allele frequency, and scaled by the
+/// binomial standard deviation, as in GCTA.
+///
+/// @param dose alt allele dosages, with nans for missing samples
+/// @param n number of samples
+/// @param mean output, for the mean dosage of the samples which are not missing
+/// @param scale output, for one over the standard deviation
+/// @return whether the variant can be standardized, which needs some samples that
+///     are not missing, and both alleles present
+bool standard_scale(const float * dose, std::uint32_t n, float & mean, float & scale) {
+  double sum = 0;
+  std::uint32_t observed = 0;
+  for (std::uint32_t i=0; i<n; i++) {
+    if (!std::isnan(dose[i])) {
+      sum += dose[i];
+      observed++;
+    }
+  }
+  if (observed == 0) {
+    return false;
+  }
+  double freq = sum / observed / 2;
+  double variance = 2 * freq * (1 - freq);
+  if (!(variance > 0)) {
+    return false;
+  }
+  mean = (float) (2 * freq);
+  scale = (float) (1 / std::sqrt(variance));
+  return true;
+}
+
+/// standardize dosages, with missing samples set to zero (the mean)
+void standardize(const float * dose, std::uint32_t n, float mean, float scale,
+                 float * out) {
+  for (std::uint32_t i=0; i<n; i++) {
+    out[i] = std::isnan(dose[i]) ? 0.0f : (dose[i] - mean) * scale;
+  }
+}
+
+/// @brief add the products of a block of terms to a tile, one element at a time
+///
+/// Uses fused multiply-adds, in term order, as the FMA version does, so both give
+/// the same floats.
+static void accumulate_scalar(const float * zi, const float * zj, std::uint32_t n_terms,
+                              std::uint64_t term_stride, std::uint64_t item_stride,
+                              std::uint32_t rows, std::uint32_t cols, double * tile,
+                              std::uint64_t tile_stride, bool upper,
+                              std::uint32_t first_row) {
+  for (std::uint32_t i=0; i<rows; i++) {
+    for (std::uint32_t j = upper ? std::min(cols, first_row + i) : 0; j<cols; j++) {
+      float acc = 0;
+      for (std::uint32_t t=0; t<n_terms; t++) {
+        acc = std::fma(zi[t * term_stride + i * item_stride],
+                       zj[t * term_stride + j * item_stride], acc);
+      }
+      tile[i * tile_stride + j] += acc;
+    }
+  }
+}
+
+#if defined(__x86_64__)
+// add a float32 row of 8 sums to 8 doubles of the tile
+BGEN_TARGET_FMA
+static inline void add_to_tile(double * tile, __m256 acc) {
+  __m256d low = _mm256_cvtps_pd(_mm256_castps256_ps128(acc));
+  __m256d high = _mm256_cvtps_pd(_mm256_extractf128_ps(acc, 1));
+  _mm256_storeu_pd(tile, _mm256_add_pd(_mm256_loadu_pd(tile), low));
+  _mm256_storeu_pd(&tile[4], _mm256_add_pd(_mm256_loadu_pd(&tile[4]), high));
+}
+
+// copy some items of a block into a panel, term by term, so the kernel reads it in
+// order. Items past the end are zero, so panels are always full width
+static void pack_panel(const float * z, std::uint32_t n_terms, std::uint64_t term_stride,
+                       std::uint64_t item_stride, std::uint32_t start, std::uint32_t n,
+                       std::uint32_t width, float * panel) {
+  for (std::uint32_t t=0; t<n_terms; t++) {
+    const float * items = &z[t * term_stride + start * item_stride];
+    float * out = &panel[(std::uint64_t) t * width];
+    std::uint32_t k = 0;
+    for (; k<n; k++) {
+      out[k] = items[k * item_stride];
+    }
+    for (; k<width; k++) {
+      out[k] = 0;
+    }
+  }
+}
+
+// the FMA half of accumulate_products. Works on 6 x 16 blocks of the tile, from
+// panels packed so each term's 6 row items and 16 column items sit together, which
+// keeps 12 accumulators, the two column vectors and a broadcast in the 16 registers.
+// Each element sums its products in term order, as accumulate_scalar does.
+static const std::uint32_t GROUP = 6;
+
+BGEN_TARGET_FMA
+static void accumulate_fma(const float * zi, const float * zj, std::uint32_t n_terms,
+                           std::uint64_t term_stride, std::uint64_t item_stride,
+                           std::uint32_t rows, std::uint32_t cols, double * tile,
+                           std::uint64_t tile_stride, bool upper,
+                           std::uint32_t first_row, ProductScratch & scratch) {
+  std::uint32_t row_groups = (rows + GROUP - 1) / GROUP;
+  // resizing only allocates while the scratch is still growing
+  std::vector<float> & row_panels = scratch.row_panels;
+  row_panels.resize((std::uint64_t) row_groups * n_terms * GROUP);
+  for (std::uint32_t g=0; g<row_groups; g++) {
+    pack_panel(zi, n_terms, term_stride, item_stride, g * GROUP,
+               std::min(GROUP, rows - g * GROUP), GROUP,
+               &row_panels[(std::uint64_t) g * n_terms * GROUP]);
+  }
+  std::vector<float> & col_panel = scratch.col_panel;
+  col_panel.resize((std::uint64_t) n_terms * 16);
+  float spill[GROUP][16];
+  for (std::uint32_t j=0; j<cols; j += 16) {
+    std::uint32_t n_cols = std::min(16u, cols - j);
+    if (upper && (j + 16 <= first_row)) {
+      // every element of the strip is below the diagonal
+      continue;
+    }
+    pack_panel(zj, n_terms, term_stride, item_stride, j, n_cols, 16, col_panel.data());
+    for (std::uint32_t g=0; g<row_groups; g++) {
+      std::uint32_t i = g * GROUP;
+      if (upper && (j + 16 <= first_row + i)) {
+        break;
+      }
+      const float * a = &row_panels[(std::uint64_t) g * n_terms * GROUP];
+      const float * b = col_panel.data();
+      // written out in full, so the accumulators stay in registers
+      __m256 acc00 = _mm256_setzero_ps(), acc01 = _mm256_setzero_ps();
+      __m256 acc10 = _mm256_setzero_ps(), acc11 = _mm256_setzero_ps();
+      __m256 acc20 = _mm256_setzero_ps(), acc21 = _mm256_setzero_ps();
+      __m256 acc30 = _mm256_setzero_ps(), acc31 = _mm256_setzero_ps();
+      __m256 acc40 = _mm256_setzero_ps(), acc41 = _mm256_setzero_ps();
+      __m256 acc50 = _mm256_setzero_ps(), acc51 = _mm256_setzero_ps();
+      for (std::uint32_t t=0; t<n_terms; t++) {
+        __m256 b0 = _mm256_loadu_ps(&b[t * 16]);
+        __m256 b1 = _mm256_loadu_ps(&b[t * 16 + 8]);
+        const float * a_v = &a[t * GROUP];
+        __m256 a_r = _mm256_broadcast_ss(&a_v[0]);
+        acc00 = _mm256_fmadd_ps(a_r, b0, acc00);
+        acc01 = _mm256_fmadd_ps(a_r, b1, acc01);
+        a_r = _mm256_broadcast_ss(&a_v[1]);
+        acc10 = _mm256_fmadd_ps(a_r, b0, acc10);
+        acc11 = _mm256_fmadd_ps(a_r, b1, acc11);
+        a_r = _mm256_broadcast_ss(&a_v[2]);
+        acc20 = _mm256_fmadd_ps(a_r, b0, acc20);
+        acc21 = _mm256_fmadd_ps(a_r, b1, acc21);
+        a_r = _mm256_broadcast_ss(&a_v[3]);
+        acc30 = _mm256_fmadd_ps(a_r, b0, acc30);
+        acc31 = _mm256_fmadd_ps(a_r, b1, acc31);
+        a_r = _mm256_broadcast_ss(&a_v[4]);
+        acc40 = _mm256_fmadd_ps(a_r, b0, acc40);
+        acc41 = _mm256_fmadd_ps(a_r, b1, acc41);
+        a_r = _mm256_broadcast_ss(&a_v[5]);
+        acc50 = _mm256_fmadd_ps(a_r, b0, acc50);
+        acc51 = _mm256_fmadd_ps(a_r, b1, acc51);
+      }
+      __m256 acc[GROUP * 2] = {acc00, acc01, acc10, acc11, acc20, acc21, acc30, acc31,
+                               acc40, acc41, acc50, acc51};
+      std::uint32_t n_rows = std::min(GROUP, rows - i);
+      if ((n_rows == GROUP) && (n_cols == 16)) {
+        for (std::uint32_t r=0; r<GROUP; r++) {
+          double * out = &tile[(i + r) * tile_stride + j];
+          add_to_tile(out, acc[r * 2]);
+          add_to_tile(&out[8], acc[r * 2 + 1]);
+        }
+      } else {
+        // a block at the edge of the tile, so only add the part inside it
+        for (std::uint32_t r=0; r<GROUP; r++) {
+          _mm256_storeu_ps(spill[r], acc[r * 2]);
+          _mm256_storeu_ps(&spill[r][8], acc[r * 2 + 1]);
+        }
+        for (std::uint32_t r=0; r<n_rows; r++) {
+          for (std::uint32_t c=0; c<n_cols; c++) {
+            tile[(i + r) * tile_stride + j + c] += spill[r][c];
+          }
+        }
+      }
+    }
+  }
+}
+#endif
+
+/// @brief add the products of a block of standardized dosages to a tile
+///
+/// Each tile element gets the sum over terms t of zi[t][i] * zj[t][j], summed in
+/// float32 over the block, then added to the float64 tile. For the GRM the terms
+/// are variants and the items samples. For LD they are the other way around.
+///
+/// @param zi values of the tile's row items, for the first term
+/// @param zj values of the tile's column items, laid out as zi
+/// @param n_terms number of terms in the block
+/// @param term_stride floats between one term and the next
+/// @param item_stride floats between one item and the next
+/// @param rows number of tile rows to add to
+/// @param cols number of tile columns to add to
+/// @param tile the tile, at its first row to add to
+/// @param tile_stride doubles between one tile row and the next
+/// @param upper whether the tile sits on the diagonal of a symmetric matrix, in
+///     which case only elements on or above the diagonal need to be right, and the
+///     rest can be skipped, to mirror from those later
+/// @param first_row column on the diagonal in the first row, if upper
+/// @param scratch space to pack the values into, reused from call to call
+void accumulate_products(const float * zi, const float * zj, std::uint32_t n_terms,
+                         std::uint64_t term_stride, std::uint64_t item_stride,
+                         std::uint32_t rows, std::uint32_t cols, double * tile,
+                         std::uint64_t tile_stride, bool upper,
+                         std::uint32_t first_row, ProductScratch & scratch) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    accumulate_fma(zi, zj, n_terms, term_stride, item_stride, rows, cols, tile,
+                   tile_stride, upper, first_row, scratch);
+    return;
+  }
+#else
+  // only the FMA kernel packs panels
+  (void) scratch;
+#endif
+  accumulate_scalar(zi, zj, n_terms, term_stride, item_stride, rows, cols, tile,
+                    tile_stride, upper, first_row);
+}
+
+} // namespace bgen
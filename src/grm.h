@@ -0,0 +1,37 @@
+#ifndef BGEN_GRM_H_
+#define BGEN_GRM_H_
+
+#include <cstdint>
+#include <vector>
+
+namespace bgen {
+
+// variants decoded and standardized together, before their outer products are
+// added to the GRM tile. Each tile element sums this many products in float32
+const std::uint32_t GRM_BLOCK = 256;
+
+// rows of a GRM tile handed to each thread when adding a block of variants, a
+// multiple of the 6 rows the kernel works on at once
+const std::uint32_t GRM_STRIPE = 96;
+
+// panels the products kernel packs its values into. Each thread keeps its own
+// between calls, so they are only allocated once
+struct ProductScratch {
+  std::vector<float> row_panels;
+  std::vector<float> col_panel;
+};
+
+bool standard_scale(const float * dose, std::uint32_t n, float & mean, float & scale);
+
+void standardize(const float * dose, std::uint32_t n, float mean, float scale,
+                 float * out);
+
+void accumulate_products(const float * zi, const float * zj, std::uint32_t n_terms,
+                         std::uint64_t term_stride, std::uint64_t item_stride,
+                         std::uint32_t rows, std::uint32_t cols, double * tile,
+                         std::uint64_t tile_stride, bool upper, std::uint32_t first_row,
+                         ProductScratch & scratch);
+
+} // namespace bgen
+
+#endif  // BGEN_GRM_H_
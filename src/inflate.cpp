@@ -0,0 +1,105 @@
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#if defined(BGEN_LIBDEFLATE)
+  #include "libdeflate.h"
+#else
+  #include "zlib.h"
+#endif
+
+#include "inflate.h"
+
+namespace bgen {
+
+#if defined(BGEN_LIBDEFLATE)
+
+const char * inflate_backend() { return "libdeflate"; }
+
+// libdeflate keeps no state between buffers, but the decompressor is a sizeable
+// allocation, so as for the zstd context, one is kept per thread.
+static libdeflate_decompressor * borrow_decompressor() {
+  struct Deleter {
+    void operator()(libdeflate_decompressor * d) const { libdeflate_free_decompressor(d); }
+  };
+  static thread_local std::unique_ptr<libdeflate_decompressor, Deleter> decompressor;
+  if (!decompressor) {
+    decompressor.reset(libdeflate_alloc_decompressor());
+    if (!decompressor) {
+      throw std::runtime_error("cannot allocate a libdeflate decompressor");
+    }
+  }
+  return decompressor.get();
+}
+
+void zlib_uncompress(const char * input, int compressed_len, char * decompressed,
+                     int decompressed_len) {
+  std::size_t total_out = 0;
+  libdeflate_result status = libdeflate_zlib_decompress(borrow_decompressor(),
+      input, compressed_len, decompressed, decompressed_len, &total_out);
+  if (status == LIBDEFLATE_BAD_DATA) {
+    throw std::invalid_argument("zlib decompression failed: invalid or corrupt data");
+  }
+  if (status != LIBDEFLATE_SUCCESS || total_out != (std::size_t) decompressed_len) {
+    throw std::invalid_argument("zlib decompression gave data of wrong length");
+  }
+}
+
+#else
+
+const char * inflate_backend() { return "zlib"; }
+
+// inflateInit allocates the inflate state and its 32 kB window, and inflateEnd frees
+// them, so making a fresh stream per variant costs two large allocations each time,
+// which for small variants is a large share of the time spent inflating. A stream
+// is instead kept per thread, for the same reasons as the zstd context, and
+// inflateReset readies it for each block without freeing anything.
+struct InflateStream {
+  z_stream strm;
+  InflateStream() {
+    std::memset(&strm, 0, sizeof(strm));
+    if (inflateInit(&strm) != Z_OK) {
+      throw std::runtime_error("cannot allocate a zlib inflate stream");
+    }
+  }
+  ~InflateStream() { inflateEnd(&strm); }
+  InflateStream(const InflateStream &) = delete;
+  InflateStream & operator=(const InflateStream &) = delete;
+};
+
+static z_stream * borrow_inflate_stream() {
+  static thread_local std::unique_ptr<InflateStream> stream;
+  if (!stream) {
+    stream.reset(new InflateStream());
+  } else {
+    // also clears any error left by a corrupt block
+    inflateReset(&stream->strm);
+  }
+  return &stream->strm;
+}
+
+void zlib_uncompress(const char * input, int compressed_len, char * decompressed,
+                     int decompressed_len) {
+  z_stream * strm = borrow_inflate_stream();
+  strm->avail_in = compressed_len;
+  strm->next_in = (Bytef *) input;
+  strm->avail_out = decompressed_len;
+  strm->next_out = (Bytef *) decompressed;
+
+  // the whole block and its output buffer are at hand, so finish in one call
+  int status = inflate(strm, Z_FINISH);
+  if (status == Z_DATA_ERROR || status == Z_NEED_DICT || status == Z_MEM_ERROR) {
+    throw std::invalid_argument(std::string("zlib decompression failed: ") +
+                                (strm->msg ? strm->msg : "invalid or corrupt data"));
+  }
+  if (status != Z_STREAM_END || decompressed_len != (int) strm->total_out) {
+    throw std::invalid_argument("zlib decompression gave data of wrong length");
+  }
+}
+
+#endif
+
+} // namespace bgen
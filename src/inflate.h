@@ -0,0 +1,26 @@
+#ifndef BGEN_INFLATE_H_
+#define BGEN_INFLATE_H_
+
+namespace bgen {
+
+/// name of the deflate decoder compiled in, "zlib" or "libdeflate"
+///
+/// zlib (zlib-ng in zlib compatible mode) is the default. Building with
+/// BGEN_LIBDEFLATE defined swaps in libdeflate, which only decodes whole buffers
+/// in one shot, but bgen blocks are always decoded that way, since the
+/// decompressed size is stored ahead of each block.
+const char * inflate_backend();
+
+/// decompress a zlib stream into a buffer of the known decompressed size
+///
+/// @param input zlib compressed bytes
+/// @param compressed_len number of compressed bytes
+/// @param decompressed buffer to decompress into
+/// @param decompressed_len expected number of decompressed bytes, which must
+///   match the stream exactly
+void zlib_uncompress(const char * input, int compressed_len, char * decompressed,
+                     int decompressed_len);
+
+} // namespace bgen
+
+#endif  // BGEN_INFLATE_H_
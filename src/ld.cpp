@@ -0,0 +1,52 @@
+
+#include <cmath>
+
+#include "ld.h"
+
+namespace bgen {
+
+/// @brief standardize a variant's dosages, so dot products with others are correlations
+///
+/// Missing samples are mean imputed, which puts them at zero. The rest are centred
+/// on the mean of the samples which are not missing, and scaled by the standard
+/// deviation of the imputed dosages times the square root of the sample count. The
+/// dot product of two rows is then the correlation of the imputed dosages, as
+/// np.corrcoef would give.
+///
+/// @param dose alt allele dosages, with nans for missing samples
+/// @param n number of samples
+/// @param out output, n standardized values. All zero if the variant can't be
+///     standardized
+/// @return whether the variant could be standardized, which needs samples that
+///     are not missing, with some spread in their dosages
+bool ld_standardize(const float * dose, std::uint32_t n, float * out) {
+  double sum = 0;
+  std::uint32_t observed = 0;
+  for (std::uint32_t i=0; i<n; i++) {
+    if (!std::isnan(dose[i])) {
+      sum += dose[i];
+      observed++;
+    }
+  }
+  double mean = (observed > 0) ? sum / observed : 0;
+  double squares = 0;
+  for (std::uint32_t i=0; i<n; i++) {
+    if (!std::isnan(dose[i])) {
+      squares += (dose[i] - mean) * (dose[i] - mean);
+    }
+  }
+  if (!(squares > 0)) {
+    for (std::uint32_t i=0; i<n; i++) {
+      out[i] = 0;
+    }
+    return false;
+  }
+  // squares is n times the variance of the imputed dosages
+  double scale = 1 / std::sqrt(squares);
+  for (std::uint32_t i=0; i<n; i++) {
+    out[i] = std::isnan(dose[i]) ? 0.0f : (float) ((dose[i] - mean) * scale);
+  }
+  return true;
+}
+
+} // namespace bgen
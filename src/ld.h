@@ -0,0 +1,23 @@
+#ifndef BGEN_LD_H_
+#define BGEN_LD_H_
+
+#include <cstdint>
+
+namespace bgen {
+
+// variants per block of the LD matrix. Each block is multiplied by itself and the
+// blocks after it, as far as the window reaches, a stripe of rows per task
+const std::uint32_t LD_BLOCK = 192;
+
+// rows of a block handed to each thread, a multiple of the 6 rows the kernel works
+// on at once
+const std::uint32_t LD_STRIPE = 96;
+
+// samples summed in float32 at a time, before adding to the float64 totals
+const std::uint32_t LD_CHUNK = 256;
+
+bool ld_standardize(const float * dose, std::uint32_t n, float * out);
+
+} // namespace bgen
+
+#endif  // BGEN_LD_H_
@@ -0,0 +1,153 @@
+
+#include <stdexcept>
+
+#if defined(_WIN32)
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include "mapped.h"
+
+namespace bgen {
+
+/// map a file into memory, read only
+///
+/// A file which cannot be opened or mapped is left unmapped rather than throwing, so
+/// that the reader reports it the same way as a file its ifstream could not open. An
+/// empty file is never mapped (mmap rejects a zero length), but it is still open, and
+/// reading the header from it then fails as it would through a stream.
+MappedRegion::MappedRegion(const std::string & path) {
+#if defined(_WIN32)
+  HANDLE fh = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (fh == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  LARGE_INTEGER filesize;
+  if (!GetFileSizeEx(fh, &filesize)) {
+    CloseHandle(fh);
+    return;
+  }
+  file = fh;
+  length = (std::uint64_t) filesize.QuadPart;
+  if (length > 0) {
+    HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mh == NULL) {
+      return;
+    }
+    mapping = mh;
+    begin = static_cast<char *>(MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0));
+    if (begin == nullptr) {
+      return;
+    }
+  }
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat info;
+  if ((fstat(fd, &info) != 0) || !S_ISREG(info.st_mode)) {
+    // a pipe or device cannot be mapped, and has no size to bound reads by
+    ::close(fd);
+    return;
+  }
+  length = (std::uint64_t) info.st_size;
+  if (length > 0) {
+    void * addr = mmap(nullptr, (std::size_t) length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      ::close(fd);
+      length = 0;
+      return;
+    }
+    begin = static_cast<char *>(addr);
+  }
+  // the mapping holds its own reference to the file, so the descriptor can go
+  ::close(fd);
+#endif
+  opened = true;
+}
+
+MappedRegion::~MappedRegion() {
+#if defined(_WIN32)
+  if (begin != nullptr) {
+    UnmapViewOfFile(begin);
+  }
+  if (mapping != nullptr) {
+    CloseHandle(static_cast<HANDLE>(mapping));
+  }
+  if (file != nullptr) {
+    CloseHandle(static_cast<HANDLE>(file));
+  }
+#else
+  if (begin != nullptr) {
+    munmap(begin, (std::size_t) length);
+  }
+#endif
+}
+
+MappedBuffer::MappedBuffer(const std::string & path) : region(new MappedRegion(path)) {
+  setg(region->begin, region->begin, region->begin + region->length);
+}
+
+/// drop this buffer's share of the mapping, after which reads find nothing left
+///
+/// The pages are only unmapped once nothing else shares the region, i.e. once any
+/// genotypes which were decoded in place have also gone.
+void MappedBuffer::unmap() {
+  region.reset();
+  setg(nullptr, nullptr, nullptr);
+}
+
+MappedBuffer::pos_type MappedBuffer::seekoff(off_type off, std::ios_base::seekdir dir,
+                                             std::ios_base::openmode which) {
+  if (!(which & std::ios_base::in)) {
+    return pos_type(off_type(-1));
+  }
+  char * begin = eback();
+  std::uint64_t length = size();
+  off_type base = 0;
+  if (dir == std::ios_base::cur) {
+    base = gptr() - begin;
+  } else if (dir == std::ios_base::end) {
+    base = (off_type) length;
+  }
+  off_type target = base + off;
+  if ((target < 0) || ((std::uint64_t) target > length)) {
+    return pos_type(off_type(-1));
+  }
+  setg(begin, begin + target, begin + length);
+  return pos_type(target);
+}
+
+MappedBuffer::pos_type MappedBuffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+  return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+MappedFile::MappedFile(const std::string & path) : MappedBuffer(path),
+    std::istream(static_cast<MappedBuffer *>(this)) {
+  if (!mapped()) {
+    setstate(std::ios::failbit);
+  }
+}
+
+/// unmap the file, and mark the stream as closed
+///
+/// The badbit is what every Variant checks before it reads, and the mapping is gone
+/// after this, so setting it is what stops a surviving Variant from reading freed
+/// pages. An ifstream gets the same effect from the reads failing on a closed file.
+/// Genotypes decoded in place hold their own share of the mapping, so they stay
+/// readable afterwards, as genotypes decompressed from a closed ifstream do.
+void MappedFile::close() {
+  unmap();
+  setstate(std::ios::badbit);
+}
+
+} // namespace bgen
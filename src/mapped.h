@@ -0,0 +1,77 @@
+#ifndef BGEN_MAPPED_H_
+#define BGEN_MAPPED_H_
+
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <streambuf>
+#include <string>
+
+namespace bgen {
+
+/// a read-only memory mapping of a whole file
+///
+/// This is held through a shared_ptr, since genotypes decoded in place from the
+/// mapping have to keep it alive after the reader closes, in the same way a Variant
+/// keeps decompressed genotypes it already read from a closed file.
+class MappedRegion {
+public:
+  MappedRegion(const std::string & path);
+  ~MappedRegion();
+  MappedRegion(const MappedRegion &) = delete;
+  MappedRegion & operator=(const MappedRegion &) = delete;
+  char * begin = nullptr;
+  std::uint64_t length = 0;
+  bool opened = false;
+private:
+#if defined(_WIN32)
+  void * file = nullptr;
+  void * mapping = nullptr;
+#endif
+};
+
+/// a stream buffer over a mapped file
+///
+/// The bytes are handed out through the get area, so reads through the stream are
+/// plain memcpys out of the page cache, and seeking just moves a pointer rather than
+/// discarding and refilling a buffer with a read syscall. This is a base of
+/// MappedFile so that it exists before, and outlives, the istream reading from it.
+class MappedBuffer : public std::streambuf {
+public:
+  MappedBuffer(const std::string & path);
+  const char * data() const { return region ? region->begin : nullptr; }
+  std::uint64_t size() const { return region ? region->length : 0; }
+  bool mapped() const { return region && region->opened; }
+  void unmap();
+protected:
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which = std::ios_base::in) override;
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which = std::ios_base::in) override;
+  std::shared_ptr<const MappedRegion> region;
+};
+
+/// a bgen file read through a memory mapping rather than a buffered ifstream
+///
+/// This is still a std::istream, so the header, sample and stdin code which reads
+/// through a stream works unchanged. The variant and genotype parsers check for this
+/// type, and read straight out of data() instead, with their own bounds checks
+/// against size(), since that avoids a copy and a stream state check per field.
+class MappedFile : private MappedBuffer, public std::istream {
+public:
+  MappedFile(const std::string & path);
+  using MappedBuffer::data;
+  using MappedBuffer::size;
+  bool is_open() const { return mapped(); }
+  void close();
+  /// share ownership of the mapping, for data which is used where it sits
+  std::shared_ptr<const MappedRegion> pin() const { return region; }
+};
+
+/// find the mapping under a bgen stream, or nullptr if it is an ordinary stream
+inline const MappedFile * as_mapped(std::istream * handle) {
+  return dynamic_cast<const MappedFile *>(handle);
+}
+
+} // namespace bgen
+
+#endif  // BGEN_MAPPED_H_
@@ -0,0 +1,170 @@
+#ifndef BGEN_PARALLEL_H_
+#define BGEN_PARALLEL_H_
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace bgen {
+
+/// pick how many threads to run, given what the caller asked for
+///
+/// Zero (or less) means one per core. Never more threads than there are tasks,
+/// since the surplus would only start up to find nothing left to do.
+inline int resolve_threads(int threads, std::uint64_t n_tasks) {
+  if (threads < 1) {
+    threads = (int) std::thread::hardware_concurrency();
+    if (threads < 1) {
+      // hardware_concurrency is allowed to return zero when it can't tell
+      threads = 1;
+    }
+  }
+  if ((std::uint64_t) threads > n_tasks) {
+    threads = (int) n_tasks;
+  }
+  return threads > 0 ? threads : 1;
+}
+
+/// run a task for every index in [0, n), spread across a set of threads
+///
+/// Indices are handed out one at a time from a shared counter, rather than split
+/// into fixed chunks up front, since tasks here are variants whose cost varies
+/// with their compressed size and ploidy, so fixed chunks would leave some threads
+/// idle while one works through a run of large variants.
+///
+/// Each thread builds its own state first (e.g. a handle on the bgen, as threads
+/// cannot share a stream position), then calls task(state, idx) for each index it
+/// claims. When a task throws, the remaining indices are abandoned, and the error
+/// from the lowest failing index is rethrown once every thread has finished, so the
+/// error doesn't depend on which thread happened to get there first.
+///
+/// @param n number of tasks
+/// @param threads number of threads to use, or zero for one per core
+/// @param make_state builds the per thread state, called once on each thread
+/// @param task runs one index, given the calling thread's state
+template <typename MakeState, typename Task>
+void parallel_for(std::uint64_t n, int threads, MakeState make_state, Task task) {
+  if (n == 0) {
+    return;
+  }
+  threads = resolve_threads(threads, n);
+  std::atomic<std::uint64_t> next(0);
+  std::atomic<bool> failed(false);
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  std::uint64_t error_idx = n;
+
+  auto record = [&](std::uint64_t idx) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error || (idx < error_idx)) {
+      error_idx = idx;
+      error = std::current_exception();
+    }
+    failed = true;
+  };
+
+  auto run = [&]() {
+    std::uint64_t idx = n;
+    try {
+      auto state = make_state();
+      while (!failed) {
+        idx = next++;
+        if (idx >= n) {
+          return;
+        }
+        task(state, idx);
+      }
+    } catch (...) {
+      // a failure to build the state belongs to no index, so is ranked last
+      record(idx);
+    }
+  };
+
+  if (threads == 1) {
+    // no need to start a thread just to wait on it
+    run();
+  } else {
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    try {
+      for (int i = 1; i < threads; i++) {
+        workers.push_back(std::thread(run));
+      }
+    } catch (...) {
+      // stop whichever threads did start, and report the failure to start more
+      failed = true;
+      for (auto & worker : workers) {
+        worker.join();
+      }
+      throw;
+    }
+    // the calling thread takes a share of the work too
+    run();
+    for (auto & worker : workers) {
+      worker.join();
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/// per thread state, kept across several parallel_for calls
+///
+/// parallel_for builds each thread's state afresh on every call, which is wasteful
+/// when calls come in a loop and the state is costly, e.g. a handle which maps the
+/// whole bgen, or buffers sized by the sample count. This builds one state for each
+/// thread the calls could use, up front, and hands them out to the threads of each
+/// call in turn (see the parallel_for overload below).
+template <typename State>
+class ThreadStates {
+public:
+  /// @param threads number of threads to use, or zero for one per core
+  /// @param n_tasks largest number of tasks in any one call
+  /// @param make_state builds the state of one thread
+  template <typename MakeState>
+  ThreadStates(int threads, std::uint64_t n_tasks, MakeState make_state) :
+      n_threads(resolve_threads(threads, n_tasks)) {
+    states.reserve(n_threads);
+    for (int i = 0; i < n_threads; i++) {
+      states.push_back(make_state());
+    }
+  }
+  ThreadStates(const ThreadStates &) = delete;
+  ThreadStates & operator=(const ThreadStates &) = delete;
+  int threads() const { return n_threads; }
+  /// take the next state not in use by this call
+  State * claim() {
+    std::uint64_t idx = next++;
+    if (idx >= states.size()) {
+      throw std::logic_error("more threads than thread states");
+    }
+    return &states[idx];
+  }
+  /// make every state available again, before the next call
+  void release() { next = 0; }
+private:
+  int n_threads;
+  std::vector<State> states;
+  std::atomic<std::uint64_t> next{0};
+};
+
+/// run a task for every index in [0, n), with the per thread states given
+///
+/// As parallel_for above, but each thread takes one of the states rather than
+/// building its own, so never runs on more threads than there are states.
+template <typename State, typename Task>
+void parallel_for(std::uint64_t n, ThreadStates<State> & states, Task task) {
+  states.release();
+  parallel_for(n, states.threads(),
+    [&states] { return states.claim(); },
+    [&task] (State * & state, std::uint64_t idx) { task(*state, idx); });
+}
+
+} // namespace bgen
+
+#endif  // BGEN_PARALLEL_H_
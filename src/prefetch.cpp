@@ -0,0 +1,136 @@
+
+#include <stdexcept>
+
+#include "prefetch.h"
+
+namespace bgen {
+
+/// start reading ahead from a variant offset
+///
+/// @param source handle the workers read through, which nothing else may use
+/// @param target handle of the reader, which handed out variants are moved onto
+/// @param offset file offset of the first variant to read
+/// @param layout bgen layout version (1 or 2)
+/// @param compression compression scheme (0=no compression, 1=zlib, 2=zstd)
+/// @param n_samples number of samples in the bgen
+/// @param is_stdin whether the bgen is streamed in on stdin
+/// @param depth most variants to hold decompressed ahead of the caller
+/// @param threads number of worker threads
+Prefetcher::Prefetcher(std::shared_ptr<std::istream> _source,
+                       std::shared_ptr<std::istream> _target,
+                       std::uint64_t _offset, int _layout, int _compression, int _n_samples,
+                       bool _is_stdin, int _depth, int threads) :
+    source(_source), target(_target), offset(_offset), layout(_layout),
+    compression(_compression), n_samples(_n_samples), is_stdin(_is_stdin) {
+  if (_depth < 1) {
+    throw std::invalid_argument("prefetch depth must be at least one");
+  }
+  if (threads < 1) {
+    throw std::invalid_argument("prefetch needs at least one thread");
+  }
+  depth = (std::uint64_t) _depth;
+  slots.resize(depth);
+  workers.reserve(threads);
+  try {
+    for (int i = 0; i < threads; i++) {
+      workers.push_back(std::thread(&Prefetcher::work, this));
+    }
+  } catch (...) {
+    // a thread which failed to start must not leave the others running
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    freed.notify_all();
+    for (auto & worker : workers) {
+      worker.join();
+    }
+    throw;
+  }
+}
+
+Prefetcher::~Prefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  freed.notify_all();
+  for (auto & worker : workers) {
+    worker.join();
+  }
+}
+
+/// read and decompress variants until stopped, or until the bgen runs out
+///
+/// A variant which fails to parse ends reading, since the next one's offset comes
+/// from it. Its error is left in its slot, so the caller gets exactly the error a
+/// serial read would have raised at that point. Failures after the header (reading
+/// or decompressing the genotypes) are dropped here instead, since a serial read
+/// would only raise those once the genotypes were asked for. The genotypes are
+/// simply left undecoded, and raise the same error again when they are used.
+void Prefetcher::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    freed.wait(lock, [this] {
+      return stopping || finished || (next_seq < consumed + depth);
+    });
+    if (stopping || finished) {
+      return;
+    }
+    std::uint64_t seq = next_seq++;
+    Slot & slot = slots[seq % depth];
+    Variant var;
+    try {
+      var = Variant(source, offset, layout, compression, n_samples, is_stdin);
+      offset = var.next_variant_offset;
+    } catch (...) {
+      finished = true;
+      slot.error = std::current_exception();
+      slot.ready = true;
+      filled.notify_all();
+      freed.notify_all();
+      return;
+    }
+
+    // the stream is shared by the workers, so only the read happens under the lock
+    bool was_read = true;
+    try {
+      var.read_genotypes();
+    } catch (...) {
+      was_read = false;
+    }
+    lock.unlock();
+    if (was_read) {
+      try {
+        var.prepare_genotypes();
+      } catch (...) {
+      }
+    }
+    lock.lock();
+    slot.variant = std::move(var);
+    slot.ready = true;
+    filled.notify_all();
+  }
+}
+
+/// hand out the next variant in file order, waiting for it if needed
+///
+/// Once a variant has failed to parse, every later call raises the same error, as
+/// repeating a failed serial read would.
+Variant Prefetcher::next() {
+  std::unique_lock<std::mutex> lock(mutex);
+  Slot & slot = slots[consumed % depth];
+  filled.wait(lock, [&slot] { return slot.ready; });
+  if (slot.error) {
+    std::rethrow_exception(slot.error);
+  }
+  Variant var = std::move(slot.variant);
+  slot.ready = false;
+  consumed++;
+  lock.unlock();
+  freed.notify_all();
+  var.rebind(target);
+  return var;
+}
+
+} // namespace bgen
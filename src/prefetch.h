@@ -0,0 +1,73 @@
+#ifndef BGEN_PREFETCH_H_
+#define BGEN_PREFETCH_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "variant.h"
+
+namespace bgen {
+
+/// reads and decompresses the variants following the current one in the background
+///
+/// Worker threads take turns to parse the next variant's header and read its stored
+/// genotype block, which has to happen in file order, under a lock on their stream.
+/// Each then decompresses its block without the lock, so several blocks decompress
+/// at once. Finished variants go into a ring of depth slots, indexed by their
+/// position in the file, and are handed out strictly in that order, so the caller
+/// sees the same sequence as reading serially. A worker waits for a free slot before
+/// starting another variant, which bounds memory to depth decompressed blocks.
+///
+/// The workers read through a handle of their own, rather than the reader's stream,
+/// so that picking variants by index while prefetching doesn't race the workers for
+/// the stream position. Variants are moved onto the reader's handle as they're
+/// handed out.
+class Prefetcher {
+public:
+  Prefetcher(std::shared_ptr<std::istream> source,
+             std::shared_ptr<std::istream> target,
+             std::uint64_t offset, int layout, int compression, int n_samples,
+             bool is_stdin, int depth, int threads);
+  ~Prefetcher();
+  Prefetcher(const Prefetcher &) = delete;
+  Prefetcher & operator=(const Prefetcher &) = delete;
+  Variant next();
+private:
+  struct Slot {
+    Variant variant;
+    std::exception_ptr error;
+    bool ready = false;
+  };
+  void work();
+  std::shared_ptr<std::istream> source;
+  std::shared_ptr<std::istream> target;
+  std::uint64_t offset;
+  int layout;
+  int compression;
+  int n_samples;
+  bool is_stdin;
+  std::uint64_t depth;
+  std::vector<Slot> slots;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  // signals a slot being filled, for the consumer, and a slot being freed (or the
+  // prefetcher stopping), for the workers
+  std::condition_variable filled;
+  std::condition_variable freed;
+  std::uint64_t next_seq = 0;
+  std::uint64_t consumed = 0;
+  // set once a variant fails to parse, since the offset of the next one is then
+  // unknown, so nothing past it can be read
+  bool finished = false;
+  bool stopping = false;
+};
+
+} // namespace bgen
+
+#endif  // BGEN_PREFETCH_H_
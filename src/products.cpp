@@ -0,0 +1,163 @@
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "products.h"
+#include "utils.h"
+
+#if defined(__x86_64__)
+  #include <immintrin.h>
+#endif
+
+namespace bgen {
+
+/// @brief mean impute the missing samples of a dosage row
+///
+/// Missing samples are set to zero, so they add nothing to the products, and
+/// dosage_products' caller adds the mean times their phenotypes afterwards. The sums
+/// are of the imputed row.
+///
+/// @param dose dosages of one variant, with nans for missing samples
+/// @param n number of samples
+/// @param missing output, for the indices of the missing samples
+/// @param sum output, for the sum of the imputed dosages
+/// @param sumsq output, for the sum of the squared imputed dosages
+/// @return mean dosage of the samples which are not missing, or nan if all are
+double impute_row(float * dose, std::uint32_t n, std::vector<std::uint32_t> & missing,
+                  double & sum, double & sumsq) {
+  missing.clear();
+  sum = 0;
+  sumsq = 0;
+  for (std::uint32_t i=0; i<n; i++) {
+    if (std::isnan(dose[i])) {
+      missing.push_back(i);
+      dose[i] = 0;
+    } else {
+      sum += dose[i];
+      sumsq += (double) dose[i] * dose[i];
+    }
+  }
+  std::uint32_t observed = n - (std::uint32_t) missing.size();
+  if (observed == 0) {
+    sum = sumsq = std::numeric_limits<double>::quiet_NaN();
+    return sum;
+  }
+  double mean = sum / observed;
+  sum += mean * missing.size();
+  sumsq += mean * mean * missing.size();
+  return mean;
+}
+
+/// @brief dot products of dosage rows with a phenotype column, over one tile
+///
+/// Samples are summed in eight lanes, each lane taking every eighth sample, then
+/// the lanes are added in the order the AVX2 version reduces them, so both give
+/// the same floats.
+///
+/// @param x dosage rows, each at the start of the tile. Unused rows may repeat a
+///     used one
+/// @param y phenotype column, at the start of the tile
+/// @param len number of samples, a multiple of eight
+/// @param sums output, a dot product per row
+static void tile_dots(const float * const * x, const float * y, std::uint32_t len,
+                      float * sums) {
+  for (std::uint32_t b=0; b<PRODUCT_ROWS; b++) {
+    float lanes[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    for (std::uint32_t i=0; i<len; i += 8) {
+      for (std::uint32_t l=0; l<8; l++) {
+        lanes[l] += x[b][i + l] * y[i + l];
+      }
+    }
+    float quad[4];
+    for (std::uint32_t l=0; l<4; l++) {
+      quad[l] = lanes[l] + lanes[l + 4];
+    }
+    sums[b] = (quad[0] + quad[2]) + (quad[1] + quad[3]);
+  }
+}
+
+#if defined(__x86_64__)
+// the AVX2 half of tile_dots. This uses separate multiplies and adds rather than
+// FMA, since fused rounding would differ from the scalar version.
+BGEN_TARGET_AVX2
+static inline float reduce_lanes(__m256 lanes) {
+  __m128 quad = _mm_add_ps(_mm256_castps256_ps128(lanes), _mm256_extractf128_ps(lanes, 1));
+  __m128 pair = _mm_add_ps(quad, _mm_movehl_ps(quad, quad));
+  __m128 single = _mm_add_ss(pair, _mm_shuffle_ps(pair, pair, 1));
+  return _mm_cvtss_f32(single);
+}
+
+BGEN_TARGET_AVX2
+static void tile_dots_avx2(const float * const * x, const float * y, std::uint32_t len,
+                           float * sums) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  __m256 acc2 = _mm256_setzero_ps();
+  __m256 acc3 = _mm256_setzero_ps();
+  for (std::uint32_t i=0; i<len; i += 8) {
+    __m256 pheno = _mm256_loadu_ps(&y[i]);
+    acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(&x[0][i]), pheno));
+    acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(&x[1][i]), pheno));
+    acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(_mm256_loadu_ps(&x[2][i]), pheno));
+    acc3 = _mm256_add_ps(acc3, _mm256_mul_ps(_mm256_loadu_ps(&x[3][i]), pheno));
+  }
+  sums[0] = reduce_lanes(acc0);
+  sums[1] = reduce_lanes(acc1);
+  sums[2] = reduce_lanes(acc2);
+  sums[3] = reduce_lanes(acc3);
+}
+#endif
+
+/// @brief multiply a block of dosage rows by a phenotype matrix
+///
+/// Works a tile of samples at a time, summing each tile in float32 then adding it to
+/// the float64 output, so rounding error only builds up over PRODUCT_TILE samples.
+///
+/// @param dose rows x n dosages, row major, with no nans (see impute_row)
+/// @param rows number of dosage rows, up to PRODUCT_ROWS
+/// @param n number of samples
+/// @param yt k x n phenotypes, so each phenotype is contiguous
+/// @param k number of phenotypes
+/// @param out rows x k output, row major
+void dosage_products(const float * dose, std::uint32_t rows, std::uint32_t n,
+                     const float * yt, std::uint32_t k, double * out) {
+  for (std::uint32_t b=0; b<rows * k; b++) {
+    out[b] = 0;
+  }
+  if (rows == 0) {
+    return;
+  }
+#if defined(__x86_64__)
+  bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+  const float * x[PRODUCT_ROWS];
+  float sums[PRODUCT_ROWS];
+  for (std::uint32_t start=0; start<n; start += PRODUCT_TILE) {
+    std::uint32_t len = std::min(PRODUCT_TILE, n - start);
+    std::uint32_t whole = len - (len % 8);
+    for (std::uint32_t b=0; b<PRODUCT_ROWS; b++) {
+      x[b] = &dose[(std::uint64_t) (b < rows ? b : 0) * n + start];
+    }
+    for (std::uint32_t j=0; j<k; j++) {
+      const float * y = &yt[(std::uint64_t) j * n + start];
+#if defined(__x86_64__)
+      if (avx2) {
+        tile_dots_avx2(x, y, whole, sums);
+      } else {
+        tile_dots(x, y, whole, sums);
+      }
+#else
+      tile_dots(x, y, whole, sums);
+#endif
+      for (std::uint32_t b=0; b<rows; b++) {
+        for (std::uint32_t i=whole; i<len; i++) {
+          sums[b] += x[b][i] * y[i];
+        }
+        out[b * k + j] += sums[b];
+      }
+    }
+  }
+}
+
+} // namespace bgen
@@ -0,0 +1,25 @@
+#ifndef BGEN_PRODUCTS_H_
+#define BGEN_PRODUCTS_H_
+
+#include <cstdint>
+#include <vector>
+
+namespace bgen {
+
+// variants multiplied together against each tile of the phenotypes, so each
+// phenotype value loaded is used this many times
+const std::uint32_t PRODUCT_ROWS = 4;
+
+// samples per tile. A tile of PRODUCT_ROWS dosage rows (16 KB) stays in L1 while
+// every phenotype column runs past it
+const std::uint32_t PRODUCT_TILE = 1024;
+
+double impute_row(float * dose, std::uint32_t n, std::vector<std::uint32_t> & missing,
+                  double & sum, double & sumsq);
+
+void dosage_products(const float * dose, std::uint32_t rows, std::uint32_t n,
+                     const float * yt, std::uint32_t k, double * out);
+
+} // namespace bgen
+
+#endif  // BGEN_PRODUCTS_H_
@@ -1,5 +1,6 @@
 
 #include <algorithm>
+#include <limits>
 #include <string>
 
 #include "reader.h"
@@ -43,20 +44,23 @@ const std::uint64_t MIN_VARIANT_BYTES = 12;
 
 /// most variants to reserve space for up front when the bgen's size is unknown
 ///
-/// A Variant is a few hundred bytes, so reserving the claimed count asks the
-/// allocator for over a terabyte when that count is corrupt, which fails even
-/// though the pages are never touched. This is only needed for a stream, whose
-/// size cannot be measured, so growing past it costs a few reallocations.
+/// Reserving the claimed count asks the allocator for gigabytes when that count is
+/// corrupt. This is only needed for a stream, whose size cannot be measured, so
+/// growing past it costs a few reallocations.
 const std::uint64_t MAX_VARIANT_RESERVE = 1 << 16;
 
-CppBgenReader::CppBgenReader(std::string path, std::string sample_path, bool delay_parsing) {
-  if (path != "/dev/stdin") {
-    handle = std::shared_ptr<std::istream>(new BufferedFile(path, STREAM_BUFFER));
-  } else {
-    is_stdin = true;
-    // std::cin is not ours to close, so hold it without owning it
-    handle = borrowed_stream(&std::cin);
-  }
+/// open a bgen, and parse its header and sample IDs
+///
+/// @param path path to the bgen, or /dev/stdin to stream it in
+/// @param sample_path optional path to a sample file, for a bgen without sample IDs
+/// @param delay_parsing whether to leave the variants unparsed until needed
+/// @param use_mmap whether to read the bgen through a memory mapping instead of a
+///     buffered stream. Only applies to a regular file, since stdin can't be mapped,
+///     so stdin quietly falls back to the stream.
+CppBgenReader::CppBgenReader(std::string _path, std::string sample_path, bool delay_parsing,
+                             bool _use_mmap) : path(_path), use_mmap(_use_mmap) {
+  is_stdin = (path == "/dev/stdin");
+  handle = open_handle();
   if (handle->fail()) {
     throw std::invalid_argument("error reading from '" + path + "'");
   }
@@ -97,6 +101,17 @@ CppBgenReader::CppBgenReader(std::string path, std::string sample_path, bool del
   }
 }
 
+/// open a new handle on the bgen, of whichever kind the reader was asked for
+std::shared_ptr<std::istream> CppBgenReader::open_handle() {
+  if (is_stdin) {
+    // std::cin is not ours to close, so hold it without owning it
+    return borrowed_stream(&std::cin);
+  } else if (use_mmap) {
+    return std::shared_ptr<std::istream>(new MappedFile(path));
+  }
+  return std::shared_ptr<std::istream>(new BufferedFile(path, STREAM_BUFFER));
+}
+
 /// release the operating system file handle
 ///
 /// The stream is shared with every Variant taken from this reader, so dropping this
@@ -105,6 +120,8 @@ CppBgenReader::CppBgenReader(std::string path, std::string sample_path, bool del
 /// handle itself. Every accessor on a Variant checks the reader is open before it
 /// reads, so none of them can reach the closed stream afterwards.
 void CppBgenReader::close_stream() {
+  // the prefetch threads hold a handle of their own, so stop them to close that too
+  stop_prefetch();
   if (is_stdin) {
     // std::cin is not ours to close
     return;
@@ -113,6 +130,10 @@ void CppBgenReader::close_stream() {
   if ((file != nullptr) && file->is_open()) {
     file->close();
   }
+  MappedFile * mapped = dynamic_cast<MappedFile *>(handle.get());
+  if ((mapped != nullptr) && mapped->is_open()) {
+    mapped->close();
+  }
 }
 
 /// byte position of the first variant in the bgen
@@ -133,16 +154,534 @@ Variant CppBgenReader::next_var() {
   return var;
 }
 
-/// load all variants into memory at once
-void CppBgenReader::parse_all_variants() {
-  if (variants.size() == header.nvariants) {
-    return;
+/// start reading and decompressing variants ahead of iteration, in the background
+///
+/// Any earlier prefetch is discarded, so this can also restart reading from a new
+/// offset.
+///
+/// @param from file offset of the next variant the caller will ask for
+/// @param depth most variants to hold ready at once, which bounds the memory used
+/// @param threads number of threads reading and decompressing
+void CppBgenReader::start_prefetch(std::uint64_t from, int depth, int threads) {
+  stop_prefetch();
+  std::shared_ptr<std::istream> source = open_handle();
+  if (source->fail()) {
+    throw std::invalid_argument("error reading from '" + path + "'");
   }
-  offset = first_variant_offset();
-  variants.clear();
-  // Only reserve what the file could hold. nvariants comes straight from the
-  // header, so a corrupt count would otherwise ask for hundreds of GB of
-  // Variants up front. Parsing still stops at whatever the file really contains.
+  prefetcher.reset(new Prefetcher(source, handle, from, header.layout, header.compression,
+                                  header.nsamples, is_stdin, depth, threads));
+}
+
+/// get the next variant from the prefetch threads
+///
+/// This returns a heap allocated Variant, which the caller takes ownership of, so
+/// that python can wrap it without having to construct (and so parse) another.
+Variant * CppBgenReader::next_prefetched() {
+  if (!prefetcher) {
+    throw std::invalid_argument("variants are not being prefetched");
+  }
+  std::unique_ptr<Variant> var(new Variant(prefetcher->next()));
+  var->select_samples(subset);
+  return var.release();
+}
+
+/// stop any prefetch threads, dropping whatever they had read ahead
+void CppBgenReader::stop_prefetch() {
+  prefetcher.reset();
+}
+
+/// restrict the genotypes of variants opened from here on to a subset of samples
+///
+/// @param _subset samples to keep, or an empty pointer to go back to every sample
+void CppBgenReader::select_samples(std::shared_ptr<const SampleSubset> _subset) {
+  if (_subset && (_subset->n_samples != header.nsamples)) {
+    throw std::invalid_argument("sample subset is for " +
+                                std::to_string(_subset->n_samples) +
+                                " samples, but the bgen has " +
+                                std::to_string(header.nsamples));
+  }
+  subset = _subset;
+}
+
+/// number of samples each variant from this reader outputs
+std::uint32_t CppBgenReader::n_selected() {
+  return subset ? subset->size() : header.nsamples;
+}
+
+/// positions of the rows flagged as malformed
+static std::vector<std::uint64_t> flagged_rows(const std::vector<char> & malformed) {
+  std::vector<std::uint64_t> flagged;
+  for (std::uint64_t row = 0; row < malformed.size(); row++) {
+    if (malformed[row]) {
+      flagged.push_back(row);
+    }
+  }
+  return flagged;
+}
+
+/// decode many variants at once, across a set of threads
+///
+/// Each thread opens its own handle on the bgen, since a stream can only sit at one
+/// offset at a time, then claims variants one by one, parsing, decompressing and
+/// decoding each straight into its row of the output. This all happens in C++, so
+/// the caller can release the GIL for the whole call.
+///
+/// @param offsets file offsets of the variants, one per output row
+/// @param threads number of threads to decode with, or zero for one per core
+/// @param decode called with each variant and its row, to decode it into the output
+/// @return rows for variants whose probabilities summed above the bit depth maximum,
+///     so the caller can warn about a malformed bgen
+template <typename Decode>
+std::vector<std::uint64_t> CppBgenReader::decode_rows(
+    const std::vector<std::uint64_t> & offsets, int threads, Decode decode) {
+  if (is_stdin) {
+    throw std::invalid_argument("cannot decode variants by offset from stdin");
+  }
+  std::vector<char> malformed(offsets.size(), 0);
+  parallel_for(offsets.size(), threads,
+    [this] { return open_checked_handle(); },
+    [&] (std::shared_ptr<std::istream> & source, std::uint64_t row) {
+      Variant var = open_variant(source, offsets[row]);
+      decode(var, row);
+      malformed[row] = var.probs_above_max();
+    });
+  return flagged_rows(malformed);
+}
+
+/// open a handle on the bgen for a decoding thread, failing if it can't be read
+std::shared_ptr<std::istream> CppBgenReader::open_checked_handle() {
+  std::shared_ptr<std::istream> source = open_handle();
+  if (source->fail()) {
+    throw std::invalid_argument("error reading from '" + path + "'");
+  }
+  return source;
+}
+
+/// parse the variant at an offset, ready to decode with this reader's samples and cache
+Variant CppBgenReader::open_variant(std::shared_ptr<std::istream> & source,
+                                    std::uint64_t offset) {
+  std::uint64_t var_offset = offset;
+  Variant var;
+  try {
+    var = Variant(source, var_offset, header.layout, header.compression,
+                  header.nsamples, false);
+  } catch (const std::out_of_range &) {
+    // the offset came from the caller, or an index, so running out of file
+    // means the bgen is missing a variant, rather than having been iterated past
+    throw std::invalid_argument("bgen is truncated - could not read the variant "
+                                "at offset " + std::to_string(offset));
+  }
+  var.select_samples(subset);
+  var.use_cache(cache);
+  return var;
+}
+
+/// decode the dosages of many variants at once, across a set of threads
+///
+/// @param offsets file offsets of the variants, one per output row
+/// @param dose output array of offsets.size() x n_selected() values of the output
+///     type, in row major order
+/// @param use_minor whether to give the minor allele dosage, instead of the alt allele
+/// @param threads number of threads to decode with, or zero for one per core
+/// @param type one of OutputType
+/// @return rows for variants whose probabilities summed above the bit depth maximum
+std::vector<std::uint64_t> CppBgenReader::dosage_matrix(
+    const std::vector<std::uint64_t> & offsets, void * dose, bool use_minor,
+    int threads, int type) {
+  std::uint64_t row_bytes = (std::uint64_t) n_selected() * output_size(type);
+  char * out = reinterpret_cast<char *>(dose);
+  return decode_rows(offsets, threads, [&] (Variant & var, std::uint64_t row) {
+    char * row_dose = out + row * row_bytes;
+    if (use_minor) {
+      var.minor_allele_dosage_as(row_dose, type);
+    } else {
+      var.alt_dosage_as(row_dose, type);
+    }
+  });
+}
+
+/// hard call the genotypes of many variants at once, across a set of threads
+///
+/// @param offsets file offsets of the variants, one per output row
+/// @param calls output array of offsets.size() x n_selected() int8s, in row major order
+/// @param threshold lowest probability a genotype is called at
+/// @param threads number of threads to decode with, or zero for one per core
+/// @return rows for variants whose probabilities summed above the bit depth maximum
+std::vector<std::uint64_t> CppBgenReader::hard_call_matrix(
+    const std::vector<std::uint64_t> & offsets, std::int8_t * calls, float threshold,
+    int threads) {
+  std::uint64_t n_samples = n_selected();
+  return decode_rows(offsets, threads, [&] (Variant & var, std::uint64_t row) {
+    var.hard_calls(calls + row * n_samples, threshold);
+  });
+}
+
+/// quality control statistics of many variants at once, across a set of threads
+///
+/// @param offsets file offsets of the variants, one per table row
+/// @param table output, resized to a row per variant
+/// @param threshold lowest probability a genotype is hard called at
+/// @param threads number of threads to decode with, or zero for one per core
+/// @return rows for variants whose probabilities summed above the bit depth maximum
+std::vector<std::uint64_t> CppBgenReader::variant_stats(
+    const std::vector<std::uint64_t> & offsets, StatsTable & table, float threshold,
+    int threads) {
+  table.resize(offsets.size());
+  return decode_rows(offsets, threads, [&] (Variant & var, std::uint64_t row) {
+    // each row is only written by the thread that decodes it
+    table.varid[row] = var.varid;
+    table.rsid[row] = var.rsid;
+    table.chrom[row] = var.chrom;
+    table.pos[row] = var.pos;
+    table.n_alleles[row] = var.n_alleles;
+    table.set(row, var.stats(threshold));
+  });
+}
+
+/// @brief multiply the dosages of many variants by a phenotype matrix
+///
+/// Finds X^T Y for the variants x samples dosage matrix X, without building X. Each
+/// task decodes a block of PRODUCT_ROWS variants into a small buffer, mean imputes
+/// their missing samples, and multiplies the block by every phenotype a tile of
+/// samples at a time. Blocks are spread across threads as in decode_rows.
+///
+/// @param offsets file offsets of the variants, one per output row
+/// @param yt k x n_selected() phenotypes, row major, so each phenotype is contiguous
+/// @param k number of phenotypes
+/// @param out output array of offsets.size() x k products, row major
+/// @param sums output, the sum of each variant's imputed dosages
+/// @param sumsq output, the sum of each variant's squared imputed dosages
+/// @param use_minor whether to use minor allele dosages, instead of alt allele ones
+/// @param threads number of threads to decode with, or zero for one per core
+/// @return rows for variants whose probabilities summed above the bit depth maximum
+std::vector<std::uint64_t> CppBgenReader::dosage_products(
+    const std::vector<std::uint64_t> & offsets, const float * yt, std::uint32_t k,
+    double * out, double * sums, double * sumsq, bool use_minor, int threads) {
+  if (is_stdin) {
+    throw std::invalid_argument("cannot decode variants by offset from stdin");
+  }
+  std::uint32_t n = n_selected();
+  std::uint64_t n_blocks = (offsets.size() + PRODUCT_ROWS - 1) / PRODUCT_ROWS;
+  std::vector<char> malformed(offsets.size(), 0);
+  struct Worker {
+    std::shared_ptr<std::istream> source;
+    std::vector<float> dose;
+    // samples missing from each variant of the block
+    std::vector<std::uint32_t> missing[PRODUCT_ROWS];
+  };
+  parallel_for(n_blocks, threads,
+    [&] {
+      Worker worker;
+      worker.source = open_checked_handle();
+      worker.dose.resize((std::uint64_t) PRODUCT_ROWS * n);
+      return worker;
+    },
+    [&] (Worker & worker, std::uint64_t block) {
+      std::uint64_t first = block * PRODUCT_ROWS;
+      std::uint32_t rows = (std::uint32_t) std::min((std::uint64_t) PRODUCT_ROWS,
+                                                    offsets.size() - first);
+      double means[PRODUCT_ROWS];
+      for (std::uint32_t b = 0; b < rows; b++) {
+        Variant var = open_variant(worker.source, offsets[first + b]);
+        float * dose = &worker.dose[(std::uint64_t) b * n];
+        if (use_minor) {
+          var.minor_allele_dosage(dose);
+        } else {
+          var.alt_dosage(dose);
+        }
+        malformed[first + b] = var.probs_above_max();
+        means[b] = impute_row(dose, n, worker.missing[b], sums[first + b], sumsq[first + b]);
+      }
+      double * block_out = &out[first * k];
+      bgen::dosage_products(worker.dose.data(), rows, n, yt, k, block_out);
+      // the missing samples were zeroed, so add what their mean dosage contributes
+      for (std::uint32_t b = 0; b < rows; b++) {
+        if (worker.missing[b].empty()) {
+          continue;
+        }
+        for (std::uint32_t j = 0; j < k; j++) {
+          const float * y = &yt[(std::uint64_t) j * n];
+          double total = 0;
+          for (auto i : worker.missing[b]) {
+            total += y[i];
+          }
+          block_out[b * k + j] += means[b] * total;
+        }
+      }
+    });
+  return flagged_rows(malformed);
+}
+
+/// @brief add the standardized dosage outer products of many variants to a GRM tile
+///
+/// Covers the tile of sample pairs between two ranges of the selected samples. The
+/// variants go through a block of GRM_BLOCK at a time: first decoded and
+/// standardized across threads, keeping just the samples the tile needs, then
+/// added to the tile across threads, a stripe of rows each. Each tile element
+/// is only ever added to by one thread, in variant order, so the result is the
+/// same whatever the number of threads.
+///
+/// Variants without two alleles, or where every sample is missing or has the same
+/// genotype, are skipped, since they have no spread to standardize.
+///
+/// @param offsets file offsets of the variants
+/// @param row_start first sample of the tile rows
+/// @param n_rows number of tile rows
+/// @param col_start first sample of the tile columns
+/// @param n_cols number of tile columns
+/// @param tile output, n_rows x n_cols sums of products, row major. Not divided by
+///     the number of variants
+/// @param n_used output, for the number of variants which were not skipped
+/// @param threads number of threads to decode with, or zero for one per core
+/// @return positions of variants whose probabilities summed above the bit depth maximum
+std::vector<std::uint64_t> CppBgenReader::grm_tile(
+    const std::vector<std::uint64_t> & offsets, std::uint32_t row_start,
+    std::uint32_t n_rows, std::uint32_t col_start, std::uint32_t n_cols, double * tile,
+    std::uint64_t & n_used, int threads) {
+  if (is_stdin) {
+    throw std::invalid_argument("cannot decode variants by offset from stdin");
+  }
+  std::uint32_t n = n_selected();
+  if (((std::uint64_t) row_start + n_rows > n) || ((std::uint64_t) col_start + n_cols > n)) {
+    throw std::invalid_argument("GRM tile runs past the last sample");
+  }
+  std::fill(tile, tile + (std::uint64_t) n_rows * n_cols, 0.0);
+  n_used = 0;
+  // tiles on the diagonal need each sample's values once, not twice
+  bool diagonal = (row_start == col_start) && (n_rows == n_cols);
+  std::uint64_t width = diagonal ? n_rows : (std::uint64_t) n_rows + n_cols;
+  std::vector<float> z((std::uint64_t) GRM_BLOCK * width);
+  std::vector<char> used(GRM_BLOCK);
+  std::vector<char> malformed(offsets.size(), 0);
+  struct Worker {
+    std::shared_ptr<std::istream> source;
+    std::vector<float> dose;
+  };
+  // open the handles once, rather than for every block
+  std::uint64_t max_block = std::min((std::uint64_t) GRM_BLOCK, offsets.size());
+  ThreadStates<Worker> workers(threads, max_block,
+    [&] {
+      Worker worker;
+      worker.source = open_checked_handle();
+      worker.dose.resize(n);
+      return worker;
+    });
+  std::uint64_t n_stripes = (n_rows + GRM_STRIPE - 1) / GRM_STRIPE;
+  ThreadStates<ProductScratch> scratches(threads, n_stripes,
+                                         [] { return ProductScratch(); });
+  for (std::uint64_t first = 0; first < offsets.size(); first += GRM_BLOCK) {
+    std::uint32_t block = (std::uint32_t) std::min((std::uint64_t) GRM_BLOCK,
+                                                   offsets.size() - first);
+    parallel_for(block, workers,
+      [&] (Worker & worker, std::uint64_t v) {
+        used[v] = 0;
+        Variant var = open_variant(worker.source, offsets[first + v]);
+        if (var.n_alleles != 2) {
+          return;
+        }
+        var.alt_dosage(worker.dose.data());
+        malformed[first + v] = var.probs_above_max();
+        float mean, scale;
+        if (!standard_scale(worker.dose.data(), n, mean, scale)) {
+          return;
+        }
+        float * row = &z[v * width];
+        standardize(&worker.dose[row_start], n_rows, mean, scale, row);
+        if (!diagonal) {
+          standardize(&worker.dose[col_start], n_cols, mean, scale, &row[n_rows]);
+        }
+        used[v] = 1;
+      });
+    // move the variants in use to the front of the block, keeping their order
+    std::uint32_t kept = 0;
+    for (std::uint32_t v = 0; v < block; v++) {
+      if (used[v]) {
+        if (kept != v) {
+          std::copy(&z[v * width], &z[v * width] + width, &z[kept * width]);
+        }
+        kept++;
+      }
+    }
+    n_used += kept;
+    if (kept == 0) {
+      continue;
+    }
+    const float * zj = diagonal ? z.data() : &z[n_rows];
+    parallel_for(n_stripes, scratches,
+      [&] (ProductScratch & scratch, std::uint64_t stripe) {
+        std::uint32_t start = (std::uint32_t) stripe * GRM_STRIPE;
+        std::uint32_t rows = std::min(GRM_STRIPE, n_rows - start);
+        accumulate_products(&z[start], zj, kept, width, 1, rows, n_cols,
+                            &tile[(std::uint64_t) start * n_cols], n_cols, diagonal,
+                            start, scratch);
+      });
+  }
+  if (diagonal) {
+    // only the upper triangle was summed, and the GRM is symmetric
+    for (std::uint64_t i = 1; i < n_rows; i++) {
+      for (std::uint64_t j = 0; j < i; j++) {
+        tile[i * n_cols + j] = tile[j * n_cols + i];
+      }
+    }
+  }
+  return flagged_rows(malformed);
+}
+
+/// @brief correlations between the dosages of many variants
+///
+/// The variants go through in blocks of LD_BLOCK. Each block is decoded and
+/// standardized (see ld_standardize) once, into a ring of blocks holding as many
+/// as the window reaches, then multiplied by itself and the blocks after it within
+/// the window. The products are split across threads by block and stripe of rows,
+/// and each sums its samples in order, so the result is the same whatever the
+/// number of threads.
+///
+/// Variants whose dosages can't be standardized (all missing, or all the same,
+/// including variants without two alleles) get nan correlations.
+///
+/// @param offsets file offsets of the variants, in output order
+/// @param window largest distance between two variants, by their order in offsets,
+///     to find the correlation of
+/// @param banded whether to give the output as a band, rather than a full matrix
+/// @param out output. For a full matrix, offsets.size() x offsets.size() floats,
+///     which needs a window of at least offsets.size() - 1. For a band,
+///     offsets.size() x (window + 1) floats, with the correlation between variants
+///     a and a + d at row a, column d, and nans past the last variant
+/// @param threads number of threads to decode with, or zero for one per core
+/// @return positions of variants whose probabilities summed above the bit depth maximum
+std::vector<std::uint64_t> CppBgenReader::ld_matrix(
+    const std::vector<std::uint64_t> & offsets, std::uint64_t window, bool banded,
+    float * out, int threads) {
+  if (is_stdin) {
+    throw std::invalid_argument("cannot decode variants by offset from stdin");
+  }
+  std::uint64_t n_vars = offsets.size();
+  std::uint32_t n = n_selected();
+  if (n_vars == 0) {
+    return {};
+  }
+  if (!banded && (window + 1 < n_vars)) {
+    throw std::invalid_argument("a full LD matrix needs a window covering every variant");
+  }
+  std::uint64_t out_cols = banded ? window + 1 : n_vars;
+  window = std::min(window, n_vars - 1);
+  float nan = std::numeric_limits<float>::quiet_NaN();
+  if (banded) {
+    // the corner past the last variant never gets written
+    std::fill(out, out + n_vars * out_cols, nan);
+  }
+  
+  std::uint64_t n_blocks = (n_vars + LD_BLOCK - 1) / LD_BLOCK;
+  // blocks after each block which hold variants within the window of it
+  std::uint64_t ahead = (window + LD_BLOCK - 1) / LD_BLOCK;
+  std::uint64_t slots = std::min(ahead + 1, n_blocks);
+  std::uint64_t block_floats = (std::uint64_t) LD_BLOCK * n;
+  std::vector<float> z(slots * block_floats);
+  std::vector<char> valid(n_vars, 0);
+  std::vector<char> malformed(n_vars, 0);
+  struct Worker {
+    std::shared_ptr<std::istream> source;
+    std::vector<float> dose;
+    std::vector<float> z;
+  };
+  struct Products {
+    ProductScratch scratch;
+    std::vector<double> tile;
+  };
+  std::uint64_t stripes = (LD_BLOCK + LD_STRIPE - 1) / LD_STRIPE;
+  // open the handles and allocate buffers once, rather than for every block. The
+  // first blocks decode the most variants at once, every block in the first window
+  ThreadStates<Worker> workers(threads, std::min(slots * LD_BLOCK, n_vars),
+    [&] {
+      Worker worker;
+      worker.source = open_checked_handle();
+      worker.dose.resize(n);
+      worker.z.resize(n);
+      return worker;
+    });
+  ThreadStates<Products> products(threads, slots * stripes,
+    [] { return Products(); });
+  std::uint64_t decoded = 0;
+  for (std::uint64_t k = 0; k < n_blocks; k++) {
+    std::uint64_t last = std::min(k + ahead, n_blocks - 1);
+    // decode whichever blocks have just come within the window
+    std::uint64_t first_var = std::min(decoded * LD_BLOCK, n_vars);
+    std::uint64_t end_var = std::min((last + 1) * LD_BLOCK, n_vars);
+    parallel_for(end_var - first_var, workers,
+      [&] (Worker & worker, std::uint64_t idx) {
+        std::uint64_t v = first_var + idx;
+        Variant var = open_variant(worker.source, offsets[v]);
+        if (var.n_alleles == 2) {
+          var.alt_dosage(worker.dose.data());
+          malformed[v] = var.probs_above_max();
+          valid[v] = ld_standardize(worker.dose.data(), n, worker.z.data());
+        } else {
+          std::fill(worker.z.begin(), worker.z.end(), 0.0f);
+        }
+        // blocks are stored sample by sample, so the kernel reads them in order
+        float * column = &z[(v / LD_BLOCK % slots) * block_floats + v % LD_BLOCK];
+        for (std::uint32_t i = 0; i < n; i++) {
+          column[(std::uint64_t) i * LD_BLOCK] = worker.z[i];
+        }
+      });
+    decoded = std::max(decoded, last + 1);
+    
+    std::uint64_t row_start = k * LD_BLOCK;
+    std::uint32_t rows = (std::uint32_t) std::min((std::uint64_t) LD_BLOCK, n_vars - row_start);
+    const float * zi = &z[(k % slots) * block_floats];
+    parallel_for((last - k + 1) * stripes, products,
+      [&] (Products & state, std::uint64_t task) {
+        std::uint64_t m = k + task / stripes;
+        std::uint32_t stripe_start = (std::uint32_t) (task % stripes) * LD_STRIPE;
+        if (stripe_start >= rows) {
+          return;
+        }
+        std::uint32_t stripe_rows = std::min(LD_STRIPE, rows - stripe_start);
+        std::uint64_t col_start = m * LD_BLOCK;
+        std::uint32_t cols = (std::uint32_t) std::min((std::uint64_t) LD_BLOCK,
+                                                      n_vars - col_start);
+        const float * zj = &z[(m % slots) * block_floats];
+        bool upper = (m == k);
+        std::vector<double> & tile = state.tile;
+        tile.assign((std::uint64_t) stripe_rows * cols, 0.0);
+        for (std::uint32_t s = 0; s < n; s += LD_CHUNK) {
+          std::uint32_t chunk = std::min(LD_CHUNK, n - s);
+          std::uint64_t first = (std::uint64_t) s * LD_BLOCK;
+          accumulate_products(&zi[first + stripe_start], &zj[first], chunk, LD_BLOCK, 1,
+                              stripe_rows, cols, tile.data(), cols, upper, stripe_start,
+                              state.scratch);
+        }
+        for (std::uint32_t i = 0; i < stripe_rows; i++) {
+          std::uint64_t a = row_start + stripe_start + i;
+          for (std::uint32_t j = upper ? stripe_start + i : 0; j < cols; j++) {
+            std::uint64_t b = col_start + j;
+            if (b - a > window) {
+              break;
+            }
+            float r = nan;
+            if (valid[a] && valid[b]) {
+              r = (a == b) ? 1.0f : (float) std::max(-1.0, std::min(1.0,
+                                                  tile[(std::uint64_t) i * cols + j]));
+            }
+            if (banded) {
+              out[a * out_cols + (b - a)] = r;
+            } else {
+              out[a * out_cols + b] = r;
+              out[b * out_cols + a] = r;
+            }
+          }
+        }
+      });
+  }
+  return flagged_rows(malformed);
+}
+
+/// how many variants to reserve space for, before parsing them
+///
+/// Only reserve what the file could hold. nvariants comes straight from the header,
+/// so a corrupt count would otherwise ask for GBs up front. Parsing still stops at
+/// whatever the file really contains.
+std::uint64_t CppBgenReader::n_to_reserve() {
   std::uint64_t n_reserve = header.nvariants;
   if (file_size > 0) {
     std::uint64_t possible = file_size / MIN_VARIANT_BYTES + 1;
@@ -151,30 +690,73 @@ void CppBgenReader::parse_all_variants() {
     }
   } else {
     // A stream cannot be seeked, so nothing here bounds the count. Cap the reserve
-    // and let the vector grow as the variants actually arrive.
+    // and let the arrays grow as the variants actually arrive.
     n_reserve = std::min(n_reserve, MAX_VARIANT_RESERVE);
   }
-  variants.reserve(n_reserve);
+  return n_reserve;
+}
+
+/// build a Variant for one of the parsed variants, ready to read its genotypes
+///
+/// @param idx position of the variant in the catalog
+Variant CppBgenReader::get(std::size_t idx) {
+  if (idx >= catalog.size()) {
+    throw std::out_of_range("variant index " + std::to_string(idx) +
+                            " is out of range for a bgen with " +
+                            std::to_string(catalog.size()) + " variants");
+  }
+  std::uint64_t var_offset = catalog.offset(idx);
+  Variant var(handle, var_offset, header.layout, header.compression, header.nsamples, is_stdin);
+  var.select_samples(subset);
+  var.use_cache(cache);
+  return var;
+}
+
+/// list the identifiers and offsets of every variant in the bgen
+///
+/// This only keeps a compact catalog entry per variant, rather than a whole Variant.
+/// One scratch Variant is reparsed at each offset in turn, so its strings keep their
+/// capacity, and no Genotypes is built at all. A stdin bgen still builds a full
+/// Variant each time, since its genotype block has to be read through to reach
+/// the next variant.
+void CppBgenReader::parse_all_variants() {
+  if (catalog.size() == header.nvariants) {
+    return;
+  }
+  offset = first_variant_offset();
+  catalog.clear();
+  catalog.reserve(n_to_reserve());
+  Variant scratch;
+  scratch.handle = handle;
+  std::uint64_t geno_offset;
   try {
     for (std::uint32_t idx=0; idx < header.nvariants; idx++) {
-      variants.push_back(next_var());
+      std::uint64_t start = offset;
+      if (is_stdin) {
+        Variant var = next_var();
+        catalog.append(start, var.varid, var.rsid, var.chrom, var.pos, var.n_alleles);
+      } else {
+        scratch.parse_fields(start, header.layout, header.compression, header.nsamples,
+                             false, geno_offset);
+        offset = scratch.next_variant_offset;
+        catalog.append(start, scratch.varid, scratch.rsid, scratch.chrom,
+                       scratch.pos, scratch.n_alleles);
+      }
     }
   } catch (const std::out_of_range &) {
     // Running out of file part way through means the bgen holds fewer variants
     // than its header lists, so say that, rather than reporting the end of the
     // file for what looked like a perfectly valid variant index.
-    std::uint64_t parsed = variants.size();
-    variants.clear();
+    std::uint64_t parsed = catalog.size();
+    catalog.clear();
     throw std::invalid_argument("bgen is truncated - the header lists " +
                                 std::to_string(header.nvariants) +
                                 " variants, but only " + std::to_string(parsed) +
                                 " could be read");
   } catch (...) {
-    // Drop the partial list, so a later call retries and raises again, rather
-    // than finding a full sized vector and assuming the parse had finished. The
-    // variants are pushed on as they parse for the same reason - resizing up
-    // front would leave empty variants behind on failure.
-    variants.clear();
+    // Drop the partial catalog, so a later call retries and raises again, rather
+    // than finding a full sized catalog and assuming the parse had finished.
+    catalog.clear();
     throw;
   }
   // finally reset the offset position to the first variant, so we can iterate
@@ -182,44 +764,102 @@ void CppBgenReader::parse_all_variants() {
   offset = first_variant_offset();
 }
 
+/// find the offset and position of every variant, as fast as the file can be read
+///
+/// This skips everything else about the variants, and doesn't fill the catalog, so
+/// it suits planning work over a bgen before anything is decoded. It reads through a
+/// handle of its own, so it leaves iteration where it was.
+///
+/// @param offsets filled with the file offset of each variant
+/// @param positions filled with the position of each variant
+void CppBgenReader::scan_positions(std::vector<std::uint64_t> & offsets,
+                                   std::vector<std::uint32_t> & positions) {
+  if (is_stdin) {
+    throw std::invalid_argument("cannot scan variants from stdin");
+  }
+  std::shared_ptr<std::istream> source = open_handle();
+  if (source->fail()) {
+    throw std::invalid_argument("error reading from '" + path + "'");
+  }
+  offsets.clear();
+  positions.clear();
+  offsets.reserve(n_to_reserve());
+  positions.reserve(n_to_reserve());
+  try {
+    scan_variants(source.get(), first_variant_offset(), header.layout, header.compression,
+                  header.nsamples, header.nvariants, offsets, positions);
+  } catch (const std::out_of_range &) {
+    // the offset is pushed before the variant is read, so the last one is partial
+    throw std::invalid_argument("bgen is truncated - the header lists " +
+                                std::to_string(header.nvariants) +
+                                " variants, but only " + std::to_string(offsets.size() - 1) +
+                                " could be read");
+  }
+}
+
+/// collect the fields of every variant which go into an index, in file order
+///
+/// This reads only the variant headers, through a handle of its own, and without
+/// filling the catalog.
+///
+/// @param rows filled with the chromosome, position, rsID, alleles, offset and size
+///     of each variant
+void CppBgenReader::index_rows(IndexRows & rows) {
+  // one batch holds every variant
+  std::uint64_t batch_size = (std::uint64_t) header.nvariants + 1;
+  std::unique_ptr<IndexScanner> scanner(index_scanner(batch_size, 1));
+  rows.clear();
+  scanner->next(rows);
+}
+
+/// start scanning the fields which go into an index, in a background thread
+///
+/// This returns a heap allocated IndexScanner, which the caller takes ownership of.
+///
+/// @param batch_size most variants in each batch the scanner hands out
+/// @param depth most batches to hold before they are taken
+IndexScanner * CppBgenReader::index_scanner(std::uint64_t batch_size, int depth) {
+  if (is_stdin) {
+    throw std::invalid_argument("cannot index a bgen read from stdin");
+  }
+  std::shared_ptr<std::istream> source = open_handle();
+  if (source->fail()) {
+    throw std::invalid_argument("error reading from '" + path + "'");
+  }
+  return new IndexScanner(source, first_variant_offset(), header.layout,
+                          header.compression, header.nsamples, header.nvariants,
+                          batch_size, depth);
+}
+
 /// drop a subset of variants passed in by indexes
 void CppBgenReader::drop_variants(std::vector<int> indices) {
   // Check every index before dropping any, so a bad index cannot leave the
-  // variants half dropped. Without this, an out of range index builds an invalid
-  // iterator and erases from outside the vector, which segfaults.
+  // variants half dropped.
   for (auto idx : indices) {
-    if ((idx < 0) || ((std::size_t) idx >= variants.size())) {
+    if ((idx < 0) || ((std::uint64_t) idx >= catalog.size())) {
       throw std::out_of_range("variant index " + std::to_string(idx) +
                               " is out of range for a bgen with " +
-                              std::to_string(variants.size()) + " variants");
+                              std::to_string(catalog.size()) + " variants");
     }
   }
   
-  // sort indices in descending order, so dropping elemtns doesn't affect later items
-  std::sort(indices.rbegin(), indices.rend());
-  
-  // adjacent_find checks for duplicates without editing indices, whereas
-  // std::unique would shuffle them about before we then throw
-  if (std::adjacent_find(indices.begin(), indices.end()) != indices.end()) {
+  // adjacent_find checks for duplicates once sorted, before anything is dropped
+  std::vector<int> sorted = indices;
+  std::sort(sorted.begin(), sorted.end());
+  if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
     throw std::invalid_argument("can't drop variants with duplicate indices");
   }
   
-  for (auto idx : indices) {
-    variants.erase(variants.begin() + idx);
-  }
-  variants.shrink_to_fit();
-  
-  // and sort the variants again afterward
-  std::sort(variants.begin(), variants.end(),
-          [] (Variant const& a, Variant const& b) { return a.pos < b.pos; });
+  // this also sorts the remaining variants by position, as before
+  catalog.drop(sorted);
 }
 
 /// get all the IDs for the variants in the bgen file
 std::vector<std::string> CppBgenReader::varids() {
   parse_all_variants();
-  std::vector<std::string> varid(variants.size());
-  for (std::uint32_t x=0; x<variants.size(); x++) {
-    varid[x] = variants[x].varid;
+  std::vector<std::string> varid(catalog.size());
+  for (std::uint64_t x=0; x<catalog.size(); x++) {
+    varid[x] = catalog.varid(x);
   }
   return varid;
 }
@@ -227,9 +867,9 @@ std::vector<std::string> CppBgenReader::varids() {
 /// get all the rsIDs for the variants in the bgen file
 std::vector<std::string> CppBgenReader::rsids() {
   parse_all_variants();
-  std::vector<std::string> rsid(variants.size());
-  for (std::uint32_t x=0; x<variants.size(); x++) {
-    rsid[x] = variants[x].rsid;
+  std::vector<std::string> rsid(catalog.size());
+  for (std::uint64_t x=0; x<catalog.size(); x++) {
+    rsid[x] = catalog.rsid(x);
   }
   return rsid;
 }
@@ -237,9 +877,9 @@ std::vector<std::string> CppBgenReader::rsids() {
 /// get all the chroms for the variants in the bgen file
 std::vector<std::string> CppBgenReader::chroms() {
   parse_all_variants();
-  std::vector<std::string> chrom(variants.size());
-  for (std::uint32_t x=0; x<variants.size(); x++) {
-    chrom[x] = variants[x].chrom;
+  std::vector<std::string> chrom(catalog.size());
+  for (std::uint64_t x=0; x<catalog.size(); x++) {
+    chrom[x] = catalog.chrom(x);
   }
   return chrom;
 }
@@ -247,9 +887,9 @@ std::vector<std::string> CppBgenReader::chroms() {
 /// get all the positions for the variants in the bgen file
 std::vector<std::uint32_t> CppBgenReader::positions() {
   parse_all_variants();
-  std::vector<std::uint32_t> position(variants.size());
-  for (std::uint32_t x=0; x<variants.size(); x++) {
-    position[x] = variants[x].pos;
+  std::vector<std::uint32_t> position(catalog.size());
+  for (std::uint64_t x=0; x<catalog.size(); x++) {
+    position[x] = catalog.position(x);
   }
   return position;
 }
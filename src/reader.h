@@ -6,22 +6,73 @@
 #include <stdexcept>
 #include <vector>
 
+#include "blockcache.h"
+#include "catalog.h"
+#include "grm.h"
 #include "header.h"
+#include "ld.h"
+#include "mapped.h"
+#include "parallel.h"
+#include "prefetch.h"
+#include "products.h"
 #include "samples.h"
+#include "scan.h"
+#include "varindex.h"
 #include "variant.h"
 
 namespace bgen {
 
 class CppBgenReader {
+  std::string path;
   bool is_stdin = false;
+  bool use_mmap = false;
   // size of the bgen in bytes, or zero if not known (stdin cannot be seeked)
   std::uint64_t file_size = 0;
+  std::unique_ptr<Prefetcher> prefetcher;
+  std::shared_ptr<std::istream> open_handle();
+  std::uint64_t n_to_reserve();
+  std::shared_ptr<std::istream> open_checked_handle();
+  Variant open_variant(std::shared_ptr<std::istream> & source, std::uint64_t offset);
+  template <typename Decode>
+  std::vector<std::uint64_t> decode_rows(const std::vector<std::uint64_t> & offsets,
+                                         int threads, Decode decode);
 public:
-  CppBgenReader(std::string path, std::string sample_path = "", bool delay_parsing = false);
+  CppBgenReader(std::string path, std::string sample_path = "", bool delay_parsing = false,
+                bool use_mmap = false);
   void close_stream();
   std::uint64_t first_variant_offset();
   void parse_all_variants();
+  void scan_positions(std::vector<std::uint64_t> & offsets,
+                      std::vector<std::uint32_t> & positions);
+  void index_rows(IndexRows & rows);
+  IndexScanner * index_scanner(std::uint64_t batch_size, int depth);
   Variant next_var();
+  void start_prefetch(std::uint64_t from, int depth, int threads);
+  Variant * next_prefetched();
+  void stop_prefetch();
+  void select_samples(std::shared_ptr<const SampleSubset> _subset);
+  std::uint32_t n_selected();
+  std::vector<std::uint64_t> dosage_matrix(const std::vector<std::uint64_t> & offsets,
+                                           void * dose, bool use_minor, int threads,
+                                           int type=FLOAT32);
+  std::vector<std::uint64_t> hard_call_matrix(const std::vector<std::uint64_t> & offsets,
+                                              std::int8_t * calls, float threshold,
+                                              int threads);
+  std::vector<std::uint64_t> variant_stats(const std::vector<std::uint64_t> & offsets,
+                                           StatsTable & table, float threshold,
+                                           int threads);
+  std::vector<std::uint64_t> dosage_products(const std::vector<std::uint64_t> & offsets,
+                                             const float * yt, std::uint32_t k,
+                                             double * out, double * sums, double * sumsq,
+                                             bool use_minor, int threads);
+  std::vector<std::uint64_t> grm_tile(const std::vector<std::uint64_t> & offsets,
+                                      std::uint32_t row_start, std::uint32_t n_rows,
+                                      std::uint32_t col_start, std::uint32_t n_cols,
+                                      double * tile, std::uint64_t & n_used,
+                                      int threads);
+  std::vector<std::uint64_t> ld_matrix(const std::vector<std::uint64_t> & offsets,
+                                       std::uint64_t window, bool banded, float * out,
+                                       int threads);
   void drop_variants(std::vector<int> indices);
   // the bgen stream, shared with every Variant opened from this reader, so the
   // file is closed once this reader and all of its variants are gone
@@ -30,11 +81,17 @@ public:
   std::vector<std::string> rsids();
   std::vector<std::string> chroms();
   std::vector<std::uint32_t> positions();
-  Variant & operator[](std::size_t idx) { return variants[idx]; }
-  Variant & get(std::size_t idx) { return variants[idx]; }
-  std::vector<Variant> variants;
+  Variant operator[](std::size_t idx) { return get(idx); }
+  Variant get(std::size_t idx);
+  // identifiers and offsets of the parsed variants. Variants are only built from
+  // these when asked for, since a parsed Variant is far larger than its entry here
+  VariantCatalog catalog;
   Header header;
   Samples samples;
+  // samples for the variants from this reader to restrict their output to, if any
+  std::shared_ptr<const SampleSubset> subset;
+  // decompressed genotype blocks shared by the variants from this reader, if kept
+  std::shared_ptr<BlockCache> cache;
   std::uint64_t offset;
 };
 
@@ -188,4 +188,38 @@ const std::vector<std::string> & Samples::get_samples() {
   return samples;
 }
 
+/// pick out a subset of samples, by their index in the bgen
+///
+/// @param _indices cohort indices of the samples to keep, in the order to output them
+/// @param _n_samples number of samples in the bgen
+SampleSubset::SampleSubset(const std::vector<std::uint32_t> & _indices,
+                           std::uint32_t _n_samples) :
+    indices(_indices), n_samples(_n_samples) {
+  column.assign(n_samples, NOT_SELECTED);
+  for (std::uint32_t i = 0; i < indices.size(); i++) {
+    std::uint32_t idx = indices[i];
+    if (idx >= n_samples) {
+      throw std::out_of_range("sample index " + std::to_string(idx) +
+                              " is out of range for a bgen with " +
+                              std::to_string(n_samples) + " samples");
+    }
+    if (column[idx] != NOT_SELECTED) {
+      // a sample picked twice would need two output columns, but column only has
+      // room for one, so a missing sample would then only be blanked in one of them
+      throw std::invalid_argument("sample index " + std::to_string(idx) +
+                                  " was selected more than once");
+    }
+    column[idx] = i;
+  }
+  // walking the column map gives the ascending order directly, without a sort
+  sorted.reserve(indices.size());
+  dest.reserve(indices.size());
+  for (std::uint32_t idx = 0; idx < n_samples; idx++) {
+    if (column[idx] != NOT_SELECTED) {
+      sorted.push_back(idx);
+      dest.push_back(column[idx]);
+    }
+  }
+}
+
 } // namespace bgen
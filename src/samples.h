@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <fstream>
+#include <limits>
 #include <vector>
 #include <string>
 
@@ -32,6 +33,33 @@ private:
   std::uint64_t file_size = 0;
 };
 
+/// marks a sample which is not part of a SampleSubset, in SampleSubset::column
+const std::uint32_t NOT_SELECTED = std::numeric_limits<std::uint32_t>::max();
+
+/// a selection of samples for the genotype decoders to restrict their output to
+///
+/// Output columns follow the order the samples were picked in. The decoders walk the
+/// genotype block from start to end though, since a sample's position in the block
+/// depends on the ploidy of every sample before it, so the selection is also kept in
+/// ascending order, along with the output column of each of those. column maps the
+/// other way, from a cohort index to its output column, for the few things (the list
+/// of missing samples) which are stored by cohort index.
+///
+/// This is built once per selection and shared, read only, by every variant decoded
+/// with it, so the per sample tables are not rebuilt per variant.
+struct SampleSubset {
+  SampleSubset(const std::vector<std::uint32_t> & indices, std::uint32_t n_samples);
+  std::uint32_t size() const { return (std::uint32_t) indices.size(); }
+  // cohort indices of the selected samples, in output order
+  std::vector<std::uint32_t> indices;
+  // the same indices in ascending order, and the output column for each
+  std::vector<std::uint32_t> sorted;
+  std::vector<std::uint32_t> dest;
+  // output column of every sample in the cohort, or NOT_SELECTED
+  std::vector<std::uint32_t> column;
+  std::uint32_t n_samples = 0;
+};
+
 } // namespace bgen
 
 #endif  // BGEN_SAMPLES_H_
@@ -0,0 +1,283 @@
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "mapped.h"
+#include "scan.h"
+
+namespace bgen {
+
+/// bytes read at once while variants are packed closely enough to share a read
+const std::uint64_t SCAN_CHUNK = 1 << 20;
+
+/// bytes read at once when variants are too far apart to share a read
+///
+/// Each variant then needs a read of its own, and reading a whole chunk for the ~50
+/// bytes of fields would mostly fetch genotypes only to skip over them.
+const std::uint64_t SCAN_SMALL_READ = 512;
+
+/// widest spacing between variants at which a chunk is still read in one go
+///
+/// A chunk then covers at least 16 variants. Past this, reading the genotypes in
+/// between costs more than seeking over them.
+const std::uint64_t SCAN_MAX_STRIDE = SCAN_CHUNK / 16;
+
+/// a window onto the bgen bytes, refilled from the stream as the scan moves on
+///
+/// A memory mapped bgen is one window over the whole file, so it never refills.
+class ScanWindow {
+  std::istream * source;
+  const char * data = nullptr;
+  std::uint64_t start = 0;
+  std::uint64_t size = 0;
+  std::vector<char> buffer;
+  bool mapped = false;
+public:
+  // bytes between the starts of the last two variants, which sets the read size
+  std::uint64_t stride = 0;
+  ScanWindow(std::istream * _source) : source(_source) {
+    const MappedFile * map = as_mapped(source);
+    if (map != nullptr) {
+      mapped = true;
+      data = map->data();
+      size = map->size();
+    }
+  }
+  /// get a pointer to n bytes at a file offset, reading them in if needed
+  ///
+  /// @return pointer to the bytes, or nullptr if the file ends before them
+  const char * get(std::uint64_t pos, std::uint64_t n) {
+    if ((pos >= start) && (pos - start <= size) && (n <= size - (pos - start))) {
+      return data + (pos - start);
+    }
+    if (mapped) {
+      return nullptr;
+    }
+    std::uint64_t want = (stride <= SCAN_MAX_STRIDE) ? SCAN_CHUNK : SCAN_SMALL_READ;
+    if (want < n) {
+      want = n;
+    }
+    buffer.resize(want);
+    source->clear();
+    source->seekg(pos);
+    source->read(buffer.data(), (std::streamsize) want);
+    start = pos;
+    size = (std::uint64_t) source->gcount();
+    data = buffer.data();
+    return (n <= size) ? data : nullptr;
+  }
+  /// copy out a string of n bytes at a file offset, and step past it
+  std::string text(std::uint64_t & pos, std::uint64_t n) {
+    const char * bytes = get(pos, n);
+    if (bytes == nullptr) {
+      throw std::out_of_range("reached end of file");
+    }
+    pos += n;
+    return std::string(bytes, n);
+  }
+  template <typename T>
+  T value(std::uint64_t & pos) {
+    const char * bytes = get(pos, sizeof(T));
+    if (bytes == nullptr) {
+      throw std::out_of_range("reached end of file");
+    }
+    T value;
+    std::memcpy(&value, bytes, sizeof(T));
+    pos += sizeof(T);
+    return value;
+  }
+};
+
+/// find the offset and position of every variant, without reading anything else
+///
+/// Parsing a Variant reads each field through the stream, and builds strings for the
+/// IDs and alleles. This reads only the length prefixes (to step over the strings),
+/// the position, and the genotype block length (to step over the genotypes), out of
+/// large reads which cover many variants at once when they are small. A layout 1
+/// sample count is checked as it would be for a parsed Variant, but the skipped IDs
+/// and alleles are only found to be cut short by the read which follows them.
+///
+/// @param source stream for the bgen, which is read from wherever it sits
+/// @param from file offset of the first variant
+/// @param layout bgen layout version (1 or 2)
+/// @param compression compression scheme (0=no compression, 1=zlib, 2=zstd)
+/// @param expected_n number of samples in the bgen
+/// @param n_variants number of variants to scan
+/// @param offsets file offsets of the variants, appended to
+/// @param positions variant positions, appended to
+void scan_variants(std::istream * source, std::uint64_t from, int layout, int compression,
+                   std::uint32_t expected_n, std::uint32_t n_variants,
+                   std::vector<std::uint64_t> & offsets,
+                   std::vector<std::uint32_t> & positions) {
+  ScanWindow window(source);
+  std::uint64_t pos = from;
+  for (std::uint32_t idx = 0; idx < n_variants; idx++) {
+    offsets.push_back(pos);
+    std::uint32_t n_samples = expected_n;
+    if (layout == 1) {
+      n_samples = window.value<std::uint32_t>(pos);
+      if (n_samples != expected_n) {
+        throw std::invalid_argument("number of samples doesn't match");
+      }
+    }
+    for (int field = 0; field < 3; field++) {
+      pos += window.value<std::uint16_t>(pos);
+    }
+    positions.push_back(window.value<std::uint32_t>(pos));
+    std::uint16_t n_alleles = (layout == 1) ? 2 : window.value<std::uint16_t>(pos);
+    for (int x = 0; x < n_alleles; x++) {
+      pos += window.value<std::uint32_t>(pos);
+    }
+    std::uint64_t length;
+    if ((layout == 1) && (compression == 0)) {
+      length = (std::uint64_t) n_samples * 6;
+    } else {
+      length = window.value<std::uint32_t>(pos);
+    }
+    pos += length;
+    window.stride = pos - offsets.back();
+  }
+}
+
+/// most rows to reserve space for up front, whatever the header claims
+const std::uint64_t INDEX_RESERVE_CAP = 1 << 20;
+
+/// start scanning from the first variant
+///
+/// @param source handle the scan reads through, which nothing else may use
+/// @param from file offset of the first variant
+/// @param layout bgen layout version (1 or 2)
+/// @param compression compression scheme (0=no compression, 1=zlib, 2=zstd)
+/// @param expected_n number of samples in the bgen
+/// @param n_variants number of variants to scan
+/// @param batch_size most rows in each batch handed out
+/// @param depth most batches to hold before the caller takes them
+IndexScanner::IndexScanner(std::shared_ptr<std::istream> _source, std::uint64_t _from,
+                           int _layout, int _compression, std::uint32_t _expected_n,
+                           std::uint32_t _n_variants, std::uint64_t _batch_size,
+                           int _depth) :
+    source(_source), from(_from), layout(_layout), compression(_compression),
+    expected_n(_expected_n), n_variants(_n_variants), batch_size(_batch_size) {
+  if (_batch_size < 1) {
+    throw std::invalid_argument("index batches need at least one variant");
+  }
+  if (_depth < 1) {
+    throw std::invalid_argument("index scan depth must be at least one");
+  }
+  depth = (std::uint64_t) _depth;
+  worker = std::thread(&IndexScanner::work, this);
+}
+
+IndexScanner::~IndexScanner() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  freed.notify_all();
+  worker.join();
+}
+
+/// read each variant's fields, queueing them a batch at a time
+///
+/// This steps through the bgen as scan_variants does, but copies out the IDs and
+/// the first two alleles rather than skipping over them. A failure ends the scan,
+/// and is raised to the caller once it has taken the batches before it.
+void IndexScanner::work() {
+  ScanWindow window(source.get());
+  std::uint64_t pos = from;
+  std::uint32_t idx = 0;
+  try {
+    while (idx < n_variants) {
+      IndexRows batch;
+      batch.reserve(std::min({batch_size, (std::uint64_t) (n_variants - idx),
+                              INDEX_RESERVE_CAP}));
+      for (; (idx < n_variants) && (batch.size() < batch_size); idx++) {
+        std::uint64_t start = pos;
+        std::uint32_t n_samples = expected_n;
+        if (layout == 1) {
+          n_samples = window.value<std::uint32_t>(pos);
+          if (n_samples != expected_n) {
+            throw std::invalid_argument("number of samples doesn't match");
+          }
+        }
+        pos += window.value<std::uint16_t>(pos);  // skip the varid
+        std::uint16_t len = window.value<std::uint16_t>(pos);
+        std::string rsid = window.text(pos, len);
+        len = window.value<std::uint16_t>(pos);
+        std::string chrom = window.text(pos, len);
+        std::uint32_t position = window.value<std::uint32_t>(pos);
+        std::uint16_t n_alleles = (layout == 1) ? 2 : window.value<std::uint16_t>(pos);
+        std::string allele1, allele2;
+        for (int x = 0; x < n_alleles; x++) {
+          std::uint32_t allele_len = window.value<std::uint32_t>(pos);
+          if (x == 0) {
+            allele1 = window.text(pos, allele_len);
+          } else if (x == 1) {
+            allele2 = window.text(pos, allele_len);
+          } else {
+            pos += allele_len;
+          }
+        }
+        std::uint64_t length;
+        if ((layout == 1) && (compression == 0)) {
+          length = (std::uint64_t) n_samples * 6;
+        } else {
+          length = window.value<std::uint32_t>(pos);
+        }
+        pos += length;
+        window.stride = pos - start;
+
+        batch.chroms.push_back(std::move(chrom));
+        batch.positions.push_back(position);
+        batch.rsids.push_back(std::move(rsid));
+        batch.n_alleles.push_back(n_alleles);
+        batch.allele1.push_back(std::move(allele1));
+        batch.allele2.push_back(std::move(allele2));
+        batch.offsets.push_back(start);
+        batch.sizes.push_back((std::uint32_t) (pos - start));
+      }
+      std::unique_lock<std::mutex> lock(mutex);
+      freed.wait(lock, [this] { return stopping || (ready.size() < depth); });
+      if (stopping) {
+        return;
+      }
+      ready.push_back(std::move(batch));
+      filled.notify_all();
+    }
+  } catch (const std::out_of_range &) {
+    std::lock_guard<std::mutex> lock(mutex);
+    error = std::make_exception_ptr(std::invalid_argument(
+        "bgen is truncated - the header lists " + std::to_string(n_variants) +
+        " variants, but only " + std::to_string(idx) + " could be read"));
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex);
+    error = std::current_exception();
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  finished = true;
+  filled.notify_all();
+}
+
+/// take the next batch of rows, waiting for it if needed
+///
+/// @param rows replaced with the next batch
+/// @return false once every batch has been taken
+bool IndexScanner::next(IndexRows & rows) {
+  std::unique_lock<std::mutex> lock(mutex);
+  filled.wait(lock, [this] { return finished || !ready.empty(); });
+  if (!ready.empty()) {
+    rows = std::move(ready.front());
+    ready.pop_front();
+    lock.unlock();
+    freed.notify_all();
+    return true;
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  return false;
+}
+
+} // namespace bgen
@@ -0,0 +1,62 @@
+#ifndef BGEN_SCAN_H_
+#define BGEN_SCAN_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "varindex.h"
+
+namespace bgen {
+
+void scan_variants(std::istream * source, std::uint64_t from, int layout, int compression,
+                   std::uint32_t expected_n, std::uint32_t n_variants,
+                   std::vector<std::uint64_t> & offsets,
+                   std::vector<std::uint32_t> & positions);
+
+/// scans the fields which go into a variant index, in a background thread
+///
+/// Building a .bgi splits into reading the bgen, and loading rows into sqlite. The
+/// scan runs here, in a thread of its own, and hands its rows out in batches, so the
+/// next batch is read while the caller loads the last. At most depth batches wait to
+/// be taken, which bounds the memory held however large the bgen is.
+class IndexScanner {
+public:
+  IndexScanner(std::shared_ptr<std::istream> source, std::uint64_t from, int layout,
+               int compression, std::uint32_t expected_n, std::uint32_t n_variants,
+               std::uint64_t batch_size, int depth);
+  ~IndexScanner();
+  IndexScanner(const IndexScanner &) = delete;
+  IndexScanner & operator=(const IndexScanner &) = delete;
+  bool next(IndexRows & rows);
+private:
+  void work();
+  std::shared_ptr<std::istream> source;
+  std::uint64_t from;
+  int layout;
+  int compression;
+  std::uint32_t expected_n;
+  std::uint32_t n_variants;
+  std::uint64_t batch_size;
+  std::uint64_t depth;
+  std::deque<IndexRows> ready;
+  std::mutex mutex;
+  // signals a batch being queued (or the scan ending), for the consumer, and a
+  // batch being taken (or the scanner stopping), for the worker
+  std::condition_variable filled;
+  std::condition_variable freed;
+  std::exception_ptr error;
+  bool finished = false;
+  bool stopping = false;
+  std::thread worker;
+};
+
+} // namespace bgen
+
+#endif  // BGEN_SCAN_H_
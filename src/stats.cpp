@@ -0,0 +1,111 @@
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "stats.h"
+
+namespace bgen {
+
+/// turn the sums over every sample into the variant's statistics
+///
+/// @param stats statistics to fill in
+/// @param n_samples number of samples summed over, missing ones included
+void StatsSums::finish(VariantStats & stats, std::uint64_t n_samples) const {
+  stats.missing_rate = (n_samples > 0) ? (double) missing / n_samples : std::nan("1");
+  if (alleles > 0) {
+    stats.alt_freq = dosage / alleles;
+    double theta = stats.alt_freq;
+    if ((theta > 0) && (theta < 1)) {
+      stats.info = 1.0 - variance / (alleles * theta * (1.0 - theta));
+    } else {
+      // a monomorphic variant has nothing left to impute, as IMPUTE and qctool treat it
+      stats.info = 1.0;
+    }
+  }
+  stats.hom_ref = (std::uint32_t) counts[0];
+  stats.het = (std::uint32_t) counts[1];
+  stats.hom_alt = (std::uint32_t) counts[2];
+  stats.hwe_p = hwe_exact(counts[0], counts[1], counts[2]);
+}
+
+/// @brief exact test for Hardy-Weinberg equilibrium
+///
+/// Follows Wigginton, Cutler and Abecasis (2005), summing the probabilities of every
+/// heterozygote count (given the allele counts) which is no more likely than the one
+/// observed. The probabilities are worked out relative to the most likely count, so
+/// nothing overflows whatever the sample size.
+///
+/// @return p-value, or nan if no samples were called
+double hwe_exact(std::uint64_t hom_ref, std::uint64_t het, std::uint64_t hom_alt) {
+  std::uint64_t n = hom_ref + het + hom_alt;
+  if (n == 0) {
+    return std::nan("1");
+  }
+  std::uint64_t rare_homs = std::min(hom_ref, hom_alt);
+  std::uint64_t rare = 2 * rare_homs + het;
+
+  // start from the most likely heterozygote count, which has the parity of rare
+  std::uint64_t mid = (std::uint64_t) ((double) rare * (double) (2 * n - rare) / (2.0 * n));
+  if ((mid & 1) != (rare & 1)) {
+    mid++;
+  }
+  std::vector<double> probs(rare + 1, 0.0);
+  probs[mid] = 1.0;
+  double total = 1.0;
+
+  double homr = (double) ((rare - mid) / 2);
+  double homc = (double) (n - mid) - homr;
+  for (std::uint64_t hets = mid; hets > 1; hets -= 2) {
+    probs[hets - 2] = probs[hets] * hets * (hets - 1.0) / (4.0 * (homr + 1.0) * (homc + 1.0));
+    total += probs[hets - 2];
+    homr += 1;
+    homc += 1;
+  }
+  homr = (double) ((rare - mid) / 2);
+  homc = (double) (n - mid) - homr;
+  for (std::uint64_t hets = mid; hets + 2 <= rare; hets += 2) {
+    probs[hets + 2] = probs[hets] * 4.0 * homr * homc / ((hets + 2.0) * (hets + 1.0));
+    total += probs[hets + 2];
+    homr -= 1;
+    homc -= 1;
+  }
+
+  // a little slack, so counts as likely as the observed one are not lost to rounding
+  double observed = probs[het] * (1.0 + 1e-7);
+  double p_value = 0;
+  for (auto p: probs) {
+    if (p <= observed) {
+      p_value += p;
+    }
+  }
+  return std::min(1.0, p_value / total);
+}
+
+void StatsTable::resize(std::uint64_t n) {
+  varid.resize(n);
+  rsid.resize(n);
+  chrom.resize(n);
+  pos.resize(n);
+  n_alleles.resize(n);
+  alt_freq.resize(n);
+  missing_rate.resize(n);
+  info.resize(n);
+  hwe_p.resize(n);
+  hom_ref.resize(n);
+  het.resize(n);
+  hom_alt.resize(n);
+}
+
+/// fill in the statistics of one row
+void StatsTable::set(std::uint64_t row, const VariantStats & stats) {
+  alt_freq[row] = stats.alt_freq;
+  missing_rate[row] = stats.missing_rate;
+  info[row] = stats.info;
+  hwe_p[row] = stats.hwe_p;
+  hom_ref[row] = stats.hom_ref;
+  het[row] = stats.het;
+  hom_alt[row] = stats.hom_alt;
+}
+
+} // namespace bgen
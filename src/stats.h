@@ -0,0 +1,94 @@
+#ifndef BGEN_STATS_H_
+#define BGEN_STATS_H_
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace bgen {
+
+/// quality control statistics of one biallelic variant
+///
+/// Variants with more alleles, or ploidy above 2, keep the defaults: nan for the
+/// rates and scores, and zero counts.
+struct VariantStats {
+  // mean alt allele dosage per allele copy, over the called samples
+  double alt_freq = std::numeric_limits<double>::quiet_NaN();
+  // fraction of samples which are missing, or have a ploidy of zero
+  double missing_rate = std::numeric_limits<double>::quiet_NaN();
+  // IMPUTE info score, from the variance of each sample's dosage
+  double info = std::numeric_limits<double>::quiet_NaN();
+  // exact Hardy-Weinberg p-value of the diploid hard call counts
+  double hwe_p = std::numeric_limits<double>::quiet_NaN();
+  // hard call counts of the diploid samples
+  std::uint32_t hom_ref = 0;
+  std::uint32_t het = 0;
+  std::uint32_t hom_alt = 0;
+};
+
+/// running sums over samples, for working out VariantStats in one pass
+struct StatsSums {
+  double dosage = 0;
+  // summed variance of each sample's alt allele count
+  double variance = 0;
+  // summed ploidy of the samples which are not missing
+  double alleles = 0;
+  std::uint64_t missing = 0;
+  std::uint64_t counts[3] = {0, 0, 0};
+
+  /// add a sample from its genotype probabilities, by count of alt alleles
+  ///
+  /// @param geno probabilities of 0 to ploidy alt alleles
+  /// @param ploidy the sample's ploidy, 1 or 2
+  /// @param threshold lowest probability a genotype is hard called at
+  inline void add(const float * geno, int ploidy, float threshold) {
+    double expected = geno[1];
+    double squared = geno[1];
+    float top = geno[0];
+    int best = 0;
+    if (geno[1] > top) {
+      top = geno[1];
+      best = 1;
+    }
+    if (ploidy == 2) {
+      expected += 2.0 * geno[2];
+      squared += 4.0 * geno[2];
+      if (geno[2] > top) {
+        top = geno[2];
+        best = 2;
+      }
+      if (top >= threshold) {
+        counts[best]++;
+      }
+    }
+    dosage += expected;
+    variance += squared - expected * expected;
+    alleles += ploidy;
+  }
+  void finish(VariantStats & stats, std::uint64_t n_samples) const;
+};
+
+double hwe_exact(std::uint64_t hom_ref, std::uint64_t het, std::uint64_t hom_alt);
+
+/// VariantStats for many variants, a column per field, with the variant details
+struct StatsTable {
+  std::vector<std::string> varid;
+  std::vector<std::string> rsid;
+  std::vector<std::string> chrom;
+  std::vector<std::uint32_t> pos;
+  std::vector<std::uint16_t> n_alleles;
+  std::vector<double> alt_freq;
+  std::vector<double> missing_rate;
+  std::vector<double> info;
+  std::vector<double> hwe_p;
+  std::vector<std::uint32_t> hom_ref;
+  std::vector<std::uint32_t> het;
+  std::vector<std::uint32_t> hom_alt;
+  void resize(std::uint64_t n);
+  void set(std::uint64_t row, const VariantStats & stats);
+};
+
+} // namespace bgen
+
+#endif  // BGEN_STATS_H_
@@ -5,6 +5,7 @@
 #include <bitset>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <istream>
 #include <map>
@@ -39,10 +40,14 @@ inline std::shared_ptr<std::istream> borrowed_stream(std::istream * handle) {
   #define BGEN_TARGET_AVX  __attribute__((target("avx")))
   #define BGEN_TARGET_AVX2 __attribute__((target("avx2")))
   #define BGEN_TARGET_SSE4 __attribute__((target("sse4.1")))
+  #define BGEN_TARGET_F16C __attribute__((target("avx,f16c")))
+  #define BGEN_TARGET_FMA  __attribute__((target("avx2,fma")))
 #else
   #define BGEN_TARGET_AVX
   #define BGEN_TARGET_AVX2
   #define BGEN_TARGET_SSE4
+  #define BGEN_TARGET_F16C
+  #define BGEN_TARGET_FMA
 #endif
 
 /// read a fixed width value from a stream, and report whether the read worked
@@ -96,6 +101,44 @@ inline bool read_prefixed_string(std::istream & handle, std::string & value) {
   return true;
 }
 
+/// a position within bytes which are already in memory, e.g. a mapped bgen
+///
+/// This stands in for a stream when parsing from a memory mapping. The overloads
+/// below mirror the stream reads above, so a parser templated over its source reads
+/// each field the same way from either, with every read bounds checked against the
+/// end of the data rather than relying on a stream's failbit.
+struct ByteCursor {
+  const char * data;
+  std::uint64_t size;
+  std::uint64_t pos;
+  bool has(std::uint64_t n) const { return (pos <= size) && (n <= size - pos); }
+};
+
+template <typename T>
+inline bool read_value(ByteCursor & cursor, T & value) {
+  if (!cursor.has(sizeof(T))) {
+    return false;
+  }
+  std::memcpy(&value, cursor.data + cursor.pos, sizeof(T));
+  cursor.pos += sizeof(T);
+  return true;
+}
+
+/// read a length prefixed string out of memory
+///
+/// Unlike the stream version this knows how many bytes remain, so a corrupt length is
+/// rejected before anything is allocated, and no chunking is needed.
+template <typename LenType>
+inline bool read_prefixed_string(ByteCursor & cursor, std::string & value) {
+  LenType len;
+  if (!read_value(cursor, len) || !cursor.has(len)) {
+    return false;
+  }
+  value.assign(cursor.data + cursor.pos, (std::size_t) len);
+  cursor.pos += len;
+  return true;
+}
+
 struct Range {
     std::uint8_t _min;
     std::uint8_t _max;
@@ -10,86 +10,135 @@ namespace bgen {
 /// read a fixed width value from the bgen, throwing if the read failed
 ///
 /// Throws out_of_range, which surfaces in python as IndexError, so that reaching
-/// the end of the file ends iteration.
-template <typename T>
-static void read_checked(std::istream & handle, T & value) {
-  if (!read_value(handle, value)) {
+/// the end of the file ends iteration. The source is either the bgen stream, or a
+/// ByteCursor over a memory mapped bgen.
+template <typename Source, typename T>
+static void read_checked(Source & source, T & value) {
+  if (!read_value(source, value)) {
     throw std::out_of_range("reached end of file");
   }
 }
 
 /// read a string which is prefixed by its length, and check the reads succeeded
-template <typename LenType>
-static void read_checked_string(std::istream & handle, std::string & value) {
-  if (!read_prefixed_string<LenType>(handle, value)) {
+template <typename LenType, typename Source>
+static void read_checked_string(Source & source, std::string & value) {
+  if (!read_prefixed_string<LenType>(source, value)) {
     throw std::out_of_range("reached end of file");
   }
 }
 
-/// initialise a single variant with chrom, pos, rsID identifiers
+/// parse the fields ahead of a variant's genotype block
 ///
-/// This starts a Genotypes object, but this doesn't parse the genotypes until
-/// required, just starts it so we can get the offset of the next variant, so as
-/// to parse the bgen variants at speed.
+/// Shared between the stream and memory mapped readers, so that both apply the same
+/// checks in the same order, and so raise the same errors on a malformed bgen.
 ///
-///  @param _handle std::istream for bgen file, shared with the CppBgenReader so
-///     the file stays open for as long as this Variant might read from it
-///  @param varoffset start byte for variant in bgen file
-///  @param layout bgen layout version (1 or 2)
-///  @param compression compression scheme (0=no compression, 1=zlib, 2=zstd)
-///  @param expected_n number of samples for variant
-Variant::Variant(std::shared_ptr<std::istream> _handle, std::uint64_t & varoffset, int layout, int compression, int expected_n, bool is_stdin) : handle(_handle) {
-  offset = varoffset;
-  if (!is_stdin) {
-    handle->clear();
-    handle->seekg(offset);
-  }
-  if (handle->eof()) {
-    // check for end-of-file before reading, so we don't try to read after EOF.
-    // This is how iteration over a stdin bgen terminates, since we cannot seek
-    // back on stdin to check whether another variant follows.
-    throw std::out_of_range("reached end of file");
-  }
+/// @return length in bytes of the genotype block which follows
+template <typename Source>
+static std::uint32_t parse_variant(Variant & var, Source & source, int layout,
+                                   int compression, int expected_n) {
   if (layout == 1) {
-    read_checked(*handle, n_samples);
+    read_checked(source, var.n_samples);
   } else {
-    n_samples = expected_n;
+    var.n_samples = expected_n;
   }
   
-  if ((int) n_samples != expected_n) {
+  if ((int) var.n_samples != expected_n) {
     throw std::invalid_argument("number of samples doesn't match");
   }
   
-  read_checked_string<std::uint16_t>(*handle, varid);
-  read_checked_string<std::uint16_t>(*handle, rsid);
-  read_checked_string<std::uint16_t>(*handle, chrom);
+  read_checked_string<std::uint16_t>(source, var.varid);
+  read_checked_string<std::uint16_t>(source, var.rsid);
+  read_checked_string<std::uint16_t>(source, var.chrom);
   
-  read_checked(*handle, pos);
+  read_checked(source, var.pos);
   if (layout == 1) {
-    n_alleles = 2;
+    var.n_alleles = 2;
   } else {
-    read_checked(*handle, n_alleles);
+    read_checked(source, var.n_alleles);
   }
   
-  alleles.reserve(n_alleles);
-  for (int x=0; x < n_alleles; x++) {
+  // a scratch Variant is reparsed over and over when cataloging a bgen
+  var.alleles.clear();
+  var.alleles.reserve(var.n_alleles);
+  for (int x=0; x < var.n_alleles; x++) {
     std::string allele;
-    read_checked_string<std::uint32_t>(*handle, allele);
-    alleles.push_back(allele);
+    read_checked_string<std::uint32_t>(source, allele);
+    var.alleles.push_back(allele);
   }
   
   std::uint32_t length;
   if ((layout == 1) && (compression == 0)) {
-    length = n_samples * 6;
+    length = var.n_samples * 6;
   } else {
-    read_checked(*handle, length);
+    read_checked(source, length);
   }
+  return length;
+}
+
+/// initialise a single variant with chrom, pos, rsID identifiers
+///
+/// This starts a Genotypes object, but this doesn't parse the genotypes until
+/// required, just starts it so we can get the offset of the next variant, so as
+/// to parse the bgen variants at speed.
+///
+///  @param _handle std::istream for bgen file, shared with the CppBgenReader so
+///     the file stays open for as long as this Variant might read from it. If
+///     this is a MappedFile, the fields are read directly from the mapping.
+///  @param varoffset start byte for variant in bgen file
+///  @param layout bgen layout version (1 or 2)
+///  @param compression compression scheme (0=no compression, 1=zlib, 2=zstd)
+///  @param expected_n number of samples for variant
+Variant::Variant(std::shared_ptr<std::istream> _handle, std::uint64_t & varoffset, int layout, int compression, int expected_n, bool is_stdin) : handle(_handle) {
   std::uint64_t geno_offset = 0;
-  if (!is_stdin) {
-    geno_offset = (std::uint64_t) handle->tellg();
-  }
+  std::uint32_t length = parse_fields(varoffset, layout, compression, expected_n, is_stdin, geno_offset);
   geno.initialize(handle, layout, compression, n_alleles, n_samples, geno_offset, length, is_stdin);
+}
+
+/// read the identifiers and alleles of the variant at an offset, without the genotypes
+///
+/// This reads through the Variant's handle, and leaves the genotypes untouched, so
+/// one Variant can be reused to list the variants of a whole bgen without building
+/// (and freeing) a Genotypes for each of them.
+///
+///  @param varoffset start byte for variant in bgen file
+///  @param layout bgen layout version (1 or 2)
+///  @param compression compression scheme (0=no compression, 1=zlib, 2=zstd)
+///  @param expected_n number of samples for variant
+///  @param is_stdin whether the handle is stdin, which is read in place without seeking
+///  @param geno_offset set to the file offset of the genotype block
+///  @return length in bytes of the genotype block
+std::uint32_t Variant::parse_fields(std::uint64_t varoffset, int layout, int compression,
+                                    int expected_n, bool is_stdin, std::uint64_t & geno_offset) {
+  offset = varoffset;
+  const MappedFile * mapped = is_stdin ? nullptr : as_mapped(handle.get());
+  std::uint32_t length;
+  geno_offset = 0;
+  if (mapped != nullptr) {
+    // a closed mapping has no data left, so this also ends on a closed bgen
+    ByteCursor cursor = {mapped->data(), mapped->size(), offset};
+    if (!cursor.has(1)) {
+      throw std::out_of_range("reached end of file");
+    }
+    length = parse_variant(*this, cursor, layout, compression, expected_n);
+    geno_offset = cursor.pos;
+  } else {
+    if (!is_stdin) {
+      handle->clear();
+      handle->seekg(offset);
+    }
+    if (handle->eof()) {
+      // check for end-of-file before reading, so we don't try to read after EOF.
+      // This is how iteration over a stdin bgen terminates, since we cannot seek
+      // back on stdin to check whether another variant follows.
+      throw std::out_of_range("reached end of file");
+    }
+    length = parse_variant(*this, *handle, layout, compression, expected_n);
+    if (!is_stdin) {
+      geno_offset = (std::uint64_t) handle->tellg();
+    }
+  }
   next_variant_offset = geno_offset + length;
+  return length;
 }
 
 int Variant::probs_per_sample() {
@@ -116,6 +165,30 @@ std::uint8_t * Variant::ploidy() {
   return geno.ploidy.get();
 }
 
+/// copy the ploidy of the selected samples (or every sample, if none were selected)
+///
+/// @param out array with room for n_selected() values
+void Variant::selected_ploidy(std::uint8_t * out) {
+  if (geno.max_probs == 0) {
+    geno.load_data_and_parse_header();
+  }
+  geno.selected_ploidy(out);
+}
+
+/// restrict genotype outputs (probabilities, dosages and ploidy) to a subset of samples
+///
+/// @param subset samples to keep, in output order, or an empty pointer for all samples
+void Variant::select_samples(std::shared_ptr<const SampleSubset> subset) {
+  geno.select_samples(subset);
+}
+
+/// share decompressed genotype blocks with other variants from the same bgen
+///
+/// @param cache blocks to look the genotypes up in, and add them to once decompressed
+void Variant::use_cache(std::shared_ptr<BlockCache> cache) {
+  geno.use_cache(cache);
+}
+
 /// get genotype probabilities for the variant as a 1-dimensional vector
 ///
 /// This makes it easy to pass the data via cython into a numpy array, which can
@@ -124,6 +197,11 @@ void Variant::probs_1d(float * probs) {
   geno.probabilities(probs);
 }
 
+/// get the probabilities in one of the OutputTypes, laid out as probs_1d
+void Variant::probs_1d_as(void * probs, int type) {
+  geno.probabilities_as(probs, type);
+}
+
 /// whether the last decode saw probabilities summing above the bit depth's maximum
 ///
 /// The genotype decoders infer final probabilities from the remainder, so an over-large
@@ -145,6 +223,35 @@ void Variant::minor_allele_dosage(float * dose) {
   minor_allele = alleles[geno.minor_idx];
 }
 
+/// get alt allele dosages in one of the OutputTypes (only works for biallelic variants)
+void Variant::alt_dosage_as(void * dose, int type) {
+  geno.allele_dosage_as(dose, type, true, false);
+  minor_allele = alleles[geno.minor_idx];
+}
+
+/// get minor allele dosages in one of the OutputTypes (only works for biallelic variants)
+void Variant::minor_allele_dosage_as(void * dose, int type) {
+  geno.allele_dosage_as(dose, type, false, true);
+  minor_allele = alleles[geno.minor_idx];
+}
+
+/// hard call each sample's genotype as a count of alt alleles, or -1 (biallelic only)
+void Variant::hard_calls(std::int8_t * calls, float threshold) {
+  geno.hard_calls(calls, threshold);
+}
+
+/// flag each sample which is missing, as 1, or 0 otherwise
+void Variant::missing_samples(std::uint8_t * out) {
+  geno.missing_samples(out);
+}
+
+/// quality control statistics of a biallelic variant, with nans for any other
+VariantStats Variant::stats(float threshold) {
+  VariantStats out;
+  geno.variant_stats(out, threshold);
+  return out;
+}
+
 /// the least common of a biallelic variant's alleles
 ///
 /// Which allele is the minor one depends on the genotypes, so this reads them,
@@ -163,6 +270,28 @@ std::string Variant::get_minor_allele() {
   return minor_allele;
 }
 
+/// fetch the stored genotype block, without decompressing it
+///
+/// This is the only step of decoding which reads the bgen, so the prefetcher does
+/// it while holding the lock on its stream, then leaves the rest to run unlocked.
+void Variant::read_genotypes() {
+  geno.read_block();
+}
+
+/// decompress the genotypes, and parse the ploidy and bit depth ahead of them
+///
+/// The whole block is decompressed, even one large enough to be streamed otherwise,
+/// since the point of preparing ahead is to have the decompression done.
+void Variant::prepare_genotypes() {
+  geno.load_data_and_parse_header(true);
+}
+
+/// move the variant over to a different handle on the same bgen
+void Variant::rebind(std::shared_ptr<std::istream> _handle) {
+  handle = _handle;
+  geno.rebind(_handle);
+}
+
 std::vector<std::uint8_t> Variant::copy_data() {
   // as in Genotypes::decompress, the badbit marks a closed bgen, while other
   // error states are recoverable and just need clearing before the seek
@@ -171,6 +300,15 @@ std::vector<std::uint8_t> Variant::copy_data() {
   }
   handle->clear();
   std::uint32_t length = next_variant_offset - offset;
+  const MappedFile * mapped = as_mapped(handle.get());
+  if (mapped != nullptr) {
+    ByteCursor cursor = {mapped->data(), mapped->size(), offset};
+    if (!cursor.has(length)) {
+      throw std::invalid_argument("could not read variant data - is the bgen truncated?");
+    }
+    const std::uint8_t * start = reinterpret_cast<const std::uint8_t *>(mapped->data() + offset);
+    return std::vector<std::uint8_t>(start, start + length);
+  }
   std::vector<std::uint8_t> data(length);
   handle->seekg(offset);
   if (!handle->read(reinterpret_cast<char *>(data.data()), length)) {
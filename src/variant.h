@@ -19,17 +19,32 @@ class Variant {
 public:
   Variant(std::shared_ptr<std::istream> _handle, std::uint64_t & varoffset, int layout, int compression, int expected_n, bool is_stdin=false);
   Variant() {}
+  std::uint32_t parse_fields(std::uint64_t varoffset, int layout, int compression,
+                             int expected_n, bool is_stdin, std::uint64_t & geno_offset);
   int probs_per_sample();
   void alt_dosage(float * dosage);
   void minor_allele_dosage(float * dosage);
+  void hard_calls(std::int8_t * calls, float threshold);
+  void missing_samples(std::uint8_t * out);
+  VariantStats stats(float threshold);
+  void alt_dosage_as(void * dosage, int type);
+  void minor_allele_dosage_as(void * dosage, int type);
   std::string get_minor_allele();
   void probs_1d(float * probs);
+  void probs_1d_as(void * probs, int type);
   bool phased();
   /// check for probabilities summing above bit-depth max, indicates malformed bgen
   bool probs_above_max();
   std::shared_ptr<std::istream> handle;
   std::uint8_t * ploidy();
+  void selected_ploidy(std::uint8_t * out);
+  void select_samples(std::shared_ptr<const SampleSubset> subset);
+  void use_cache(std::shared_ptr<BlockCache> cache);
+  std::uint32_t n_selected() { return geno.n_out(); }
   std::vector<std::uint8_t> copy_data();
+  void read_genotypes();
+  void prepare_genotypes();
+  void rebind(std::shared_ptr<std::istream> _handle);
   std::string minor_allele;
   
   std::uint64_t offset = 0;
@@ -0,0 +1,380 @@
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "varindex.h"
+
+namespace bgen {
+
+/// identifies a file as a binary variant index, and the version of its layout
+const char INDEX_MAGIC[8] = {'B', 'G', 'E', 'N', 'I', 'D', 'X', '1'};
+const std::uint64_t INDEX_VERSION = 1;
+
+/// bytes in the header: the magic, then seven 64-bit fields
+const std::uint64_t INDEX_HEADER_BYTES = 64;
+
+/// round a section length up, so the section after it stays 8 byte aligned
+static std::uint64_t pad8(std::uint64_t n) {
+  return (n + 7) & ~(std::uint64_t) 7;
+}
+
+/// hash an rsID for the lookup table (64-bit FNV-1a)
+///
+/// This is written into the index as bucket positions, so it has to stay fixed
+/// across platforms and versions, which rules out std::hash.
+static std::uint64_t hash_rsid(const char * data, std::uint64_t len) {
+  std::uint64_t hash = 14695981039346656037ULL;
+  for (std::uint64_t i = 0; i < len; i++) {
+    hash ^= (std::uint8_t) data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/// number of buckets in the rsID table, a power of two at least twice the rows
+///
+/// Keeping the table at most half full keeps the linear probes short.
+static std::uint64_t bucket_count(std::uint64_t n_rows) {
+  std::uint64_t n = 1;
+  while (n < n_rows * 2) {
+    n <<= 1;
+  }
+  return n;
+}
+
+/// where each section of an index starts, which follows from the counts alone
+struct IndexLayout {
+  std::uint64_t chroms, chrom_names, offsets, rsid_starts, sorted, buckets, sizes,
+                positions, chrom_ids, sorted_positions, rsid_arena, end;
+  IndexLayout(std::uint64_t n, std::uint64_t n_chroms, std::uint64_t names_len,
+              std::uint64_t n_buckets, std::uint64_t arena_len) {
+    chroms = INDEX_HEADER_BYTES;
+    chrom_names = chroms + n_chroms * 32;
+    offsets = chrom_names + pad8(names_len);
+    rsid_starts = offsets + n * 8;
+    sorted = rsid_starts + (n + 1) * 8;
+    buckets = sorted + n * 8;
+    sizes = buckets + n_buckets * 8;
+    positions = sizes + pad8(n * 4);
+    chrom_ids = positions + pad8(n * 4);
+    sorted_positions = chrom_ids + pad8(n * 4);
+    rsid_arena = sorted_positions + pad8(n * 4);
+    end = rsid_arena + pad8(arena_len);
+  }
+};
+
+void IndexRows::reserve(std::uint64_t n) {
+  chroms.reserve(n);
+  positions.reserve(n);
+  rsids.reserve(n);
+  n_alleles.reserve(n);
+  allele1.reserve(n);
+  allele2.reserve(n);
+  offsets.reserve(n);
+  sizes.reserve(n);
+}
+
+void IndexRows::clear() {
+  chroms.clear();
+  positions.clear();
+  rsids.clear();
+  n_alleles.clear();
+  allele1.clear();
+  allele2.clear();
+  offsets.clear();
+  sizes.clear();
+}
+
+/// write a section, then zeros up to the next 8 byte boundary
+static void write_section(std::ofstream & out, const void * data, std::uint64_t len) {
+  static const char zeros[8] = {0};
+  if (len > 0) {
+    out.write(static_cast<const char *>(data), (std::streamsize) len);
+  }
+  out.write(zeros, (std::streamsize) (pad8(len) - len));
+}
+
+/// write a binary variant index for a bgen
+///
+/// @param path where to write the index
+/// @param rows fields of every variant, in file order
+/// @param bgen_size size of the bgen in bytes, so a reader can spot a stale index
+void write_variant_index(const std::string & path, const IndexRows & rows,
+                         std::uint64_t bgen_size) {
+  std::uint64_t n = rows.size();
+  if ((rows.chroms.size() != n) || (rows.positions.size() != n) ||
+      (rows.rsids.size() != n) || (rows.sizes.size() != n)) {
+    throw std::invalid_argument("index rows have fields of different lengths");
+  }
+
+  // number the chromosomes in the order they first appear
+  std::vector<std::uint32_t> chrom_ids(n);
+  std::vector<std::string> names;
+  std::unordered_map<std::string, std::uint32_t> lookup;
+  for (std::uint64_t i = 0; i < n; i++) {
+    auto found = lookup.find(rows.chroms[i]);
+    if (found == lookup.end()) {
+      chrom_ids[i] = (std::uint32_t) names.size();
+      lookup[rows.chroms[i]] = chrom_ids[i];
+      names.push_back(rows.chroms[i]);
+    } else {
+      chrom_ids[i] = found->second;
+    }
+  }
+
+  // stable, so variants sharing a position keep their file order
+  std::vector<std::uint64_t> sorted(n);
+  for (std::uint64_t i = 0; i < n; i++) {
+    sorted[i] = i;
+  }
+  std::stable_sort(sorted.begin(), sorted.end(), [&] (std::uint64_t a, std::uint64_t b) {
+    if (chrom_ids[a] != chrom_ids[b]) {
+      return chrom_ids[a] < chrom_ids[b];
+    }
+    return rows.positions[a] < rows.positions[b];
+  });
+  std::vector<std::uint32_t> sorted_positions(n);
+  for (std::uint64_t i = 0; i < n; i++) {
+    sorted_positions[i] = rows.positions[sorted[i]];
+  }
+
+  std::string name_arena;
+  std::vector<std::uint64_t> chrom_table(names.size() * 4, 0);
+  for (std::uint64_t c = 0; c < names.size(); c++) {
+    chrom_table[c * 4] = name_arena.size();
+    chrom_table[c * 4 + 1] = names[c].size();
+    name_arena += names[c];
+  }
+  // each chromosome's rows form one run of the sorted permutation
+  for (std::uint64_t i = 0; i < n; i++) {
+    std::uint32_t c = chrom_ids[sorted[i]];
+    if ((i == 0) || (chrom_ids[sorted[i - 1]] != c)) {
+      chrom_table[c * 4 + 2] = i;
+    }
+    chrom_table[c * 4 + 3] = i + 1;
+  }
+
+  std::string rsid_arena;
+  std::vector<std::uint64_t> rsid_starts(n + 1, 0);
+  for (std::uint64_t i = 0; i < n; i++) {
+    rsid_arena += rows.rsids[i];
+    rsid_starts[i + 1] = rsid_arena.size();
+  }
+
+  std::uint64_t n_buckets = bucket_count(n);
+  std::vector<std::uint64_t> buckets(n_buckets, 0);
+  for (std::uint64_t i = 0; i < n; i++) {
+    const std::string & rsid = rows.rsids[i];
+    std::uint64_t slot = hash_rsid(rsid.data(), rsid.size()) & (n_buckets - 1);
+    while (buckets[slot] != 0) {
+      slot = (slot + 1) & (n_buckets - 1);
+    }
+    buckets[slot] = i + 1;
+  }
+
+  std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    throw std::invalid_argument("could not open '" + path + "' to write an index");
+  }
+  std::uint64_t header[7] = {INDEX_VERSION, n, names.size(), n_buckets, bgen_size,
+                             name_arena.size(), rsid_arena.size()};
+  out.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  out.write(reinterpret_cast<const char *>(header), sizeof(header));
+  write_section(out, chrom_table.data(), chrom_table.size() * 8);
+  write_section(out, name_arena.data(), name_arena.size());
+  write_section(out, rows.offsets.data(), n * 8);
+  write_section(out, rsid_starts.data(), (n + 1) * 8);
+  write_section(out, sorted.data(), n * 8);
+  write_section(out, buckets.data(), n_buckets * 8);
+  write_section(out, rows.sizes.data(), n * 4);
+  write_section(out, rows.positions.data(), n * 4);
+  write_section(out, chrom_ids.data(), n * 4);
+  write_section(out, sorted_positions.data(), n * 4);
+  write_section(out, rsid_arena.data(), rsid_arena.size());
+  out.close();
+  if (out.fail()) {
+    throw std::invalid_argument("could not write the index to '" + path + "'");
+  }
+}
+
+/// open a binary variant index
+///
+/// Only the header and the bounds of each section are checked here, so opening
+/// doesn't touch the rows. Values read from the rows are checked as they're used.
+///
+/// @param path path to the index
+VariantIndex::VariantIndex(const std::string & path) : region(new MappedRegion(path)) {
+  if (!region->opened) {
+    throw std::invalid_argument("error reading from '" + path + "'");
+  }
+  const char * data = region->begin;
+  if ((region->length < INDEX_HEADER_BYTES) ||
+      (std::memcmp(data, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)) {
+    throw std::invalid_argument("'" + path + "' is not a bgen variant index");
+  }
+  std::uint64_t header[7];
+  std::memcpy(header, data + sizeof(INDEX_MAGIC), sizeof(header));
+  if (header[0] != INDEX_VERSION) {
+    throw std::invalid_argument("'" + path + "' is a variant index of version " +
+                                std::to_string(header[0]) + ", which this can't read");
+  }
+  n_variants = header[1];
+  n_chroms = header[2];
+  n_buckets = header[3];
+  recorded_size = header[4];
+  std::uint64_t names_len = header[5];
+  std::uint64_t arena_len = header[6];
+  // bound every count by the file length before the layout multiplies them, so a
+  // corrupt count cannot wrap the section offsets around
+  if ((n_variants > region->length) || (n_chroms > region->length) ||
+      (n_buckets > region->length) || (names_len > region->length) ||
+      (arena_len > region->length) || (n_buckets == 0) ||
+      ((n_buckets & (n_buckets - 1)) != 0) || (n_buckets < n_variants)) {
+    throw std::invalid_argument("'" + path + "' is a malformed variant index");
+  }
+  IndexLayout layout(n_variants, n_chroms, names_len, n_buckets, arena_len);
+  if (layout.end > region->length) {
+    throw std::invalid_argument("'" + path + "' is truncated - the variant index "
+                                "needs " + std::to_string(layout.end) + " bytes, "
+                                "but only has " + std::to_string(region->length));
+  }
+  chroms = reinterpret_cast<const Chrom *>(data + layout.chroms);
+  chrom_names = data + layout.chrom_names;
+  offsets = reinterpret_cast<const std::uint64_t *>(data + layout.offsets);
+  rsid_starts = reinterpret_cast<const std::uint64_t *>(data + layout.rsid_starts);
+  sorted = reinterpret_cast<const std::uint64_t *>(data + layout.sorted);
+  buckets = reinterpret_cast<const std::uint64_t *>(data + layout.buckets);
+  sizes = reinterpret_cast<const std::uint32_t *>(data + layout.sizes);
+  positions = reinterpret_cast<const std::uint32_t *>(data + layout.positions);
+  chrom_ids = reinterpret_cast<const std::uint32_t *>(data + layout.chrom_ids);
+  sorted_positions = reinterpret_cast<const std::uint32_t *>(data + layout.sorted_positions);
+  rsid_arena = data + layout.rsid_arena;
+  for (std::uint64_t c = 0; c < n_chroms; c++) {
+    const Chrom & chrom = chroms[c];
+    if ((chrom.name_start > names_len) || (chrom.name_len > names_len - chrom.name_start) ||
+        (chrom.first > chrom.last) || (chrom.last > n_variants)) {
+      throw std::invalid_argument("'" + path + "' is a malformed variant index");
+    }
+  }
+  if (rsid_starts[n_variants] > arena_len) {
+    throw std::invalid_argument("'" + path + "' is a malformed variant index");
+  }
+}
+
+/// add the offsets of a chromosome's variants within a region, in position order
+void VariantIndex::rows_at(const Chrom & chrom, std::uint32_t start, std::uint32_t stop,
+                           std::vector<std::uint64_t> & found) const {
+  const std::uint32_t * first = sorted_positions + chrom.first;
+  const std::uint32_t * last = sorted_positions + chrom.last;
+  const std::uint32_t * lo = std::lower_bound(first, last, start);
+  const std::uint32_t * hi = std::upper_bound(lo, last, stop);
+  for (std::uint64_t i = lo - sorted_positions; i < (std::uint64_t) (hi - sorted_positions); i++) {
+    found.push_back(offset(sorted[i]));
+  }
+}
+
+/// get file offsets of the variants within a region of a chromosome
+///
+/// @param chrom chromosome name
+/// @param start first position to include
+/// @param stop last position to include
+/// @return offsets of the variants, in position order
+std::vector<std::uint64_t> VariantIndex::fetch(const std::string & chrom,
+                                               std::uint32_t start,
+                                               std::uint32_t stop) const {
+  std::vector<std::uint64_t> found;
+  // a bgen has a few dozen chromosomes at most, so a linear search is enough
+  for (std::uint64_t c = 0; c < n_chroms; c++) {
+    const Chrom & entry = chroms[c];
+    if ((entry.name_len == chrom.size()) &&
+        (std::memcmp(chrom_names + entry.name_start, chrom.data(), chrom.size()) == 0)) {
+      if (start <= stop) {
+        rows_at(entry, start, stop, found);
+      }
+      break;
+    }
+  }
+  return found;
+}
+
+/// get file offsets of the variants with an rsID, in file order
+std::vector<std::uint64_t> VariantIndex::with_rsid(const std::string & rsid) const {
+  std::vector<std::uint64_t> found;
+  std::uint64_t mask = n_buckets - 1;
+  std::uint64_t slot = hash_rsid(rsid.data(), rsid.size()) & mask;
+  // the table is at most half full, so an empty bucket always ends the probe, but
+  // cap it anyway so a corrupt table full of entries cannot loop forever
+  for (std::uint64_t probes = 0; probes < n_buckets; probes++) {
+    std::uint64_t entry = buckets[slot];
+    if (entry == 0) {
+      break;
+    }
+    std::uint64_t row = entry - 1;
+    if (row >= n_variants) {
+      throw std::invalid_argument("variant index has an rsID entry out of range");
+    }
+    std::uint64_t begin = rsid_starts[row];
+    std::uint64_t end = rsid_starts[row + 1];
+    if ((begin <= end) && (end - begin == rsid.size()) &&
+        (std::memcmp(rsid_arena + begin, rsid.data(), rsid.size()) == 0)) {
+      found.push_back(offset(row));
+    }
+    slot = (slot + 1) & mask;
+  }
+  // duplicates are inserted in file order, but can wrap around the table's end
+  std::sort(found.begin(), found.end());
+  return found;
+}
+
+/// get file offsets of the variants at a position, on any chromosome
+std::vector<std::uint64_t> VariantIndex::at_position(std::uint32_t pos) const {
+  std::vector<std::uint64_t> found;
+  for (std::uint64_t c = 0; c < n_chroms; c++) {
+    rows_at(chroms[c], pos, pos, found);
+  }
+  return found;
+}
+
+std::uint64_t VariantIndex::offset(std::uint64_t row) const {
+  if (row >= n_variants) {
+    throw std::out_of_range("variant index " + std::to_string(row) +
+                            " is out of range for an index of " +
+                            std::to_string(n_variants) + " variants");
+  }
+  return offsets[row];
+}
+
+/// bytes the variant in a row takes up in the bgen, to read it in one go
+std::uint32_t VariantIndex::size(std::uint64_t row) const {
+  offset(row);
+  return sizes[row];
+}
+
+std::uint32_t VariantIndex::position(std::uint64_t row) const {
+  offset(row);  // just to check the row
+  return positions[row];
+}
+
+std::string VariantIndex::chrom(std::uint64_t row) const {
+  offset(row);
+  std::uint32_t c = chrom_ids[row];
+  if (c >= n_chroms) {
+    throw std::invalid_argument("variant index has a chromosome out of range");
+  }
+  return std::string(chrom_names + chroms[c].name_start, chroms[c].name_len);
+}
+
+std::string VariantIndex::rsid(std::uint64_t row) const {
+  offset(row);
+  std::uint64_t begin = rsid_starts[row];
+  std::uint64_t end = rsid_starts[row + 1];
+  if ((begin > end) || (end > rsid_starts[n_variants])) {
+    throw std::invalid_argument("variant index has an rsID out of range");
+  }
+  return std::string(rsid_arena + begin, end - begin);
+}
+
+} // namespace bgen
@@ -0,0 +1,107 @@
+#ifndef BGEN_VARINDEX_H_
+#define BGEN_VARINDEX_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mapped.h"
+
+namespace bgen {
+
+/// the fields of every variant which go into an index, in file order
+///
+/// The alleles are only needed for a bgenix (.bgi) index, which lists the first two.
+/// allele2 is left empty for a variant with a single allele.
+struct IndexRows {
+  std::vector<std::string> chroms;
+  std::vector<std::uint32_t> positions;
+  std::vector<std::string> rsids;
+  std::vector<std::uint16_t> n_alleles;
+  std::vector<std::string> allele1;
+  std::vector<std::string> allele2;
+  std::vector<std::uint64_t> offsets;
+  std::vector<std::uint32_t> sizes;
+  std::uint64_t size() const { return offsets.size(); }
+  void reserve(std::uint64_t n);
+  void clear();
+};
+
+void write_variant_index(const std::string & path, const IndexRows & rows,
+                         std::uint64_t bgen_size);
+
+/// a binary variant index, read in place through a memory mapping
+///
+/// A bgenix (.bgi) index is a sqlite database, so each lookup runs a query, and
+/// listing every offset means stepping through every row. This format is laid out
+/// for lookups straight out of the mapping instead: the rows are stored in file
+/// order, with a permutation which sorts them by chromosome then position, so a
+/// region is one binary search within its chromosome's range of that permutation.
+/// rsIDs go into an open addressing hash table of row numbers. Opening only checks
+/// the header and section bounds, so it costs the same whatever the bgen's size.
+///
+/// Values are in the native byte order of the machine which wrote the index, so an
+/// index can't move between hosts of different endianness (its version then reads
+/// wrong, and opening it fails). The header is the 8 byte magic, then seven u64s:
+/// version, number of rows, number of chromosomes, number of rsID hash buckets, bgen
+/// size, and the sizes of the chromosome name and rsID arenas. Section starts follow
+/// from those counts. Each column is a section of its own, padded to 8 bytes, in
+/// this order:
+///   chromosome table: per chromosome the start and length of its name in the
+///     name arena, and its first and end rows in the sorted permutation (4 x u64)
+///   chromosome name arena (chars)
+///   file offset of each row, in file order (u64)
+///   start of each row's rsID in the rsID arena, plus the end of the last (u64)
+///   sorted permutation, of rows by chromosome then position (u64)
+///   rsID hash table, of row + 1 per bucket, with zero for an empty bucket (u64)
+///   size of each row in the bgen (u32)
+///   position of each row (u32)
+///   chromosome number of each row, into the chromosome table (u32)
+///   positions in sorted order (u32), which keeps the binary search within one
+///     small array
+///   rsID arena (chars)
+class VariantIndex {
+public:
+  VariantIndex(const std::string & path);
+  std::uint64_t size() const { return n_variants; }
+  std::uint64_t bgen_size() const { return recorded_size; }
+  std::vector<std::uint64_t> fetch(const std::string & chrom, std::uint32_t start,
+                                   std::uint32_t stop) const;
+  std::vector<std::uint64_t> with_rsid(const std::string & rsid) const;
+  std::vector<std::uint64_t> at_position(std::uint32_t pos) const;
+  std::uint64_t offset(std::uint64_t row) const;
+  std::uint32_t size(std::uint64_t row) const;
+  std::uint32_t position(std::uint64_t row) const;
+  std::string chrom(std::uint64_t row) const;
+  std::string rsid(std::uint64_t row) const;
+private:
+  struct Chrom {
+    std::uint64_t name_start;
+    std::uint64_t name_len;
+    std::uint64_t first;
+    std::uint64_t last;
+  };
+  void rows_at(const Chrom & chrom, std::uint32_t start, std::uint32_t stop,
+               std::vector<std::uint64_t> & found) const;
+  std::shared_ptr<const MappedRegion> region;
+  std::uint64_t n_variants = 0;
+  std::uint64_t n_chroms = 0;
+  std::uint64_t n_buckets = 0;
+  std::uint64_t recorded_size = 0;
+  const Chrom * chroms = nullptr;
+  const char * chrom_names = nullptr;
+  const std::uint64_t * offsets = nullptr;
+  const std::uint32_t * sizes = nullptr;
+  const std::uint32_t * positions = nullptr;
+  const std::uint32_t * chrom_ids = nullptr;
+  const std::uint64_t * rsid_starts = nullptr;
+  const char * rsid_arena = nullptr;
+  const std::uint64_t * sorted = nullptr;
+  const std::uint32_t * sorted_positions = nullptr;
+  const std::uint64_t * buckets = nullptr;
+};
+
+} // namespace bgen
+
+#endif  // BGEN_VARINDEX_H_
@@ -21,6 +21,7 @@
 
 #include "writer.h"
 #include "genotypes.h"
+#include "parallel.h"
 #include "utils.h"
 
 namespace bgen {
@@ -87,6 +88,11 @@ static void write_nvariants(std::ofstream &handle, std::uint32_t &offset, std::u
 void CppBgenWriter::close() {
   if (closed) { return; }
   closed = true;
+  if (pipeline) {
+    // the pipeline has to finish with the handle before the header is updated
+    pipeline->flush();
+    pipeline.reset();
+  }
   write_variants_offset(handle, variant_data_offset);
   write_nvariants(handle, nvars_offset, n_variants);
   handle.close();
@@ -199,13 +205,14 @@ void CppBgenWriter::add_samples(std::vector<std::string> &samples) {
   write_variants_offset(handle, variant_data_offset);
 }
 
-std::uint64_t CppBgenWriter::write_variant_header(std::string &varid,
-                                                  std::string &rsid,
-                                                  std::string &chrom,
-                                                  std::uint32_t &pos,
-                                                  std::vector<std::string> &alleles,
-                                                  std::uint32_t _n_samples) {
-  std::uint64_t var_offset = current_position(handle);
+// check a variant's details, and lay out its header as it's stored in the file
+void CppBgenWriter::variant_header(std::string &varid,
+                                   std::string &rsid,
+                                   std::string &chrom,
+                                   std::uint32_t &pos,
+                                   std::vector<std::string> &alleles,
+                                   std::uint32_t _n_samples,
+                                   std::vector<char> &header) {
   if (_n_samples != n_samples) {
     throw std::invalid_argument("number of samples doesn't match sample count in file");
   }
@@ -224,39 +231,56 @@ std::uint64_t CppBgenWriter::write_variant_header(std::string &varid,
                                 " alleles, but the maximum is " +
                                 std::to_string(UINT16_MAX));
   }
-  n_variants += 1;
+  header.clear();
   if (layout == 1) {
-    handle.write(reinterpret_cast<char *>(&_n_samples), 4);
-    // handle << _n_samples;
+    append_bytes(header, &_n_samples, 4);
   }
   std::uint16_t tmp;
   tmp = varid.size();
-  handle.write(reinterpret_cast<char *>(&tmp), 2);
-  handle << varid;
+  append_bytes(header, &tmp, 2);
+  append_bytes(header, varid.data(), varid.size());
   tmp = rsid.size();
-  handle.write(reinterpret_cast<char *>(&tmp), 2);
-  handle << rsid;
+  append_bytes(header, &tmp, 2);
+  append_bytes(header, rsid.data(), rsid.size());
   tmp = chrom.size();
-  handle.write(reinterpret_cast<char *>(&tmp), 2);
-  handle << chrom;
-  handle.write(reinterpret_cast<char *>(&pos), 4);
+  append_bytes(header, &tmp, 2);
+  append_bytes(header, chrom.data(), chrom.size());
+  append_bytes(header, &pos, 4);
   
   if (layout != 1) {
     std::uint16_t n_alleles = alleles.size();
-    handle.write(reinterpret_cast<char *>(&n_alleles), 2);
+    append_bytes(header, &n_alleles, 2);
   }
 
   std::uint32_t allele_size;
   for (auto &x : alleles) {
     allele_size = x.size();
-    handle.write(reinterpret_cast<char *>(&allele_size), 4);
-    handle << x;
+    append_bytes(header, &allele_size, 4);
+    append_bytes(header, x.data(), x.size());
   }
+}
+
+std::uint64_t CppBgenWriter::write_variant_header(std::string &varid,
+                                                  std::string &rsid,
+                                                  std::string &chrom,
+                                                  std::uint32_t &pos,
+                                                  std::vector<std::string> &alleles,
+                                                  std::uint32_t _n_samples) {
+  if (pipeline) {
+    throw std::invalid_argument("variants are queued while compressing in the background");
+  }
+  std::uint64_t var_offset = current_position(handle);
+  variant_header(varid, rsid, chrom, pos, alleles, _n_samples, pending_header);
+  n_variants += 1;
+  handle.write(pending_header.data(), pending_header.size());
   handle.flush();
   return var_offset;
 }
 
 std::uint64_t CppBgenWriter::write_variant_direct(std::vector<std::uint8_t> & data) {
+  if (pipeline) {
+    throw std::invalid_argument("variants are queued while compressing in the background");
+  }
   std::uint64_t var_offset = current_position(handle);
   n_variants += 1;
   // write() rather than a std::ostreambuf_iterator, because the iterator reports a
@@ -267,59 +291,134 @@ std::uint64_t CppBgenWriter::write_variant_direct(std::vector<std::uint8_t> & da
   return var_offset;
 }
 
-// compress a char array with zlib
-static void zlib_compress(char * input, int input_len, std::vector<char> &output) {
+// deflateInit allocates the deflate state, with its window and hash tables, and
+// deflateEnd frees them, so a fresh stream per variant makes several large
+// allocations each time. As for inflating in inflate.cpp, a stream is kept per
+// thread instead, so the compression threads of a WritePipeline each have their
+// own, and deflateReset readies it for each block without freeing anything. The
+// reset keeps the compression level, so the output is as from a fresh stream.
+struct DeflateStream {
   z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-
-  strm.avail_in = input_len;      // size of input
-  strm.next_in = (Bytef *) input; // input char array
-  strm.avail_out = output.size();        // size of output
-  strm.next_out = (Bytef *) &output[0]; // output char array
+  DeflateStream() {
+    std::memset(&strm, 0, sizeof(strm));
+    if (deflateInit(&strm, 6) != Z_OK) {
+      throw std::runtime_error("cannot allocate a zlib deflate stream");
+    }
+  }
+  ~DeflateStream() { deflateEnd(&strm); }
+  DeflateStream(const DeflateStream &) = delete;
+  DeflateStream & operator=(const DeflateStream &) = delete;
+};
+
+static z_stream * borrow_deflate_stream() {
+  static thread_local std::unique_ptr<DeflateStream> stream;
+  if (!stream) {
+    stream.reset(new DeflateStream());
+  } else {
+    deflateReset(&stream->strm);
+  }
+  return &stream->strm;
+}
 
-  int ret;
-  deflateInit(&strm, 6);
-  ret = deflate(&strm, Z_FINISH);
-  deflateEnd(&strm);
+// compress a char array with zlib, into output with room for compressBound bytes
+static std::size_t zlib_compress(const char * input, std::size_t input_len, char * output,
+                                 std::size_t output_len) {
+  z_stream * strm = borrow_deflate_stream();
+  strm->avail_in = input_len;      // size of input
+  strm->next_in = (Bytef *) input; // input char array
+  strm->avail_out = output_len;        // size of output
+  strm->next_out = (Bytef *) output; // output char array
 
+  int ret = deflate(strm, Z_FINISH);
   if (ret != Z_STREAM_END) {
     throw(std::invalid_argument("zlib compression encountered an error"));
   }
+  return strm->total_out;
+}
 
-  output.resize(strm.total_out);
+// ZSTD_compress makes and frees a compression context per call, and the context
+// holds the match finder's tables, so one is kept per thread instead, as for the
+// decompression context in genotypes.cpp. Each frame is compressed independently,
+// so reusing the context doesn't change the output.
+static ZSTD_CCtx * borrow_zstd_cctx() {
+  // the unique_ptr frees the context when the thread exits
+  struct Deleter {
+    void operator()(ZSTD_CCtx * ctx) const { ZSTD_freeCCtx(ctx); }
+  };
+  static thread_local std::unique_ptr<ZSTD_CCtx, Deleter> ctx;
+  if (!ctx) {
+    ctx.reset(ZSTD_createCCtx());
+    if (!ctx) {
+      throw std::runtime_error("cannot allocate a zstd compression context");
+    }
+  }
+  return ctx.get();
 }
 
-// compress a char array with zstd
-static void zstd_compress(char *input, int input_len, std::vector<char> &output) {
-  std::size_t total_out = ZSTD_compress(&output[0], output.size(), input, input_len, 3);
+// compress a char array with zstd, into output with room for ZSTD_compressBound bytes
+static std::size_t zstd_compress(const char * input, std::size_t input_len, char * output,
+                                 std::size_t output_len) {
+  std::size_t total_out = ZSTD_compressCCtx(borrow_zstd_cctx(), output, output_len,
+                                            input, input_len, 3);
 
   if (ZSTD_isError(total_out)) {
     throw(std::invalid_argument("zstd compression encountered an error"));
   }
-
-  output.resize(total_out);
+  return total_out;
 }
 
-/// Compress genotype data for a variant.
+/// @brief compress an encoded genotype block, and lay it out as it's stored on disk
+///
+/// The block is compressed straight into its place after the length prefixes, and
+/// the output keeps its capacity from one variant to the next, so once it has grown
+/// to fit, packing a block allocates nothing.
 ///
-/// Compression is handled internally by either zlib_decompress, or zstd_decompress,
-/// depending on compression scheme.
-static std::vector<char> compress(std::vector<std::uint8_t> &uncompressed, std::uint32_t compression) {
-  std::size_t bound;
-  if (compression == 1) { // zlib
-    bound = compressBound(uncompressed.size());
+/// @param encoded genotype data, before compression
+/// @param layout bgen layout version (1 or 2)
+/// @param compression compression scheme (0=no compression, 1=zlib, 2=zstd)
+/// @param block output, for the block with its length prefixes
+static void pack_block(std::vector<std::uint8_t> &encoded, std::uint32_t layout,
+                       std::uint32_t compression, std::vector<char> &block) {
+  // layout 1 only stores a length when compressed, layout 2 always stores the
+  // block length, then the decompressed length if compressed
+  std::size_t prefix = (layout == 1) ? 0 : 4;
+  if (compression != 0) {
+    prefix += 4;
+  }
+  const char * input = reinterpret_cast<const char *>(encoded.data());
+  std::size_t data_len;
+  if (compression == 0) {
+    block.resize(prefix + encoded.size());
+    std::memcpy(&block[prefix], input, encoded.size());
+    data_len = encoded.size();
+  } else if (compression == 1) { // zlib
+    std::size_t bound = compressBound(encoded.size());
+    block.resize(prefix + bound);
+    data_len = zlib_compress(input, encoded.size(), &block[prefix], bound);
   } else { // zstd
-    bound = ZSTD_compressBound(uncompressed.size());
+    std::size_t bound = ZSTD_compressBound(encoded.size());
+    block.resize(prefix + bound);
+    data_len = zstd_compress(input, encoded.size(), &block[prefix], bound);
   }
-  std::vector<char> compressed(bound);
-  if (compression == 1) { // zlib
-    zlib_compress(reinterpret_cast<char *>(&uncompressed[0]), (int)uncompressed.size(), compressed);
-  } else if (compression == 2) { // zstd
-    zstd_compress(reinterpret_cast<char *>(&uncompressed[0]), (int)uncompressed.size(), compressed);
+  block.resize(prefix + data_len);
+
+  std::uint32_t size;
+  if (layout == 1) {
+    if (compression != 0) {
+      size = data_len;
+      std::memcpy(&block[0], &size, 4);
+    }
+  } else {
+    if (compression == 0) {
+      size = data_len;
+      std::memcpy(&block[0], &size, 4);
+    } else {
+      size = data_len + 4;
+      std::memcpy(&block[0], &size, 4);
+      size = encoded.size();
+      std::memcpy(&block[4], &size, 4);
+    }
   }
-  return compressed;
 }
 
 /// tolerance for genotype probabilities which sit just outside the legal range.
@@ -408,11 +507,12 @@ static inline bool missing_genotypes(double *genotypes, std::uint32_t size) {
   return nan_count == size;
 }
 
-static std::vector<std::uint8_t> encode_layout1(
+static void encode_layout1(
                     double *genotypes,
-                    std::uint32_t geno_len) {
+                    std::uint32_t geno_len,
+                    std::vector<std::uint8_t> &encoded) {
   // genotypes are encoded as 16-bit uints, so resize to n_genotypes * 2
-  std::vector<std::uint8_t> encoded(geno_len * 2 + 8);
+  encoded.assign(geno_len * 2 + 8, 0);
 
   std::uint32_t i = 0;
   std::int32_t scaled32;
@@ -449,7 +549,6 @@ static std::vector<std::uint8_t> encode_layout1(
     }
   }
   encoded.resize(geno_len * 2);
-  return encoded;
 }
 
 /// @brief scale a running total of probabilities into the encoded integer range
@@ -1017,7 +1116,7 @@ static std::uint32_t encode_phased(std::vector<std::uint8_t> &encoded,
   return genotype_offset + (bit_idx / 8) + (std::uint32_t)((bit_idx % 8) > 0);
 }
 
-static std::vector<std::uint8_t> encode_layout2(
+static void encode_layout2(
                     std::uint32_t n_samples,
                     std::uint16_t n_alleles,
                     double *genotypes,
@@ -1026,7 +1125,8 @@ static std::vector<std::uint8_t> encode_layout2(
                     std::uint8_t min_ploidy,
                     std::uint8_t max_ploidy,
                     bool phased,
-                    std::uint8_t &bit_depth
+                    std::uint8_t &bit_depth,
+                    std::vector<std::uint8_t> &encoded
                     ) 
 {
   int _max_ploid = (int)max_ploidy;
@@ -1044,7 +1144,9 @@ static std::vector<std::uint8_t> encode_layout2(
   probs_len = (probs_len / 8) + remainder;
 
   std::uint32_t encoded_size = 10 + n_samples + probs_len;
-  std::vector<std::uint8_t> encoded(encoded_size + 8);  // extend slightly to help with variable bit depths
+  // zeroed, as the bit packing ORs values in. Extend slightly to help with variable
+  // bit depths
+  encoded.assign(encoded_size + 8, 0);
   std::uint32_t i=0;
   std::memcpy(&encoded[i], &n_samples, 4);
   i += 4;
@@ -1091,7 +1193,6 @@ static std::vector<std::uint8_t> encode_layout2(
   }
 
   encoded.resize(encoded_size);
-  return encoded;
 }
 
 // convenience function for constant ploidy
@@ -1126,45 +1227,21 @@ void CppBgenWriter::encode_genotype_data(std::uint16_t n_alleles,
     throw std::invalid_argument("you cannot use zstd compression with layout 1");
   }
 
-  std::vector<std::uint8_t> encoded;
+  // encoded into a buffer kept between variants, so it only grows for the first few
   if (layout == 1) {
-    encoded = encode_layout1(genotypes, geno_len);
+    encode_layout1(genotypes, geno_len, pending_encoded);
   } else {
-    encoded = encode_layout2(n_samples, n_alleles, genotypes, geno_len, ploidy, 
-                   min_ploidy, max_ploidy, phased, bit_depth);
+    encode_layout2(n_samples, n_alleles, genotypes, geno_len, ploidy, 
+                   min_ploidy, max_ploidy, phased, bit_depth, pending_encoded);
   }
 
-  std::vector<char> compressed;
-  if (compression != 0) {
-    compressed = compress(encoded, compression);
+  if (pipeline) {
+    // compressed later, by the pipeline's threads
+    return;
   }
-  std::uint32_t compressed_len = compressed.size();
-
   // assemble the block exactly as it needs to appear on disk, so that writing
   // it later is a single copy which cannot fail partway on bad input
-  pending.clear();
-  std::uint32_t size;
-  if (layout == 1) {
-    if (compression != 0) {
-      append_bytes(pending, &compressed_len, 4);
-    }
-  } else {
-    if (compression == 0) {
-      size = encoded.size();
-      append_bytes(pending, &size, 4);
-    } else {
-      size = compressed_len + 4;
-      append_bytes(pending, &size, 4);
-      size = encoded.size();
-      append_bytes(pending, &size, 4);
-    }
-  }
-
-  if (compression == 0) {
-    append_bytes(pending, encoded.data(), encoded.size());
-  } else {
-    append_bytes(pending, compressed.data(), compressed.size());
-  }
+  pack_block(pending_encoded, layout, compression, pending);
 }
 
 // write the block prepared by encode_genotype_data()
@@ -1174,4 +1251,223 @@ std::uint64_t CppBgenWriter::write_genotype_data() {
   return current_position(handle);
 }
 
+/// @brief compress variants in the background, from here on
+///
+/// Variants are then queued with queue_variant or queue_variant_direct, rather than
+/// written with write_variant_header and write_genotype_data.
+///
+/// @param threads number of compression threads, or zero for one per core
+/// @param depth most variants to hold queued, compressing or waiting to be written
+void CppBgenWriter::start_pipeline(int threads, int depth) {
+  if (pipeline) {
+    throw std::invalid_argument("variants are already compressing in the background");
+  }
+  threads = resolve_threads(threads, UINT64_MAX);
+  pipeline.reset(new WritePipeline(handle, layout, compression, threads, depth));
+}
+
+// queue a variant, with the genotypes from the last encode_genotype_data()
+void CppBgenWriter::queue_variant(std::string &varid,
+                                  std::string &rsid,
+                                  std::string &chrom,
+                                  std::uint32_t &pos,
+                                  std::vector<std::string> &alleles,
+                                  std::uint32_t _n_samples) {
+  if (!pipeline) {
+    throw std::invalid_argument("variants are only queued when compressing in the background");
+  }
+  variant_header(varid, rsid, chrom, pos, alleles, _n_samples, pending_header);
+  pipeline->queue(pending_header, pending_encoded, false);
+  n_variants += 1;
+}
+
+// queue the stored bytes of a variant, copied from another bgen
+void CppBgenWriter::queue_variant_direct(std::vector<std::uint8_t> & data) {
+  if (!pipeline) {
+    throw std::invalid_argument("variants are only queued when compressing in the background");
+  }
+  pending_header.clear();
+  pipeline->queue(pending_header, data, true);
+  n_variants += 1;
+}
+
+// wait for every queued variant to be written, and raise any error from doing so
+void CppBgenWriter::flush() {
+  if (pipeline) {
+    pipeline->flush();
+  }
+}
+
+// collect the file offsets of the variants written since the last call, in the
+// order they were queued
+void CppBgenWriter::written_offsets(std::vector<std::uint64_t> & starts,
+                                    std::vector<std::uint64_t> & ends) {
+  starts.clear();
+  ends.clear();
+  if (pipeline) {
+    pipeline->written(starts, ends);
+  }
+}
+
+/// start the compression threads and the writer thread
+///
+/// @param handle file to write to, which nothing else may use until the pipeline
+///     stops
+/// @param layout bgen layout version (1 or 2)
+/// @param compression compression scheme (0=no compression, 1=zlib, 2=zstd)
+/// @param threads number of compression threads
+/// @param depth most variants to hold in the pipeline at once
+WritePipeline::WritePipeline(std::ofstream & _handle, std::uint32_t _layout,
+                             std::uint32_t _compression, int threads, int _depth) :
+    handle(_handle), layout(_layout), compression(_compression) {
+  if (_depth < 1) {
+    throw std::invalid_argument("write queue depth must be at least one");
+  }
+  if (threads < 1) {
+    throw std::invalid_argument("writing in the background needs at least one thread");
+  }
+  depth = (std::uint64_t) _depth;
+  slots.resize(depth);
+  workers.reserve(threads + 1);
+  try {
+    workers.push_back(std::thread(&WritePipeline::write_work, this));
+    for (int i = 0; i < threads; i++) {
+      workers.push_back(std::thread(&WritePipeline::compress_work, this));
+    }
+  } catch (...) {
+    // a thread which failed to start must not leave the others running
+    stop();
+    throw;
+  }
+}
+
+WritePipeline::~WritePipeline() {
+  stop();
+}
+
+// stop the threads, abandoning anything not yet written
+void WritePipeline::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  queued_cv.notify_all();
+  ready_cv.notify_all();
+  written_cv.notify_all();
+  for (auto & worker : workers) {
+    worker.join();
+  }
+  workers.clear();
+}
+
+/// @brief hand a variant over to be compressed and written, waiting for room if needed
+///
+/// @param header variant header, as stored. Emptied, as it's moved into the queue
+/// @param data the variant's genotype block, emptied as it's moved into the queue
+/// @param packed whether data is already as stored, with the header included, as
+///     when copying a variant from another bgen
+void WritePipeline::queue(std::vector<char> & header, std::vector<std::uint8_t> & data,
+                          bool packed) {
+  std::unique_lock<std::mutex> lock(mutex);
+  written_cv.wait(lock, [this] {
+    return error || (n_queued < n_written + depth);
+  });
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  Slot & slot = slots[n_queued % depth];
+  // swap, so the buffers of the variant last in this slot go back to the caller, to
+  // reuse for its next variant
+  slot.header.swap(header);
+  slot.data.swap(data);
+  slot.packed = packed;
+  n_queued++;
+  lock.unlock();
+  queued_cv.notify_one();
+  header.clear();
+  data.clear();
+}
+
+/// wait for every queued variant to be written, and raise any error from doing so
+void WritePipeline::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  written_cv.wait(lock, [this] { return error || (n_written == n_queued); });
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/// move out the offsets of variants written since the last call, in queue order
+void WritePipeline::written(std::vector<std::uint64_t> & _starts,
+                            std::vector<std::uint64_t> & _ends) {
+  std::lock_guard<std::mutex> lock(mutex);
+  _starts.swap(starts);
+  _ends.swap(ends);
+  starts.clear();
+  ends.clear();
+}
+
+/// compress queued variants, in the order they were queued, until stopped
+void WritePipeline::compress_work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    queued_cv.wait(lock, [this] { return stopping || (n_claimed < n_queued); });
+    if (stopping) {
+      return;
+    }
+    Slot & slot = slots[n_claimed++ % depth];
+    lock.unlock();
+    try {
+      if (!slot.packed) {
+        pack_block(slot.data, layout, compression, slot.block);
+      }
+    } catch (...) {
+      slot.error = std::current_exception();
+    }
+    lock.lock();
+    slot.ready = true;
+    ready_cv.notify_all();
+  }
+}
+
+/// append compressed variants to the file, strictly in queue order, until stopped
+void WritePipeline::write_work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    Slot & slot = slots[n_written % depth];
+    ready_cv.wait(lock, [this, &slot] { return stopping || (!error && slot.ready); });
+    if (stopping) {
+      return;
+    }
+    lock.unlock();
+    std::uint64_t start = 0, end = 0;
+    std::exception_ptr failed = slot.error;
+    if (!failed) {
+      try {
+        start = current_position(handle);
+        if (slot.packed) {
+          handle.write(reinterpret_cast<char *>(slot.data.data()), slot.data.size());
+        } else {
+          handle.write(slot.header.data(), slot.header.size());
+          handle.write(slot.block.data(), slot.block.size());
+        }
+        end = current_position(handle);
+      } catch (...) {
+        failed = std::current_exception();
+      }
+    }
+    lock.lock();
+    slot.ready = false;
+    slot.error = nullptr;
+    if (failed) {
+      error = failed;
+    } else {
+      starts.push_back(start);
+      ends.push_back(end);
+      n_written++;
+    }
+    written_cv.notify_all();
+  }
+}
+
 }  // namespace bgen
@@ -1,13 +1,77 @@
 #ifndef BGEN_WRITER_H_
 #define BGEN_WRITER_H_
 
+#include <condition_variable>
 #include <cstdint>
+#include <exception>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 namespace bgen {
 
+/// compresses variants on a pool of threads, and writes them in the order queued
+///
+/// The caller encodes each variant's genotypes, so bad genotypes are still reported
+/// before anything is queued, then hands the encoded block over with the variant's
+/// header. Queued variants go into a ring of depth slots, indexed by their position
+/// in the queue. Compression threads take the next queued slot, and compress it
+/// without the lock, so several variants compress at once. A writer thread of its
+/// own appends finished slots to the file strictly in queue order, and records
+/// where each one landed, for the index. The caller waits for a free slot before
+/// queuing another variant, which bounds memory to depth variants.
+///
+/// A failure to compress or write a variant stops the writing, since every variant
+/// after it would sit at the wrong offset. The error is raised on the caller's next
+/// queue or flush.
+class WritePipeline {
+public:
+  WritePipeline(std::ofstream & handle, std::uint32_t layout, std::uint32_t compression,
+                int threads, int depth);
+  ~WritePipeline();
+  WritePipeline(const WritePipeline &) = delete;
+  WritePipeline & operator=(const WritePipeline &) = delete;
+  void queue(std::vector<char> & header, std::vector<std::uint8_t> & data, bool packed);
+  void flush();
+  void written(std::vector<std::uint64_t> & starts, std::vector<std::uint64_t> & ends);
+private:
+  struct Slot {
+    // the variant header, then its genotypes as encoded, or as stored if packed
+    std::vector<char> header;
+    std::vector<std::uint8_t> data;
+    std::vector<char> block;
+    bool packed = false;
+    bool ready = false;
+    std::exception_ptr error;
+  };
+  void compress_work();
+  void write_work();
+  void stop();
+  std::ofstream & handle;
+  std::uint32_t layout;
+  std::uint32_t compression;
+  std::uint64_t depth;
+  std::vector<Slot> slots;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  // signals a variant being queued, for the compression threads, a slot being
+  // ready, for the writer thread, and a slot being written, for the caller
+  std::condition_variable queued_cv;
+  std::condition_variable ready_cv;
+  std::condition_variable written_cv;
+  std::uint64_t n_queued = 0;
+  std::uint64_t n_claimed = 0;
+  std::uint64_t n_written = 0;
+  // file offsets of the start and end of each written variant, until collected
+  std::vector<std::uint64_t> starts;
+  std::vector<std::uint64_t> ends;
+  std::exception_ptr error;
+  bool stopping = false;
+};
+
 class CppBgenWriter {
   std::ofstream handle;
   std::uint32_t n_samples;
@@ -17,8 +81,24 @@ class CppBgenWriter {
   std::uint32_t nvars_offset=8;
   std::uint32_t variant_data_offset=0;
   bool closed=false;
-  // genotype block (length prefixes included) held between encoding and writing
+  // genotype block (length prefixes included) held between encoding and writing.
+  // This and the other pending buffers keep their capacity between variants, so
+  // writing allocates nothing once they have grown to fit
   std::vector<char> pending;
+  // encoded genotypes, before compression. Held between encoding and queuing, if
+  // compressing in the background
+  std::vector<std::uint8_t> pending_encoded;
+  // declared after the handle it writes to, so it stops before the handle closes
+  std::unique_ptr<WritePipeline> pipeline;
+  // variant header, laid out as stored, held between checking and writing
+  std::vector<char> pending_header;
+  void variant_header(std::string &varid,
+                      std::string &rsid,
+                      std::string &chrom,
+                      std::uint32_t &pos,
+                      std::vector<std::string> &alleles,
+                      std::uint32_t _n_samples,
+                      std::vector<char> &header);
 public:
   CppBgenWriter(std::string &path,
              std::uint32_t _n_samples,
@@ -61,6 +141,17 @@ public:
                             bool phased = 0,
                             std::uint8_t bit_depth = 8);
   std::uint64_t write_genotype_data();
+  void start_pipeline(int threads, int depth);
+  void queue_variant(std::string &varid,
+                     std::string &rsid,
+                     std::string &chrom,
+                     std::uint32_t &pos,
+                     std::vector<std::string> &alleles,
+                     std::uint32_t _n_samples);
+  void queue_variant_direct(std::vector<std::uint8_t> & data);
+  void flush();
+  void written_offsets(std::vector<std::uint64_t> & starts,
+                       std::vector<std::uint64_t> & ends);
   void close();
 };
 
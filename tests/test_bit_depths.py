@@ -0,0 +1,307 @@
+
+import logging
+from pathlib import Path
+import tempfile
+import unittest
+
+import numpy as np
+
+from bgen import BgenReader, BgenWriter
+
+DEPTHS = list(range(1, 33))
+SAMPLE_COUNTS = [5, 8, 37, 1000, 2051]
+
+def stored_values(var, n_values, bit_depth):
+    ''' unpack the stored integers of an uncompressed variant, bit by bit
+
+    The probabilities are the last part of the genotype block, which is itself the
+    last part of the variant, so they can be taken from the end of its data.
+    '''
+    n_bytes = (n_values * bit_depth + 7) // 8
+    raw = np.frombuffer(bytes(var.copy_data()[-n_bytes:]), dtype=np.uint8)
+    bits = np.unpackbits(raw, bitorder='little')[:n_values * bit_depth]
+    bits = bits.reshape(n_values, bit_depth).astype(np.uint64)
+    return (bits << np.arange(bit_depth, dtype=np.uint64)).sum(axis=1)
+
+# the table the 8 bit decoders read from, which holds each value / 255 to seven places
+LUT8 = np.round(np.arange(511) / 255, 7).astype(np.float32)
+
+def expected_probs(values, n_rows, bit_depth):
+    ''' probabilities as the scalar decoder computes them, in float32 throughout
+    '''
+    stored = values.reshape(n_rows, -1).astype(np.int64)
+    if bit_depth == 8 and stored.shape[1] <= 2:
+        # one or two values per row at 8 bits are looked up, remainder included
+        remainder = np.clip(255 - stored.sum(axis=1), 0, None)
+        return np.column_stack([LUT8[stored], LUT8[remainder]])
+    # as float(2 ** bit_depth) - 1 in float, then a double divide, rounded to float
+    factor = np.float32(1.0 / float(np.float32(2.0 ** bit_depth) - np.float32(1)))
+    stored = stored.astype(np.float32) * factor
+    remainder = np.ones(n_rows, dtype=np.float32)
+    for x in range(stored.shape[1]):
+        remainder = remainder - stored[:, x]
+    remainder[remainder < np.float32(-1e-6)] = 0
+    return np.column_stack([stored, remainder])
+
+def expected_alt_dosage(values, bit_depth):
+    ''' alt dosages of unphased diploid samples, as the scalar decoder computes them
+    '''
+    factor = np.float32(1) / np.float32(2 ** bit_depth - 1)
+    hom, het = values[0::2], values[1::2]
+    ref = (hom * 2 + het).astype(np.float32) * factor
+    ref[hom + het > 2 ** bit_depth - 1] = 2
+    return np.float32(2) - ref
+
+def expected_phased_alt_dosage(values, bit_depth):
+    ''' alt dosages of phased diploid samples, with each haplotype scaled before summing
+    '''
+    factor = np.float32(1) / np.float32(2 ** bit_depth - 1)
+    first, second = values[0::2], values[1::2]
+    ref = first.astype(np.float32) * factor + second.astype(np.float32) * factor
+    return np.float32(2) - ref
+
+def expected_mixed_probs(values, ploidy, bit_depth):
+    ''' unphased biallelic probabilities of samples with zero, one or two copies
+
+    Each sample stores as many values as its ploidy, so its values start after the
+    summed ploidy of the samples before it. Rows are padded out to three with nan.
+    '''
+    factor = np.float32(1.0 / float(np.float32(2.0 ** bit_depth) - np.float32(1)))
+    start = np.concatenate([[0], np.cumsum(ploidy)[:-1]]).astype(np.int64)
+    padded = np.concatenate([values, [0, 0]]).astype(np.float32) * factor
+    first = np.where(ploidy > 0, padded[start], np.float32(0))
+    second = np.where(ploidy > 1, padded[start + 1], np.float32(0))
+    remainder = np.float32(1) - first
+    remainder = np.where(ploidy > 1, remainder - second, remainder)
+    remainder[remainder < np.float32(-1e-6)] = 0
+    probs = np.full((len(ploidy), 3), np.nan, dtype=np.float32)
+    probs[:, 0] = np.where(ploidy == 0, np.float32(1), first)
+    probs[ploidy == 1, 1] = remainder[ploidy == 1]
+    probs[ploidy == 2, 1] = second[ploidy == 2]
+    probs[ploidy == 2, 2] = remainder[ploidy == 2]
+    return probs
+
+def expected_mixed_alt_dosage(values, ploidy, bit_depth, phased):
+    ''' alt dosages of biallelic samples with zero, one or two copies
+    '''
+    factor = np.float32(1) / np.float32(2 ** bit_depth - 1)
+    start = np.concatenate([[0], np.cumsum(ploidy)[:-1]]).astype(np.int64)
+    padded = np.concatenate([values, [0, 0]])
+    first = np.where(ploidy > 0, padded[start], 0)
+    second = np.where(ploidy > 1, padded[start + 1], 0)
+    if phased:
+        ref = first.astype(np.float32) * factor + second.astype(np.float32) * factor
+    else:
+        ref = (first * ploidy + second).astype(np.float32) * factor
+        above = (first + second) > 2 ** bit_depth - 1
+        ref[above] = ploidy[above]
+    return ploidy.astype(np.float32) - ref
+
+class TestBitDepths(unittest.TestCase):
+    ''' check the vectorised decoders match the stored values exactly, at every depth
+    '''
+    def setUp(self):
+        self.tmp = tempfile.TemporaryDirectory()
+        self.addCleanup(self.tmp.cleanup)
+        self.rng = np.random.default_rng(11)
+
+    def write(self, n_samples, bit_depth, n_alleles=2, phased=False, missing=()):
+        if phased:
+            geno = self.rng.random((n_samples * 2, n_alleles))
+            geno /= geno.sum(axis=1)[:, None]
+            geno = geno.reshape(n_samples, 2 * n_alleles)
+        else:
+            geno = self.rng.random((n_samples, 3 if n_alleles == 2 else 6))
+            geno /= geno.sum(axis=1)[:, None]
+        geno[list(missing)] = np.nan
+        path = Path(self.tmp.name) / f'{n_samples}.{bit_depth}.{n_alleles}.{phased}.bgen'
+        with BgenWriter(path, n_samples, compression=None) as bfile:
+            bfile.add_variant('var', 'rs', '1', 1, ['A', 'C', 'G'][:n_alleles], geno,
+                              phased=phased, bit_depth=bit_depth)
+        return path
+
+    def check(self, n_samples, bit_depth, n_alleles=2, phased=False, missing=()):
+        path = self.write(n_samples, bit_depth, n_alleles, phased, missing)
+        with BgenReader(path, delay_parsing=True) as bfile:
+            var = next(iter(bfile))
+            n_rows = n_samples * 2 if phased else n_samples
+            n_stored = n_alleles - 1 if phased else (2 if n_alleles == 2 else 5)
+            values = stored_values(var, n_rows * n_stored, bit_depth)
+
+            expected = expected_probs(values, n_rows, bit_depth).reshape(n_samples, -1)
+            expected[list(missing)] = np.nan
+            np.testing.assert_array_equal(var.probabilities, expected)
+            if n_alleles == 2:
+                if phased:
+                    dose = expected_phased_alt_dosage(values, bit_depth)
+                else:
+                    dose = expected_alt_dosage(values, bit_depth)
+                dose[list(missing)] = np.nan
+                np.testing.assert_array_equal(var.alt_dosage, dose)
+
+    def test_unphased(self):
+        ''' check unphased biallelic probabilities and dosages at each depth
+        '''
+        for bit_depth in DEPTHS:
+            for n_samples in SAMPLE_COUNTS:
+                with self.subTest(bit_depth=bit_depth, n_samples=n_samples):
+                    self.check(n_samples, bit_depth, missing=[1, n_samples - 1])
+
+    def test_phased(self):
+        ''' check phased biallelic probabilities and dosages at each depth
+        '''
+        for bit_depth in DEPTHS:
+            for n_samples in SAMPLE_COUNTS:
+                with self.subTest(bit_depth=bit_depth, n_samples=n_samples):
+                    self.check(n_samples, bit_depth, phased=True, missing=[0, n_samples - 2])
+
+    def test_32_bit(self):
+        ''' check 32 bit values, which are loaded whole rather than unpacked
+
+        The packed decoders set up their unpacking for every depth, including those
+        they load whole, so this is also worth running on a build made with
+        BGEN_SANITIZE=undefined, to catch undefined shifts at 32 bits.
+        '''
+        for phased in [False, True]:
+            for n_samples in SAMPLE_COUNTS:
+                with self.subTest(phased=phased, n_samples=n_samples):
+                    self.check(n_samples, 32, phased=phased, missing=[0])
+
+    def test_multiallelic(self):
+        for bit_depth in [3, 8, 13, 16, 25, 32]:
+            for n_samples in SAMPLE_COUNTS:
+                for phased in [False, True]:
+                    with self.subTest(bit_depth=bit_depth, n_samples=n_samples,
+                                      phased=phased):
+                        self.check(n_samples, bit_depth, n_alleles=3, phased=phased)
+
+    def test_above_max(self):
+        ''' check samples summing above the maximum are clamped and reported
+        '''
+        n_samples = 40
+        for bit_depth in [4, 12, 16, 20]:
+            with self.subTest(bit_depth=bit_depth):
+                path = self.write(n_samples, bit_depth)
+                # each sample fills a whole number of bytes at these depths, so set every
+                # bit of a few samples, which sums their two values above the maximum
+                sample_bytes = bit_depth * 2 // 8
+                data = bytearray(path.read_bytes())
+                start = len(data) - n_samples * sample_bytes
+                for sample in [3, 17, 38]:
+                    offset = start + sample * sample_bytes
+                    data[offset:offset + sample_bytes] = b'\xff' * sample_bytes
+                path.write_bytes(bytes(data))
+
+                with BgenReader(path, delay_parsing=True) as bfile:
+                    var = next(iter(bfile))
+                    values = stored_values(var, n_samples * 2, bit_depth)
+                    with self.assertLogs(level=logging.WARNING):
+                        probs = var.probabilities
+                    np.testing.assert_array_equal(probs,
+                        expected_probs(values, n_samples, bit_depth))
+                    self.assertEqual(list(probs[[3, 17, 38], 2]), [0, 0, 0])
+                    with self.assertLogs(level=logging.WARNING):
+                        dose = var.alt_dosage
+                    np.testing.assert_array_equal(dose, expected_alt_dosage(values, bit_depth))
+                    self.assertEqual(list(dose[[3, 17, 38]]), [0, 0, 0])
+
+    def write_mixed(self, ploidy, bit_depth, phased=False, missing=()):
+        ''' write a biallelic variant whose samples carry zero, one or two copies
+        '''
+        n_samples = len(ploidy)
+        if phased:
+            first = self.rng.random((n_samples, 2))
+            geno = np.column_stack([first[:, 0], 1 - first[:, 0],
+                                    first[:, 1], 1 - first[:, 1]])
+            geno[ploidy < 2, 2:] = np.nan
+            geno[ploidy < 1, :2] = np.nan
+        else:
+            geno = self.rng.random((n_samples, 3))
+            geno[ploidy == 1, 2] = 0
+            geno /= geno.sum(axis=1)[:, None]
+            geno[ploidy == 1, 2] = np.nan
+            geno[ploidy == 0] = [1, np.nan, np.nan]
+        geno[list(missing)] = np.nan
+        path = Path(self.tmp.name) / f'mixed.{n_samples}.{bit_depth}.{phased}.bgen'
+        with BgenWriter(path, n_samples, compression=None) as bfile:
+            bfile.add_variant('var', 'rs', 'X', 1, ['A', 'C'], geno, ploidy=ploidy,
+                              phased=phased, bit_depth=bit_depth)
+        return path
+
+    def test_mixed_ploidy(self):
+        ''' check haploid and diploid samples mixed in a variant, as on chrX
+        '''
+        for bit_depth in DEPTHS:
+            for n_samples in SAMPLE_COUNTS:
+                for phased in [False, True]:
+                    with self.subTest(bit_depth=bit_depth, n_samples=n_samples,
+                                      phased=phased):
+                        ploidy = self.rng.choice([1, 2], n_samples).astype(np.uint8)
+                        # a sample with no copies now and then, which stores nothing
+                        ploidy[::7] = 0
+                        ploidy[2:4] = [2, 1]
+                        missing = [1, n_samples - 1]
+                        path = self.write_mixed(ploidy, bit_depth, phased, missing)
+                        if phased:
+                            # the writer marks phased samples of only nan as missing
+                            missing += list(np.flatnonzero(ploidy == 0))
+                        with BgenReader(path, delay_parsing=True) as bfile:
+                            var = next(iter(bfile))
+                            values = stored_values(var, int(ploidy.sum()), bit_depth)
+                            dose = expected_mixed_alt_dosage(values, ploidy, bit_depth,
+                                                             phased)
+                            dose[missing] = np.nan
+                            np.testing.assert_array_equal(var.alt_dosage, dose)
+                            if not phased:
+                                probs = expected_mixed_probs(values, ploidy, bit_depth)
+                                probs[missing] = np.nan
+                                np.testing.assert_array_equal(var.probabilities, probs)
+                            probs = var.probabilities
+                        with BgenReader(path, delay_parsing=True) as bfile:
+                            # a subset never takes the vectorised paths
+                            bfile.select_samples(list(range(n_samples)))
+                            var = next(iter(bfile))
+                            np.testing.assert_array_equal(var.probabilities, probs)
+                            np.testing.assert_array_equal(var.alt_dosage, dose)
+
+    def test_mixed_ploidy_above_max(self):
+        ''' check mixed ploidy samples summing above the maximum are clamped
+        '''
+        n_samples = 100
+        for bit_depth in [3, 8, 16, 25]:
+            with self.subTest(bit_depth=bit_depth):
+                ploidy = self.rng.choice([0, 1, 2], n_samples).astype(np.uint8)
+                ploidy[:2] = [2, 1]
+                path = self.write_mixed(ploidy, bit_depth)
+                # fill the stored values with random bits, which puts many diploid
+                # samples above the maximum, without touching the ploidy bytes before
+                n_bytes = (int(ploidy.sum()) * bit_depth + 7) // 8
+                data = bytearray(path.read_bytes())
+                data[-n_bytes:] = self.rng.integers(0, 256, n_bytes, dtype=np.uint8).tobytes()
+                path.write_bytes(bytes(data))
+
+                with BgenReader(path, delay_parsing=True) as bfile:
+                    var = next(iter(bfile))
+                    values = stored_values(var, int(ploidy.sum()), bit_depth)
+                    with self.assertLogs(level=logging.WARNING):
+                        probs = var.probabilities
+                    np.testing.assert_array_equal(probs,
+                        expected_mixed_probs(values, ploidy, bit_depth))
+                    with self.assertLogs(level=logging.WARNING):
+                        dose = var.alt_dosage
+                    np.testing.assert_array_equal(dose,
+                        expected_mixed_alt_dosage(values, ploidy, bit_depth, False))
+
+    def test_example_files(self):
+        ''' check the example and complex files at each depth decode the same subsets
+        '''
+        folder = Path(__file__).parent / 'data'
+        for path in sorted(folder.glob('*.*bits.bgen')):
+            with self.subTest(name=path.name):
+                with BgenReader(path) as bfile:
+                    full = [v.probabilities for v in bfile]
+                with BgenReader(path) as bfile:
+                    # a subset never takes the vectorised paths
+                    bfile.select_samples(list(range(len(bfile.samples))))
+                    for var, probs in zip(bfile, full):
+                        np.testing.assert_array_equal(var.probabilities, probs)
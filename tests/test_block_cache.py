@@ -0,0 +1,137 @@
+
+from pathlib import Path
+import pickle
+import unittest
+import warnings
+
+import numpy as np
+
+from bgen import BgenReader
+
+class TestBlockCache(unittest.TestCase):
+    ''' check cached genotype blocks decode the same as freshly read ones
+    '''
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+
+    def test_disabled_by_default(self):
+        ''' check there is no cache unless a size is given
+        '''
+        with BgenReader(self.folder / 'example.16bits.bgen') as bfile:
+            bfile[0].alt_dosage
+            bfile[0].alt_dosage
+            self.assertEqual(bfile.cache_info(), {'hits': 0, 'misses': 0,
+                'evictions': 0, 'entries': 0, 'bytes': 0, 'capacity': 0})
+
+    def test_negative_size(self):
+        with self.assertRaises(ValueError):
+            BgenReader(self.folder / 'example.16bits.bgen', cache_size=-1)
+
+    def test_matches_uncached(self):
+        ''' check repeat lookups hit the cache, and decode the same genotypes
+        '''
+        names = ['example.16bits.bgen', 'example.16bits.zstd.bgen', 'example.v11.bgen',
+                 'complex.bgen', 'haplotypes.bgen']
+        for name in names:
+            path = self.folder / name
+            with BgenReader(path) as bfile:
+                expected = [(v.probabilities, v.ploidy) for v in bfile]
+            for use_mmap in [False, True]:
+                with self.subTest(name=name, use_mmap=use_mmap):
+                    with BgenReader(path, use_mmap=use_mmap, cache_size=2**24) as bfile:
+                        for _ in range(3):
+                            for i, (probs, ploidy) in enumerate(expected):
+                                var = bfile[i]
+                                np.testing.assert_array_equal(var.probabilities, probs)
+                                np.testing.assert_array_equal(var.ploidy, ploidy)
+                        info = bfile.cache_info()
+                    self.assertEqual(info['hits'] + info['misses'], 3 * len(expected))
+                    if info['entries'] > 0:
+                        # only blocks which had to be copied or decompressed are kept
+                        self.assertEqual(info['misses'], len(expected))
+                        self.assertEqual(info['entries'], len(expected))
+                    self.assertEqual(info['evictions'], 0)
+                    self.assertLessEqual(info['bytes'], info['capacity'])
+
+    def test_eviction(self):
+        ''' check a small budget drops the least recently used blocks
+        '''
+        path = self.folder / 'example.16bits.bgen'
+        with BgenReader(path, cache_size=2**24) as bfile:
+            bfile[0].alt_dosage
+            budget = bfile.cache_info()['bytes'] * 3
+        with BgenReader(path, cache_size=budget) as bfile:
+            expected = [v.alt_dosage for v in bfile]
+            for i in range(len(expected)):
+                np.testing.assert_array_equal(bfile[i].alt_dosage, expected[i])
+            info = bfile.cache_info()
+            self.assertGreater(info['evictions'], 0)
+            self.assertEqual(info['entries'], 3)
+            self.assertLessEqual(info['bytes'], budget)
+
+            # the most recent variant is still cached, but the first has gone
+            hits = info['hits']
+            bfile[len(expected) - 1].alt_dosage
+            self.assertEqual(bfile.cache_info()['hits'], hits + 1)
+            bfile[0].alt_dosage
+            self.assertEqual(bfile.cache_info()['hits'], hits + 1)
+
+    def test_block_larger_than_budget(self):
+        ''' check blocks which cannot fit are decoded but not kept
+        '''
+        path = self.folder / 'example.16bits.bgen'
+        with BgenReader(path, cache_size=10) as bfile:
+            bfile[0].alt_dosage
+            bfile[0].alt_dosage
+            info = bfile.cache_info()
+            self.assertEqual(info['misses'], 2)
+            self.assertEqual(info['entries'], 0)
+
+    def test_dosage_matrix_shares_cache(self):
+        ''' check the threaded dosage decode reads and fills the same cache
+        '''
+        path = self.folder / 'example.16bits.zstd.bgen'
+        with BgenReader(path, cache_size=2**24) as bfile:
+            n = len(bfile)
+            first = bfile.dosage_matrix(indices=range(n), threads=4)
+            self.assertEqual(bfile.cache_info()['misses'], n)
+            second = bfile.dosage_matrix(indices=range(n), threads=4)
+            self.assertEqual(bfile.cache_info()['hits'], n)
+            np.testing.assert_array_equal(first, second)
+            np.testing.assert_array_equal(bfile[5].alt_dosage, first[5])
+            self.assertEqual(bfile.cache_info()['hits'], n + 1)
+
+    def test_sample_selection(self):
+        ''' check cached blocks hold every sample, whatever subset is selected
+        '''
+        path = self.folder / 'example.16bits.bgen'
+        with BgenReader(path, cache_size=2**24) as bfile:
+            full = bfile[3].probabilities
+            bfile.select_samples([5, 1, 8])
+            np.testing.assert_array_equal(bfile[3].probabilities, full[[5, 1, 8]])
+            self.assertEqual(bfile.cache_info()['hits'], 1)
+
+    def test_close_frees_blocks(self):
+        ''' check closing the reader drops the cached blocks
+        '''
+        path = self.folder / 'example.16bits.bgen'
+        bfile = BgenReader(path, cache_size=2**24)
+        var = bfile[0]
+        dose = var.alt_dosage
+        self.assertEqual(bfile.cache_info()['entries'], 1)
+        bfile.close()
+        self.assertEqual(bfile.cache_info()['entries'], 0)
+        # a variant which already decoded its block still has it
+        np.testing.assert_array_equal(var.alt_dosage, dose)
+
+    def test_pickled_variant(self):
+        ''' check an unpickled variant decodes without the reader's cache
+        '''
+        path = self.folder / 'example.16bits.bgen'
+        with BgenReader(path, cache_size=2**24) as bfile:
+            var = bfile[2]
+            with warnings.catch_warnings():
+                warnings.simplefilter('ignore', RuntimeWarning)
+                copied = pickle.loads(pickle.dumps(var))
+            np.testing.assert_array_equal(copied.alt_dosage, var.alt_dosage)
+            self.assertEqual(bfile.cache_info()['misses'], 1)
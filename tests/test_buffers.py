@@ -0,0 +1,52 @@
+
+from pathlib import Path
+import unittest
+
+import numpy as np
+
+from bgen import BgenReader
+from bgen.reader import genotype_buffer_stats
+
+class TestGenotypeBuffers(unittest.TestCase):
+    ''' check genotype buffers are reused, rather than allocated per variant
+    '''
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+
+    def decode_all(self, bfile):
+        ''' decode every variant, and return the new buffer allocations
+        '''
+        before = genotype_buffer_stats()
+        values = []
+        for var in bfile:
+            values.append((var.probabilities, var.ploidy))
+            if len(var.alleles) == 2 and var.ploidy.max() <= 2:
+                values.append((var.alt_dosage, var.minor_allele_dosage))
+        after = genotype_buffer_stats()
+        return values, after['allocations'] - before['allocations']
+
+    def test_steady_state_allocates_nothing(self):
+        ''' check a second pass through a bgen allocates no genotype buffers
+        '''
+        names = ['example.16bits.bgen', 'example.16bits.zstd.bgen', 'example.v11.bgen',
+                 'complex.bgen', 'haplotypes.bgen']
+        for name in names:
+            for use_mmap in [False, True]:
+                with self.subTest(name=name, use_mmap=use_mmap):
+                    with BgenReader(self.folder / name, use_mmap=use_mmap) as bfile:
+                        first, _ = self.decode_all(bfile)
+                    with BgenReader(self.folder / name, use_mmap=use_mmap) as bfile:
+                        second, allocations = self.decode_all(bfile)
+                    self.assertEqual(allocations, 0)
+                    for a, b in zip(first, second):
+                        for x, y in zip(a, b):
+                            np.testing.assert_array_equal(x, y)
+
+    def test_prefetch_reuses_buffers(self):
+        ''' check prefetch threads get back the buffers the caller frees
+        '''
+        path = self.folder / 'example.16bits.zstd.bgen'
+        with BgenReader(path, prefetch=4, prefetch_threads=2) as bfile:
+            values, allocations = self.decode_all(bfile)
+        # only enough buffers for the variants in flight at once are allocated
+        self.assertLess(allocations, len(values) / 2)
@@ -0,0 +1,100 @@
+
+from pathlib import Path
+import shutil
+import sqlite3
+import tempfile
+import unittest
+
+import numpy as np
+
+import bgen.reader
+from bgen import BgenReader, BgenWriter, build_index
+
+VARIANT_QUERY = '''SELECT chromosome, position, rsid, number_of_alleles, allele1,
+                   allele2, file_start_position, size_in_bytes FROM Variant
+                   ORDER BY file_start_position'''
+
+def index_rows(path):
+    ''' get the variant rows and the names of the table indexes from a .bgi
+    '''
+    conn = sqlite3.connect(str(path))
+    try:
+        rows = conn.execute(VARIANT_QUERY).fetchall()
+        indexes = {x[0] for x in conn.execute(
+            "SELECT name FROM sqlite_master WHERE type='index' AND tbl_name='Variant'")}
+        metadata = conn.execute('SELECT filename, file_size FROM Metadata').fetchall()
+    finally:
+        conn.close()
+    return rows, indexes, metadata
+
+class TestBuildIndex(unittest.TestCase):
+    ''' check build_index writes the same .bgi as indexing while writing
+    '''
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+        self.tmp = tempfile.TemporaryDirectory()
+        self.addCleanup(self.tmp.cleanup)
+
+    def test_matches_shipped_index(self):
+        ''' check the rows match the bgenix made indexes in the test data
+        '''
+        for name in ['example.16bits.bgen', 'complex.bgen', 'haplotypes.bgen']:
+            with self.subTest(name=name):
+                path = Path(self.tmp.name) / name
+                shutil.copy(self.folder / name, path)
+                index_path = build_index(path)
+                self.assertEqual(index_path, str(path) + '.bgi')
+                expected, _, _ = index_rows(self.folder / (name + '.bgi'))
+                rows, indexes, metadata = index_rows(index_path)
+                self.assertEqual(rows, expected)
+                self.assertTrue({'chrom_index', 'pos_index', 'rsid_index'} <= indexes)
+                self.assertEqual(metadata, [(str(path), path.stat().st_size)])
+
+    def test_matches_writer_index(self):
+        ''' check across layouts and compression, against the index BgenWriter makes
+        '''
+        rng = np.random.default_rng(3)
+        for layout, compression in [(1, None), (1, 'zlib'), (2, None), (2, 'zstd')]:
+            with self.subTest(layout=layout, compression=compression):
+                path = Path(self.tmp.name) / f'written.{layout}.{compression}.bgen'
+                with BgenWriter(path, 5, layout=layout, compression=compression) as bfile:
+                    for i in range(300):
+                        # layout 2 variants can have more than two alleles
+                        n_alleles = 2 if layout == 1 else 2 + i % 2
+                        geno = rng.random((5, 3 if n_alleles == 2 else 6))
+                        geno /= geno.sum(axis=1)[:, None]
+                        alleles = ['A', 'CT', 'G'][:n_alleles]
+                        bfile.add_variant(f'var{i}', f'rs{i % 50}', str(1 + i % 2),
+                                          i * 10, alleles, geno)
+                expected, _, _ = index_rows(str(path) + '.bgi')
+                build_index(path)
+                rows, _, _ = index_rows(str(path) + '.bgi')
+                self.assertEqual(rows, expected)
+
+                with BgenReader(path) as bfile:
+                    self.assertEqual(len(list(bfile.fetch('1', 100, 1000))), 46)
+
+    def test_batches(self):
+        ''' check a bgen spanning several batches keeps every row, in file order
+        '''
+        path = Path(self.tmp.name) / 'example.16bits.bgen'
+        shutil.copy(self.folder / 'example.16bits.bgen', path)
+        expected, _, _ = index_rows(self.folder / 'example.16bits.bgen.bgi')
+        original = bgen.reader.INDEX_BATCH_SIZE
+        bgen.reader.INDEX_BATCH_SIZE = 7
+        try:
+            build_index(path)
+        finally:
+            bgen.reader.INDEX_BATCH_SIZE = original
+        rows, _, _ = index_rows(str(path) + '.bgi')
+        self.assertEqual(rows, expected)
+
+    def test_truncated(self):
+        ''' check a truncated bgen raises an error, and leaves no index behind
+        '''
+        path = Path(self.tmp.name) / 'example.16bits.bgen'
+        data = (self.folder / 'example.16bits.bgen').read_bytes()
+        path.write_bytes(data[:len(data) // 2])
+        with self.assertRaises(ValueError):
+            build_index(path)
+        self.assertFalse(Path(str(path) + '.bgi').exists())
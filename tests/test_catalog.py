@@ -0,0 +1,63 @@
+
+from pathlib import Path
+import tempfile
+import unittest
+
+import numpy as np
+
+from bgen import BgenReader, BgenWriter
+
+class TestCatalog(unittest.TestCase):
+    ''' check the variant listings match the variants found by iterating
+    '''
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+
+    def test_example_files(self):
+        ''' check IDs, positions and offsets against iteration, across example files
+        '''
+        for path in sorted(self.folder.glob('*.bgen')):
+            if path.with_suffix('.bgen.bgi').exists():
+                # an index takes over the listings, so leave those files out
+                continue
+            with self.subTest(path=path.name):
+                with BgenReader(path, delay_parsing=True) as bfile:
+                    variants = [(v.varid, v.rsid, v.chrom, v.pos, v.fileoffset) for v in bfile]
+                with BgenReader(path) as bfile:
+                    self.assertEqual(bfile.varids(), [x[0] for x in variants])
+                    self.assertEqual(bfile.rsids(), [x[1] for x in variants])
+                    self.assertEqual(bfile.chroms(), [x[2] for x in variants])
+                    self.assertEqual(list(bfile.positions()), [x[3] for x in variants])
+                    # variants are rebuilt from their catalog entry when indexed
+                    for i, expected in enumerate(variants):
+                        var = bfile[i]
+                        self.assertEqual((var.varid, var.rsid, var.chrom, var.pos,
+                                          var.fileoffset), expected)
+
+    def test_varied_ids(self):
+        ''' check empty, long and repeated IDs, across many chromosomes
+        '''
+        rng = np.random.default_rng(6)
+        ids = [('', ''), ('a' * 3000, 'rs1'), ('dup', 'dup'), ('dup', ''), ('x', 'y' * 70)]
+        chroms = ['1', '22', 'X', '1', 'MT']
+        with tempfile.TemporaryDirectory() as tmp:
+            path = Path(tmp) / 'ids.bgen'
+            with BgenWriter(path, n_samples=5) as bfile:
+                for i, ((varid, rsid), chrom) in enumerate(zip(ids, chroms)):
+                    geno = rng.random((5, 3))
+                    geno /= geno.sum(axis=1)[:, None]
+                    bfile.add_variant(varid, rsid, chrom, 100 - i, ['A', 'C'], geno)
+            Path(str(path) + '.bgi').unlink()
+            with BgenReader(path) as bfile:
+                self.assertEqual(bfile.varids(), [x[0] for x in ids])
+                self.assertEqual(bfile.rsids(), [x[1] for x in ids])
+                self.assertEqual(bfile.chroms(), chroms)
+                self.assertEqual(bfile[3].chrom, '1')
+
+                # dropping keeps the rest, sorted by position
+                with self.assertWarns(DeprecationWarning):
+                    bfile.drop_variants([1, 3])
+                self.assertEqual(len(bfile), 3)
+                self.assertEqual([bfile[i].varid for i in range(3)], ['x', 'dup', ''])
+                self.assertEqual([bfile[i].chrom for i in range(3)], ['MT', 'X', '1'])
+                self.assertEqual([bfile[i].pos for i in range(3)], [96, 98, 100])
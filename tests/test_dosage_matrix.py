@@ -0,0 +1,130 @@
+
+from pathlib import Path
+import tempfile
+import unittest
+
+import numpy as np
+
+from bgen import BgenReader, BgenWriter
+
+class TestDosageMatrix(unittest.TestCase):
+    ''' check decoding many variants at once matches decoding them one at a time
+    '''
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+        self.path = self.folder / 'example.16bits.zstd.bgen'
+
+    def expected(self, bfile, indices, minor=False):
+        attr = 'minor_allele_dosage' if minor else 'alt_dosage'
+        return np.array([getattr(bfile[i], attr) for i in indices], dtype=np.float32)
+
+    def test_matches_per_variant(self):
+        ''' check the matrix rows match alt_dosage, for several thread counts
+        '''
+        for name in ['example.8bits.bgen', 'example.16bits.bgen',
+                     'example.16bits.zstd.bgen', 'example.v11.bgen', 'haplotypes.bgen']:
+            with BgenReader(self.folder / name) as bfile:
+                indices = list(range(len(bfile)))
+                expected = self.expected(bfile, indices)
+                for threads in [1, 2, 7, 0]:
+                    with self.subTest(name=name, threads=threads):
+                        dose = bfile.dosage_matrix(indices, threads=threads)
+                        self.assertEqual(dose.dtype, np.float32)
+                        self.assertTrue(np.array_equal(dose, expected, equal_nan=True))
+
+    def test_mmap(self):
+        ''' check the threads can each read through their own memory mapping
+        '''
+        with BgenReader(self.path, use_mmap=True) as bfile:
+            indices = list(range(len(bfile)))
+            dose = bfile.dosage_matrix(indices, threads=4)
+            self.assertTrue(np.array_equal(dose, self.expected(bfile, indices), equal_nan=True))
+
+    def test_minor_allele(self):
+        ''' check the minor allele dosages can be decoded instead
+        '''
+        with BgenReader(self.path) as bfile:
+            indices = list(range(0, len(bfile), 3))
+            dose = bfile.dosage_matrix(indices, threads=3, minor_allele=True)
+            expected = self.expected(bfile, indices, minor=True)
+            self.assertTrue(np.array_equal(dose, expected, equal_nan=True))
+
+    def test_picking_variants(self):
+        ''' check rows follow the order asked for, by index or offset
+        '''
+        with BgenReader(self.path) as bfile:
+            indices = [5, -1, 0, 5, 100]
+            dose = bfile.dosage_matrix(indices, threads=2)
+            self.assertTrue(np.array_equal(dose, self.expected(bfile, indices), equal_nan=True))
+
+            offsets = [bfile[i].fileoffset for i in indices]
+            by_offset = bfile.dosage_matrix(offsets=offsets, threads=2)
+            self.assertTrue(np.array_equal(dose, by_offset, equal_nan=True))
+
+            empty = bfile.dosage_matrix([])
+            self.assertEqual(empty.shape, (0, len(bfile.samples)))
+
+    def test_output_array(self):
+        ''' check a given array is filled in place, and bad arrays are rejected
+        '''
+        with BgenReader(self.path) as bfile:
+            n = len(bfile.samples)
+            out = np.zeros((4, n), dtype=np.float32)
+            result = bfile.dosage_matrix([0, 1, 2, 3], out=out)
+            self.assertIs(result, out)
+            self.assertTrue(np.array_equal(out, self.expected(bfile, [0, 1, 2, 3]), equal_nan=True))
+
+            for bad in [np.zeros((4, n), dtype=np.float64),
+                        np.zeros((3, n), dtype=np.float32),
+                        np.zeros((n, 4), dtype=np.float32).T]:
+                with self.assertRaises(ValueError):
+                    bfile.dosage_matrix([0, 1, 2, 3], out=bad)
+
+    def test_bad_selections(self):
+        ''' check out of range or ambiguous selections raise errors
+        '''
+        with BgenReader(self.path) as bfile:
+            with self.assertRaises(IndexError):
+                bfile.dosage_matrix([0, len(bfile)])
+            with self.assertRaises(ValueError):
+                bfile.dosage_matrix()
+            with self.assertRaises(ValueError):
+                bfile.dosage_matrix([0], offsets=[bfile[0].fileoffset])
+            with self.assertRaises(ValueError):
+                bfile.dosage_matrix(offsets=[-1])
+            # an offset past the end of the file has no variant to read
+            with self.assertRaises(ValueError):
+                bfile.dosage_matrix(offsets=[self.path.stat().st_size + 10])
+        with self.assertRaises(ValueError):
+            bfile.dosage_matrix([0])
+
+    def test_errors_raise(self):
+        ''' check a variant which can't give a dosage raises, as it does singly
+        '''
+        with BgenReader(self.folder / 'complex.bgen') as bfile:
+            errors = []
+            for i in range(len(bfile)):
+                try:
+                    bfile[i].alt_dosage
+                except ValueError as err:
+                    errors.append(str(err))
+            self.assertTrue(len(errors) > 0)
+            with self.assertRaises(ValueError) as ctx:
+                bfile.dosage_matrix(list(range(len(bfile))), threads=4)
+            self.assertEqual(str(ctx.exception), errors[0])
+
+    def test_many_variants(self):
+        ''' check a file with many more variants than threads
+        '''
+        rng = np.random.default_rng(3)
+        with tempfile.TemporaryDirectory() as tmp:
+            path = Path(tmp) / 'many.bgen'
+            with BgenWriter(path, n_samples=40, compression='zlib') as bfile:
+                for i in range(250):
+                    geno = rng.random((40, 3))
+                    geno /= geno.sum(axis=1)[:, None]
+                    bfile.add_variant(f'var{i}', f'rs{i}', '1', i, ['A', 'C'], geno)
+            with BgenReader(path) as bfile:
+                indices = list(range(len(bfile)))
+                dose = bfile.dosage_matrix(indices, threads=8)
+                self.assertTrue(np.array_equal(dose, self.expected(bfile, indices)))
@@ -0,0 +1,94 @@
+
+from pathlib import Path
+
+import numpy as np
+
+import bgen.reader
+from bgen import BgenReader, BgenWriter
+
+from tests.utils import RandomBgenCase, write_random_bgen
+
+def expected_products(dose, y):
+    ''' X^T Y and dosage sums from a dosage matrix, mean imputed in numpy
+    '''
+    dose = dose.astype(np.float64)
+    means = np.nanmean(dose, axis=1)
+    dose = np.where(np.isnan(dose), means[:, None], dose)
+    y = y.astype(np.float32).astype(np.float64)
+    return dose @ y, dose.sum(axis=1), (dose ** 2).sum(axis=1), np.abs(dose) @ np.abs(y)
+
+class TestDosageProducts(RandomBgenCase):
+    ''' check dosage products match those from the dosage matrix
+    '''
+    seed = 17
+    def setUp(self):
+        super().setUp()
+        default = bgen.reader.stream_size()
+        self.addCleanup(bgen.reader.set_stream_size, default)
+
+    def check(self, bfile, indices, y, **kwargs):
+        products, sums, sumsq = bfile.dosage_products(y, indices, **kwargs)
+        minor = kwargs.get('minor_allele', False)
+        dose = bfile.dosage_matrix(indices, minor_allele=minor)
+        y2d = y if y.ndim == 2 else y[:, None]
+        exp_products, exp_sums, exp_sumsq, scale = expected_products(dose, y2d)
+        if y.ndim == 1:
+            exp_products, scale = exp_products[:, 0], scale[:, 0]
+        self.assertEqual(products.shape, exp_products.shape)
+        # tiles are summed in float32, so allow for float32 rounding of each term
+        np.testing.assert_array_less(np.abs(products - exp_products), 1e-5 * scale + 1e-9)
+        np.testing.assert_allclose(sums, exp_sums, rtol=1e-9)
+        np.testing.assert_allclose(sumsq, exp_sumsq, rtol=1e-9)
+
+    def write(self, n_samples, n_variants, bit_depth=8, compression='zlib'):
+        path = Path(self.tmp.name) / f'{n_samples}.{n_variants}.{compression}.bgen'
+        return write_random_bgen(path, n_samples, n_variants, self.rng,
+                                 compression=compression, bit_depth=bit_depth)
+
+    def test_example_file(self):
+        with BgenReader(self.folder / 'example.16bits.bgen') as bfile:
+            y = self.rng.normal(size=(len(bfile.samples), 3))
+            self.check(bfile, range(len(bfile)), y, threads=2)
+            self.check(bfile, range(len(bfile)), y[:, 0], minor_allele=True)
+
+    def test_synthetic(self):
+        ''' check blocks with fewer variants than a full block, and tiles with tails
+        '''
+        for n_samples in [7, 1023, 2053]:
+            path = self.write(n_samples, 11)
+            with BgenReader(path) as bfile:
+                for k in [1, 5]:
+                    with self.subTest(n_samples=n_samples, k=k):
+                        y = self.rng.normal(size=(n_samples, k))
+                        self.check(bfile, range(11), y, threads=3)
+                        self.check(bfile, [10, 3, 3], y)
+
+    def test_streamed_and_selected(self):
+        path = self.write(10003, 5, bit_depth=12, compression='zstd')
+        y = self.rng.normal(size=(10003, 2))
+        with BgenReader(path) as bfile:
+            whole = bfile.dosage_products(y, range(5))
+        bgen.reader.set_stream_size(1)
+        with BgenReader(path) as bfile:
+            streamed = bfile.dosage_products(y, range(5))
+            for a, b in zip(whole, streamed):
+                np.testing.assert_array_equal(a, b)
+            keep = list(range(0, 10003, 4))
+            bfile.select_samples(keep)
+            self.check(bfile, range(5), y[keep])
+
+    def test_all_missing(self):
+        path = Path(self.tmp.name) / 'missing.bgen'
+        with BgenWriter(path, 20) as bfile:
+            bfile.add_variant('var0', 'rs0', '1', 1, ['A', 'C'], np.full((20, 3), np.nan))
+        with BgenReader(path) as bfile:
+            products, sums, sumsq = bfile.dosage_products(np.ones(20), [0])
+            self.assertTrue(np.isnan(products[0]))
+            self.assertTrue(np.isnan(sums[0]))
+
+    def test_bad_input(self):
+        with BgenReader(self.folder / 'example.16bits.bgen') as bfile:
+            with self.assertRaises(ValueError):
+                bfile.dosage_products(np.ones((10, 2)), [0])
+            products, sums, sumsq = bfile.dosage_products(np.ones(len(bfile.samples)), [])
+            self.assertEqual(products.shape, (0, ))
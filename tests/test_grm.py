@@ -0,0 +1,87 @@
+
+from pathlib import Path
+
+import numpy as np
+
+from bgen import BgenReader
+
+from tests.utils import RandomBgenCase, random_genotypes, write_random_bgen
+
+def expected_grm(dose):
+    ''' GRM from a variants x samples dosage matrix, standardized in numpy
+    '''
+    dose = dose.astype(np.float64)
+    freq = np.nanmean(dose, axis=1) / 2
+    keep = (freq > 0) & (freq < 1)
+    dose, freq = dose[keep], freq[keep]
+    z = (dose - 2 * freq[:, None]) / np.sqrt(2 * freq * (1 - freq))[:, None]
+    z = np.nan_to_num(z)
+    return z.T @ z / len(z), len(z)
+
+class TestGRM(RandomBgenCase):
+    ''' check the GRM matches one built from the dosage matrix
+    '''
+    seed = 19
+
+    def write(self, n_samples, n_variants):
+        path = Path(self.tmp.name) / f'{n_samples}.{n_variants}.bgen'
+        def genotypes(i):
+            if i < n_variants:
+                return random_genotypes(self.rng, n_samples)
+            # a monomorphic variant last, which has nothing to standardize
+            geno = np.zeros((n_samples, 3))
+            geno[:, 0] = 1
+            return geno
+        return write_random_bgen(path, n_samples, n_variants + 1, self.rng, genotypes)
+
+    def check(self, bfile, indices=None, **kwargs):
+        grm, n_used = bfile.grm(indices, **kwargs)
+        rows = range(len(bfile)) if indices is None else indices
+        expected, exp_used = expected_grm(bfile.dosage_matrix(rows))
+        self.assertEqual(n_used, exp_used)
+        self.assertEqual(grm.dtype, np.float32)
+        np.testing.assert_allclose(grm, expected, rtol=1e-4, atol=1e-4)
+        np.testing.assert_array_equal(grm, grm.T)
+        return grm
+
+    def test_grm(self):
+        path = self.write(300, 600)
+        with BgenReader(path) as bfile:
+            whole = self.check(bfile, threads=2)
+            # small tiles, which don't divide the samples evenly, and more threads
+            # give the same floats, since each sum keeps its order
+            tiled = self.check(bfile, threads=3, max_memory=200000)
+            np.testing.assert_array_equal(tiled, whole)
+            self.check(bfile, [5, 2, 600, 2])
+
+    def test_example_file(self):
+        ''' the example file has multiallelic variants, which are left out
+        '''
+        with BgenReader(self.folder / 'complex.bgen') as bfile:
+            biallelic = [i for i, var in enumerate(bfile) if len(var.alleles) == 2
+                         and max(var.ploidy) <= 2]
+            self.check(bfile, biallelic)
+
+    def test_selected_samples(self):
+        path = self.write(200, 50)
+        with BgenReader(path) as bfile:
+            keep = list(range(0, 200, 3))
+            bfile.select_samples(keep)
+            self.check(bfile)
+
+    def test_written_to_disk(self):
+        path = self.write(150, 40)
+        out = Path(self.tmp.name) / 'grm.npy'
+        with BgenReader(path) as bfile:
+            in_memory, n_used = bfile.grm()
+            on_disk, _ = bfile.grm(path=out, max_memory=50000)
+            np.testing.assert_array_equal(on_disk, in_memory)
+            del on_disk
+        np.testing.assert_array_equal(np.load(out), in_memory)
+
+    def test_no_variants(self):
+        path = self.write(20, 2)
+        with BgenReader(path) as bfile:
+            grm, n_used = bfile.grm([2])
+            self.assertEqual(n_used, 0)
+            self.assertTrue(np.isnan(grm).all())
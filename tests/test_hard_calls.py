@@ -0,0 +1,151 @@
+
+from pathlib import Path
+
+import numpy as np
+
+import bgen.reader
+from bgen import BgenReader
+
+from tests.utils import RandomBgenCase, write_random_bgen
+
+THRESHOLDS = [0.0, 0.5, 0.9, 1.0]
+
+def expected_calls(probs, ploidy, phased, threshold):
+    ''' hard calls from the probabilities a variant gives, in float32 throughout
+    '''
+    ploidy = np.asarray(ploidy)
+    n = len(ploidy)
+    geno = np.full((n, 3), np.nan, dtype=np.float32)
+    if phased:
+        haploid, diploid = ploidy == 1, ploidy == 2
+        geno[haploid, :2] = probs[haploid, :2]
+        if diploid.any():
+            a0, a1, b0, b1 = (probs[diploid, i] for i in range(4))
+            geno[diploid, 0] = a0 * b0
+            geno[diploid, 1] = a0 * b1 + a1 * b0
+            geno[diploid, 2] = a1 * b1
+    else:
+        for p in [1, 2]:
+            geno[ploidy == p, :p + 1] = probs[ploidy == p, :p + 1]
+    # nans beyond a sample's ploidy never win, and ties go to the first
+    filled = np.where(np.isnan(geno), -np.inf, geno)
+    best = filled.argmax(axis=1)
+    top = geno[np.arange(n), best]
+    calls = best.astype(np.int8)
+    calls[~(top >= threshold)] = -1
+    calls[ploidy == 0] = -1
+    return calls
+
+class TestHardCalls(RandomBgenCase):
+    ''' check hard calls match those made from the decoded probabilities
+    '''
+    seed = 11
+    def setUp(self):
+        super().setUp()
+        default = bgen.reader.stream_size()
+        self.addCleanup(bgen.reader.set_stream_size, default)
+
+    def check_file(self, path, **kwargs):
+        ''' check every biallelic variant of a bgen at a few thresholds
+        '''
+        with BgenReader(path, delay_parsing=True, **kwargs) as bfile:
+            for var in bfile:
+                if len(var.alleles) != 2 or max(var.ploidy) > 2:
+                    with self.assertRaises(ValueError):
+                        var.hard_calls()
+                    continue
+                probs = var.probabilities
+                for threshold in THRESHOLDS:
+                    calls = var.hard_calls(threshold)
+                    self.assertEqual(calls.dtype, np.int8)
+                    np.testing.assert_array_equal(calls, expected_calls(probs,
+                        var.ploidy, var.is_phased, threshold))
+
+    def write(self, n_samples, bit_depth=8, phased=False, mixed=False,
+              compression='zlib', layout=2):
+        ''' write a few biallelic variants, with some missing samples
+        '''
+        path = Path(self.tmp.name) / f'{n_samples}.{bit_depth}.{phased}.{mixed}.{compression}.{layout}.bgen'
+        ploidy = 2
+        if mixed:
+            ploidy = self.rng.choice([0, 1, 2], n_samples).astype(np.uint8)
+            ploidy[:2] = [1, 2]
+        def genotypes(i):
+            width = 4 if phased else 3
+            geno = self.rng.random((n_samples, width))
+            if phased:
+                geno[:, :2] /= geno[:, :2].sum(axis=1)[:, None]
+                geno[:, 2:] /= geno[:, 2:].sum(axis=1)[:, None]
+            else:
+                # peak one genotype per sample, so calls fall either side of 0.9
+                geno[np.arange(n_samples), self.rng.integers(0, 3, n_samples)] += 6
+                geno /= geno.sum(axis=1)[:, None]
+            if mixed:
+                haploid = ploidy == 1
+                if phased:
+                    geno[haploid, 2:] = np.nan
+                else:
+                    geno[haploid, :2] /= geno[haploid, :2].sum(axis=1)[:, None]
+                    geno[haploid, 2] = np.nan
+            return geno
+        return write_random_bgen(path, n_samples, 3, self.rng, genotypes,
+                                 compression=compression, layout=layout, ploidy=ploidy,
+                                 phased=phased, bit_depth=bit_depth)
+
+    def test_example_files(self):
+        for name in ['example.16bits.bgen', 'example.8bits.bgen', 'example.3bits.bgen',
+                     'example.v11.bgen', 'haplotypes.bgen', 'complex.bgen']:
+            with self.subTest(name=name):
+                self.check_file(self.folder / name)
+
+    def test_synthetic(self):
+        ''' check bit depths, phasing and mixed ploidy, over several chunks of samples
+        '''
+        for bit_depth, phased, mixed in [(8, False, False), (8, True, False),
+                                         (16, False, False), (11, True, False),
+                                         (12, False, True), (8, True, True)]:
+            with self.subTest(bit_depth=bit_depth, phased=phased, mixed=mixed):
+                self.check_file(self.write(10003, bit_depth, phased, mixed))
+        with self.subTest(layout=1):
+            self.check_file(self.write(10003, 16, layout=1))
+
+    def test_subset_and_streaming(self):
+        path = self.write(10003, 10)
+        with BgenReader(path) as bfile:
+            expected = [var.hard_calls() for var in bfile]
+        keep = list(range(10002, 0, -7))
+        with BgenReader(path) as bfile:
+            bfile.select_samples(keep)
+            for var, calls in zip(bfile, expected):
+                np.testing.assert_array_equal(var.hard_calls(), calls[keep])
+        bgen.reader.set_stream_size(1)
+        with BgenReader(path) as bfile:
+            for var, calls in zip(bfile, expected):
+                np.testing.assert_array_equal(var.hard_calls(), calls)
+                # the streamed block can be read again
+                np.testing.assert_array_equal(var.hard_calls(), calls)
+
+    def test_matrix(self):
+        path = self.write(5000, 12, phased=True)
+        with BgenReader(path) as bfile:
+            expected = np.array([var.hard_calls(0.8) for var in bfile])
+            for threads in [1, 2]:
+                matrix = bfile.hard_call_matrix(range(3), threads=threads, threshold=0.8)
+                self.assertEqual(matrix.dtype, np.int8)
+                np.testing.assert_array_equal(matrix, expected)
+            out = np.zeros((2, 5000), dtype=np.int8)
+            self.assertIs(bfile.hard_call_matrix([2, 0], out=out, threshold=0.8), out)
+            np.testing.assert_array_equal(out, expected[[2, 0]])
+            with self.assertRaises(ValueError):
+                bfile.hard_call_matrix([0], out=np.zeros((1, 5000), dtype=np.float32))
+            with self.assertRaises(ValueError):
+                bfile.hard_call_matrix([0, 1], out=np.zeros((1, 5000), dtype=np.int8))
+
+    def test_bad_threshold(self):
+        with BgenReader(self.folder / 'example.16bits.bgen') as bfile:
+            var = bfile[0]
+            for threshold in [-0.1, 1.5, float('nan')]:
+                with self.assertRaises(ValueError):
+                    var.hard_calls(threshold)
+                with self.assertRaises(ValueError):
+                    bfile.hard_call_matrix([0], threshold=threshold)
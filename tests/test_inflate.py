@@ -0,0 +1,74 @@
+
+from pathlib import Path
+import tempfile
+import unittest
+
+import numpy as np
+
+import bgen.reader
+from bgen import BgenReader, BgenWriter
+
+class TestInflate(unittest.TestCase):
+    ''' check zlib blocks decode the same through the reused inflate state
+    '''
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+        self.tmp = tempfile.TemporaryDirectory()
+        self.addCleanup(self.tmp.cleanup)
+
+    def write(self, n_variants=20, n_samples=50):
+        ''' write a small zlib compressed bgen, and give its path and genotypes
+        '''
+        rng = np.random.default_rng(5)
+        path = Path(self.tmp.name) / 'zlib.bgen'
+        genotypes = []
+        with BgenWriter(path, n_samples, compression='zlib') as bfile:
+            for i in range(n_variants):
+                geno = rng.random((n_samples, 3))
+                geno /= geno.sum(axis=1)[:, None]
+                genotypes.append(geno)
+                bfile.add_variant(f'var{i}', f'rs{i}', '1', i + 1, ['A', 'G'], geno)
+        return path, genotypes
+
+    def test_backend(self):
+        self.assertIn(bgen.reader.INFLATE_BACKEND, ('zlib', 'libdeflate'))
+
+    def test_repeat_decodes(self):
+        ''' check decoding the same blocks repeatedly gives the same genotypes
+        '''
+        path, genotypes = self.write()
+        with BgenReader(path) as bfile:
+            self.assertEqual(bfile.header.compression, 'zlib')
+            for _ in range(3):
+                for var, geno in zip(bfile, genotypes):
+                    np.testing.assert_allclose(var.probabilities, geno, atol=5e-3)
+
+    def test_threads(self):
+        ''' check each thread's inflate state decodes the same as a single thread
+        '''
+        path = self.folder / 'example.16bits.bgen'
+        with BgenReader(path) as bfile:
+            self.assertEqual(bfile.header.compression, 'zlib')
+            expected = np.array([v.alt_dosage for v in bfile])
+            for threads in [1, 2, 4]:
+                dosage = bfile.dosage_matrix(indices=range(len(bfile)), threads=threads)
+                np.testing.assert_array_equal(dosage, expected)
+
+    def test_corrupt_block(self):
+        ''' check a corrupt block raises an error, without breaking later blocks
+        '''
+        path, genotypes = self.write()
+        with BgenReader(path) as bfile:
+            # the genotype block ends where the next variant starts
+            end = bfile[10].next_variant_offset
+        data = bytearray(path.read_bytes())
+        for i in range(end - 64, end - 32):
+            data[i] ^= 0xff
+        path.write_bytes(bytes(data))
+
+        with BgenReader(path) as bfile:
+            with self.assertRaises(ValueError):
+                bfile[10].probabilities
+            # the stream is reset for the next block, so later variants still decode
+            np.testing.assert_allclose(bfile[11].probabilities, genotypes[11], atol=5e-3)
+            np.testing.assert_allclose(bfile[9].probabilities, genotypes[9], atol=5e-3)
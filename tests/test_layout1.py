@@ -0,0 +1,104 @@
+
+from pathlib import Path
+import tempfile
+import unittest
+
+import numpy as np
+
+from bgen import BgenReader, BgenWriter
+
+SAMPLE_COUNTS = [1, 7, 8, 9, 37, 1000, 2051]
+
+def expected_probs(values):
+    ''' layout 1 probabilities, each 16-bit value scaled by 1 / 32768
+    '''
+    probs = values.reshape(-1, 3).astype(np.float32) * np.float32(1 / 32768)
+    probs[(values.reshape(-1, 3) == 0).all(axis=1)] = np.nan
+    return probs
+
+def expected_alt_dosage(values):
+    ''' layout 1 alt dosages, from the hom and het values of each sample
+    '''
+    stored = values.reshape(-1, 3).astype(np.int64)
+    ref = (stored[:, 0] * 2 + stored[:, 1]).astype(np.float32) * np.float32(1 / 32768)
+    ref[(stored == 0).all(axis=1)] = np.nan
+    return np.float32(2) - ref
+
+class TestLayout1(unittest.TestCase):
+    ''' check the vectorised layout 1 decoders match the stored values exactly
+    '''
+    def setUp(self):
+        self.tmp = tempfile.TemporaryDirectory()
+        self.addCleanup(self.tmp.cleanup)
+        self.rng = np.random.default_rng(3)
+
+    def write(self, n_samples):
+        ''' write an uncompressed layout 1 variant, then fill it with random values
+
+        Layout 1 stores three 16-bit values per sample and nothing else, at the end of
+        the variant, so they can be swapped for any values. A few samples are left all
+        zero, which marks them missing.
+        '''
+        geno = self.rng.random((n_samples, 3))
+        geno /= geno.sum(axis=1)[:, None]
+        path = Path(self.tmp.name) / f'{n_samples}.bgen'
+        with BgenWriter(path, n_samples, layout=1, compression=None) as bfile:
+            bfile.add_variant('var', 'rs', '1', 1, ['A', 'C'], geno)
+
+        values = self.rng.integers(0, 2 ** 16, n_samples * 3, dtype=np.uint16)
+        # single zero values too, which do not make a sample missing on their own
+        values[self.rng.random(n_samples * 3) < 0.2] = 0
+        missing = self.rng.random(n_samples) < 0.1
+        missing[[0, -1]] = True
+        values.reshape(-1, 3)[missing] = 0
+        data = bytearray(path.read_bytes())
+        data[-n_samples * 6:] = values.astype('<u2').tobytes()
+        path.write_bytes(bytes(data))
+        return path, values
+
+    def test_probabilities(self):
+        for n_samples in SAMPLE_COUNTS:
+            with self.subTest(n_samples=n_samples):
+                path, values = self.write(n_samples)
+                with BgenReader(path, delay_parsing=True) as bfile:
+                    var = next(iter(bfile))
+                    self.assertEqual(bfile.header.layout, 1)
+                    np.testing.assert_array_equal(var.probabilities,
+                                                  expected_probs(values))
+
+    def test_dosage(self):
+        for n_samples in SAMPLE_COUNTS:
+            with self.subTest(n_samples=n_samples):
+                path, values = self.write(n_samples)
+                with BgenReader(path, delay_parsing=True) as bfile:
+                    var = next(iter(bfile))
+                    expected = expected_alt_dosage(values)
+                    np.testing.assert_array_equal(var.alt_dosage, expected)
+                    # a second read must not list the missing samples twice over
+                    np.testing.assert_array_equal(var.alt_dosage, expected)
+                    # the probabilities find missing samples on their own
+                    self.assertEqual(np.isnan(var.probabilities[:, 0]).sum(),
+                                     np.isnan(expected).sum())
+
+    def test_subset_matches(self):
+        ''' check the vectorised decode matches the per-sample subset decode
+        '''
+        path, _ = self.write(1000)
+        with BgenReader(path, delay_parsing=True) as bfile:
+            var = next(iter(bfile))
+            probs, dose = var.probabilities, var.alt_dosage
+        with BgenReader(path, delay_parsing=True) as bfile:
+            bfile.select_samples(list(range(1000)))
+            var = next(iter(bfile))
+            np.testing.assert_array_equal(var.probabilities, probs)
+            np.testing.assert_array_equal(var.alt_dosage, dose)
+
+    def test_example_files(self):
+        ''' check the layout 1 example files decode the same as the layout 2 ones
+        '''
+        folder = Path(__file__).parent / 'data'
+        with BgenReader(folder / 'example.v11.bgen') as bfile:
+            probs = [v.probabilities for v in bfile]
+        with BgenReader(folder / 'example.16bits.bgen') as bfile:
+            for var, layout1 in zip(bfile, probs):
+                np.testing.assert_allclose(var.probabilities, layout1, atol=1e-4)
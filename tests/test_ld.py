@@ -0,0 +1,123 @@
+
+from pathlib import Path
+
+import numpy as np
+
+from bgen import BgenReader
+
+from tests.utils import RandomBgenCase, write_random_bgen
+
+def expected_ld(dose):
+    ''' correlations from a variants x samples dosage matrix, mean imputed in numpy
+    '''
+    dose = dose.astype(np.float64)
+    means = np.nanmean(dose, axis=1)
+    dose = np.where(np.isnan(dose), means[:, None], dose)
+    with np.errstate(invalid='ignore', divide='ignore'):
+        return np.corrcoef(dose)
+
+def band_of(full, window):
+    ''' the band of a full matrix, as ld_matrix gives it with a window
+    '''
+    n = len(full)
+    band = np.full((n, window + 1), np.nan, dtype=full.dtype)
+    for d in range(min(window + 1, n)):
+        band[:n - d, d] = np.diagonal(full, d)
+    return band
+
+class TestLD(RandomBgenCase):
+    ''' check LD matrices match correlations of the dosage matrix
+    '''
+    seed = 23
+
+    def write(self, n_samples, n_variants):
+        ''' variants on two chromosomes, with correlated neighbours and a monomorphic one
+        '''
+        path = Path(self.tmp.name) / f'{n_samples}.{n_variants}.bgen'
+        last = [self.rng.random((n_samples, 3)) ** 3]
+        def correlated(i):
+            # mostly keep the last variant's genotypes, so neighbours correlate
+            fresh = self.rng.random((n_samples, 3)) ** 3
+            swap = self.rng.random(n_samples) < 0.3
+            geno = np.where(swap[:, None], fresh, last[0])
+            geno /= geno.sum(axis=1)[:, None]
+            last[0] = geno
+            if i == n_variants // 2:
+                geno = np.zeros((n_samples, 3))
+                geno[:, 0] = 1
+            # copied, as the writer sets samples missing in place
+            return geno.copy()
+        return write_random_bgen(path, n_samples, n_variants, self.rng, correlated,
+                                 chrom=lambda i: '1' if i < n_variants - 10 else '2')
+
+    def check(self, bfile, rows, ld):
+        expected = expected_ld(bfile.dosage_matrix(rows))
+        self.assertEqual(ld.dtype, np.float32)
+        np.testing.assert_allclose(ld, expected, rtol=1e-4, atol=1e-4)
+        np.testing.assert_array_equal(ld, ld.T)
+
+    def test_full_matrix(self):
+        path = self.write(300, 450)
+        with BgenReader(path) as bfile:
+            ld = bfile.ld_matrix(threads=2)
+            self.check(bfile, range(len(bfile)), ld)
+            # the monomorphic variant has no correlations
+            self.assertTrue(np.isnan(ld[225]).all())
+            # more threads sum in the same order, so give the same floats
+            np.testing.assert_array_equal(bfile.ld_matrix(threads=3), ld)
+            rows = [5, 2, 449, 2]
+            self.check(bfile, rows, bfile.ld_matrix(indices=rows))
+
+    def test_banded(self):
+        path = self.write(200, 500)
+        with BgenReader(path) as bfile:
+            full = bfile.ld_matrix()
+            for window in [0, 7, 191, 192, 250, 600]:
+                band = bfile.ld_matrix(window=window, threads=2)
+                self.assertEqual(band.shape, (500, window + 1))
+                np.testing.assert_array_equal(band, band_of(full, window))
+
+    def test_region(self):
+        ''' regions come from the index, or from the parsed variants without one
+        '''
+        path = self.write(100, 60)
+        with BgenReader(path) as bfile:
+            ld = bfile.ld_matrix('1', 10, 30)
+            self.check(bfile, range(9, 30), ld)
+            with self.assertRaises(ValueError):
+                bfile.ld_matrix('1', indices=[0])
+        Path(str(path) + '.bgi').unlink()
+        with BgenReader(path) as bfile:
+            np.testing.assert_array_equal(bfile.ld_matrix('1', 10, 30), ld)
+            stats = bfile.variant_stats(chrom='1', start=10, stop=30)
+            self.assertEqual(list(stats['pos']), list(range(10, 31)))
+            self.assertEqual(bfile.ld_matrix('2').shape, (10, 10))
+            self.assertEqual(bfile.ld_matrix('3').shape, (0, 0))
+
+    def test_selected_samples(self):
+        path = self.write(150, 40)
+        with BgenReader(path) as bfile:
+            bfile.select_samples(list(range(0, 150, 4)))
+            self.check(bfile, range(len(bfile)), bfile.ld_matrix())
+
+    def test_written_to_disk(self):
+        path = self.write(80, 50)
+        out = Path(self.tmp.name) / 'ld.npy'
+        with BgenReader(path) as bfile:
+            in_memory = bfile.ld_matrix(window=5)
+            on_disk = bfile.ld_matrix(window=5, path=out)
+            np.testing.assert_array_equal(on_disk, in_memory)
+            del on_disk
+        np.testing.assert_array_equal(np.load(out), in_memory)
+
+    def test_example_file(self):
+        ''' the example file has multiallelic variants, which get nan correlations
+        '''
+        with BgenReader(self.folder / 'complex.bgen') as bfile:
+            rows = [i for i, var in enumerate(bfile) if max(var.ploidy) <= 2]
+            ld = bfile.ld_matrix(indices=rows)
+            for i, row in enumerate(rows):
+                if len(bfile[row].alleles) != 2:
+                    self.assertTrue(np.isnan(ld[i]).all())
+            biallelic = [row for row in rows if len(bfile[row].alleles) == 2]
+            self.check(bfile, biallelic, bfile.ld_matrix(indices=biallelic))
@@ -0,0 +1,196 @@
+
+from pathlib import Path
+import pickle
+import tempfile
+import unittest
+
+import numpy as np
+
+from bgen import BgenReader, BgenWriter
+
+from tests.utils import nan_equal, outcome, same_outcome
+
+class TestMemoryMapped(unittest.TestCase):
+    ''' check reading through a memory mapping gives what the stream gives
+
+    The mapped reader parses variants out of memory rather than through the
+    stream, so everything it reports is compared against the stream reader on the
+    same files, including the malformed ones where both should fail the same way.
+    '''
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+
+    def compare_files(self, path):
+        ''' check every variant in a bgen matches between the stream and mapping
+        '''
+        with BgenReader(path, delay_parsing=True) as stream, \
+                BgenReader(path, delay_parsing=True, use_mmap=True) as mapped:
+            self.assertEqual(stream.samples, mapped.samples)
+            self.assertEqual(stream.header.nvariants, mapped.header.nvariants)
+            n = 0
+            for a, b in zip(stream, mapped):
+                n += 1
+                self.assertEqual(a.varid, b.varid)
+                self.assertEqual(a.rsid, b.rsid)
+                self.assertEqual(a.chrom, b.chrom)
+                self.assertEqual(a.pos, b.pos)
+                self.assertEqual(a.alleles, b.alleles)
+                self.assertEqual(a.fileoffset, b.fileoffset)
+                self.assertEqual(a.next_variant_offset, b.next_variant_offset)
+                self.assertEqual(a.copy_data(), b.copy_data())
+                self.assertTrue((a.ploidy == b.ploidy).all())
+                for attr in ['probabilities', 'alt_dosage', 'minor_allele_dosage']:
+                    self.assertTrue(same_outcome(outcome(a, attr), outcome(b, attr)))
+            self.assertEqual(n, stream.header.nvariants)
+
+    def test_matches_stream(self):
+        ''' check the example files all parse the same through a mapping
+        '''
+        paths = sorted(self.folder.glob('*.bgen'))
+        self.assertTrue(len(paths) > 0)
+        for path in paths:
+            with self.subTest(path=path.name):
+                self.compare_files(path)
+
+    def test_parsed_variants_match(self):
+        ''' check the variant lists from a fully parsed bgen match
+        '''
+        path = self.folder / 'example.16bits.zstd.bgen'
+        stream = BgenReader(path, delay_parsing=False)
+        mapped = BgenReader(path, delay_parsing=False, use_mmap=True)
+        self.assertEqual(stream.varids(), mapped.varids())
+        self.assertEqual(stream.rsids(), mapped.rsids())
+        self.assertEqual(stream.chroms(), mapped.chroms())
+        self.assertEqual(list(stream.positions()), list(mapped.positions()))
+        self.assertEqual(stream[5].varid, mapped[5].varid)
+        self.assertTrue(nan_equal(stream[-5].probabilities, mapped[-5].probabilities))
+        stream.close()
+        mapped.close()
+
+    def test_closed_mapping_refuses_reads(self):
+        ''' check a variant outliving its reader cannot read the unmapped file
+        '''
+        path = self.folder / 'example.8bits.bgen'
+        with BgenReader(path, use_mmap=True) as bfile:
+            var = next(bfile)
+        with self.assertRaises(ValueError):
+            var.probabilities
+        with self.assertRaises(ValueError):
+            var.copy_data()
+
+    def test_pickled_variant(self):
+        ''' check a pickled variant from a mapped bgen reads from the same mapping
+        '''
+        path = self.folder / 'example.8bits.bgen'
+        with BgenReader(path, use_mmap=True) as bfile:
+            var = bfile[3]
+            other = pickle.loads(pickle.dumps(var))
+            self.assertTrue(nan_equal(var.probabilities, other.probabilities))
+
+    def test_truncated_bgen(self):
+        ''' check a truncated bgen fails the same way through the mapping
+        '''
+        path = self.folder / 'example.16bits.bgen'
+        with tempfile.TemporaryDirectory() as tmp:
+            short = Path(tmp) / 'short.bgen'
+            data = path.read_bytes()
+            short.write_bytes(data[:len(data) - 500])
+            for use_mmap in [False, True]:
+                with self.subTest(use_mmap=use_mmap):
+                    with BgenReader(short, use_mmap=use_mmap) as bfile:
+                        with self.assertRaises(ValueError):
+                            for var in bfile:
+                                var.probabilities
+
+    def test_empty_file(self):
+        ''' check an empty file is rejected rather than mapped
+        '''
+        with tempfile.TemporaryDirectory() as tmp:
+            path = Path(tmp) / 'empty.bgen'
+            path.write_bytes(b'')
+            with self.assertRaises(ValueError):
+                BgenReader(path, use_mmap=True)
+
+    def test_missing_file(self):
+        ''' check a missing file raises the same error as without a mapping
+        '''
+        with tempfile.TemporaryDirectory() as tmp:
+            with self.assertRaises(ValueError):
+                BgenReader(Path(tmp) / 'missing.bgen', use_mmap=True)
+
+    def test_written_file(self):
+        ''' check a freshly written bgen reads back through a mapping
+        '''
+        geno = np.random.random((20, 3)).astype(np.float64)
+        geno /= geno.sum(axis=1)[:, None]
+        with tempfile.TemporaryDirectory() as tmp:
+            path = Path(tmp) / 'temp.bgen'
+            with BgenWriter(path, n_samples=20) as bfile:
+                for i in range(10):
+                    bfile.add_variant(f'var{i}', f'rs{i}', '1', i + 1, ['A', 'C'], geno)
+            self.compare_files(path)
+
+class TestZeroCopy(unittest.TestCase):
+    ''' check genotypes decoded straight from the mapping match a copied decode
+
+    Uncompressed genotype blocks are decoded where they sit in a mapped bgen, so the
+    padding past each block is the start of the next variant rather than zeros. The
+    final variant has nothing after it, so it gets copied instead.
+    '''
+    def write(self, folder, compression, layout=2, bit_depth=8, phased=False):
+        ''' write a small bgen with a mix of genotypes, including missing samples
+        '''
+        rng = np.random.default_rng(5)
+        path = Path(folder) / f'{compression}.{layout}.{bit_depth}.bgen'
+        cols = 4 if phased else 3
+        with BgenWriter(path, n_samples=37, compression=compression, layout=layout) as bfile:
+            for i in range(12):
+                geno = rng.random((37, cols))
+                if phased:
+                    geno[:, :2] /= geno[:, :2].sum(axis=1)[:, None]
+                    geno[:, 2:] /= geno[:, 2:].sum(axis=1)[:, None]
+                else:
+                    geno /= geno.sum(axis=1)[:, None]
+                geno[i % 37] = np.nan
+                bfile.add_variant(f'var{i}', f'rs{i}', '1', i + 1, ['A', 'C'], geno,
+                                  phased=phased, bit_depth=bit_depth)
+        return path
+
+    def test_uncompressed_in_place(self):
+        ''' check uncompressed bgens decode the same in place as from a copy
+        '''
+        with tempfile.TemporaryDirectory() as tmp:
+            for layout, bit_depth, phased in [(1, 16, False), (2, 8, False),
+                                              (2, 8, True), (2, 3, False), (2, 16, True)]:
+                with self.subTest(layout=layout, bit_depth=bit_depth, phased=phased):
+                    path = self.write(tmp, None, layout, bit_depth, phased)
+                    with BgenReader(path) as stream, BgenReader(path, use_mmap=True) as mapped:
+                        for a, b in zip(stream, mapped):
+                            self.assertTrue(nan_equal(a.probabilities, b.probabilities))
+                            self.assertTrue(nan_equal(a.alt_dosage, b.alt_dosage))
+
+    def test_compressed_from_mapping(self):
+        ''' check compressed bgens decompress the same from the mapping
+        '''
+        with tempfile.TemporaryDirectory() as tmp:
+            for compression in ['zlib', 'zstd']:
+                with self.subTest(compression=compression):
+                    path = self.write(tmp, compression)
+                    with BgenReader(path) as stream, BgenReader(path, use_mmap=True) as mapped:
+                        for a, b in zip(stream, mapped):
+                            self.assertTrue(nan_equal(a.probabilities, b.probabilities))
+
+    def test_in_place_data_outlives_reader(self):
+        ''' check genotypes decoded in place stay readable after the reader closes
+        '''
+        with tempfile.TemporaryDirectory() as tmp:
+            path = self.write(tmp, None)
+            with BgenReader(path) as bfile:
+                expected = [x.probabilities for x in bfile]
+            with BgenReader(path, use_mmap=True) as bfile:
+                variants = list(bfile)
+                for var in variants:
+                    var.probabilities
+            for var, probs in zip(variants, expected):
+                self.assertTrue(nan_equal(var.probabilities, probs))
+            del variants
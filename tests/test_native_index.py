@@ -0,0 +1,168 @@
+
+from pathlib import Path
+import shutil
+import tempfile
+import unittest
+
+from bgen import BgenReader, NativeIndex, build_native_index
+from bgen.index import Index
+
+class TestNativeIndex(unittest.TestCase):
+    ''' check the binary index answers queries the same as the bgenix index
+    '''
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+        self.tmp = tempfile.TemporaryDirectory()
+        self.addCleanup(self.tmp.cleanup)
+
+    def copy(self, name, with_bgi=True):
+        ''' copy a bgen (and optionally its .bgi) to a temporary folder
+        '''
+        path = Path(self.tmp.name) / name
+        shutil.copy(self.folder / name, path)
+        if with_bgi:
+            shutil.copy(self.folder / (name + '.bgi'), str(path) + '.bgi')
+        return path
+
+    def check_matches(self, native, bgi):
+        ''' check every query gives the same answers from both indexes
+        '''
+        self.assertEqual(len(native), len(bgi))
+        self.assertEqual(native.rsids, bgi.rsids)
+        self.assertEqual(native.chroms, bgi.chroms)
+        self.assertEqual(native.positions, bgi.positions)
+        for i in range(len(bgi)):
+            self.assertEqual(native.offset_by_index(i), bgi.offset_by_index(i))
+        self.assertEqual(native.offset_by_index(-1), bgi.offset_by_index(-1))
+        # variants sit back to back, so each size reaches the next offset
+        offsets = [native.offset_by_index(i) for i in range(len(native))]
+        ends = offsets[1:] + [native.bgen_size]
+        self.assertEqual(native.sizes, [b - a for a, b in zip(offsets, ends)])
+        self.assertEqual(native.size_by_index(-1), native.sizes[-1])
+        for rsid in set(bgi.rsids):
+            self.assertEqual(native.offset_by_rsid(rsid), sorted(bgi.offset_by_rsid(rsid)))
+        for pos in set(bgi.positions):
+            self.assertEqual(sorted(native.offset_by_pos(pos)), sorted(bgi.offset_by_pos(pos)))
+
+        pos_at = {bgi.offset_by_index(i): pos for i, pos in enumerate(bgi.positions)}
+        positions = sorted(bgi.positions)
+        bounds = [None, -5, 0, positions[0], positions[len(positions) // 2],
+                  positions[-1], positions[-1] + 1, 2 ** 40]
+        for chrom in set(bgi.chroms) | {'missing'}:
+            for start in bounds:
+                for stop in bounds:
+                    with self.subTest(chrom=chrom, start=start, stop=stop):
+                        found = list(native.fetch(chrom, start, stop))
+                        expected = list(bgi.fetch(chrom, start, stop))
+                        self.assertEqual(sorted(found), sorted(expected))
+                        # offsets come out in position order
+                        self.assertEqual([pos_at[x] for x in found],
+                                         sorted(pos_at[x] for x in found))
+
+    def test_from_bgi(self):
+        ''' check an index converted from a .bgi matches it
+        '''
+        for name in ['example.16bits.bgen', 'complex.bgen', 'haplotypes.bgen']:
+            with self.subTest(name=name):
+                path = self.copy(name)
+                index_path = build_native_index(path)
+                self.assertEqual(index_path, str(path) + '.bgix')
+                native = NativeIndex(index_path)
+                bgi = Index(str(path) + '.bgi')
+                self.check_matches(native, bgi)
+                self.assertEqual(native.bgen_size, path.stat().st_size)
+                native.close()
+                bgi.close()
+
+    def test_from_scan(self):
+        ''' check an index built by scanning the bgen matches the .bgi
+        '''
+        for name in ['example.16bits.bgen', 'complex.bgen', 'haplotypes.bgen']:
+            with self.subTest(name=name):
+                path = self.copy(name, with_bgi=False)
+                index_path = build_native_index(path)
+                native = NativeIndex(index_path)
+                bgi = Index(self.folder / (name + '.bgi'))
+                self.check_matches(native, bgi)
+                native.close()
+                bgi.close()
+
+    def test_reader_prefers_native_index(self):
+        ''' check BgenReader opens the binary index, and gives the same variants
+        '''
+        path = self.copy('example.16bits.bgen')
+        with BgenReader(path) as bfile:
+            expected = [(v.rsid, v.pos) for v in bfile.fetch('01', 5000, 50000)]
+            with_rsid = [v.pos for v in bfile.with_rsid('RSID_10')]
+
+        # without the .bgi, only the binary index can answer fetch()
+        build_native_index(path)
+        Path(str(path) + '.bgi').unlink()
+        with BgenReader(path) as bfile:
+            self.assertEqual([(v.rsid, v.pos) for v in bfile.fetch('01', 5000, 50000)], expected)
+            self.assertEqual([v.pos for v in bfile.with_rsid('RSID_10')], with_rsid)
+            self.assertEqual(bfile[10].rsid, bfile.rsids()[10])
+
+    def test_stale_index_ignored(self):
+        ''' check the binary index is skipped once the bgen changes size
+        '''
+        path = self.copy('example.16bits.bgen')
+        build_native_index(path)
+        with open(path, 'ab') as handle:
+            handle.write(b'\x00')
+        bfile = BgenReader(path, delay_parsing=True)
+        with self.assertLogs(level='WARNING'):
+            # falls back to the .bgi
+            self.assertTrue(bfile._check_for_index(str(path)))
+        Path(str(path) + '.bgi').unlink()
+        with self.assertLogs(level='WARNING'):
+            self.assertFalse(bfile._check_for_index(str(path)))
+        bfile.close()
+
+    def test_closed(self):
+        ''' check a closed index raises errors rather than crashing
+        '''
+        path = self.copy('example.16bits.bgen')
+        native = NativeIndex(build_native_index(path))
+        native.close()
+        with self.assertRaises(ValueError):
+            list(native.fetch('01'))
+        with self.assertRaises(ValueError):
+            len(native)
+        native.close()
+
+    def test_out_of_range(self):
+        ''' check out of range rows raise IndexError
+        '''
+        path = self.copy('example.16bits.bgen')
+        native = NativeIndex(build_native_index(path))
+        with self.assertRaises(IndexError):
+            native.offset_by_index(len(native))
+        with self.assertRaises(IndexError):
+            native.offset_by_index(-len(native) - 1)
+        with self.assertRaises(IndexError):
+            native.size_by_index(len(native))
+        self.assertEqual(native.offset_by_rsid('missing'), [])
+        self.assertEqual(native.offset_by_pos(-1), [])
+
+    def test_malformed(self):
+        ''' check truncated or foreign files are rejected when opened
+        '''
+        path = self.copy('example.16bits.bgen')
+        index_path = Path(build_native_index(path))
+        data = index_path.read_bytes()
+        for name, content in [('truncated', data[:len(data) // 2]),
+                              ('header', data[:40]),
+                              ('magic', b'NOTINDEX' + data[8:]),
+                              ('empty', b'')]:
+            with self.subTest(name=name):
+                index_path.write_bytes(content)
+                with self.assertRaises(ValueError):
+                    NativeIndex(index_path)
+
+    def test_missing_source(self):
+        ''' check converting a missing .bgi raises an error
+        '''
+        path = self.copy('example.16bits.bgen', with_bgi=False)
+        with self.assertRaises(ValueError):
+            build_native_index(path, source=str(path) + '.bgi')
@@ -0,0 +1,163 @@
+
+from pathlib import Path
+
+import numpy as np
+
+import bgen.reader
+from bgen import BgenReader
+
+from tests.test_bit_depths import stored_values
+from tests.utils import RandomBgenCase, random_genotypes, write_random_bgen
+
+def to_bfloat16(values):
+    ''' raw bfloat16 bits of float32 values, rounded to nearest even
+    '''
+    bits = np.asarray(values, dtype=np.float32).view(np.uint32).astype(np.uint64)
+    rounded = ((bits + 0x7fff + ((bits >> 16) & 1)) >> 16).astype(np.uint16)
+    nans = np.isnan(values)
+    rounded[nans] = ((bits[nans] >> 16) | 0x40).astype(np.uint16)
+    return rounded
+
+def to_uint8(values, max_value, top=255, missing=0):
+    ''' values scaled so max_value is top, with a byte for missing values
+    '''
+    values = np.asarray(values, dtype=np.float32)
+    scaled = np.clip(np.rint(values * np.float32(top / max_value)), 0, top)
+    return np.where(np.isnan(values), missing, scaled).astype(np.uint8)
+
+def expected(values, dtype, max_value):
+    ''' narrower versions of float32 outputs, as the decoders should give them
+    '''
+    if dtype == 'float16':
+        return values.astype(np.float16)
+    elif dtype == 'bfloat16':
+        return to_bfloat16(values)
+    elif dtype == 'uint8':
+        return to_uint8(values, max_value)
+    elif dtype == 'uint8_254':
+        return to_uint8(values, max_value, 254, 255)
+    return values
+
+DTYPES = ['float32', 'float16', 'bfloat16', 'uint8', 'uint8_254']
+
+class TestOutputDtypes(RandomBgenCase):
+    ''' check narrower outputs match the float32 outputs converted in numpy
+    '''
+    seed = 5
+    def setUp(self):
+        super().setUp()
+        default = bgen.reader.stream_size()
+        self.addCleanup(bgen.reader.set_stream_size, default)
+
+    def check_file(self, path, **kwargs):
+        with BgenReader(path, delay_parsing=True, **kwargs) as bfile:
+            for var in bfile:
+                probs = var.probabilities
+                # uint8 has no missing value, so missingness comes separately
+                np.testing.assert_array_equal(var.missing, np.isnan(probs).all(axis=1))
+                biallelic = len(var.alleles) == 2 and max(var.ploidy) <= 2
+                if biallelic:
+                    alt, minor = var.alt_dosage, var.minor_allele_dosage
+                for dtype in DTYPES:
+                    with self.subTest(varid=var.varid, dtype=dtype):
+                        observed = var.probabilities_as(dtype)
+                        self.assertEqual(observed.shape, probs.shape)
+                        np.testing.assert_array_equal(observed, expected(probs, dtype, 1))
+                        if biallelic:
+                            np.testing.assert_array_equal(var.alt_dosage_as(dtype),
+                                                          expected(alt, dtype, 2))
+                            np.testing.assert_array_equal(var.minor_allele_dosage_as(dtype),
+                                                          expected(minor, dtype, 2))
+
+    def write(self, n_samples, bit_depth, phased=False, compression='zlib'):
+        path = Path(self.tmp.name) / f'{n_samples}.{bit_depth}.{phased}.{compression}.bgen'
+        return write_random_bgen(path, n_samples, 3, self.rng,
+            lambda i: random_genotypes(self.rng, n_samples, phased, power=4),
+            compression=compression, phased=phased, bit_depth=bit_depth)
+
+    def test_example_files(self):
+        ''' check files with multiple alleles, variable ploidy and layout 1
+        '''
+        for name in ['example.16bits.bgen', 'example.8bits.bgen', 'example.v11.bgen',
+                     'haplotypes.bgen', 'complex.bgen']:
+            with self.subTest(name=name):
+                self.check_file(self.folder / name)
+
+    def test_synthetic(self):
+        ''' check over several decode chunks, with tails the vector loops leave
+        '''
+        for bit_depth, phased in [(8, False), (16, False), (8, True), (23, True)]:
+            with self.subTest(bit_depth=bit_depth, phased=phased):
+                path = self.write(10003, bit_depth, phased)
+                self.check_file(path)
+                keep = list(range(0, 10003, 5))
+                with BgenReader(path) as bfile:
+                    full = [var.probabilities_as('float16') for var in bfile]
+                    bfile.select_samples(keep)
+                    for var, probs in zip(bfile, full):
+                        np.testing.assert_array_equal(var.probabilities_as('float16'),
+                                                      probs[keep])
+
+    def test_streamed(self):
+        path = self.write(10003, 12, compression='zstd')
+        with BgenReader(path) as bfile:
+            whole = [var.probabilities_as('uint8') for var in bfile]
+        bgen.reader.set_stream_size(1)
+        with BgenReader(path) as bfile:
+            for var, probs in zip(bfile, whole):
+                np.testing.assert_array_equal(var.probabilities_as('uint8'), probs)
+                np.testing.assert_array_equal(var.probabilities_as('uint8'), probs)
+
+    def test_8_bit_exact(self):
+        ''' check uint8 gives the probabilities of 8 bit bgens exactly as stored
+        '''
+        for phased in [False, True]:
+            with self.subTest(phased=phased):
+                path = self.write(1003, 8, phased, compression=None)
+                with BgenReader(path) as bfile:
+                    keep = list(range(0, 1003, 3))
+                    for var in bfile:
+                        n_values = 1003 * 2
+                        values = stored_values(var, n_values, 8).reshape(1003, 2)
+                        if phased:
+                            # one stored value per haplotype, the other is the remainder
+                            stored = np.column_stack([values[:, 0], 255 - values[:, 0],
+                                                      values[:, 1], 255 - values[:, 1]])
+                        else:
+                            stored = np.column_stack([values, 255 - values.sum(axis=1)])
+                        missing = var.missing
+                        observed = var.probabilities_as('uint8')
+                        np.testing.assert_array_equal(observed[~missing], stored[~missing])
+                        self.assertTrue((observed[missing] == 0).all())
+                    bfile.select_samples(keep)
+                    for var in bfile:
+                        np.testing.assert_array_equal(var.missing,
+                            np.isnan(var.probabilities).all(axis=1))
+
+    def test_dtype_names(self):
+        with BgenReader(self.folder / 'example.16bits.bgen') as bfile:
+            var = bfile[0]
+            self.assertEqual(var.probabilities_as(np.float16).dtype, np.float16)
+            self.assertEqual(var.alt_dosage_as(np.uint8).dtype, np.uint8)
+            self.assertEqual(var.alt_dosage_as('bfloat16').dtype, np.uint16)
+            for dtype in ['float64', np.int16, 'nonsense']:
+                with self.assertRaises(ValueError):
+                    var.probabilities_as(dtype)
+
+    def test_dosage_matrix(self):
+        path = self.write(5000, 8)
+        with BgenReader(path) as bfile:
+            dose = bfile.dosage_matrix(range(3), threads=2)
+            for dtype, np_dtype in [('float16', np.float16), ('bfloat16', np.uint16),
+                                    ('uint8', np.uint8), ('uint8_254', np.uint8)]:
+                with self.subTest(dtype=dtype):
+                    matrix = bfile.dosage_matrix(range(3), threads=2, dtype=dtype)
+                    self.assertEqual(matrix.dtype, np_dtype)
+                    np.testing.assert_array_equal(matrix, expected(dose, dtype, 2))
+                    minor = bfile.dosage_matrix(range(3), dtype=dtype, minor_allele=True)
+                    np.testing.assert_array_equal(minor, expected(
+                        bfile.dosage_matrix(range(3), minor_allele=True), dtype, 2))
+            out = np.empty((3, 5000), dtype=np.float16)
+            self.assertIs(bfile.dosage_matrix(range(3), out=out, dtype='float16'), out)
+            with self.assertRaises(ValueError):
+                bfile.dosage_matrix(range(3), out=out)
@@ -0,0 +1,139 @@
+
+from pathlib import Path
+import tempfile
+import unittest
+
+import numpy as np
+
+from bgen import BgenReader, BgenWriter
+
+from tests.test_bgen_streaming import run_piped
+from tests.utils import outcome, same_outcome
+
+class TestPrefetch(unittest.TestCase):
+    ''' check iterating with background prefetching matches iterating serially
+
+    The prefetch threads read and decompress variants ahead of the caller, so these
+    check the variants still come out complete, in order, and with the same errors
+    as a serial read, whatever the depth and thread count.
+    '''
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+
+    def compare(self, path, **kwargs):
+        ''' check iterating a bgen with prefetching gives what serial iteration does
+        '''
+        with BgenReader(path) as serial, BgenReader(path, **kwargs) as ahead:
+            n = 0
+            for a, b in zip(serial, ahead):
+                n += 1
+                self.assertEqual(a.varid, b.varid)
+                self.assertEqual(a.pos, b.pos)
+                self.assertEqual(a.fileoffset, b.fileoffset)
+                self.assertEqual(a.copy_data(), b.copy_data())
+                for attr in ['probabilities', 'alt_dosage', 'ploidy', 'is_phased']:
+                    self.assertTrue(same_outcome(outcome(a, attr), outcome(b, attr)))
+            self.assertEqual(n, serial.header.nvariants)
+            with self.assertRaises(StopIteration):
+                next(ahead)
+
+    def test_matches_serial(self):
+        ''' check the example bgens iterate the same with prefetching
+        '''
+        for path in sorted(self.folder.glob('*.bgen')):
+            for depth, threads in [(1, 1), (4, 2), (16, 4)]:
+                with self.subTest(path=path.name, depth=depth, threads=threads):
+                    self.compare(path, prefetch=depth, prefetch_threads=threads)
+
+    def test_matches_serial_mmap(self):
+        ''' check prefetching through a memory mapping
+        '''
+        for path in sorted(self.folder.glob('example.*.bgen')):
+            with self.subTest(path=path.name):
+                self.compare(path, prefetch=8, prefetch_threads=3, use_mmap=True)
+
+    def test_many_variants(self):
+        ''' check ordering holds over many more variants than the queue depth
+        '''
+        rng = np.random.default_rng(2)
+        with tempfile.TemporaryDirectory() as tmp:
+            path = Path(tmp) / 'many.bgen'
+            with BgenWriter(path, n_samples=50, compression='zlib') as bfile:
+                for i in range(300):
+                    geno = rng.random((50, 3))
+                    geno /= geno.sum(axis=1)[:, None]
+                    bfile.add_variant(f'var{i}', f'rs{i}', '1', i, ['A', 'C'], geno)
+            self.compare(path, prefetch=5, prefetch_threads=4)
+
+    def test_truncated(self):
+        ''' check a truncated bgen still raises the truncation error at the same point
+        '''
+        path = self.folder / 'example.16bits.bgen'
+        with tempfile.TemporaryDirectory() as tmp:
+            short = Path(tmp) / 'short.bgen'
+            data = path.read_bytes()
+            short.write_bytes(data[:len(data) // 2])
+            with BgenReader(short) as bfile:
+                expected = []
+                with self.assertRaises(ValueError) as serial_err:
+                    for var in bfile:
+                        expected.append(var.varid)
+            with BgenReader(short, prefetch=4, prefetch_threads=2) as bfile:
+                found = []
+                with self.assertRaises(ValueError) as ahead_err:
+                    for var in bfile:
+                        found.append(var.varid)
+                # the failure is sticky, rather than hanging on the next call
+                with self.assertRaises(ValueError):
+                    next(bfile)
+            self.assertEqual(expected, found)
+            self.assertEqual(str(serial_err.exception), str(ahead_err.exception))
+
+    def test_random_access_while_prefetching(self):
+        ''' check indexing a bgen while its prefetch threads are running
+        '''
+        path = self.folder / 'example.16bits.bgen'
+        with BgenReader(path) as bfile:
+            expected = [x.probabilities for x in bfile]
+        with BgenReader(path, prefetch=4, prefetch_threads=2) as bfile:
+            for i, var in enumerate(bfile):
+                other = bfile[len(expected) - 1 - i]
+                self.assertTrue(same_outcome(var.probabilities, expected[i]))
+                self.assertTrue(same_outcome(other.probabilities, expected[-1 - i]))
+
+    def test_close_while_prefetching(self):
+        ''' check closing part way through stops the threads, and closes the variants
+        '''
+        path = self.folder / 'example.16bits.zstd.bgen'
+        with BgenReader(path, prefetch=8, prefetch_threads=4) as bfile:
+            first = next(bfile)
+            first.probabilities
+            second = next(bfile)
+        # the first was decoded already, so stays readable, as for a serial read
+        self.assertEqual(first.probabilities.shape[0], 500)
+        with self.assertRaises(ValueError):
+            second.copy_data()
+
+    def test_invalid_settings(self):
+        ''' check negative depths or too few threads are rejected
+        '''
+        path = self.folder / 'example.16bits.bgen'
+        with self.assertRaises(ValueError):
+            BgenReader(path, prefetch=-1)
+        with self.assertRaises(ValueError):
+            BgenReader(path, prefetch=2, prefetch_threads=0)
+
+    def test_stdin(self):
+        ''' check prefetching works when the bgen is streamed in on stdin
+        '''
+        path = self.folder / 'example.16bits.zstd.bgen'
+        code = '\n'.join(['import sys',
+            'from bgen import BgenReader',
+            'with BgenReader(sys.stdin, prefetch=4, prefetch_threads=2) as bfile:',
+            '    for var in bfile:',
+            '        print(var.varid, round(float(var.alt_dosage[:10].sum()), 4))'])
+        result = run_piped(code, path.read_bytes())
+        self.assertEqual(result.returncode, 0, result.stderr)
+        with BgenReader(path) as bfile:
+            expected = [f'{x.varid} {round(float(x.alt_dosage[:10].sum()), 4)}' for x in bfile]
+        self.assertEqual(result.stdout.decode('utf8').splitlines(), expected)
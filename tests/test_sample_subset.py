@@ -0,0 +1,184 @@
+
+from pathlib import Path
+import pickle
+import tempfile
+import unittest
+
+import numpy as np
+
+from bgen import BgenReader, BgenWriter
+
+from tests.utils import outcome
+
+def subset_rows(probs, ploidy, phased, indices):
+    ''' pick the rows of a full probabilities array for some samples
+
+    Phased probabilities with a varying ploidy are padded out to the largest ploidy
+    of the samples present, so selecting samples can leave fewer padded columns.
+    '''
+    picked = probs[indices]
+    if phased:
+        width = probs.shape[1] // max(ploidy.max(), 1)
+        picked = picked[:, :max(ploidy[indices].max(), 1) * width]
+    return picked
+
+class TestSampleSubset(unittest.TestCase):
+    ''' check decoding a subset of samples matches decoding all then indexing
+    '''
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+
+    def check_file(self, path, indices):
+        with BgenReader(path) as bfile:
+            full = [(outcome(v, 'probabilities'), outcome(v, 'alt_dosage'),
+                     outcome(v, 'minor_allele_dosage'), v.ploidy, v.is_phased) for v in bfile]
+        with BgenReader(path) as bfile:
+            bfile.select_samples(indices)
+            for (probs, alt, minor, ploidy, phased), var in zip(full, bfile):
+                self.assertTrue(np.array_equal(var.ploidy, ploidy[indices]))
+                sub_probs = outcome(var, 'probabilities')
+                if isinstance(probs, str):
+                    self.assertEqual(sub_probs, probs)
+                else:
+                    expected = subset_rows(probs, ploidy, phased, indices)
+                    self.assertEqual(sub_probs.shape, expected.shape)
+                    self.assertTrue(np.array_equal(sub_probs, expected, equal_nan=True))
+                sub_alt = outcome(var, 'alt_dosage')
+                if isinstance(alt, str):
+                    # a subset can avoid the samples which made the full decode fail,
+                    # but otherwise has to fail the same way
+                    if isinstance(sub_alt, str):
+                        self.assertEqual(sub_alt, alt)
+                else:
+                    self.assertTrue(np.array_equal(sub_alt, alt[indices], equal_nan=True))
+                    # the minor allele comes from the subset, so it is either the full
+                    # minor dosage, or the swap of it
+                    sub_minor = var.minor_allele_dosage
+                    flipped = ploidy[indices] - alt[indices]
+                    self.assertTrue(np.array_equal(sub_minor, alt[indices], equal_nan=True) or
+                                    np.allclose(sub_minor, flipped, equal_nan=True, atol=1e-6))
+
+    def test_example_files(self):
+        ''' check subsets in several orders, across all the example files
+        '''
+        rng = np.random.default_rng(4)
+        for path in sorted(self.folder.glob('*.bgen')):
+            with BgenReader(path) as bfile:
+                n = bfile.header.nsamples
+            choices = {'first': [0], 'last': [n - 1], 'ascending': list(range(0, n, 3)),
+                       'shuffled': list(rng.permutation(n)[:max(n // 2, 1)]),
+                       'all_reversed': list(range(n))[::-1]}
+            for name, indices in choices.items():
+                with self.subTest(path=path.name, order=name):
+                    self.check_file(path, np.array(indices))
+
+    def test_select_by_id(self):
+        ''' check samples can be picked by ID, by index, or by a boolean mask
+        '''
+        path = self.folder / 'example.16bits.zstd.bgen'
+        with BgenReader(path) as bfile:
+            samples = bfile.samples
+            full = bfile[3].alt_dosage
+            ids = [samples[10], samples[2], samples[400]]
+            bfile.select_samples(ids)
+            self.assertEqual(bfile.selected_samples, ids)
+            self.assertTrue(np.array_equal(bfile[3].alt_dosage, full[[10, 2, 400]], equal_nan=True))
+
+            bfile.select_samples([-1, 0])
+            self.assertTrue(np.array_equal(bfile[3].alt_dosage, full[[-1, 0]], equal_nan=True))
+
+            mask = np.zeros(len(samples), dtype=bool)
+            mask[[5, 7]] = True
+            bfile.select_samples(mask)
+            self.assertTrue(np.array_equal(bfile[3].alt_dosage, full[[5, 7]], equal_nan=True))
+
+            bfile.select_samples(None)
+            self.assertEqual(bfile.selected_samples, samples)
+            self.assertTrue(np.array_equal(bfile[3].alt_dosage, full, equal_nan=True))
+
+    def test_invalid_selections(self):
+        ''' check bad selections are rejected
+        '''
+        path = self.folder / 'example.16bits.zstd.bgen'
+        with BgenReader(path) as bfile:
+            n = len(bfile.samples)
+            with self.assertRaises(IndexError):
+                bfile.select_samples([0, n])
+            with self.assertRaises(ValueError):
+                bfile.select_samples([1, 1])
+            with self.assertRaises(ValueError):
+                bfile.select_samples(['not_a_sample'])
+            with self.assertRaises(ValueError):
+                bfile.select_samples([])
+            with self.assertRaises(ValueError):
+                bfile.select_samples(np.zeros(n + 1, dtype=bool))
+            # a failed selection leaves the old one in place
+            self.assertEqual(len(bfile[0].alt_dosage), n)
+
+    def test_earlier_variants_unchanged(self):
+        ''' check variants opened before a selection keep their own sample set
+        '''
+        path = self.folder / 'example.16bits.zstd.bgen'
+        with BgenReader(path) as bfile:
+            before = bfile[0]
+            bfile.select_samples([1, 2, 3])
+            after = bfile[0]
+            self.assertEqual(len(before.alt_dosage), len(bfile.samples))
+            self.assertEqual(len(after.alt_dosage), 3)
+
+    def test_prefetch_and_matrix(self):
+        ''' check the selection reaches prefetched variants and the dosage matrix
+        '''
+        path = self.folder / 'example.16bits.zstd.bgen'
+        indices = [30, 1, 250, 7]
+        with BgenReader(path) as bfile:
+            full = np.array([v.alt_dosage for v in bfile])
+        with BgenReader(path, prefetch=4) as bfile:
+            bfile.select_samples(indices)
+            dose = np.array([v.alt_dosage for v in bfile])
+            self.assertTrue(np.array_equal(dose, full[:, indices], equal_nan=True))
+            matrix = bfile.dosage_matrix(list(range(len(full))), threads=2)
+            self.assertEqual(matrix.shape, (len(full), 4))
+            self.assertTrue(np.array_equal(matrix, full[:, indices], equal_nan=True))
+
+    def test_pickling(self):
+        ''' check a pickled variant keeps its sample selection
+        '''
+        path = self.folder / 'example.16bits.zstd.bgen'
+        with BgenReader(path) as bfile:
+            bfile.select_samples([4, 3])
+            var = bfile[2]
+            with self.assertWarns(RuntimeWarning):
+                copied = pickle.loads(pickle.dumps(var))
+            self.assertTrue(np.array_equal(var.alt_dosage, copied.alt_dosage, equal_nan=True))
+
+    def test_varying_ploidy(self):
+        ''' check skipping samples of varying ploidy, at an odd bit depth
+        '''
+        rng = np.random.default_rng(5)
+        n = 60
+        ploidy = rng.integers(1, 4, size=n).astype(np.uint8)
+        with tempfile.TemporaryDirectory() as tmp:
+            path = Path(tmp) / 'ploidy.bgen'
+            with BgenWriter(path, n_samples=n) as bfile:
+                for i, phased in enumerate([False, True]):
+                    for bits in [3, 8, 13]:
+                        width = ploidy.max() * 2 if phased else ploidy.max() + 1
+                        geno = rng.random((n, width))
+                        if phased:
+                            for j, p in enumerate(ploidy):
+                                geno[j, p * 2:] = np.nan
+                                for h in range(p):
+                                    geno[j, h*2:h*2+2] /= geno[j, h*2:h*2+2].sum()
+                        else:
+                            for j, p in enumerate(ploidy):
+                                geno[j, p + 1:] = np.nan
+                                geno[j, :p + 1] /= geno[j, :p + 1].sum()
+                        bfile.add_variant(f'v{i}{bits}', f'rs{i}{bits}', '1', bits,
+                                          ['A', 'C'], geno, ploidy=ploidy,
+                                          phased=phased, bit_depth=bits)
+            # a subset without the triploid samples can give unphased dosages
+            diploid = [i for i in range(n) if ploidy[i] < 3][::-1]
+            for indices in [list(range(0, n, 7)), diploid, [n - 1, 0]]:
+                with self.subTest(indices=indices):
+                    self.check_file(path, np.array(indices))
@@ -0,0 +1,79 @@
+
+from pathlib import Path
+import tempfile
+import unittest
+
+import numpy as np
+
+from bgen import BgenReader, BgenWriter
+
+class TestScanPositions(unittest.TestCase):
+    ''' check the metadata scan finds the same variants as parsing them
+    '''
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+
+    def expected(self, path):
+        with BgenReader(path, delay_parsing=True) as bfile:
+            variants = [(v.fileoffset, v.pos) for v in bfile]
+        return (np.array([x[0] for x in variants], dtype=np.uint64),
+                np.array([x[1] for x in variants], dtype=np.uint32))
+
+    def test_example_files(self):
+        ''' check every example file, through a stream and a memory mapping
+        '''
+        for path in sorted(self.folder.glob('*.bgen')):
+            offsets, positions = self.expected(path)
+            for use_mmap in [False, True]:
+                with self.subTest(path=path.name, use_mmap=use_mmap):
+                    with BgenReader(path, delay_parsing=True, use_mmap=use_mmap) as bfile:
+                        found_offsets, found_positions = bfile.scan_positions()
+                    self.assertEqual(found_offsets.dtype, np.uint64)
+                    self.assertEqual(found_positions.dtype, np.uint32)
+                    self.assertTrue(np.array_equal(found_offsets, offsets))
+                    self.assertTrue(np.array_equal(found_positions, positions))
+
+    def test_spans_reads(self):
+        ''' check variants of mixed sizes, which span several chunked reads
+        '''
+        rng = np.random.default_rng(7)
+        with tempfile.TemporaryDirectory() as tmp:
+            path = Path(tmp) / 'mixed.bgen'
+            with BgenWriter(path, n_samples=3000, compression=None) as bfile:
+                for i in range(300):
+                    # long alleles push some variants' fields across a read boundary
+                    alleles = ['A' * int(rng.integers(1, 5000)), 'C']
+                    geno = rng.random((3000, 3))
+                    geno /= geno.sum(axis=1)[:, None]
+                    bfile.add_variant(f'v{i}', f'rs{i}', '1', i * 10, alleles, geno,
+                                      bit_depth=16)
+            offsets, positions = self.expected(path)
+            with BgenReader(path, delay_parsing=True) as bfile:
+                found_offsets, found_positions = bfile.scan_positions()
+                # scanning leaves iteration where it was
+                self.assertEqual(next(iter(bfile)).varid, 'v0')
+            self.assertTrue(np.array_equal(found_offsets, offsets))
+            self.assertTrue(np.array_equal(found_positions, positions))
+
+    def test_truncated(self):
+        ''' check a bgen cut short raises, as parsing it does
+        '''
+        with tempfile.TemporaryDirectory() as tmp:
+            path = Path(tmp) / 'cut.bgen'
+            source = self.folder / 'example.16bits.zstd.bgen'
+            with open(source, 'rb') as handle:
+                data = handle.read()
+            with open(path, 'wb') as handle:
+                handle.write(data[:len(data) // 2])
+            with BgenReader(path, delay_parsing=True) as bfile:
+                with self.assertRaises(ValueError) as ctx:
+                    bfile.scan_positions()
+                self.assertIn('truncated', str(ctx.exception))
+
+    def test_closed(self):
+        ''' check a closed bgen can't be scanned
+        '''
+        with BgenReader(self.folder / 'example.16bits.zstd.bgen') as bfile:
+            pass
+        with self.assertRaises(ValueError):
+            bfile.scan_positions()
@@ -0,0 +1,145 @@
+
+from pathlib import Path
+
+import numpy as np
+
+import bgen.reader
+from bgen import BgenReader
+
+from tests.utils import RandomBgenCase, write_random_bgen
+
+class TestStreaming(RandomBgenCase):
+    ''' check genotype blocks decoded as they decompress match whole blocks exactly
+    '''
+    seed = 7
+    def setUp(self):
+        super().setUp()
+        default = bgen.reader.stream_size()
+        self.addCleanup(bgen.reader.set_stream_size, default)
+
+    def decode(self, path, threshold, **kwargs):
+        ''' decode every variant of a bgen, streaming blocks from the threshold size
+        '''
+        bgen.reader.set_stream_size(threshold)
+        probs, dosage = [], []
+        with BgenReader(path, delay_parsing=True, **kwargs) as bfile:
+            for var in bfile:
+                probs.append(var.probabilities)
+                if len(var.alleles) == 2 and max(var.ploidy) <= 2:
+                    dosage.append(var.alt_dosage)
+        return probs, dosage
+
+    def check(self, path, **kwargs):
+        ''' check a bgen decodes the same streamed as whole
+        '''
+        whole = self.decode(path, 0)
+        streamed = self.decode(path, 1, **kwargs)
+        for expected, observed in zip(whole, streamed):
+            self.assertEqual(len(expected), len(observed))
+            for a, b in zip(expected, observed):
+                np.testing.assert_array_equal(a, b)
+
+    def write(self, n_samples, compression, bit_depth=8, phased=False, n_alleles=2,
+              layout=2):
+        ''' write a few variants, with some missing samples
+        '''
+        path = Path(self.tmp.name) / f'{compression}.{bit_depth}.{phased}.{n_alleles}.{layout}.bgen'
+        def genotypes(i):
+            if phased:
+                geno = self.rng.random((n_samples * 2, n_alleles))
+                geno /= geno.sum(axis=1)[:, None]
+                return geno.reshape(n_samples, 2 * n_alleles)
+            geno = self.rng.random((n_samples, 3 if n_alleles == 2 else 6))
+            return geno / geno.sum(axis=1)[:, None]
+        return write_random_bgen(path, n_samples, 3, self.rng, genotypes,
+                                 alleles=['A', 'C', 'G'][:n_alleles],
+                                 compression=compression, layout=layout, phased=phased,
+                                 bit_depth=bit_depth)
+
+    def test_threshold(self):
+        bgen.reader.set_stream_size(12345)
+        self.assertEqual(bgen.reader.stream_size(), 12345)
+
+    def test_example_files(self):
+        ''' check the example files, including variable ploidy and multiple alleles
+        '''
+        for name in ['example.16bits.bgen', 'example.16bits.zstd.bgen',
+                     'example.v11.bgen', 'complex.bgen', 'haplotypes.bgen',
+                     'example.3bits.bgen', 'complex.24bits.bgen']:
+            with self.subTest(name=name):
+                self.check(self.folder / name)
+
+    def test_wide_variants(self):
+        ''' check variants spanning many windows, at depths and layouts streamed
+        '''
+        # 300000 samples at 8 bits is 600 kB of probabilities, a few windows
+        n_samples = 300000
+        for compression in ['zlib', 'zstd']:
+            for bit_depth, phased, n_alleles in [(8, False, 2), (13, False, 2),
+                                                 (8, True, 2), (16, False, 3),
+                                                 (5, True, 3)]:
+                with self.subTest(compression=compression, bit_depth=bit_depth,
+                                  phased=phased, n_alleles=n_alleles):
+                    self.check(self.write(n_samples, compression, bit_depth, phased,
+                                          n_alleles))
+        with self.subTest(layout=1):
+            self.check(self.write(n_samples, 'zlib', layout=1))
+
+    def test_repeat_decodes(self):
+        ''' check a variant decodes the same when asked again, after the stream is spent
+        '''
+        path = self.write(20000, 'zstd', bit_depth=10)
+        expected = self.decode(path, 0)
+        bgen.reader.set_stream_size(1)
+        with BgenReader(path, delay_parsing=True) as bfile:
+            var = next(iter(bfile))
+            # reading the ploidy first only decompresses the header
+            self.assertEqual(len(var.ploidy), 20000)
+            for _ in range(2):
+                np.testing.assert_array_equal(var.probabilities, expected[0][0])
+                np.testing.assert_array_equal(var.alt_dosage, expected[1][0])
+
+    def test_subsets_and_threads(self):
+        ''' check a sample subset, prefetching and threaded dosage all agree
+        '''
+        path = self.write(20000, 'zlib', bit_depth=12)
+        probs, dosage = self.decode(path, 0)
+        bgen.reader.set_stream_size(1)
+        keep = list(range(0, 20000, 3))
+        with BgenReader(path, delay_parsing=True) as bfile:
+            bfile.select_samples(keep)
+            for var, expected in zip(bfile, probs):
+                np.testing.assert_array_equal(var.probabilities, expected[keep])
+        with BgenReader(path, prefetch=2) as bfile:
+            for var, expected in zip(bfile, dosage):
+                np.testing.assert_array_equal(var.alt_dosage, expected)
+        with BgenReader(path) as bfile:
+            matrix = bfile.dosage_matrix(range(3), threads=2)
+            np.testing.assert_array_equal(matrix, np.array(dosage))
+
+    def test_cache_gets_whole_blocks(self):
+        path = self.write(2000, 'zlib')
+        bgen.reader.set_stream_size(1)
+        with BgenReader(path, cache_size=10_000_000) as bfile:
+            for var in bfile:
+                var.alt_dosage
+            self.assertEqual(bfile.cache_info()['entries'], 3)
+
+    def test_corrupt_block(self):
+        ''' check corrupt data raises an error part way through a streamed decode
+        '''
+        path = self.write(20000, 'zlib')
+        with BgenReader(path) as bfile:
+            end = bfile[1].next_variant_offset
+        data = bytearray(path.read_bytes())
+        for i in range(end - 64, end - 32):
+            data[i] ^= 0xff
+        path.write_bytes(bytes(data))
+
+        bgen.reader.set_stream_size(1)
+        with BgenReader(path) as bfile:
+            with self.assertRaises(ValueError):
+                bfile[1].alt_dosage
+            with self.assertRaises(ValueError):
+                bfile[1].probabilities
+            self.assertEqual(len(bfile[2].alt_dosage), 20000)
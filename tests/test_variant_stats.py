@@ -0,0 +1,178 @@
+
+from math import lgamma, exp
+from pathlib import Path
+
+import numpy as np
+
+import bgen.reader
+from bgen import BgenReader
+
+from tests.test_hard_calls import expected_calls
+from tests.utils import RandomBgenCase, random_genotypes, write_random_bgen
+
+def hwe_exact(hom_ref, het, hom_alt):
+    ''' exact HWE p-value, by enumerating every heterozygote count in log space
+    '''
+    n = hom_ref + het + hom_alt
+    if n == 0:
+        return np.nan
+    rare = 2 * min(hom_ref, hom_alt) + het
+    def log_prob(hets):
+        homs_rare = (rare - hets) // 2
+        homs_common = n - hets - homs_rare
+        return (lgamma(n + 1) - lgamma(homs_rare + 1) - lgamma(hets + 1) -
+                lgamma(homs_common + 1) + hets * np.log(2) + lgamma(rare + 1) +
+                lgamma(2 * n - rare + 1) - lgamma(2 * n + 1))
+    probs = [exp(log_prob(h)) for h in range(rare % 2, rare + 1, 2)]
+    observed = exp(log_prob(het)) * (1 + 1e-7)
+    return min(1.0, sum(p for p in probs if p <= observed) / sum(probs))
+
+def expected_stats(var, threshold):
+    ''' statistics of a variant worked out in numpy from its probabilities
+    '''
+    stats = {'alt_freq': np.nan, 'missing_rate': np.nan, 'info': np.nan,
+             'hwe_p': np.nan, 'hom_ref': 0, 'het': 0, 'hom_alt': 0}
+    ploidy = np.asarray(var.ploidy)
+    if len(var.alleles) != 2 or ploidy.max() > 2:
+        return stats
+    probs = var.probabilities
+    n = len(ploidy)
+    geno = np.full((n, 3), np.nan, dtype=np.float32)
+    if var.is_phased:
+        haploid, diploid = ploidy == 1, ploidy == 2
+        geno[haploid, :2] = probs[haploid, :2]
+        if diploid.any():
+            a0, a1, b0, b1 = (probs[diploid, i] for i in range(4))
+            geno[diploid, 0] = a0 * b0
+            geno[diploid, 1] = a0 * b1 + a1 * b0
+            geno[diploid, 2] = a1 * b1
+    else:
+        for p in [1, 2]:
+            geno[ploidy == p, :p + 1] = probs[ploidy == p, :p + 1]
+    missing = (ploidy == 0) | np.isnan(geno[:, 0])
+    called = ~missing
+    geno = np.nan_to_num(geno[called].astype(np.float64))
+    expected = geno[:, 1] + 2 * geno[:, 2]
+    squared = geno[:, 1] + 4 * geno[:, 2]
+    alleles = ploidy[called].sum()
+    stats['missing_rate'] = missing.mean() if n > 0 else np.nan
+    if alleles > 0:
+        theta = expected.sum() / alleles
+        stats['alt_freq'] = theta
+        if 0 < theta < 1:
+            variance = (squared - expected ** 2).sum()
+            stats['info'] = 1 - variance / (alleles * theta * (1 - theta))
+        else:
+            stats['info'] = 1.0
+    calls = expected_calls(probs, ploidy, var.is_phased, threshold)[ploidy == 2]
+    counts = [int((calls == i).sum()) for i in range(3)]
+    stats['hom_ref'], stats['het'], stats['hom_alt'] = counts
+    stats['hwe_p'] = hwe_exact(*counts)
+    return stats
+
+class TestVariantStats(RandomBgenCase):
+    ''' check variant statistics match those worked out from the probabilities
+    '''
+    seed = 13
+    def setUp(self):
+        super().setUp()
+        default = bgen.reader.stream_size()
+        self.addCleanup(bgen.reader.set_stream_size, default)
+
+    def check_table(self, table, variants, threshold=0.9):
+        self.assertEqual(len(table['varid']), len(variants))
+        for i, var in enumerate(variants):
+            with self.subTest(varid=var.varid):
+                self.assertEqual(table['varid'][i], var.varid)
+                self.assertEqual(table['rsid'][i], var.rsid)
+                self.assertEqual(table['chrom'][i], var.chrom)
+                self.assertEqual(table['pos'][i], var.pos)
+                self.assertEqual(table['n_alleles'][i], len(var.alleles))
+                for key, value in expected_stats(var, threshold).items():
+                    if isinstance(value, int):
+                        self.assertEqual(table[key][i], value, key)
+                    else:
+                        np.testing.assert_allclose(table[key][i], value, rtol=1e-6,
+                                                   atol=1e-9, err_msg=key)
+
+    def check_file(self, path, threads=2, threshold=0.9):
+        with BgenReader(path) as bfile:
+            table = bfile.variant_stats(threads=threads, threshold=threshold)
+            self.check_table(table, list(bfile), threshold)
+
+    def write(self, n_samples, bit_depth, phased=False, compression='zlib',
+              n_variants=4):
+        path = Path(self.tmp.name) / f'{n_samples}.{bit_depth}.{phased}.{compression}.bgen'
+        def skewed(i):
+            # skew each variant towards a different genotype, so the frequencies
+            # and counts vary
+            weights = np.roll([4.0, 2.0, 1.0], i)
+            return random_genotypes(self.rng, n_samples, phased,
+                                    weights=weights[:2] if phased else weights)
+        return write_random_bgen(path, n_samples, n_variants, self.rng, skewed,
+                                 compression=compression, phased=phased,
+                                 bit_depth=bit_depth)
+
+    def test_example_files(self):
+        ''' check files with multiple alleles, variable ploidy and layout 1
+        '''
+        for name in ['example.16bits.bgen', 'example.8bits.bgen', 'example.v11.bgen',
+                     'haplotypes.bgen', 'complex.bgen']:
+            with self.subTest(name=name):
+                self.check_file(self.folder / name)
+
+    def test_synthetic(self):
+        ''' check over several decode chunks, at a few thresholds
+        '''
+        for bit_depth, phased in [(8, False), (16, False), (8, True), (11, True)]:
+            path = self.write(10003, bit_depth, phased)
+            for threshold in [0.0, 0.5, 0.9]:
+                with self.subTest(bit_depth=bit_depth, phased=phased,
+                                  threshold=threshold):
+                    self.check_file(path, threshold=threshold)
+
+    def test_streamed(self):
+        path = self.write(10003, 12, compression='zstd')
+        with BgenReader(path) as bfile:
+            whole = bfile.variant_stats(threads=1)
+        bgen.reader.set_stream_size(1)
+        with BgenReader(path) as bfile:
+            streamed = bfile.variant_stats(threads=1)
+        for key in whole:
+            np.testing.assert_array_equal(streamed[key], whole[key])
+
+    def test_selected_samples(self):
+        path = self.write(5000, 8)
+        with BgenReader(path) as bfile:
+            bfile.select_samples(range(0, 5000, 3))
+            self.check_table(bfile.variant_stats(), list(bfile))
+
+    def test_picking_variants(self):
+        path = self.write(1000, 8, n_variants=6)
+        with BgenReader(path) as bfile:
+            full = bfile.variant_stats()
+            self.assertEqual(list(full['varid']), [f'var{i}' for i in range(6)])
+            picked = bfile.variant_stats(indices=[4, 1])
+            self.assertEqual(list(picked['varid']), ['var4', 'var1'])
+            np.testing.assert_array_equal(picked['alt_freq'], full['alt_freq'][[4, 1]])
+            region = bfile.variant_stats(chrom='1', start=2, stop=4)
+            self.assertEqual(list(region['varid']), ['var1', 'var2', 'var3'])
+            empty = bfile.variant_stats(indices=[])
+            self.assertEqual(len(empty['hwe_p']), 0)
+            with self.assertRaises(ValueError):
+                bfile.variant_stats(indices=[0], chrom='1')
+            with self.assertRaises(ValueError):
+                bfile.variant_stats(threshold=1.5)
+
+    def test_hwe_exact(self):
+        ''' check the HWE test against counts with known p-values
+        '''
+        path = self.write(200, 8, n_variants=1)
+        with BgenReader(path) as bfile:
+            table = bfile.variant_stats()
+        counts = (table['hom_ref'][0], table['het'][0], table['hom_alt'][0])
+        self.assertAlmostEqual(table['hwe_p'][0], hwe_exact(*counts))
+        # from Wigginton et al. 2005, and a perfectly balanced sample
+        self.assertAlmostEqual(hwe_exact(0, 0, 10), 1.0)
+        self.assertAlmostEqual(hwe_exact(25, 50, 25), 1.0)
+        self.assertLess(hwe_exact(50, 0, 50), 1e-25)
@@ -0,0 +1,114 @@
+
+from pathlib import Path
+import sqlite3
+import tempfile
+import unittest
+
+import numpy as np
+
+from bgen import BgenReader, BgenWriter
+
+def index_rows(path):
+    ''' rows of a bgen's index, in file order
+    '''
+    conn = sqlite3.connect(str(path) + '.bgi')
+    rows = conn.execute('SELECT * FROM Variant ORDER BY file_start_position').fetchall()
+    conn.close()
+    return rows
+
+class TestWritePipeline(unittest.TestCase):
+    ''' check compressing in the background writes the same bgen and index
+    '''
+    def setUp(self):
+        self.tmp = tempfile.TemporaryDirectory()
+        self.addCleanup(self.tmp.cleanup)
+        self.tmpdir = Path(self.tmp.name)
+        rng = np.random.default_rng(31)
+        self.variants = []
+        for i in range(40):
+            # vary the size, so variants finish compressing out of order
+            n_alleles = 2 if i % 5 else 3
+            n_genos = 3 if n_alleles == 2 else 6
+            geno = rng.random((50, n_genos)) ** 3
+            geno /= geno.sum(axis=1)[:, None]
+            geno[rng.random(50) < 0.1] = np.nan
+            bit_depth = 8 if i % 3 else 16
+            alleles = ['A', 'C', 'G'][:n_alleles]
+            self.variants.append((f'var{i}', f'rs{i}', '1', i + 1, alleles, geno,
+                                  bit_depth))
+
+    def write(self, name, variants, **kwargs):
+        path = self.tmpdir / name
+        with BgenWriter(path, 50, **kwargs) as bfile:
+            for varid, rsid, chrom, pos, alleles, geno, bit_depth in variants:
+                bfile.add_variant(varid, rsid, chrom, pos, alleles, geno,
+                                  bit_depth=bit_depth)
+        return path
+
+    def test_matches_serial(self):
+        for compression in [None, 'zlib', 'zstd']:
+            expected = self.write(f'{compression}.bgen', self.variants,
+                                  compression=compression)
+            for threads, depth in [(2, 1), (3, 4), (0, 16)]:
+                path = self.write(f'{compression}.{threads}.bgen', self.variants,
+                                  compression=compression, threads=threads,
+                                  depth=depth)
+                self.assertEqual(path.read_bytes(), expected.read_bytes())
+                self.assertEqual(index_rows(path), index_rows(expected))
+
+    def test_layout_1(self):
+        variants = [x[:4] + (['A', 'C'], x[5][:, :3] / x[5][:, :3].sum(axis=1)[:, None], 16)
+                    for x in self.variants]
+        expected = self.write('serial.bgen', variants, layout=1, compression='zlib')
+        path = self.write('threaded.bgen', variants, layout=1, compression='zlib',
+                          threads=2)
+        self.assertEqual(path.read_bytes(), expected.read_bytes())
+        self.assertEqual(index_rows(path), index_rows(expected))
+
+    def test_index_offsets(self):
+        path = self.write('threaded.bgen', self.variants, threads=3, depth=2)
+        with BgenReader(path) as bfile:
+            for rsid in ['rs0', 'rs17', 'rs39']:
+                var = bfile.with_rsid(rsid)[0]
+                self.assertEqual(var.rsid, rsid)
+
+    def test_add_variant_direct(self):
+        ''' copied variants queue behind the ones still compressing
+        '''
+        source = self.write('source.bgen', self.variants[:10])
+        expected = self.tmpdir / 'serial.bgen'
+        path = self.tmpdir / 'threaded.bgen'
+        for out, threads in [(expected, 1), (path, 2)]:
+            with BgenReader(source) as bfile, \
+                    BgenWriter(out, 50, threads=threads) as output:
+                for var, extra in zip(bfile, self.variants[10:]):
+                    output.add_variant_direct(var)
+                    varid, rsid, chrom, pos, alleles, geno, bit_depth = extra
+                    output.add_variant(varid, rsid, chrom, pos, alleles, geno,
+                                       bit_depth=bit_depth)
+        self.assertEqual(path.read_bytes(), expected.read_bytes())
+        self.assertEqual(index_rows(path), index_rows(expected))
+
+    def test_bad_genotypes_raise_when_added(self):
+        ''' genotypes are still checked as they are added, and leave nothing behind
+        '''
+        expected = self.write('serial.bgen', self.variants[:2])
+        path = self.tmpdir / 'threaded.bgen'
+        with BgenWriter(path, 50, threads=2) as bfile:
+            for varid, rsid, chrom, pos, alleles, geno, bit_depth in self.variants[:1]:
+                bfile.add_variant(varid, rsid, chrom, pos, alleles, geno,
+                                  bit_depth=bit_depth)
+            with self.assertRaises(ValueError):
+                bfile.add_variant('bad', 'rs_bad', '1', 5, ['A', 'C'],
+                                  np.full((50, 3), 0.9))
+            for varid, rsid, chrom, pos, alleles, geno, bit_depth in self.variants[1:2]:
+                bfile.add_variant(varid, rsid, chrom, pos, alleles, geno,
+                                  bit_depth=bit_depth)
+        self.assertEqual(path.read_bytes(), expected.read_bytes())
+        self.assertEqual(index_rows(path), index_rows(expected))
+
+    def test_bad_arguments(self):
+        with self.assertRaises(ValueError):
+            BgenWriter(self.tmpdir / 'a.bgen', 50, threads=-1)
+        with self.assertRaises(ValueError):
+            BgenWriter(self.tmpdir / 'b.bgen', 50, threads=2, depth=0)
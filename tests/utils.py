@@ -1,9 +1,13 @@
 
 from pathlib import Path
 import re
+import tempfile
+import unittest
 
 import numpy as np
 
+from bgen import BgenWriter
+
 def can_cap_memory():
     ''' whether this platform can actually cap a child's address space
 
@@ -155,3 +159,85 @@ def arrays_equal(truth, parsed, bit_depth):
     eps_abs = 3.2e-5
     delta = array_delta(truth, parsed)
     return delta < epsilon(bit_depth) or delta < eps_abs
+
+def nan_equal(a, b):
+    ''' check two float arrays match, treating nans in the same spots as equal
+    '''
+    return a.shape == b.shape and np.array_equal(a, b, equal_nan=True)
+
+def outcome(var, attr):
+    ''' get a variant attribute, or the error it raises, so either can be compared
+    '''
+    try:
+        return getattr(var, attr)
+    except ValueError as err:
+        return str(err)
+
+def same_outcome(a, b):
+    ''' check two outcomes from outcome() match, whether arrays or errors
+    '''
+    if isinstance(a, np.ndarray) and isinstance(b, np.ndarray):
+        return nan_equal(a, b)
+    return a == b
+
+class RandomBgenCase(unittest.TestCase):
+    ''' test case which writes bgens of random genotypes to a temporary folder
+
+    Subclasses set the seed, so each test module draws its own genotypes.
+    '''
+    seed = 0
+    def setUp(self):
+        self.folder = Path(__file__).parent / 'data'
+        self.tmp = tempfile.TemporaryDirectory()
+        self.addCleanup(self.tmp.cleanup)
+        self.rng = np.random.default_rng(self.seed)
+
+def random_genotypes(rng, n_samples, phased=False, power=3, weights=None):
+    ''' random biallelic genotype probabilities, one row per sample
+
+    Raising the values to a power skews each sample towards one genotype, as real
+    probabilities are. Rows hold three genotype probabilities, or two per haplotype
+    if phased, summing to one.
+
+    Args:
+        weights: relative weights of the genotypes, or of the two alleles if phased,
+            to skew every sample the same way
+    '''
+    geno = rng.random((n_samples, 4 if phased else 3)) ** power
+    if weights is not None:
+        geno *= np.tile(weights, 2) if phased else weights
+    if phased:
+        geno[:, :2] /= geno[:, :2].sum(axis=1)[:, None]
+        geno[:, 2:] /= geno[:, 2:].sum(axis=1)[:, None]
+    else:
+        geno /= geno.sum(axis=1)[:, None]
+    return geno
+
+def write_random_bgen(path, n_samples, n_variants, rng, genotypes=None, chrom='1',
+                      alleles=('A', 'C'), missing=0.05, compression='zstd', layout=2,
+                      **kwargs):
+    ''' write variants of random genotypes to a bgen, with some samples missing
+
+    Variant i is named var{i} and rs{i}, at position i + 1.
+
+    Args:
+        path: where to write the bgen
+        genotypes: function of the variant index, giving its probabilities, for tests
+            which need particular variants. Defaults to random_genotypes
+        chrom: chromosome of every variant, or a function of the variant index
+        missing: fraction of samples set missing in each variant
+        kwargs: passed to add_variant, e.g. phased, bit_depth or ploidy
+
+    Returns:
+        the path written to
+    '''
+    if genotypes is None:
+        phased = kwargs.get('phased', False)
+        genotypes = lambda i: random_genotypes(rng, n_samples, phased)
+    with BgenWriter(path, n_samples, compression=compression, layout=layout) as bfile:
+        for i in range(n_variants):
+            geno = genotypes(i)
+            geno[rng.random(n_samples) < missing] = np.nan
+            bfile.add_variant(f'var{i}', f'rs{i}', chrom(i) if callable(chrom) else chrom,
+                              i + 1, list(alleles), geno, **kwargs)
+    return path